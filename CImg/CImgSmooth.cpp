@@ -44,6 +44,7 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription \
 "Smooth/Denoise input stream using anisotropic PDE-based smoothing.\n" \
 "Uses the 'blur_anisotropic' function from the CImg library.\n" \
+"The image is processed by tiles, using a diffusion tensor field which is computed once per render.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
@@ -52,8 +53,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: tiled LIC-based smoothing with a diffusion tensor field computed once per render
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -134,6 +136,9 @@ enum InterpEnum
 #define kParamFastApproxHint "Tells if a fast approximation of the gaussian function is used or not"
 #define kParamFastApproxDafault true
 
+// size of the tiles processed by the LIC-based smoothing (not including the halo)
+#define kTileSize 256
+
 
 /// Smooth plugin
 struct CImgSmoothParams
@@ -200,17 +205,61 @@ public:
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
-        cimg.blur_anisotropic((float)(params.amplitude * args.renderScale.x), // in pixels
-                              (float)params.sharpness,
-                              (float)params.anisotropy,
-                              (float)(params.alpha * args.renderScale.x), // in pixels
-                              (float)(params.sigma * args.renderScale.x), // in pixels
-                              (float)params.dl, // in pixel, but we don't discretize more
-                              (float)params.da,
-                              (float)params.gprec,
-                              params.interp_i,
-                              params.fast_approx);
+        const float amplitude = (float)(params.amplitude * args.renderScale.x); // in pixels
+
+        // the diffusion tensor field is computed once on the whole image
+        // (same as the blur_anisotropic() variant that takes the smoothing parameters)
+        const cimg_library::CImg<float> G = cimg.get_diffusion_tensors((float)params.sharpness,
+                                                                       (float)params.anisotropy,
+                                                                       (float)(params.alpha * args.renderScale.x), // in pixels
+                                                                       (float)(params.sigma * args.renderScale.x), // in pixels
+                                                                       params.interp_i != 3);
+        if (abort()) {
+            return;
+        }
 
+        // The LIC-based smoothing (da > 0) only depends on pixels along the streamlines, which
+        // extend up to gauss_prec*sqrt(2*amplitude) pixels (see CImg::blur_anisotropic()), so that
+        // the image can be processed by tiles with a halo of that size, keeping the working set of
+        // each pass in cache.
+        // The iterated oriented Laplacians (da = 0) use a time step that depends on the whole image.
+        const int halo = (int)std::ceil(params.gprec * std::sqrt(2. * amplitude)) + 2;
+        if (params.da <= 0. || (cimg.width() <= 2 * kTileSize && cimg.height() <= 2 * kTileSize)) {
+            cimg.blur_anisotropic(G,
+                                  amplitude,
+                                  (float)params.dl, // in pixel, but we don't discretize more
+                                  (float)params.da,
+                                  (float)params.gprec,
+                                  params.interp_i,
+                                  params.fast_approx);
+            return;
+        }
+
+        const cimg_library::CImg<float> src(cimg); // tiles read from the original image
+        for (int ty = 0; ty < cimg.height(); ty += kTileSize) {
+            for (int tx = 0; tx < cimg.width(); tx += kTileSize) {
+                if (abort()) {
+                    return;
+                }
+                // tile bounds, inclusive
+                const int x0 = tx, y0 = ty;
+                const int x1 = std::min(tx + kTileSize, cimg.width()) - 1;
+                const int y1 = std::min(ty + kTileSize, cimg.height()) - 1;
+                // tile bounds with the halo
+                const int hx0 = std::max(0, x0 - halo), hy0 = std::max(0, y0 - halo);
+                const int hx1 = std::min(cimg.width() - 1, x1 + halo), hy1 = std::min(cimg.height() - 1, y1 + halo);
+
+                cimg_library::CImg<float> tile = src.get_crop(hx0, hy0, hx1, hy1);
+                tile.blur_anisotropic(G.get_crop(hx0, hy0, hx1, hy1),
+                                      amplitude,
+                                      (float)params.dl, // in pixel, but we don't discretize more
+                                      (float)params.da,
+                                      (float)params.gprec,
+                                      params.interp_i,
+                                      params.fast_approx);
+                cimg.draw_image(x0, y0, tile.get_crop(x0 - hx0, y0 - hy0, x1 - hx0, y1 - hy0));
+            }
+        }
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgSmoothParams& params) OVERRIDE FINAL
@@ -60,8 +60,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: faster box filters, fused scaling/power and division passes
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -146,17 +147,33 @@ typedef float T;
 using namespace cimg_library;
 
 
-static inline
-T get_data(T *data, const int N, const unsigned long off, const bool boundary_conditions, const int x)
+// number of adjacent columns processed together by the vertical box filter pass
+#define kBoxColumns 16
+
+// [internal] Copy ncols adjacent lines of N samples to buf, with pad samples on each side
+// filled according to the boundary conditions, so that the filter loops need no boundary test.
+// Sample x of column k is stored at buf[(x+pad)*ncols + k].
+static void
+_cimg_box_fill(const T *data, const int N, const unsigned long off, const int ncols, const int pad,
+               const bool boundary_conditions, T *buf)
 {
     assert(N >= 1);
-    if (x < 0) {
-        return boundary_conditions ? data[0] : T();
+    for (int x = 0; x < N; ++x) {
+        std::copy(data + x*off, data + x*off + ncols, buf + (x+pad)*ncols);
     }
-    if (x >= N) {
-        return boundary_conditions ? data[(N-1)*off] : T();
+    const T *first = data;
+    const T *last = data + (N-1)*off;
+    for (int x = 0; x < pad; ++x) {
+        T *left = buf + x*ncols;
+        T *right = buf + (pad+N+x)*ncols;
+        if (boundary_conditions) {
+            std::copy(first, first + ncols, left);
+            std::copy(last, last + ncols, right);
+        } else {
+            std::fill(left, left + ncols, T());
+            std::fill(right, right + ncols, T());
+        }
     }
-    return data[x*off];
 }
 
 // [internal] Apply a box/triangle/quadratic filter (used by CImg<T>::box()).
@@ -165,51 +182,45 @@ T get_data(T *data, const int N, const unsigned long off, const bool boundary_co
  \param N size of the data
  \param width width of the box filter
  \param off the offset between two data point
+ \param ncols number of adjacent lines (with offset 1 between them) processed together
  \param iter number of iterations (1 = box, 2 = triangle, 3 = quadratic)
  \param order the order of the filter 0 (smoothing), 1st derivtive, 2nd derivative, 3rd derivative
  \param boundary_conditions Boundary conditions. Can be <tt>{ 0=dirichlet | 1=neumann }</tt>.
  **/
-static void _cimg_box_apply(T *data, const double width, const int N, const unsigned long off, const int iter,
+static void _cimg_box_apply(T *data, const double width, const int N, const unsigned long off, const int ncols, const int iter,
                             const int order, const bool boundary_conditions)
 {
+    const bool smooth = (width > 1. && iter > 0);
+    const int w2 = smooth ? (int)(width - 1)/2 : 0;
+    const int pad = w2 + 1;
+    std::vector<T> buf((N + 2*pad) * ncols);
+    const T *b = &buf[pad*ncols]; // b[x*ncols+k] is sample x of column k
     // smooth
-    if (width > 1. && iter > 0) {
-        int w2 = (int)(width - 1)/2;
+    if (smooth) {
         double frac = (width - (2*w2+1)) / 2.;
-        int winsize = 2*w2+1;
-        std::vector<T> win(winsize);
+        std::vector<double> sum(ncols); // window sums
         for (int i = 0; i < iter; ++i) {
+            _cimg_box_fill(data, N, off, ncols, pad, boundary_conditions, &buf[0]);
             // prepare for first iteration
-            double sum = 0; // window sum
+            std::fill(sum.begin(), sum.end(), 0.);
             for (int x = -w2; x <= w2; ++x) {
-                win[x+w2] = get_data(data, N, off, boundary_conditions, x);
-                sum += win[x+w2];
+                for (int k = 0; k < ncols; ++k) {
+                    sum[k] += b[x*ncols+k];
+                }
             }
-            int ifirst = 0;
-            int ilast = 2*w2;
-            T prev = get_data(data, N, off, boundary_conditions, - w2 - 1);
-            T next = get_data(data, N, off, boundary_conditions, + w2 + 1);
             // main loop
-            for (int x = 0; x < N-1; ++x) {
-                // add partial pixels
-                double sum2 = sum + frac * (prev + next);
-                // fill result
-                data[x*off] = sum2 / width;
-                // advance for next iteration
-                prev = win[ifirst];
-                sum -= prev;
-                ifirst = (ifirst + 1) % winsize;
-                ilast = (ilast + 1) % winsize;
-                assert((ilast + 1) % winsize == ifirst); // it is a circular buffer
-                win[ilast] = next;
-                sum += next;
-                next = get_data(data, N, off, boundary_conditions, x + w2 + 2);
+            for (int x = 0; x < N; ++x) {
+                T *d = data + x*off;
+                const T *prev = b + (x-w2-1)*ncols;
+                const T *first = b + (x-w2)*ncols;
+                const T *next = b + (x+w2+1)*ncols;
+                for (int k = 0; k < ncols; ++k) {
+                    // add partial pixels, and fill result
+                    d[k] = (sum[k] + frac * (prev[k] + next[k])) / width;
+                    // advance for next iteration
+                    sum[k] += next[k] - first[k];
+                }
             }
-            // last iteration
-            // add partial pixels
-            double sum2 = sum + frac * (prev + next);
-            // fill result
-            data[(N-1)*off] = sum2 / width;
         }
     }
     // derive
@@ -218,32 +229,27 @@ static void _cimg_box_apply(T *data, const double width, const int N, const unsi
             // nothing to do
             break;
         case 1 : {
-            T p = get_data(data, N, off, boundary_conditions, -1);
-            T c = get_data(data, N, off, boundary_conditions, 0);
-            T n = get_data(data, N, off, boundary_conditions, +1);
-            for (int x = 0; x < N-1; ++x) {
-                data[x*off] = (n-p)/2.;
-                // advance
-                p = c;
-                c = n;
-                n = get_data(data, N, off, boundary_conditions, x+2);
+            _cimg_box_fill(data, N, off, ncols, pad, boundary_conditions, &buf[0]);
+            for (int x = 0; x < N; ++x) {
+                T *d = data + x*off;
+                const T *p = b + (x-1)*ncols;
+                const T *n = b + (x+1)*ncols;
+                for (int k = 0; k < ncols; ++k) {
+                    d[k] = (n[k]-p[k])/2.;
+                }
             }
-            // last pixel
-            data[(N-1)*off] = (n-p)/2.;
         } break;
         case 2: {
-            T p = get_data(data, N, off, boundary_conditions, -1);
-            T c = get_data(data, N, off, boundary_conditions, 0);
-            T n = get_data(data, N, off, boundary_conditions, +1);
-            for (int x = 0; x < N-1; ++x) {
-                data[x*off] = n-2*c+p;
-                // advance
-                p = c;
-                c = n;
-                n = get_data(data, N, off, boundary_conditions, x+2);
+            _cimg_box_fill(data, N, off, ncols, pad, boundary_conditions, &buf[0]);
+            for (int x = 0; x < N; ++x) {
+                T *d = data + x*off;
+                const T *p = b + (x-1)*ncols;
+                const T *c = b + x*ncols;
+                const T *n = b + (x+1)*ncols;
+                for (int k = 0; k < ncols; ++k) {
+                    d[k] = n[k]-2*c[k]+p[k];
+                }
             }
-            // last pixel
-            data[(N-1)*off] = n-2*c+p;
         } break;
     }
 }
@@ -269,21 +275,30 @@ box(CImg<T>& img, const float width, const int iter, const int order, const char
 #pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
 #endif
             cimg_forYZC(img,y,z,c)
-            _cimg_box_apply(img.data(0,y,z,c),width,img._width,1U,iter,order,boundary_conditions);
+            _cimg_box_apply(img.data(0,y,z,c),width,img._width,1U,1,iter,order,boundary_conditions);
         } break;
         case 'y' : {
+            // process kBoxColumns adjacent columns at once, so that the inner loops access contiguous memory
+            const int nblocks = ((int)_width + kBoxColumns - 1) / kBoxColumns;
 #ifdef cimg_use_openmp
 #pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
 #endif
-            cimg_forXZC(img,x,z,c)
-            _cimg_box_apply(img.data(x,0,z,c),width,_height,(unsigned long)_width,iter,order,boundary_conditions);
+            for (int c = 0; c < (int)_spectrum; ++c) {
+                for (int z = 0; z < (int)_depth; ++z) {
+                    for (int i = 0; i < nblocks; ++i) {
+                        const int x = i * kBoxColumns;
+                        const int ncols = std::min(kBoxColumns, (int)_width - x);
+                        _cimg_box_apply(img.data(x,0,z,c),width,_height,(unsigned long)_width,ncols,iter,order,boundary_conditions);
+                    }
+                }
+            }
         } break;
         case 'z' : {
 #ifdef cimg_use_openmp
 #pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
 #endif
             cimg_forXYC(img,x,y,c)
-            _cimg_box_apply(img.data(x,y,0,c),width,_depth,(unsigned long)(_width*_height),
+            _cimg_box_apply(img.data(x,y,0,c),width,_depth,(unsigned long)(_width*_height),1,
                             iter,order,boundary_conditions);
         } break;
         default : {
@@ -291,14 +306,13 @@ box(CImg<T>& img, const float width, const int iter, const int order, const char
 #pragma omp parallel for collapse(3) if (_width>=256 && _height*_depth*_spectrum>=16)
 #endif
             cimg_forXYZ(img,x,y,z)
-            _cimg_box_apply(img.data(x,y,z,0),width,_spectrum,(unsigned long)(_width*_height*_depth),
+            _cimg_box_apply(img.data(x,y,z,0),width,_spectrum,(unsigned long)(_width*_height*_depth),1,
                             iter,order,boundary_conditions);
         }
     }
     return/* *this*/;
 }
 
-
 #define ERODESMOOTH_MIN 1.e-8 // minimum value for the weight
 #define ERODESMOOTH_OFFSET 0.1 // offset to the image values to avoid divisions by zero
 
@@ -458,76 +472,84 @@ public:
         if (rmax == rmin) {
             return;
         }
-        // scale to [0,1]
-#ifdef cimg_use_openmp
-#pragma omp parallel for if (cimg.size()>=4096)
-#endif
-        cimg_rof(cimg,ptrd,float) *ptrd = (float)((*ptrd-rmin)/(rmax-rmin) + ERODESMOOTH_OFFSET);
+        if (params.filter == eFilterQuasiGaussian || params.filter == eFilterGaussian) {
+            if (sx / 2.4 < 0.1 && sy / 2.4 < 0.1) {
+                return;
+            }
+        }
 
         // see "Robust local max-min filters by normalized power-weighted filtering" by L.J. van Vliet
         // http://dx.doi.org/10.1109/ICPR.2004.1334273
         // compute blur(x^(P+1))/blur(x^P)
+        cimg_library::CImg<float> denom(cimg.width(), cimg.height(), cimg.depth(), cimg.spectrum());
+        const double vmin = std::pow((double)ERODESMOOTH_MIN, (double)1./params.exponent);
+        //printf("%g\n",vmin);
+        // scale to [0,1], and compute x^P (denom) and x^(P+1) (cimg) in a single pass
         {
-            cimg_library::CImg<float> denom(cimg, false);
-            const double vmin = std::pow((double)ERODESMOOTH_MIN, (double)1./params.exponent);
-            //printf("%g\n",vmin);
+            float *ptrd = cimg.data();
+            float *ptrp = denom.data();
+            const long siz = (long)cimg.size();
 #ifdef cimg_use_openmp
-#pragma omp parallel for if (denom.size()>=4096)
+#pragma omp parallel for if (siz>=4096)
 #endif
-            cimg_rof(denom,ptrd,float) *ptrd = (float)std::pow((double)((*ptrd<0.?0.:*ptrd)+vmin), params.exponent); // C++98 and C++11 both have std::pow(double,int)
-
-            cimg.mul(denom);
+            for (long i = 0; i < siz; ++i) {
+                const double v = (ptrd[i]-rmin)/(rmax-rmin) + ERODESMOOTH_OFFSET;
+                const double p = std::pow((v<0.?0.:v)+vmin, params.exponent); // C++98 and C++11 both have std::pow(double,int)
+                ptrp[i] = (float)p;
+                ptrd[i] = (float)(v*p);
+            }
+        }
 
-            if (abort()) { return; }
-            // almost the same code as in CImgBlur.cpp, except we smooth both cimg and denom
-            if (params.filter == eFilterQuasiGaussian || params.filter == eFilterGaussian) {
-                float sigmax = (float)(sx / 2.4);
-                float sigmay = (float)(sy / 2.4);
-                if (sigmax < 0.1 && sigmay < 0.1) {
-                    return;
-                }
-                if (params.filter == eFilterGaussian) {
-                    cimg.vanvliet(sigmax, 0, 'x', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    cimg.vanvliet(sigmay, 0, 'y', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    denom.vanvliet(sigmax, 0, 'x', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    denom.vanvliet(sigmay, 0, 'y', (bool)params.boundary_i);
-                } else {
-                    cimg.deriche(sigmax, 0, 'x', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    cimg.deriche(sigmay, 0, 'y', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    denom.deriche(sigmax, 0, 'x', (bool)params.boundary_i);
-                    if (abort()) { return; }
-                    denom.deriche(sigmay, 0, 'y', (bool)params.boundary_i);
-                }
-            } else if (params.filter == eFilterBox || params.filter == eFilterTriangle || params.filter == eFilterQuadratic) {
-                int iter = (params.filter == eFilterBox ? 1 :
-                            (params.filter == eFilterTriangle ? 2 : 3));
-                box(cimg, sx, iter, 0, 'x', (bool)params.boundary_i);
+        if (abort()) { return; }
+        // almost the same code as in CImgBlur.cpp, except we smooth both cimg and denom
+        if (params.filter == eFilterQuasiGaussian || params.filter == eFilterGaussian) {
+            float sigmax = (float)(sx / 2.4);
+            float sigmay = (float)(sy / 2.4);
+            if (params.filter == eFilterGaussian) {
+                cimg.vanvliet(sigmax, 0, 'x', (bool)params.boundary_i);
                 if (abort()) { return; }
-                box(cimg, sy, iter, 0, 'y', (bool)params.boundary_i);
+                cimg.vanvliet(sigmay, 0, 'y', (bool)params.boundary_i);
                 if (abort()) { return; }
-                box(denom, sx, iter, 0, 'x', (bool)params.boundary_i);
+                denom.vanvliet(sigmax, 0, 'x', (bool)params.boundary_i);
                 if (abort()) { return; }
-                box(denom, sy, iter, 0, 'y', (bool)params.boundary_i);
+                denom.vanvliet(sigmay, 0, 'y', (bool)params.boundary_i);
             } else {
-                assert(false);
+                cimg.deriche(sigmax, 0, 'x', (bool)params.boundary_i);
+                if (abort()) { return; }
+                cimg.deriche(sigmay, 0, 'y', (bool)params.boundary_i);
+                if (abort()) { return; }
+                denom.deriche(sigmax, 0, 'x', (bool)params.boundary_i);
+                if (abort()) { return; }
+                denom.deriche(sigmay, 0, 'y', (bool)params.boundary_i);
             }
+        } else if (params.filter == eFilterBox || params.filter == eFilterTriangle || params.filter == eFilterQuadratic) {
+            int iter = (params.filter == eFilterBox ? 1 :
+                        (params.filter == eFilterTriangle ? 2 : 3));
+            box(cimg, sx, iter, 0, 'x', (bool)params.boundary_i);
             if (abort()) { return; }
-
-            assert(cimg.width() == denom.width() && cimg.height() == denom.height() && cimg.depth() == denom.depth() && cimg.spectrum() == denom.spectrum());
-            cimg.div(denom);
+            box(cimg, sy, iter, 0, 'y', (bool)params.boundary_i);
+            if (abort()) { return; }
+            box(denom, sx, iter, 0, 'x', (bool)params.boundary_i);
             if (abort()) { return; }
+            box(denom, sy, iter, 0, 'y', (bool)params.boundary_i);
+        } else {
+            assert(false);
         }
+        if (abort()) { return; }
 
-        // scale to [rmin,rmax]
+        assert(cimg.width() == denom.width() && cimg.height() == denom.height() && cimg.depth() == denom.depth() && cimg.spectrum() == denom.spectrum());
+        // divide and scale to [rmin,rmax] in a single pass
+        {
+            float *ptrd = cimg.data();
+            const float *ptrp = denom.data();
+            const long siz = (long)cimg.size();
 #ifdef cimg_use_openmp
-#pragma omp parallel for if (cimg.size()>=4096)
+#pragma omp parallel for if (siz>=4096)
 #endif
-        cimg_rof(cimg,ptrd,float) *ptrd = (float)((*ptrd-ERODESMOOTH_OFFSET)*(rmax-rmin)+rmin);
+            for (long i = 0; i < siz; ++i) {
+                ptrd[i] = (float)(((double)ptrd[i]/ptrp[i]-ERODESMOOTH_OFFSET)*(rmax-rmin)+rmin);
+            }
+        }
     }
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &/*args*/, const CImgErodeSmoothParams& params) OVERRIDE FINAL
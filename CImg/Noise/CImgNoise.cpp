@@ -35,6 +35,10 @@
 
 #include "CImgFilter.h"
 
+#ifndef M_PI
+#define M_PI        3.14159265358979323846264338327950288   /* pi             */
+#endif
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -43,8 +47,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping      "Draw"
 #define kPluginDescription \
 "Add random noise to input stream.\n" \
-"Note that each render gives a different noise.\n" \
-"Uses the 'noise' function from the CImg library.\n" \
+"The noise at a given pixel only depends on the pixel position, the channel, the time and the 'seed' parameter, " \
+"so that the result is the same whatever the tiling or the number of threads used for rendering. " \
+"Note that each render scale gives a different noise.\n" \
+"The noise types are the same as those of the 'noise' function from the CImg library.\n" \
 "CImg is a free, open-source library distributed under the CeCILL-C " \
 "(close to the GNU LGPL) or CeCILL (compatible with the GNU GPL) licenses. " \
 "It can be used in commercial applications (see http://cimg.sourceforge.net)."
@@ -53,8 +59,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: counter-based random number generator, add seed parameter
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsComponentRemapping 1
 #define kSupportsTiles 1
@@ -93,6 +100,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamTypeOptionRiceHint "Rician noise."
 #define kParamTypeDefault eTypeGaussian
 
+#define kParamSeed "seed"
+#define kParamSeedLabel "Random Seed"
+#define kParamSeedHint "Random seed used to generate the noise. The noise also depends on the time, to get a time-varying effect."
+
 enum TypeEnum
 {
     eTypeGaussian = 0,
@@ -103,11 +114,103 @@ enum TypeEnum
 };
 
 
+// Philox4x32-10 counter-based random number generator.
+// See "Parallel random numbers: as easy as 1, 2, 3" by J. K. Salmon, M. A. Moraes, R. O. Dror and D. E. Shaw,
+// http://dx.doi.org/10.1145/2063384.2063405
+// The output only depends on the counter and on the key, so that each pixel can be computed independently.
+class Philox4x32
+{
+public:
+    // the key is the seed and the time, the counter is (x, y, c, index of the random number for that pixel)
+    Philox4x32(unsigned int seed, unsigned int time, int x, int y, int c)
+    : _index(0)
+    , _next(4)
+    {
+        _key[0] = seed;
+        _key[1] = time;
+        _ctr[0] = (unsigned int)x;
+        _ctr[1] = (unsigned int)y;
+        _ctr[2] = (unsigned int)c;
+    }
+
+    // uniform random number in (0,1)
+    double rand()
+    {
+        if (_next >= 4) {
+            generate();
+        }
+        return (_out[_next++] + 0.5) / 4294967296.;
+    }
+
+    // Gaussian random number (mean 0, variance 1), using the Box-Muller transform
+    double grand()
+    {
+        const double u1 = rand();
+        const double u2 = rand();
+        return std::sqrt(-2. * std::log(u1)) * std::cos(2. * M_PI * u2);
+    }
+
+    // Poisson random number of mean z (same algorithm as cimg::prand())
+    unsigned int prand(double z)
+    {
+        if (z <= 1.e-10) {
+            return 0;
+        }
+        if (z > 100.) {
+            return (unsigned int)((std::sqrt(z) * grand()) + z);
+        }
+        const double y = std::exp(-z);
+        unsigned int k = 0;
+        for (double s = 1.; s >= y; ++k) {
+            s *= rand();
+        }
+        return k - 1;
+    }
+
+private:
+    static void mulhilo(unsigned int a, unsigned int b, unsigned int *hi, unsigned int *lo)
+    {
+        const unsigned long long p = (unsigned long long)a * b;
+        *hi = (unsigned int)(p >> 32);
+        *lo = (unsigned int)p;
+    }
+
+    void generate()
+    {
+        unsigned int c0 = _ctr[0], c1 = _ctr[1], c2 = _ctr[2], c3 = _index++;
+        unsigned int k0 = _key[0], k1 = _key[1];
+        for (int r = 0; r < 10; ++r) {
+            unsigned int hi0, lo0, hi1, lo1;
+            mulhilo(0xD2511F53U, c0, &hi0, &lo0);
+            mulhilo(0xCD9E8D57U, c2, &hi1, &lo1);
+            c0 = hi1 ^ c1 ^ k0;
+            c1 = lo1;
+            c2 = hi0 ^ c3 ^ k1;
+            c3 = lo0;
+            k0 += 0x9E3779B9U;
+            k1 += 0xBB67AE85U;
+        }
+        _out[0] = c0;
+        _out[1] = c1;
+        _out[2] = c2;
+        _out[3] = c3;
+        _next = 0;
+    }
+
+    unsigned int _key[2];
+    unsigned int _ctr[3];
+    unsigned int _index;
+    unsigned int _out[4];
+    int _next;
+};
+
 /// Noise plugin
 struct CImgNoiseParams
 {
     double sigma;
     int type_i;
+    int seed;
+    int channel[4]; // source channel (0=R, 1=G, 2=B, 3=A) of each cimg spectrum index
 };
 
 class CImgNoisePlugin : public CImgFilterPluginHelper<CImgNoiseParams,true>
@@ -119,13 +222,46 @@ public:
     {
         _sigma  = fetchDoubleParam(kParamSigma);
         _type = fetchChoiceParam(kParamType);
-        assert(_sigma && _type);
+        _seed = fetchIntParam(kParamSeed);
+        assert(_sigma && _type && _seed);
     }
 
     virtual void getValuesAtTime(double time, CImgNoiseParams& params) OVERRIDE FINAL
     {
         _sigma->getValueAtTime(time, params.sigma);
         _type->getValueAtTime(time, params.type_i);
+        _seed->getValueAtTime(time, params.seed);
+
+        // the cimg image only contains the processed channels, in the same order as in CImgFilterPluginHelper::render():
+        // key the generator on the source channel, so that unchecking a channel does not change the noise on the others
+        bool processR = true, processG = true, processB = true, processA = true;
+        if (_processR) {
+            _processR->getValueAtTime(time, processR);
+            _processG->getValueAtTime(time, processG);
+            _processB->getValueAtTime(time, processB);
+            _processA->getValueAtTime(time, processA);
+        }
+        const int srcNComponents = _srcClip ? _srcClip->getPixelComponentCount() : 0;
+        int c = 0;
+        if (srcNComponents == 1) {
+            params.channel[c++] = 3;
+        } else {
+            if (processR) {
+                params.channel[c++] = 0;
+            }
+            if (processG) {
+                params.channel[c++] = 1;
+            }
+            if (processB) {
+                params.channel[c++] = 2;
+            }
+            if (processA && srcNComponents >= 4) {
+                params.channel[c++] = 3;
+            }
+        }
+        for (; c < 4; ++c) {
+            params.channel[c] = c;
+        }
     }
 
     // compute the roi required to compute rect, given params. This roi is then intersected with the image rod.
@@ -138,17 +274,63 @@ public:
         roi->y2 = rect.y2;
     }
 
-    virtual void render(const OFX::RenderArguments &args, const CImgNoiseParams& params, int /*x1*/, int /*y1*/, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
+    virtual void render(const OFX::RenderArguments &args, const CImgNoiseParams& params, int x1, int y1, cimg_library::CImg<float>& cimg) OVERRIDE FINAL
     {
         // PROCESSING.
         // This is the only place where the actual processing takes place
+        // Each sample is drawn from a counter-based generator keyed on (seed, time) with counter (x, y, c),
+        // so that the result does not depend on the tiling nor on the thread scheduling.
         // the noise vs. scale dependency formula is only valid for Gaussian noise
-        if (params.type_i == eTypePoisson) {
-            cimg /= params.sigma;
+        const double sigma = params.sigma * std::sqrt(args.renderScale.x);
+        const int type = params.type_i;
+        if (sigma == 0.) {
+            return;
         }
-        cimg.noise(params.sigma * std::sqrt(args.renderScale.x), params.type_i);
-        if (params.type_i == eTypePoisson) {
-            cimg *= params.sigma;
+        const float time_f = (float)args.time;
+        unsigned int time_u;
+        std::memcpy(&time_u, &time_f, sizeof(time_u));
+        const unsigned int seed = (unsigned int)params.seed;
+        const int width = cimg.width();
+        const int height = cimg.height();
+        const int spectrum = cimg.spectrum();
+        assert(spectrum <= 4);
+
+#ifdef cimg_use_openmp
+#pragma omp parallel for collapse(2) if (width*height>=4096)
+#endif
+        for (int c = 0; c < spectrum; ++c) {
+            for (int y = 0; y < height; ++y) {
+                float *ptrd = cimg.data(0, y, 0, c);
+                for (int x = 0; x < width; ++x, ++ptrd) {
+                    Philox4x32 rng(seed, time_u, x1 + x, y1 + y, params.channel[c]);
+                    switch (type) {
+                        case eTypeGaussian:
+                            *ptrd = (float)(*ptrd + sigma * rng.grand());
+                            break;
+                        case eTypeUniform:
+                            *ptrd = (float)(*ptrd + sigma * (2. * rng.rand() - 1.));
+                            break;
+                        case eTypeSaltPepper:
+                            // CImg uses the image min and max, which depend on the tile: use 0 and 1 instead
+                            if (100. * rng.rand() < sigma) {
+                                *ptrd = (rng.rand() < 0.5) ? 1.f : 0.f;
+                            }
+                            break;
+                        case eTypePoisson:
+                            *ptrd = (float)(params.sigma * rng.prand(*ptrd / params.sigma));
+                            break;
+                        case eTypeRice: {
+                            const double val0 = *ptrd / std::sqrt(2.);
+                            const double re = val0 + sigma * rng.grand();
+                            const double im = val0 + sigma * rng.grand();
+                            *ptrd = (float)std::sqrt(re * re + im * im);
+                            break;
+                        }
+                        default:
+                            break;
+                    }
+                }
+            }
         }
     }
 
@@ -169,6 +351,7 @@ private:
     // params
     OFX::DoubleParam *_sigma;
     OFX::ChoiceParam *_type;
+    OFX::IntParam *_seed;
 };
 
 
@@ -196,7 +379,7 @@ void CImgNoisePluginFactory::describe(OFX::ImageEffectDescriptor& desc)
     desc.setSupportsMultiResolution(kSupportsMultiResolution);
     desc.setSupportsTiles(kSupportsTiles);
     desc.setTemporalClipAccess(false);
-    desc.setRenderTwiceAlways(true);
+    desc.setRenderTwiceAlways(false);
     desc.setSupportsMultipleClipPARs(kSupportsMultipleClipPARs);
     desc.setSupportsMultipleClipDepths(kSupportsMultipleClipDepths);
     desc.setRenderThreadSafety(kRenderThreadSafety);
@@ -248,6 +431,15 @@ void CImgNoisePluginFactory::describeInContext(OFX::ImageEffectDescriptor& desc,
         }
     }
 
+    {
+        OFX::IntParamDescriptor *param = desc.defineIntParam(kParamSeed);
+        param->setLabel(kParamSeedLabel);
+        param->setHint(kParamSeedHint);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     CImgNoisePlugin::describeInContextEnd(desc, context, page);
 }
 
@@ -35,6 +35,8 @@
 #include <cmath>
 #include <cfloat>
 #include <vector>
+#include <memory>
+#include <algorithm>
 #ifdef DEBUG
 #include <iostream>
 #endif
@@ -47,6 +49,12 @@
 
 #include "ofxsOGLTextRenderer.h"
 #include "ofxsTransform3x3.h"
+#include "ofxsProcessing.H"
+#include "ofxsFilter.h"
+#include "ofxsMaskMix.h"
+#include "ofxsCoords.h"
+
+#include "SourceTransform.h"
 
 using namespace OFX;
 
@@ -63,8 +71,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
     "This plugin concatenates transforms."
 #define kPluginIdentifier "net.sf.openfx.CornerPinPlugin"
 #define kPluginMaskedIdentifier "net.sf.openfx.CornerPinMaskedPlugin"
+// History:
+// version 1.0: initial version
+// version 1.1: footprint-adaptive filtering
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define POINT_SIZE 5
 #define POINT_TOLERANCE 6
@@ -126,8 +137,267 @@ static const char* const kParamFrom[4] = {
 
 #define kParamSrcClipChanged "srcClipChanged"
 
+#define kParamAdaptive "adaptiveFiltering"
+#define kParamAdaptiveLabel "Adaptive Filtering"
+#define kParamAdaptiveHint \
+    "Adapt the filtering to the footprint of each destination pixel in the source image. " \
+    "Where the footprint is about one pixel, the source is interpolated with the selected filter. " \
+    "Where the source is shrunk, e.g. on a screen receding into the distance, its footprint is filtered along its longest axis (anisotropic filtering), " \
+    "using at most \"" kParamAdaptiveMaxSamplesLabel "\" samples per pixel. " \
+    "Not used with motion blur."
+
+#define kParamAdaptiveMaxSamples "adaptiveMaxSamples"
+#define kParamAdaptiveMaxSamplesLabel "Max Samples"
+#define kParamAdaptiveMaxSamplesHint \
+    "Maximum number of bilinear samples per destination pixel used by adaptive filtering. " \
+    "Larger footprints are sampled more sparsely, which is faster but may leave some aliasing."
+#define kParamAdaptiveMaxSamplesDefault 64
+
+#define kCornerPinAdaptiveThreshold 1.5 // the longest footprint, in source pixels, filtered with the user filter
+#define kCornerPinAdaptiveSigma 0.35 // standard deviation of the footprint filter, in destination pixels
+#define kCornerPinAdaptiveRadius (2. * kCornerPinAdaptiveSigma)
+#define kCornerPinFootprintGrid 4 // number of cells along each side of the grid where the longest footprint is estimated
+
 #define POINT_INTERACT_LINE_SIZE_PIXELS 20
 
+// The footprint of a destination pixel in the source image, from the Jacobian J of the inverse transform at the
+// center of the pixel. The image of the unit disk by J is an ellipse, whose half axes are the singular values of J,
+// along the unit vectors (c, s) for the major axis and (-s, c) for the minor axis.
+struct CornerPinFootprint
+{
+    double x, y; // center, in source pixels
+    double major, minor;
+    double c, s;
+};
+
+// The footprint of the destination point (x,y), H being the inverse transform in pixel coordinates.
+// Returns false if the back-transformed point is at infinity.
+inline bool
+cornerPinFootprintAt(const OFX::Matrix3x3 &H,
+                     double x,
+                     double y,
+                     CornerPinFootprint *fp)
+{
+    const double z = H.g * x + H.h * y + H.i;
+
+    if (z == 0.) {
+        return false;
+    }
+    fp->x = (H.a * x + H.b * y + H.c) / z;
+    fp->y = (H.d * x + H.e * y + H.f) / z;
+    const double Jxx = (H.a - fp->x * H.g) / z;
+    const double Jxy = (H.b - fp->x * H.h) / z;
+    const double Jyx = (H.d - fp->y * H.g) / z;
+    const double Jyy = (H.e - fp->y * H.h) / z;
+    // the eigenvalues of J.J^T are the squared singular values of J
+    const double A = Jxx * Jxx + Jxy * Jxy;
+    const double B = Jxx * Jyx + Jxy * Jyy;
+    const double C = Jyx * Jyx + Jyy * Jyy;
+    const double m = 0.5 * (A + C);
+    const double d = std::sqrt( 0.25 * (A - C) * (A - C) + B * B );
+    const double l1 = m + d;
+    fp->major = std::sqrt(l1);
+    fp->minor = std::sqrt( std::max(0., m - d) );
+    // the eigenvector of the largest eigenvalue, from the row of J.J^T - l1.I with the largest norm
+    double vx, vy;
+    if (A >= C) {
+        vx = l1 - C;
+        vy = B;
+    } else {
+        vx = B;
+        vy = l1 - A;
+    }
+    const double n = std::sqrt(vx * vx + vy * vy);
+    if (n > 0.) {
+        fp->c = vx / n;
+        fp->s = vy / n;
+    } else {
+        // isotropic footprint
+        fp->c = 1.;
+        fp->s = 0.;
+    }
+
+    return true;
+}
+
+// Resample the source image through the inverse transform H (from destination pixels to source pixels), adapting
+// the filter to the footprint of each destination pixel.
+// Where the footprint is at most kCornerPinAdaptiveThreshold source pixels long, the source is interpolated with the
+// user filter. Elsewhere, the footprint is filtered with an elliptical Gaussian (as in EWA) of standard deviation
+// kCornerPinAdaptiveSigma destination pixels, truncated at kCornerPinAdaptiveRadius, sampled with bilinear taps along
+// the axes of the ellipse. The taps are spaced by at most one source pixel, or more if that takes more than maxSamples
+// taps.
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+class CornerPinAdaptiveProcessor
+    : public OFX::ImageProcessor
+{
+public:
+    CornerPinAdaptiveProcessor(OFX::ImageEffect &instance)
+        : OFX::ImageProcessor(instance)
+        , _srcImg(0)
+        , _maskImg(0)
+        , _domask(false)
+        , _maskInvert(false)
+        , _invtransform()
+        , _blackOutside(false)
+        , _mix(1.)
+        , _maxSamples(1)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) { _srcImg = v; }
+
+    void setMaskImg(const OFX::Image *v,
+                    bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
+
+    void doMasking(bool v) { _domask = v; }
+
+    void setValues(const OFX::Matrix3x3 &invtransform,
+                   bool blackOutside,
+                   double mix,
+                   int maxSamples)
+    {
+        _invtransform = invtransform;
+        _blackOutside = blackOutside;
+        _mix = mix;
+        _maxSamples = std::max(1, maxSamples);
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        float tmpPix[nComponents];
+        // the positions and weights of the taps along each axis of the footprint
+        std::vector<double> tMajor(_maxSamples), tMinor(_maxSamples);
+        std::vector<float> wMajor(_maxSamples), wMinor(_maxSamples);
+
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                CornerPinFootprint fp;
+                if ( !_srcImg || !cornerPinFootprintAt(_invtransform, x + 0.5, y + 0.5, &fp) ) {
+                    // the back-transformed point is at infinity
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = 0;
+                    }
+                } else if (fp.major <= kCornerPinAdaptiveThreshold) {
+                    ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fp.x, fp.y, _srcImg, _blackOutside, tmpPix);
+                } else {
+                    sampleFootprint(fp, &tMajor[0], &wMajor[0], &tMinor[0], &wMinor[0], tmpPix);
+                }
+
+                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+            }
+        }
+    }
+
+    // the taps are at the centers of n equal intervals of the footprint axis, with Gaussian weights
+    static void axisTaps(int n,
+                         double r,
+                         double *t,
+                         float *w)
+    {
+        for (int i = 0; i < n; ++i) {
+            const double u = kCornerPinAdaptiveRadius * (-1. + (2 * i + 1) / (double)n); // in destination pixels
+            t[i] = u * r;
+            w[i] = (float)std::exp( -u * u / (2. * kCornerPinAdaptiveSigma * kCornerPinAdaptiveSigma) );
+        }
+    }
+
+    void sampleFootprint(const CornerPinFootprint &fp,
+                         double *tMajor,
+                         float *wMajor,
+                         double *tMinor,
+                         float *wMinor,
+                         float *tmpPix)
+    {
+        // the footprint covers at least one source pixel along the minor axis
+        const double rMajor = fp.major;
+        const double rMinor = std::max(fp.minor, 1.);
+        int nMajor = (int)std::min( std::ceil(2. * kCornerPinAdaptiveRadius * rMajor), (double)_maxSamples );
+        int nMinor = (int)std::min( std::ceil(2. * kCornerPinAdaptiveRadius * rMinor), (double)_maxSamples );
+
+        if (nMajor * nMinor > _maxSamples) {
+            // keep the anisotropy of the footprint
+            const double f = std::sqrt( (double)_maxSamples / ( (double)nMajor * nMinor ) );
+            nMinor = std::max(1, (int)(nMinor * f));
+            nMajor = std::max(1, std::min(nMajor, _maxSamples / nMinor));
+        }
+        axisTaps(nMajor, rMajor, tMajor, wMajor);
+        axisTaps(nMinor, rMinor, tMinor, wMinor);
+
+        float acc[nComponents];
+        for (int c = 0; c < nComponents; ++c) {
+            acc[c] = 0.f;
+        }
+        float wSum = 0.f;
+        float tap[nComponents];
+        for (int j = 0; j < nMinor; ++j) {
+            const double x0 = fp.x - tMinor[j] * fp.s;
+            const double y0 = fp.y + tMinor[j] * fp.c;
+            for (int i = 0; i < nMajor; ++i) {
+                const float w = wMinor[j] * wMajor[i];
+                ofxsFilterInterpolate2D<PIX, nComponents, eFilterBilinear, false>(x0 + tMajor[i] * fp.c, y0 + tMajor[i] * fp.s, _srcImg, _blackOutside, tap);
+                for (int c = 0; c < nComponents; ++c) {
+                    acc[c] += w * tap[c];
+                }
+                wSum += w;
+            }
+        }
+        for (int c = 0; c < nComponents; ++c) {
+            tmpPix[c] = acc[c] / wSum;
+        }
+    }
+
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    bool _domask;
+    bool _maskInvert;
+    OFX::Matrix3x3 _invtransform;
+    bool _blackOutside;
+    double _mix;
+    int _maxSamples;
+};
+
+// An estimate of the longest footprint on a destination rectangle, from the footprints on a grid of
+// kCornerPinFootprintGrid x kCornerPinFootprintGrid cells covering it.
+// It only chooses between the adaptive render and the generic render, which filter the short footprints the same way,
+// so that a maximum between the grid points only leaves a few pixels filtered with the user filter.
+// The footprint grows without bound near the horizon (z = 0), so if it crosses the rectangle, DBL_MAX is returned.
+inline double
+cornerPinMaxFootprint(const OFX::Matrix3x3 &H,
+                      const OfxRectD &rect)
+{
+    // z is affine, so its extrema on the rectangle are at the corners
+    const double z11 = H.g * rect.x1 + H.h * rect.y1 + H.i;
+    const double z12 = H.g * rect.x1 + H.h * rect.y2 + H.i;
+    const double z21 = H.g * rect.x2 + H.h * rect.y1 + H.i;
+    const double z22 = H.g * rect.x2 + H.h * rect.y2 + H.i;
+    if ( ( std::min( std::min(z11, z12), std::min(z21, z22) ) <= 0. ) &&
+         ( std::max( std::max(z11, z12), std::max(z21, z22) ) >= 0. ) ) {
+        return DBL_MAX;
+    }
+
+    double maxMajor = 0.;
+    for (int i = 0; i <= kCornerPinFootprintGrid; ++i) {
+        const double x = rect.x1 + (rect.x2 - rect.x1) * i / kCornerPinFootprintGrid;
+        for (int j = 0; j <= kCornerPinFootprintGrid; ++j) {
+            const double y = rect.y1 + (rect.y2 - rect.y1) * j / kCornerPinFootprintGrid;
+            CornerPinFootprint fp;
+            if ( cornerPinFootprintAt(H, x, y, &fp) ) {
+                maxMajor = std::max(maxMajor, fp.major);
+            }
+        }
+    }
+
+    return maxMajor;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -146,6 +416,8 @@ public:
         , _copyToButton(0)
         , _copyInputButton(0)
         , _srcClipChanged(0)
+        , _adaptive(0)
+        , _adaptiveMaxSamples(0)
     {
         // NON-GENERIC
         for (int i = 0; i < 4; ++i) {
@@ -166,6 +438,9 @@ public:
         assert(_copyInputButton && _copyToButton && _copyFromButton);
         _srcClipChanged = fetchBooleanParam(kParamSrcClipChanged);
         assert(_srcClipChanged);
+        _adaptive = fetchBooleanParam(kParamAdaptive);
+        _adaptiveMaxSamples = fetchIntParam(kParamAdaptiveMaxSamples);
+        assert(_adaptive && _adaptiveMaxSamples);
     }
 
 private:
@@ -195,6 +470,17 @@ private:
     /** @brief called when a clip has just been changed in some way (a rewire maybe) */
     virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    /* adaptive filtering render functions, which return false if the generic render should be used */
+    template <class PIX, int nComponents, int maxValue>
+    bool renderAdaptiveForBitDepth(const OFX::RenderArguments &args);
+
+    template <int nComponents>
+    bool renderAdaptive(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
 private:
     // NON-GENERIC
     OFX::Double2DParam* _to[4];
@@ -207,6 +493,8 @@ private:
     OFX::PushButtonParam* _copyToButton;
     OFX::PushButtonParam* _copyInputButton;
     OFX::BooleanParam* _srcClipChanged; // set to true the first time the user connects src
+    OFX::BooleanParam* _adaptive;
+    OFX::IntParam* _adaptiveMaxSamples;
 };
 
 
@@ -428,6 +716,300 @@ CornerPinPlugin::changedClip(const InstanceChangedArgs &args,
     }
 }
 
+// Grows the region of interest of the source clip set by the generic code by a margin, in canonical coordinates.
+class CornerPinRegionOfInterestSetter
+    : public OFX::RegionOfInterestSetter
+{
+public:
+    CornerPinRegionOfInterestSetter(OFX::RegionOfInterestSetter &rois,
+                                    const OFX::Clip *srcClip,
+                                    double marginX,
+                                    double marginY)
+        : _rois(rois)
+        , _srcClip(srcClip)
+        , _marginX(marginX)
+        , _marginY(marginY)
+    {
+    }
+
+    virtual void setRegionOfInterest(const OFX::Clip &clip,
+                                     const OfxRectD &roi) OVERRIDE FINAL
+    {
+        if ( (&clip != _srcClip) || OFX::Coords::rectIsEmpty(roi) ) {
+            _rois.setRegionOfInterest(clip, roi);
+
+            return;
+        }
+        OfxRectD srcRoI = roi;
+        srcRoI.x1 -= _marginX;
+        srcRoI.x2 += _marginX;
+        srcRoI.y1 -= _marginY;
+        srcRoI.y2 += _marginY;
+        _rois.setRegionOfInterest(clip, srcRoI);
+    }
+
+private:
+    OFX::RegionOfInterestSetter &_rois;
+    const OFX::Clip *_srcClip;
+    double _marginX;
+    double _marginY;
+};
+
+// override the roi call
+void
+CornerPinPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                      OFX::RegionOfInterestSetter &rois)
+{
+    const double time = args.time;
+
+    if ( !_srcClip || !_srcClip->isConnected() || !_adaptive->getValueAtTime(time) ) {
+        Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+        return;
+    }
+    // motion blur is left to the generic render
+    double motionblur = 0.;
+    if (_motionblur) {
+        _motionblur->getValueAtTime(time, motionblur);
+    }
+    bool directionalBlur = false;
+    if (_directionalBlur) {
+        _directionalBlur->getValueAtTime(time, directionalBlur);
+    }
+    if ( (motionblur != 0.) || directionalBlur ) {
+        Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+        return;
+    }
+    // The footprint filter of a destination pixel extends kCornerPinAdaptiveRadius destination pixels around its
+    // center, so the generic code is given the region grown by that radius. Along its minor axis, the footprint covers
+    // at least one source pixel, which may reach kCornerPinAdaptiveRadius source pixels further, and the taps are
+    // bilinear, so the source region is grown by two more source pixels.
+    const double dstPar = _dstClip->getPixelAspectRatio();
+    const double srcPar = _srcClip->getPixelAspectRatio();
+    OFX::RegionsOfInterestArguments grownArgs = args;
+    grownArgs.regionOfInterest.x1 -= kCornerPinAdaptiveRadius * dstPar / args.renderScale.x;
+    grownArgs.regionOfInterest.x2 += kCornerPinAdaptiveRadius * dstPar / args.renderScale.x;
+    grownArgs.regionOfInterest.y1 -= kCornerPinAdaptiveRadius / args.renderScale.y;
+    grownArgs.regionOfInterest.y2 += kCornerPinAdaptiveRadius / args.renderScale.y;
+    CornerPinRegionOfInterestSetter grownRois(rois, _srcClip, 2. * srcPar / args.renderScale.x, 2. / args.renderScale.y);
+    Transform3x3Plugin::getRegionsOfInterest(grownArgs, grownRois);
+}
+
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+void
+cornerPinAdaptiveProcess(OFX::ImageEffect &effect,
+                         const OFX::Image *src,
+                         OFX::Image *dst,
+                         const OFX::Image *mask,
+                         bool maskInvert,
+                         const OfxRectI &renderWindow,
+                         const OFX::Matrix3x3 &invtransform,
+                         bool blackOutside,
+                         double mix,
+                         int maxSamples)
+{
+    CornerPinAdaptiveProcessor<PIX, nComponents, maxValue, filter, clamp> processor(effect);
+    processor.setDstImg(dst);
+    processor.setSrcImg(src);
+    if (mask) {
+        processor.doMasking(true);
+        processor.setMaskImg(mask, maskInvert);
+    }
+    processor.setRenderWindow(renderWindow);
+    processor.setValues(invtransform, blackOutside, mix, maxSamples);
+    processor.process();
+}
+
+template <class PIX, int nComponents, int maxValue>
+bool
+CornerPinPlugin::renderAdaptiveForBitDepth(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    // motion blur is left to the generic render
+    double motionblur = 0.;
+
+    if (_motionblur) {
+        _motionblur->getValueAtTime(time, motionblur);
+    }
+    bool directionalBlur = false;
+    if (_directionalBlur) {
+        _directionalBlur->getValueAtTime(time, directionalBlur);
+    }
+    if ( (motionblur != 0.) || directionalBlur ) {
+        return false;
+    }
+    std::auto_ptr<const OFX::Image> src( ( _srcClip && _srcClip->isConnected() ) ?
+                                         _srcClip->fetchImage(time) : 0 );
+    if ( !src.get() || OFX::Coords::rectIsEmpty( src->getBounds() ) || OFX::Coords::rectIsEmpty(args.renderWindow) ) {
+        return false;
+    }
+    std::auto_ptr<OFX::Image> dst( _dstClip->fetchImage(time) );
+    if ( !dst.get() ) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( (dst->getRenderScale().x != args.renderScale.x) ||
+         ( dst->getRenderScale().y != args.renderScale.y) ||
+         ( ( dst->getField() != OFX::eFieldNone) /* for DaVinci Resolve */ && ( dst->getField() != args.fieldToRender) ) ) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if ( ( src->getPixelDepth() != dst->getPixelDepth() ) ||
+         ( src->getPixelComponents() != dst->getPixelComponents() ) ) {
+        return false;
+    }
+
+    // the transform from destination pixels to source pixels
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    OFX::Matrix3x3 invtransform;
+    if (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, src->getPixelAspectRatio(), dst->getPixelAspectRatio(), invert, 0., 1., &invtransform, 0, 1) != 1) {
+        return false;
+    }
+    // compose with the input transform
+    if ( !sourceInverseTransform(*src, &invtransform) ) {
+        return false;
+    }
+    OfxRectD window;
+    window.x1 = args.renderWindow.x1 + 0.5;
+    window.y1 = args.renderWindow.y1 + 0.5;
+    window.x2 = args.renderWindow.x2 - 0.5;
+    window.y2 = args.renderWindow.y2 - 0.5;
+    if (cornerPinMaxFootprint(invtransform, window) <= kCornerPinAdaptiveThreshold) {
+        // the user filter is used everywhere, as in the generic render
+        return false;
+    }
+
+    FilterEnum filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && _filter) {
+        filter = (FilterEnum)_filter->getValueAtTime(time);
+    }
+    bool clamp = false;
+    if (_clamp) {
+        _clamp->getValueAtTime(time, clamp);
+    }
+    bool blackOutside = true;
+    if (_blackOutside) {
+        _blackOutside->getValueAtTime(time, blackOutside);
+    }
+    double mix = 1.;
+    if (_mix) {
+        _mix->getValueAtTime(time, mix);
+    }
+    // in draft mode, the footprints are sampled more sparsely
+    int maxSamples = _adaptiveMaxSamples->getValueAtTime(time);
+    if (args.renderQualityDraft) {
+        maxSamples = std::max(1, maxSamples / 4);
+    }
+
+    // auto ptr for the mask.
+    bool doMasking = ( ( !_maskApply || _maskApply->getValueAtTime(time) ) && _maskClip && _maskClip->isConnected() );
+    std::auto_ptr<const OFX::Image> mask(doMasking ? _maskClip->fetchImage(time) : 0);
+    bool maskInvert = false;
+    if (doMasking && _maskInvert) {
+        _maskInvert->getValueAtTime(time, maskInvert);
+    }
+
+    // as in the generic render, only the filters with negative lobes need explicit clamping
+#define CORNERPIN_ADAPTIVE_PROCESS(f, c) cornerPinAdaptiveProcess<PIX, nComponents, maxValue, f, c>(*this, src.get(), dst.get(), mask.get(), maskInvert, args.renderWindow, invtransform, blackOutside, mix, maxSamples)
+    switch (filter) {
+    case eFilterImpulse:
+        CORNERPIN_ADAPTIVE_PROCESS(eFilterImpulse, false);
+        break;
+    case eFilterBilinear:
+        CORNERPIN_ADAPTIVE_PROCESS(eFilterBilinear, false);
+        break;
+    case eFilterCubic:
+        CORNERPIN_ADAPTIVE_PROCESS(eFilterCubic, false);
+        break;
+    case eFilterKeys:
+        if (clamp) {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterKeys, true);
+        } else {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterKeys, false);
+        }
+        break;
+    case eFilterSimon:
+        if (clamp) {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterSimon, true);
+        } else {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterSimon, false);
+        }
+        break;
+    case eFilterRifman:
+        if (clamp) {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterRifman, true);
+        } else {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterRifman, false);
+        }
+        break;
+    case eFilterMitchell:
+        if (clamp) {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterMitchell, true);
+        } else {
+            CORNERPIN_ADAPTIVE_PROCESS(eFilterMitchell, false);
+        }
+        break;
+    case eFilterParzen:
+        CORNERPIN_ADAPTIVE_PROCESS(eFilterParzen, false);
+        break;
+    case eFilterNotch:
+        CORNERPIN_ADAPTIVE_PROCESS(eFilterNotch, false);
+        break;
+    }
+#undef CORNERPIN_ADAPTIVE_PROCESS
+
+    return true;
+} // CornerPinPlugin::renderAdaptiveForBitDepth
+
+template <int nComponents>
+bool
+CornerPinPlugin::renderAdaptive(const OFX::RenderArguments &args,
+                                OFX::BitDepthEnum dstBitDepth)
+{
+    switch (dstBitDepth) {
+    case OFX::eBitDepthUByte:
+
+        return renderAdaptiveForBitDepth<unsigned char, nComponents, 255>(args);
+    case OFX::eBitDepthUShort:
+
+        return renderAdaptiveForBitDepth<unsigned short, nComponents, 65535>(args);
+    case OFX::eBitDepthFloat:
+
+        return renderAdaptiveForBitDepth<float, nComponents, 1>(args);
+    default:
+
+        return false;
+    }
+}
+
+// the overridden render function
+void
+CornerPinPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+    bool rendered = false;
+
+    if ( _adaptive->getValueAtTime(args.time) ) {
+        if (dstComponents == OFX::ePixelComponentRGBA) {
+            rendered = renderAdaptive<4>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentRGB) {
+            rendered = renderAdaptive<3>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentXY) {
+            rendered = renderAdaptive<2>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentAlpha) {
+            rendered = renderAdaptive<1>(args, dstBitDepth);
+        }
+    }
+    if (!rendered) {
+        Transform3x3Plugin::render(args);
+    }
+}
+
 class CornerPinTransformInteract
     : public OFX::OverlayInteract
 {
@@ -1075,6 +1657,38 @@ CornerPinPluginDescribeInContext(OFX::ImageEffectDescriptor &desc,
     }
 } // CornerPinPluginDescribeInContext
 
+static void
+CornerPinPluginDescribeAdaptiveParams(OFX::ImageEffectDescriptor &desc,
+                                      PageParamDescriptor *page)
+{
+    // adaptiveFiltering
+    {
+        BooleanParamDescriptor* param = desc.defineBooleanParam(kParamAdaptive);
+        param->setLabel(kParamAdaptiveLabel);
+        param->setHint(kParamAdaptiveHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        param->setLayoutHint(OFX::eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // adaptiveMaxSamples
+    {
+        IntParamDescriptor* param = desc.defineIntParam(kParamAdaptiveMaxSamples);
+        param->setLabel(kParamAdaptiveMaxSamplesLabel);
+        param->setHint(kParamAdaptiveMaxSamplesHint);
+        param->setDefault(kParamAdaptiveMaxSamplesDefault);
+        param->setRange(1, 1024);
+        param->setDisplayRange(4, 256);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+}
+
 mDeclarePluginFactory(CornerPinPluginFactory, {}, {});
 void
 CornerPinPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
@@ -1100,6 +1714,8 @@ CornerPinPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
     Transform3x3DescribeInContextEnd(desc, context, page, false, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 
+    CornerPinPluginDescribeAdaptiveParams(desc, page);
+
     // srcClipChanged
     {
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSrcClipChanged);
@@ -1143,6 +1759,8 @@ CornerPinMaskedPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
 
     Transform3x3DescribeInContextEnd(desc, context, page, true, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 
+    CornerPinPluginDescribeAdaptiveParams(desc, page);
+
     // srcClipChanged
     {
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSrcClipChanged);
@@ -27,6 +27,7 @@
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
 #include "ofxsProcessing.H"
+#include "ofxsCoords.h"
 #include "ofxsMacros.h"
 
 using namespace OFX;
@@ -47,11 +48,15 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 "- Yadif: Interpolator (Yet Another DeInterlacing Filter) from MPlayer by Michael Niedermayer (http://www.mplayerhq.hu). It checks pixels of previous, current and next frames to re-create the missed field by some local adaptive method (edge-directed interpolation) and uses spatial check to prevent most artifacts." \
 
 #define kPluginIdentifier    "net.sf.openfx.Deinterlace"
+// History:
+// version 1.0: initial version
+// version 1.1: support tiles and multi-resolution
+// version 1.2: multithreaded Yadif, vectorized for 8-bit and 16-bit images
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTiles 0
-#define kSupportsMultiResolution 0
+#define kSupportsTiles 1
+#define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1 // are images still fielded at any renderscale?
 #define kSupportsMultipleClipPARs false
 #define kSupportsMultipleClipDepths false
@@ -126,6 +131,12 @@ enum YadifModeEnum {
     eYadifModeTemporal,
 };
 
+// Yadif reads up to 3 pixels on each side of the interpolated pixel, and up to 2 lines above and below it
+#define kYadifHaloX 3
+#define kYadifHaloY 2
+// number of values processed at once by the vectorized Yadif line filter
+#define kYadifChunk 256
+
 class DeinterlacePlugin : public OFX::ImageEffect 
 {
 public:
@@ -154,6 +165,9 @@ private:
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
 
+    // override the roi call
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
 private:
     // do not need to delete these, the ImageEffect is managing them for us
     OFX::Clip *_dstClip;
@@ -213,6 +227,13 @@ inline int one1(unsigned char *) { return 1; }
 inline int one1(unsigned short *) { return 1; }
 inline float one1(float *) { return 0.f; }
 
+// whether filter_line_vector is used for the interior pixels.
+// GCC only vectorizes the float version with -fno-trapping-math, and it is then no faster than FILTER,
+// so float images keep the original code.
+inline bool vectorize1(unsigned char *) { return true; }
+inline bool vectorize1(unsigned short *) { return true; }
+inline bool vectorize1(float *) { return false; }
+
 #define CHECK(j)\
     {   Diff score = FFABS(cur[mrefs + ch * (- 1 + (j))] - cur[prefs + ch * (- 1 - (j))])\
                  + FFABS(cur[mrefs   + ch * (j)] - cur[prefs   - ch * (j)])\
@@ -230,8 +251,8 @@ inline float one1(float *) { return 0.f; }
         Diff d= halven(prev2[0] + next2[0]); \
         Diff e= cur[prefs]; \
         Diff temporal_diff0= FFABS(prev2[0] - next2[0]); \
-        Diff temporal_diff1=halven( FFABS(prev[mrefs] - c) + FFABS(prev[prefs] - e) ); \
-        Diff temporal_diff2=halven( FFABS(next[mrefs] - c) + FFABS(next[prefs] - e) ); \
+        Diff temporal_diff1=halven( FFABS(prev[mrefsp] - c) + FFABS(prev[prefsp] - e) ); \
+        Diff temporal_diff2=halven( FFABS(next[mrefsn] - c) + FFABS(next[prefsn] - e) ); \
         Diff diff= FFMAX3(halven(temporal_diff0), temporal_diff1, temporal_diff2); \
         Diff spatial_pred= halven(c+e); \
  \
@@ -243,8 +264,8 @@ inline float one1(float *) { return 0.f; }
         }\
  \
         if (!(mode&2)) { \
-            Diff b = halven(prev2[2 * mrefs] + next2[2 * mrefs]); \
-            Diff f = halven(prev2[2 * prefs] + next2[2 * prefs]); \
+            Diff b = halven(prev2[2 * mrefs2p] + next2[2 * mrefs2n]); \
+            Diff f = halven(prev2[2 * prefs2p] + next2[2 * prefs2n]); \
             Diff max = FFMAX3(d - e, d - c, FFMIN(b - c, f - e)); \
             Diff min = FFMIN3(d - e, d - c, FFMAX(b - c, f - e)); \
  \
@@ -266,11 +287,96 @@ inline float one1(float *) { return 0.f; }
         next2 += ch; \
     }
 
+// Same computation as FILTER(0, n, 1), written without branches so that the compiler can vectorize it.
+// The components of a line are interleaved, and each component only depends on the same component of the
+// neighbouring pixels, so all the components are processed in a single loop over n = width * ch values.
+// spatialCheck is !(mode&2), which is constant over a line.
+// The offsets of the lines below (prefs) and above (mrefs) are given for the previous, current and next images,
+// which may have different row strides.
+template<int ch,typename Comp,typename Diff,bool spatialCheck>
+inline void filter_line_vector(Comp *dst,
+                               const Comp *prev, const Comp *cur, const Comp *next,
+                               int n, const int prefs3[3], const int mrefs3[3], int parity)
+{
+    const int prefsp = prefs3[0], prefs = prefs3[1], prefsn = prefs3[2];
+    const int mrefsp = mrefs3[0], mrefs = mrefs3[1], mrefsn = mrefs3[2];
+    const Comp *prev2 = parity ? prev : cur ;
+    const Comp *next2 = parity ? cur  : next;
+    const int prefs2p = parity ? prefsp : prefs, mrefs2p = parity ? mrefsp : mrefs;
+    const int prefs2n = parity ? prefs : prefsn, mrefs2n = parity ? mrefs : mrefsn;
+    const Diff one = one1((Comp*)0);
+    // the results are written to a local buffer, which cannot alias the source lines
+    Comp buf[kYadifChunk];
+
+    for (int x0 = 0; x0 < n; x0 += kYadifChunk) {
+        const int x1 = std::min(n, x0 + kYadifChunk);
+        for (int x = x0; x < x1; ++x) {
+            // the lines above (m) and below (p), from x-3 to x+3
+            const Diff m0 = cur[mrefs + x - 3 * ch], m1 = cur[mrefs + x - 2 * ch], m2 = cur[mrefs + x - ch], m3 = cur[mrefs + x];
+            const Diff m4 = cur[mrefs + x + ch], m5 = cur[mrefs + x + 2 * ch], m6 = cur[mrefs + x + 3 * ch];
+            const Diff p0 = cur[prefs + x - 3 * ch], p1 = cur[prefs + x - 2 * ch], p2 = cur[prefs + x - ch], p3 = cur[prefs + x];
+            const Diff p4 = cur[prefs + x + ch], p5 = cur[prefs + x + 2 * ch], p6 = cur[prefs + x + 3 * ch];
+            const Diff c = m3;
+            const Diff d = halven((Diff)prev2[x] + (Diff)next2[x]);
+            const Diff e = p3;
+            const Diff temporal_diff0 = FFABS((Diff)prev2[x] - (Diff)next2[x]);
+            const Diff temporal_diff1 = halven( FFABS((Diff)prev[mrefsp + x] - c) + FFABS((Diff)prev[prefsp + x] - e) );
+            const Diff temporal_diff2 = halven( FFABS((Diff)next[mrefsn + x] - c) + FFABS((Diff)next[prefsn + x] - e) );
+            Diff diff = FFMAX3(halven(temporal_diff0), temporal_diff1, temporal_diff2);
+            Diff spatial_score = FFABS(m2 - p2) + FFABS(c - e) + FFABS(m4 - p4) - one;
+
+            // the scores of CHECK(-1), CHECK(-2), CHECK(1) and CHECK(2)
+            const Diff score_m1 = FFABS(m1 - p3) + FFABS(m2 - p4) + FFABS(m3 - p5);
+            const Diff score_m2 = FFABS(m0 - p4) + FFABS(m1 - p5) + FFABS(m2 - p6);
+            const Diff score_p1 = FFABS(m3 - p1) + FFABS(m4 - p2) + FFABS(m5 - p3);
+            const Diff score_p2 = FFABS(m4 - p0) + FFABS(m5 - p1) + FFABS(m6 - p2);
+            // the spatial prediction is the average of the selected values above and below
+            Diff pred_m = c;
+            Diff pred_p = e;
+
+            // CHECK(-1) CHECK(-2): the second direction is only tried if the first one is better
+            bool better1 = score_m1 < spatial_score;
+            bool better2 = better1 & (score_m2 < score_m1);
+            spatial_score = better1 ? score_m1 : spatial_score;
+            spatial_score = better2 ? score_m2 : spatial_score;
+            pred_m = better1 ? m2 : pred_m;
+            pred_p = better1 ? p4 : pred_p;
+            pred_m = better2 ? m1 : pred_m;
+            pred_p = better2 ? p5 : pred_p;
+            // CHECK(1) CHECK(2)
+            better1 = score_p1 < spatial_score;
+            better2 = better1 & (score_p2 < score_p1);
+            pred_m = better1 ? m4 : pred_m;
+            pred_p = better1 ? p2 : pred_p;
+            pred_m = better2 ? m5 : pred_m;
+            pred_p = better2 ? p1 : pred_p;
+            Diff spatial_pred = halven(pred_m + pred_p);
+
+            if (spatialCheck) {
+                const Diff b = halven((Diff)prev2[2 * mrefs2p + x] + (Diff)next2[2 * mrefs2n + x]);
+                const Diff f = halven((Diff)prev2[2 * prefs2p + x] + (Diff)next2[2 * prefs2n + x]);
+                const Diff max = FFMAX3(d - e, d - c, FFMIN(b - c, f - e));
+                const Diff min = FFMIN3(d - e, d - c, FFMAX(b - c, f - e));
+
+                diff = FFMAX3(diff, min, -max);
+            }
+
+            // diff is never negative, so that this is the same as the clamping in FILTER
+            spatial_pred = FFMAX(FFMIN(spatial_pred, d + diff), d - diff);
+
+            buf[x - x0] = (Comp)spatial_pred;
+        }
+        std::memcpy(dst + x0, buf, (x1 - x0) * sizeof(Comp));
+    }
+}
+
 template<int ch,typename Comp,typename Diff>
 inline void filter_line_c(Comp *dst1,
                           const Comp *prev1, const Comp *cur1, const Comp *next1,
-                          int w, int prefs, int mrefs, int parity, int mode)
+                          int w, const int prefs3[3], const int mrefs3[3], int parity, int mode)
 {
+    const int prefsp = prefs3[0], prefs = prefs3[1], prefsn = prefs3[2];
+    const int mrefsp = mrefs3[0], mrefs = mrefs3[1], mrefsn = mrefs3[2];
     Comp *dst  = dst1;
     const Comp *prev = prev1;
     const Comp *cur  = cur1;
@@ -278,6 +384,8 @@ inline void filter_line_c(Comp *dst1,
     int x;
     const Comp *prev2 = parity ? prev : cur ;
     const Comp *next2 = parity ? cur  : next;
+    const int prefs2p = parity ? prefsp : prefs, mrefs2p = parity ? mrefsp : mrefs;
+    const int prefs2n = parity ? prefs : prefsn, mrefs2n = parity ? mrefs : mrefsn;
 
     /* The function is called with the pointers already pointing to data[3] and
      * with 6 subtracted from the width.  This allows the FILTER macro to be
@@ -286,12 +394,13 @@ inline void filter_line_c(Comp *dst1,
     FILTER(0, w, 1)
 }
 
-#define MAX_ALIGN 8
 template<int ch,typename Comp,typename Diff>
-inline void filter_edges(Comp *dst1,
-                         const Comp *prev1, const Comp *cur1, const Comp *next1,
-                         int w, int prefs, int mrefs, int parity, int mode)
+inline void filter_line_edges_c(Comp *dst1,
+                                const Comp *prev1, const Comp *cur1, const Comp *next1,
+                                int w, const int prefs3[3], const int mrefs3[3], int parity, int mode)
 {
+    const int prefsp = prefs3[0], prefs = prefs3[1], prefsn = prefs3[2];
+    const int mrefsp = mrefs3[0], mrefs = mrefs3[1], mrefsn = mrefs3[2];
     Comp *dst  = dst1;
     const Comp *prev = prev1;
     const Comp *cur  = cur1;
@@ -299,19 +408,12 @@ inline void filter_edges(Comp *dst1,
     int x;
     const Comp *prev2 = parity ? prev : cur ;
     const Comp *next2 = parity ? cur  : next;
+    const int prefs2p = parity ? prefsp : prefs, mrefs2p = parity ? mrefsp : mrefs;
+    const int prefs2n = parity ? prefs : prefsn, mrefs2n = parity ? mrefs : mrefsn;
 
-    /* Only edge pixels need to be processed here.  A constant value of false
-     * for is_not_edge should let the compiler ignore the whole branch. */
-    FILTER(0, 3, 0)
-
-    dst  = dst1  + (w - 3)*ch;
-    prev = prev1 + (w - 3)*ch;
-    cur  = cur1  + (w - 3)*ch;
-    next = next1 + (w - 3)*ch;
-    prev2 = parity ? prev : cur;
-    next2 = parity ? cur  : next;
-
-    FILTER(w - 3, w, 0)
+    /* Only pixels closer than 3 pixels to the left or right edge of the frame are processed here.
+     * A constant value of false for is_not_edge should let the compiler ignore the whole branch. */
+    FILTER(0, w, 0)
 }
 
 inline void interpolate(unsigned char *dst, const unsigned char *cur0,  const unsigned char *cur2, int w)
@@ -331,58 +433,199 @@ inline void interpolate(float *dst, const float *cur0,  const float *cur2, int w
 }
 
 
+// Process the pixels of window, which is a part of frame.
+// Lines and columns are numbered from the frame origin, so that the field parity and the edge handling do not
+// depend on the tile being rendered.
+// The source images must contain the window enlarged by kYadifHaloX pixels and kYadifHaloY lines (within the frame).
+// prev0, cur0 and next0 point to the first pixel of the window in each source image, and refsp, refs and refsn are their row strides.
 template<int ch,typename Comp,typename Diff>
-static void filter_plane(int mode, Comp *dst, int dst_stride,
-                         const Comp *prev0, const Comp *cur0, const Comp *next0,
-                         int refs, int w, int h, int parity, int tff)
+static void filter_window(int mode, Comp *dst, int dst_stride,
+                          const Comp *prev0, const Comp *cur0, const Comp *next0,
+                          int refsp, int refs, int refsn, const OfxRectI &window, const OfxRectI &frame, int parity, int tff)
 {
-    int pix_3 = 3 * ch;
-    for (int y = 0; y < h; ++y) {
-        if (((y ^ parity) & 1)) {
-            const Comp *prev= prev0 + y*refs;
+    const int h = frame.y2 - frame.y1;
+    const int ww = window.x2 - window.x1;
+    // the pixels of the window that are close to the left and right edges of the frame, and the others
+    const int xl1 = window.x1;
+    const int xl2 = std::min(window.x2, frame.x1 + 3);
+    const int xr1 = std::max(window.x1, std::max(frame.x2 - 3, frame.x1 + 3));
+    const int xr2 = window.x2;
+    const int xi1 = std::max(window.x1, frame.x1 + 3);
+    const int xi2 = std::min(window.x2, frame.x2 - 3);
+    for (int y = 0; y < window.y2 - window.y1; ++y) {
+        const int yf = y + window.y1 - frame.y1; // line number in the frame
+        if (((yf ^ parity) & 1)) {
+            const Comp *prev= prev0 + y*refsp;
             const Comp *cur = cur0 + y*refs;
-            const Comp *next= next0 + y*refs;
+            const Comp *next= next0 + y*refsn;
             Comp *dst2= dst + y*dst_stride;
-            int mode2 = y == 1 || y + 2 == h ? 2 : mode;
+            int mode2 = yf == 1 || yf + 2 == h ? 2 : mode;
+            // the line below and the line above, mirrored at the frame edges
+            const int pdir = yf + 1 < h ? 1 : -1;
+            const int mdir = yf ? -1 : 1;
+            const int prefs[3] = { pdir * refsp, pdir * refs, pdir * refsn };
+            const int mrefs[3] = { mdir * refsp, mdir * refs, mdir * refsn };
 
             for (int c = 0; c < ch; ++c) {
-                filter_line_c<ch,Comp,Diff>(dst2 + c + pix_3, prev + c + pix_3, cur + c + pix_3, next + c + pix_3, w - 6,
-                                            y + 1 < h ? refs : -refs,
-                                            y ? -refs : refs,
-                                            parity ^ tff, mode2);
-                filter_edges<ch,Comp,Diff>(dst2 + c, prev + c, cur + c, next + c, w,
-                                           y + 1 < h ? refs : -refs,
-                                           y ? -refs : refs,
-                                           parity ^ tff, mode2);
+                if (xl1 < xl2) {
+                    filter_line_edges_c<ch,Comp,Diff>(dst2 + c, prev + c, cur + c, next + c, xl2 - xl1,
+                                                      prefs, mrefs, parity ^ tff, mode2);
+                }
+                if (xr1 < xr2) {
+                    const int offset = (xr1 - window.x1) * ch + c;
+                    filter_line_edges_c<ch,Comp,Diff>(dst2 + offset, prev + offset, cur + offset, next + offset, xr2 - xr1,
+                                                      prefs, mrefs, parity ^ tff, mode2);
+                }
+            }
+            if (xi1 < xi2) {
+                // all the components of the interior pixels at once
+                const int offset = (xi1 - window.x1) * ch;
+                if (!vectorize1((Comp*)0)) {
+                    for (int c = 0; c < ch; ++c) {
+                        filter_line_c<ch,Comp,Diff>(dst2 + offset + c, prev + offset + c, cur + offset + c, next + offset + c, xi2 - xi1,
+                                                    prefs, mrefs, parity ^ tff, mode2);
+                    }
+                } else if (mode2 & 2) {
+                    filter_line_vector<ch,Comp,Diff,false>(dst2 + offset, prev + offset, cur + offset, next + offset, (xi2 - xi1) * ch,
+                                                           prefs, mrefs, parity ^ tff);
+                } else {
+                    filter_line_vector<ch,Comp,Diff,true>(dst2 + offset, prev + offset, cur + offset, next + offset, (xi2 - xi1) * ch,
+                                                          prefs, mrefs, parity ^ tff);
+                }
             }
         } else {
             std::memcpy(&dst[y * dst_stride],
-                   &cur0[y * refs], w * ch * sizeof(Comp)); // copy original
+                   &cur0[y * refs], ww * ch * sizeof(Comp)); // copy original
         }
     }
-    
+}
+
+// Processes the lines of a window in parallel: each thread gets a contiguous band of lines.
+template<int ch,typename Comp,typename Diff>
+class FilterWindowProcessor : public OFX::MultiThread::Processor
+{
+public:
+    FilterWindowProcessor(OFX::ImageEffect &effect,
+                          int mode, Comp *dst, int dst_stride,
+                          const Comp *prev0, const Comp *cur0, const Comp *next0,
+                          int refsp, int refs, int refsn, const OfxRectI &window, const OfxRectI &frame, int parity, int tff)
+    : _effect(effect)
+    , _mode(mode)
+    , _dst(dst)
+    , _dst_stride(dst_stride)
+    , _prev0(prev0)
+    , _cur0(cur0)
+    , _next0(next0)
+    , _refsp(refsp)
+    , _refs(refs)
+    , _refsn(refsn)
+    , _window(window)
+    , _frame(frame)
+    , _parity(parity)
+    , _tff(tff)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _window.y2 - _window.y1;
+        const int y1 = (int)(((long long)h * threadId) / nThreads);
+        const int y2 = (int)(((long long)h * (threadId + 1)) / nThreads);
+        for (int y = y1; y < y2; ++y) {
+            if (_effect.abort()) {
+                return;
+            }
+            OfxRectI line = _window;
+            line.y1 = _window.y1 + y;
+            line.y2 = line.y1 + 1;
+            filter_window<ch, Comp, Diff>(_mode, _dst + y * _dst_stride, _dst_stride,
+                                          _prev0 + y * _refsp, _cur0 + y * _refs, _next0 + y * _refsn,
+                                          _refsp, _refs, _refsn,
+                                          line, _frame,
+                                          _parity, _tff);
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    int _mode;
+    Comp *_dst;
+    int _dst_stride;
+    const Comp *_prev0;
+    const Comp *_cur0;
+    const Comp *_next0;
+    int _refsp;
+    int _refs;
+    int _refsn;
+    OfxRectI _window;
+    OfxRectI _frame;
+    int _parity;
+    int _tff;
+};
+
+// true if the bounds of img contain rect
+static bool
+imageContains(const OFX::Image &img,
+              const OfxRectI &rect)
+{
+    const OfxRectI bounds = img.getBounds();
+
+    return (bounds.x1 <= rect.x1 && rect.x2 <= bounds.x2 &&
+            bounds.y1 <= rect.y1 && rect.y2 <= bounds.y2);
 }
 
 template<int ch,typename Comp,typename Diff>
-static void filter_plane_ofx(int mode,
+static void filter_plane_ofx(OFX::ImageEffect &effect,
+                             int mode,
                              OFX::Image *dst_,
                              const OFX::Image *srcp,
                              const OFX::Image *src,
                              const OFX::Image *srcn,
+                             const OfxRectI &window,
+                             const OfxRectI &frame,
                              int parity, int tff)
 {
-    Comp *dst = (Comp*)dst_->getPixelData(); // change this when we support renderWindow
-    int dst_stride = dst_->getRowBytes() / sizeof(Comp);
-    const Comp *prev0 = (const Comp*)(srcp ? srcp->getPixelData() : src->getPixelData());
-    const Comp *cur0 = (const Comp*)src->getPixelData();
-    const Comp *next0 = (const Comp*)(srcn ? srcn->getPixelData() : src->getPixelData());
-    int refs = src->getRowBytes() / sizeof(Comp);
-    const OfxRectI bounds = dst_->getBounds();
-    filter_plane<ch, Comp, Diff>(mode, dst, dst_stride,
-                                 prev0, cur0, next0,
-                                 refs,
-                                 bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
-                                 parity, tff);
+    // each image is addressed through its own bounds and row stride.
+    // The previous and next images must contain the window and its halo, else (e.g. at the ends of the clip,
+    // or if the RoD changes) the current image is used in their place, as Yadif does at the ends of a sequence.
+    OfxRectI srcWindow = window;
+    srcWindow.x1 -= kYadifHaloX;
+    srcWindow.x2 += kYadifHaloX;
+    srcWindow.y1 -= kYadifHaloY;
+    srcWindow.y2 += kYadifHaloY;
+    OFX::Coords::rectIntersection(srcWindow, frame, &srcWindow);
+    if (srcp && !imageContains(*srcp, srcWindow)) {
+        srcp = 0;
+    }
+    if (srcn && !imageContains(*srcn, srcWindow)) {
+        srcn = 0;
+    }
+    if (!srcp) {
+        srcp = src;
+    }
+    if (!srcn) {
+        srcn = src;
+    }
+    Comp *dst = (Comp*)dst_->getPixelAddress(window.x1, window.y1);
+    int dst_stride = dst_->getRowBytes() / (int)sizeof(Comp);
+    const Comp *prev0 = (const Comp*)srcp->getPixelAddress(window.x1, window.y1);
+    const Comp *cur0 = (const Comp*)src->getPixelAddress(window.x1, window.y1);
+    const Comp *next0 = (const Comp*)srcn->getPixelAddress(window.x1, window.y1);
+    int refsp = srcp->getRowBytes() / (int)sizeof(Comp);
+    int refs = src->getRowBytes() / (int)sizeof(Comp);
+    int refsn = srcn->getRowBytes() / (int)sizeof(Comp);
+    assert(dst && prev0 && cur0 && next0);
+    if (!dst || !prev0 || !cur0 || !next0) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    FilterWindowProcessor<ch, Comp, Diff> processor(effect,
+                                                    mode, dst, dst_stride,
+                                                    prev0, cur0, next0,
+                                                    refsp, refs, refsn,
+                                                    window, frame,
+                                                    parity, tff);
+    const unsigned int nThreads = std::max(1u, std::min((unsigned int)(window.y2 - window.y1), OFX::MultiThread::getNumCPUs()));
+    processor.multiThread(nThreads);
 }
 
 // =========== GNU Lesser General Public License code end =================
@@ -444,10 +687,31 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
         }
     }
 
-    const OfxRectI rect = dst->getBounds();
+    // the full frame, in pixel coordinates: lines are numbered from its origin
+    OfxRectI frame;
+    const double par = _srcClip->getPixelAspectRatio();
+    const OfxRectD srcRoD = _srcClip->getRegionOfDefinition(args.time);
+    OFX::Coords::toPixelEnclosing(srcRoD, args.renderScale, par, &frame);
+    OfxRectI renderWindow;
+    if (!OFX::Coords::rectIntersection(args.renderWindow, frame, &renderWindow)) {
+        return;
+    }
+    // the source image must contain the render window and its halo (within the frame)
+    OfxRectI srcWindow = renderWindow;
+    srcWindow.x1 -= kYadifHaloX;
+    srcWindow.x2 += kYadifHaloX;
+    srcWindow.y1 -= kYadifHaloY;
+    srcWindow.y2 += kYadifHaloY;
+    OFX::Coords::rectIntersection(srcWindow, frame, &srcWindow);
+    const OfxRectI& srcBounds = src->getBounds();
+    if (srcWindow.x1 < srcBounds.x1 || srcBounds.x2 < srcWindow.x2 ||
+        srcWindow.y1 < srcBounds.y1 || srcBounds.y2 < srcWindow.y2) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave an input image smaller than the region of interest");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
 
-    int width=rect.x2-rect.x1;
-    int height=rect.y2-rect.y1;
+    int width=frame.x2-frame.x1;
+    int height=frame.y2-frame.y1;
 
     int imode       = 0;
     int ifieldOrder = 2;
@@ -460,7 +724,8 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
     imode*=2;
 
     if (ifieldOrder==2) {
-        if (width>1024) {
+        // use the width at full resolution
+        if ((srcRoD.x2 - srcRoD.x1) / par > 1024) {
             ifieldOrder=1;
         } else {
             ifieldOrder=0;
@@ -471,34 +736,34 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
     if (width < 3 || height < 3) {
         // Video of less than 3 columns or lines is not supported
         // just copy src to dst
-        for (int y=0; y<height; y++) {
-            if (src.get()) {
-                std::memcpy(dst->getPixelAddress(0,y), src->getPixelAddress(0,y), abs(src->getRowBytes()));
-            } else {
-                std::memcpy(dst->getPixelAddress(0,y), 0, abs(dst->getRowBytes()));
-            }
+        const size_t bytes = (size_t)(renderWindow.x2 - renderWindow.x1) * dst->getPixelBytes();
+        for (int y=renderWindow.y1; y<renderWindow.y2; y++) {
+            std::memcpy(dst->getPixelAddress(renderWindow.x1,y), src->getPixelAddress(renderWindow.x1,y), bytes);
         }
     } else {
         if (dstComponents == OFX::ePixelComponentRGBA) {
             switch(dstBitDepth) {
             case OFX::eBitDepthUByte:
-                filter_plane_ofx<4,unsigned char,int>(imode, // mode
+                filter_plane_ofx<4,unsigned char,int>(*this, imode, // mode
                                                       dst.get(),
                                                       srcp.get(), src.get(), srcn.get(),
+                                                      renderWindow, frame,
                                                       iparity,ifieldOrder); // parity, tff
                 break;
 
             case OFX::eBitDepthUShort:
-                filter_plane_ofx<4,unsigned short,int>(imode, // mode
+                filter_plane_ofx<4,unsigned short,int>(*this, imode, // mode
                                                        dst.get(),
                                                        srcp.get(), src.get(), srcn.get(),
+                                                       renderWindow, frame,
                                                        iparity,ifieldOrder); // parity, tff
                     break;
                     
             case OFX::eBitDepthFloat:
-                    filter_plane_ofx<4,float,float>(imode, // mode
+                    filter_plane_ofx<4,float,float>(*this, imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
+                                                    renderWindow, frame,
                                                     iparity,ifieldOrder); // parity, tff
                     break;
 
@@ -508,23 +773,26 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
         } else if (dstComponents == OFX::ePixelComponentRGB) {
             switch(dstBitDepth) {
                 case OFX::eBitDepthUByte:
-                    filter_plane_ofx<3,unsigned char,int>(imode, // mode
+                    filter_plane_ofx<3,unsigned char,int>(*this, imode, // mode
                                                           dst.get(),
                                                           srcp.get(), src.get(), srcn.get(),
+                                                          renderWindow, frame,
                                                           iparity,ifieldOrder); // parity, tff
                     break;
 
                 case OFX::eBitDepthUShort:
-                    filter_plane_ofx<3,unsigned short,int>(imode, // mode
+                    filter_plane_ofx<3,unsigned short,int>(*this, imode, // mode
                                                            dst.get(),
                                                            srcp.get(), src.get(), srcn.get(),
+                                                           renderWindow, frame,
                                                            iparity,ifieldOrder); // parity, tff
                     break;
 
                 case OFX::eBitDepthFloat:
-                    filter_plane_ofx<3,float,float>(imode, // mode
+                    filter_plane_ofx<3,float,float>(*this, imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
+                                                    renderWindow, frame,
                                                     iparity,ifieldOrder); // parity, tff
                     break;
 
@@ -534,23 +802,26 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
         } else if (dstComponents == OFX::ePixelComponentXY) {
             switch(dstBitDepth) {
                 case OFX::eBitDepthUByte:
-                    filter_plane_ofx<2,unsigned char,int>(imode, // mode
+                    filter_plane_ofx<2,unsigned char,int>(*this, imode, // mode
                                                           dst.get(),
                                                           srcp.get(), src.get(), srcn.get(),
+                                                          renderWindow, frame,
                                                           iparity,ifieldOrder); // parity, tff
                     break;
 
                 case OFX::eBitDepthUShort:
-                    filter_plane_ofx<2,unsigned short,int>(imode, // mode
+                    filter_plane_ofx<2,unsigned short,int>(*this, imode, // mode
                                                            dst.get(),
                                                            srcp.get(), src.get(), srcn.get(),
+                                                           renderWindow, frame,
                                                            iparity,ifieldOrder); // parity, tff
                     break;
 
                 case OFX::eBitDepthFloat:
-                    filter_plane_ofx<2,float,float>(imode, // mode
+                    filter_plane_ofx<2,float,float>(*this, imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
+                                                    renderWindow, frame,
                                                     iparity,ifieldOrder); // parity, tff
                     break;
 
@@ -560,23 +831,26 @@ void DeinterlacePlugin::render(const OFX::RenderArguments &args)
         } else if (dstComponents == OFX::ePixelComponentAlpha) {
             switch(dstBitDepth) {
             case OFX::eBitDepthUByte:
-                    filter_plane_ofx<1,unsigned char,int>(imode, // mode
+                    filter_plane_ofx<1,unsigned char,int>(*this, imode, // mode
                                                           dst.get(),
                                                           srcp.get(), src.get(), srcn.get(),
+                                                          renderWindow, frame,
                                                           iparity,ifieldOrder); // parity, tff
                     break;
 
             case OFX::eBitDepthUShort:
-                    filter_plane_ofx<1,unsigned short,int>(imode, // mode
+                    filter_plane_ofx<1,unsigned short,int>(*this, imode, // mode
                                                            dst.get(),
                                                            srcp.get(), src.get(), srcn.get(),
+                                                           renderWindow, frame,
                                                            iparity,ifieldOrder); // parity, tff
                     break;
 
             case OFX::eBitDepthFloat:
-                    filter_plane_ofx<1,float,float>(imode, // mode
+                    filter_plane_ofx<1,float,float>(*this, imode, // mode
                                                     dst.get(),
                                                     srcp.get(), src.get(), srcn.get(),
+                                                    renderWindow, frame,
                                                     iparity,ifieldOrder); // parity, tff
                     break;
 
@@ -628,6 +902,31 @@ DeinterlacePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
     frames.setFramesNeeded(*_srcClip, range);
 }
 
+// override the roi call
+// Required if the plugin requires a region from the inputs which is different from the rendered region of the output.
+// (this is the case here)
+void
+DeinterlacePlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                        OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectI frame;
+    OFX::Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(args.time), args.renderScale, par, &frame);
+    OfxRectI roi;
+    OFX::Coords::toPixelEnclosing(args.regionOfInterest, args.renderScale, par, &roi);
+    // add the halo, and align the lines on field pairs from the frame origin
+    roi.x1 -= kYadifHaloX;
+    roi.x2 += kYadifHaloX;
+    roi.y1 = frame.y1 + 2 * (int)std::floor((roi.y1 - kYadifHaloY - frame.y1) / 2.);
+    roi.y2 = frame.y1 + 2 * (int)std::ceil((roi.y2 + kYadifHaloY - frame.y1) / 2.);
+    OfxRectD srcRoI;
+    OFX::Coords::toCanonical(roi, args.renderScale, par, &srcRoI);
+    rois.setRegionOfInterest(*_srcClip, srcRoI);
+}
+
 mDeclarePluginFactory(DeinterlacePluginFactory, {}, {});
 
 
@@ -24,10 +24,13 @@
 // - show progress
 
 #include <cmath> // for floor
+#include <cstdlib> // for abs
 #include <climits> // for INT_MAX
 #include <cfloat>
 #include <cassert>
 #include <algorithm>
+#include <list>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -52,8 +55,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 2.1: sequential renders of Average and Sum update the previous result incrementally; fix operations other than Average
+// version 2.2: add Median and Percentile operations
+// version 2.3: the number of frames processed simultaneously depends on a memory budget, and accumulators are reused across renders
 #define kPluginVersionMajor 2 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 3 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -92,6 +98,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamOperationOptionSumHint "Output is the sum/addition of selected frames."
 #define kParamOperationOptionProduct "Product"
 #define kParamOperationOptionProductHint "Output is the product/multiplication of selected frames."
+#define kParamOperationOptionMedian "Median"
+#define kParamOperationOptionMedianHint "Output is the median of selected frames. This may be used to produce a clean background plate, or to remove temporal noise."
+#define kParamOperationOptionPercentile "Percentile"
+#define kParamOperationOptionPercentileHint "Output is the given percentile of selected frames."
 #define kParamOperationDefault eOperationAverage
 enum OperationEnum {
     eOperationAverage,
@@ -99,17 +109,52 @@ enum OperationEnum {
     eOperationMax,
     eOperationSum,
     eOperationProduct,
+    eOperationMedian,
+    eOperationPercentile,
 };
 
+#define kParamPercentileName "percentile"
+#define kParamPercentileLabel "Percentile"
+#define kParamPercentileHint "Percentile (between 0 and 100) of the values of the selected frames, computed by the Percentile operation. 0 gives the minimum, 50 the median, and 100 the maximum. Values between two frames are interpolated."
+#define kParamPercentileDefault 50.
+
 
 #define kParamOutputCountName  "outputCount"
 #define kParamOutputCountLabel "Output Count to Alpha"
 #define kParamOutputCountHint  "Output image count at each pixel to alpha (input must have an alpha channel)."
 
+#define kParamMemoryBudgetName  "memoryBudget"
+#define kParamMemoryBudgetLabel "Memory Budget (MB)"
+#define kParamMemoryBudgetHint \
+"Memory (in megabytes) that may be used to render each image, which determines how many frames are processed simultaneously, and how many rows of the image are processed simultaneously by Median and Percentile.\n" \
+"A larger budget makes the render faster, since fewer passes over the output image are needed."
+#define kParamMemoryBudgetDefault 256
+
 #define kClipFgMName "FgM"
 
-#define kFrameChunk 4 // how many frames to process simultaneously
+#define kFrameChunkMin 4 // minimum number of frames to process simultaneously, whatever the memory budget
+#define kSlidingWindowCacheSize 8 // how many render windows are kept for sliding window accumulation
+#define kSlidingWindowRefresh 32 // how many incremental updates are done before accumulating all frames again, to avoid drifting
+
 
+// the percentile (between 0 and 100) of n values, interpolated between the closest ranks.
+// The values are reordered.
+template <class PIX>
+static float
+percentileOf(PIX *values, int n, double percentile)
+{
+    assert(n > 0);
+    const double pos = std::max(0., std::min(percentile / 100., 1.)) * (n - 1);
+    const int k = std::min((int)pos, n - 1);
+    std::nth_element(values, values + k, values + n);
+    float value = values[k];
+    if (pos > k && k + 1 < n) {
+        // values after k are all larger
+        const float next = *std::min_element(values + k + 1, values + n);
+        value += (float)(pos - k) * (next - value);
+    }
+    return value;
+}
 
 class FrameBlendProcessorBase : public OFX::PixelProcessor
 {
@@ -119,12 +164,16 @@ protected:
     std::vector<const OFX::Image*> _fgMImgs;
     float *_accumulatorData;
     unsigned short *_countData;
+    void *_stackData;
+    int _stackSize;
+    double _percentile;
     const OFX::Image *_maskImg;
     bool _processR;
     bool _processG;
     bool _processB;
     bool _processA;
     bool _lastPass;
+    bool _subtract;
     bool _outputCount;
     bool  _doMasking;
     double _mix;
@@ -139,12 +188,16 @@ public:
     , _fgMImgs(0)
     , _accumulatorData(0)
     , _countData(0)
+    , _stackData(0)
+    , _stackSize(0)
+    , _percentile(kParamPercentileDefault)
     , _maskImg(0)
     , _processR(true)
     , _processG(true)
     , _processB(true)
     , _processA(false)
     , _lastPass(false)
+    , _subtract(false)
     , _outputCount(false)
     , _doMasking(false)
     , _mix(1.)
@@ -161,6 +214,14 @@ public:
 
     void doMasking(bool v) {_doMasking = v;}
 
+    // remove the source images from the accumulators instead of adding them (only for Average and Sum)
+    void setSubtract(bool v) {_subtract = v;}
+
+    // the stack where the values of each pixel are stored for Median and Percentile, with room for stackSize values per pixel and component
+    void setStack(void *stackData, int stackSize) {_stackData = stackData; _stackSize = stackSize;}
+
+    void setPercentile(double v) {_percentile = v;}
+
     void setValues(bool processR,
                    bool processG,
                    bool processB,
@@ -274,6 +335,7 @@ private:
         assert(1 <= nComponents && nComponents <= 4);
         assert(!_lastPass || _dstPixelData);
         assert(_srcImgs.size() == _fgMImgs.size());
+        assert(!_subtract || (_accumulatorData && (operation == eOperationAverage || operation == eOperationSum)));
         float tmpPix[nComponents];
         float initVal = 0.;
         if (!_accumulatorData) {
@@ -293,8 +355,14 @@ private:
                 case eOperationProduct:
                     initVal = 1.;
                     break;
+                case eOperationMedian:
+                case eOperationPercentile:
+                    initVal = 0.;
+                    break;
             }
         }
+        const bool stack = (operation == eOperationMedian || operation == eOperationPercentile);
+        assert(!stack || (_stackData && !_accumulatorData && _countData));
 
         for (int y = procWindow.y1; y < procWindow.y2; y++) {
             if (_effect.abort()) {
@@ -323,11 +391,22 @@ private:
                     const PIX *fgMPix = (const PIX *)  (_fgMImgs[i] ? _fgMImgs[i]->getPixelAddress(x, y) : 0);
                     if (!fgMPix || *fgMPix <= 0) {
                         const PIX *srcPixi = (const PIX *)  (_srcImgs[i] ? _srcImgs[i]->getPixelAddress(x, y) : 0);
-                        if (srcPixi) {
+                        if (stack) {
+                            // store the value, pixels outside of the image are black
+                            assert(count < _stackSize);
+                            PIX *stackPix = (PIX *)_stackData + renderPix * nComponents * _stackSize;
+                            for (int c = 0; c < nComponents; ++c) {
+                                stackPix[c * _stackSize + count] = srcPixi ? srcPixi[c] : PIX();
+                            }
+                        } else if (srcPixi) {
                             for (int c = 0; c < nComponents; ++c) {
                                 switch (operation) {
                                     case eOperationAverage:
-                                        tmpPix[c] += srcPixi[c];
+                                        if (_subtract) {
+                                            tmpPix[c] -= srcPixi[c];
+                                        } else {
+                                            tmpPix[c] += srcPixi[c];
+                                        }
                                         break;
                                     case eOperationMin:
                                         tmpPix[c] = std::min(tmpPix[c], (float)srcPixi[c]);
@@ -336,15 +415,26 @@ private:
                                         tmpPix[c] = std::max(tmpPix[c], (float)srcPixi[c]);
                                         break;
                                     case eOperationSum:
-                                        tmpPix[c] += srcPixi[c];
+                                        if (_subtract) {
+                                            tmpPix[c] -= srcPixi[c];
+                                        } else {
+                                            tmpPix[c] += srcPixi[c];
+                                        }
                                         break;
                                     case eOperationProduct:
                                         tmpPix[c] *= srcPixi[c];
                                         break;
+                                    case eOperationMedian:
+                                    case eOperationPercentile:
+                                        break;
                                 }
                             }
                         }
-                        ++count;
+                        if (_subtract) {
+                            --count;
+                        } else {
+                            ++count;
+                        }
                     }
                 }
                 if (!_lastPass) {
@@ -355,6 +445,13 @@ private:
                         std::copy(tmpPix, tmpPix + nComponents , &_accumulatorData[renderPix * nComponents]);
                     }
                 } else {
+                    if (stack && count) {
+                        PIX *stackPix = (PIX *)_stackData + renderPix * nComponents * _stackSize;
+                        const double percentile = (operation == eOperationMedian) ? 50. : _percentile;
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] = percentileOf(stackPix + c * _stackSize, count, percentile);
+                        }
+                    }
                     // copy back original values from unprocessed channels
                     if (nComponents == 1) {
                         int c = 0;
@@ -410,6 +507,43 @@ private:
 };
 
 
+// The accumulators of a previous render, used to compute the next frame of a sequential render
+// by removing the frames that left the range and adding the frames that entered it.
+struct FrameBlendCacheEntry
+{
+    OfxRectI renderWindow;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    int nComponents;
+    OFX::BitDepthEnum bitDepth;
+    OperationEnum operation;
+    bool fgM;
+    int interval;
+    int n; // number of frames in the range
+    int min; // first frame of the range
+    int updates; // number of incremental updates since all frames were accumulated
+    std::vector<float> accumulator;
+    std::vector<unsigned short> count;
+
+    // true if the accumulators can be updated for a render with the same properties as other
+    bool matches(const FrameBlendCacheEntry& other) const
+    {
+        return (renderWindow.x1 == other.renderWindow.x1 && renderWindow.y1 == other.renderWindow.y1 &&
+                renderWindow.x2 == other.renderWindow.x2 && renderWindow.y2 == other.renderWindow.y2 &&
+                renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                field == other.field &&
+                nComponents == other.nComponents &&
+                bitDepth == other.bitDepth &&
+                operation == other.operation &&
+                fgM == other.fgM &&
+                interval == other.interval &&
+                n == other.n &&
+                (other.min - min) % interval == 0 &&
+                2 * (std::abs(other.min - min) / interval) < n && // else accumulating all frames is faster
+                updates < kSlidingWindowRefresh);
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class FrameBlendPlugin : public OFX::ImageEffect
@@ -431,10 +565,15 @@ public:
     , _inputRange(0)
     , _frameInterval(0)
     , _operation(0)
+    , _percentile(0)
     , _outputCount(0)
     , _mix(0)
     , _maskApply(0)
     , _maskInvert(0)
+    , _memoryBudget(0)
+    , _cacheMutex()
+    , _cache()
+    , _pool()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -461,12 +600,17 @@ public:
         _inputRange = fetchPushButtonParam(kParamInputRangeName);
         _frameInterval = fetchIntParam(kParamFrameIntervalName);
         _operation = fetchChoiceParam(kParamOperation);
+        _percentile = fetchDoubleParam(kParamPercentileName);
         _outputCount = fetchBooleanParam(kParamOutputCountName);
-        assert(_frameRange && _absolute && _inputRange && _operation && _outputCount);
+        _memoryBudget = fetchIntParam(kParamMemoryBudgetName);
+        assert(_frameRange && _absolute && _inputRange && _operation && _percentile && _outputCount && _memoryBudget);
         _mix = fetchDoubleParam(kParamMix);
         _maskApply = paramExists(kParamMaskApply) ? fetchBooleanParam(kParamMaskApply) : 0;
         _maskInvert = fetchBooleanParam(kParamMaskInvert);
         assert(_mix && _maskInvert);
+
+        OperationEnum operation = (OperationEnum)_operation->getValue();
+        _percentile->setEnabled(operation == eOperationPercentile);
     }
 
 private:
@@ -486,8 +630,25 @@ private:
     /** @brief called when a param has just had its value changed */
     virtual void changedParam(const InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
 private:
 
+    /* fetch the source images and foreground mattes at times[imin..imax-1] */
+    bool fetchImages(const OFX::RenderArguments &args, const std::vector<int> &times, size_t imin, size_t imax,
+                     std::vector<const OFX::Image*> *srcImgs, std::vector<const OFX::Image*> *fgMImgs);
+
+    /* add (or subtract) the frames at the given times to the accumulators of the processor, by chunks */
+    bool accumulate(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args, const std::vector<int> &times, int chunk, bool subtract);
+
+    /* take accumulators from the pool, or new ones if the pool is empty */
+    void takeAccumulators(std::list<FrameBlendCacheEntry> *accumulators);
+
+    /* give the accumulators back to the pool */
+    void giveAccumulators(std::list<FrameBlendCacheEntry> *accumulators, size_t memoryBudget);
+
     template<int nComponents>
     void renderForComponents(const OFX::RenderArguments &args);
 
@@ -511,10 +672,17 @@ private:
     PushButtonParam* _inputRange;
     IntParam* _frameInterval;
     ChoiceParam* _operation;
+    DoubleParam* _percentile;
     BooleanParam* _outputCount;
     OFX::DoubleParam* _mix;
     OFX::BooleanParam* _maskApply;
     OFX::BooleanParam* _maskInvert;
+
+    IntParam* _memoryBudget;
+
+    OFX::MultiThread::Mutex _cacheMutex;
+    std::list<FrameBlendCacheEntry> _cache; // most recently used first, protected by _cacheMutex
+    std::list<FrameBlendCacheEntry> _pool; // accumulators that are not used, kept to avoid reallocating them, protected by _cacheMutex
 };
 
 
@@ -544,6 +712,28 @@ struct OptionalImagesHolder_RAII
     }
 };
 
+static size_t
+getBytesPerComponent(OFX::BitDepthEnum bitDepth)
+{
+    switch (bitDepth) {
+        case OFX::eBitDepthUByte:
+            return sizeof(unsigned char);
+        case OFX::eBitDepthUShort:
+            return sizeof(unsigned short);
+        default:
+            return sizeof(float);
+    }
+}
+
+// number of frames that can be processed simultaneously, given the memory budget and the memory already used
+static int
+getFrameChunk(size_t memoryBudget, size_t memoryUsed, size_t frameBytes, int n)
+{
+    size_t chunk = (memoryUsed < memoryBudget) ? (memoryBudget - memoryUsed) / std::max((size_t)1, frameBytes) : 0;
+    chunk = std::max(chunk, (size_t)kFrameChunkMin);
+    return (int)std::min(chunk, (size_t)std::max(n, 1));
+}
+
 /* set up and run a processor */
 void
 FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args)
@@ -618,12 +808,6 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
         }
     }
 
-    // accumulator image
-    std::auto_ptr<OFX::ImageMemory> accumulator;
-    float *accumulatorData = NULL;
-    std::auto_ptr<OFX::ImageMemory> count;
-    unsigned short *countData = NULL;
-
     // compute range
     bool absolute;
     _absolute->getValueAtTime(time, absolute);
@@ -645,86 +829,225 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
     const OfxRectI& renderWindow = args.renderWindow;
     size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
     OperationEnum operation = processor.getOperation();
+    int dstNComponents = _dstClip->getPixelComponentCount();
+    const bool fgM = (_fgMClip && _fgMClip->isConnected());
+
+    // memory used by the accumulators, and by the images of each frame
+    const size_t memoryBudget = (size_t)std::max(1, _memoryBudget->getValueAtTime(time)) * 1024 * 1024;
+    const size_t accumulatorBytes = nPixels * (dstNComponents * sizeof(float) + sizeof(unsigned short));
+    const size_t frameBytes = nPixels * (dstNComponents + (fgM ? 1 : 0)) * getBytesPerComponent(dstBitDepth);
+
+    processor.setRenderWindow(renderWindow);
+
+    // Sliding window accumulation.
+    // When the host renders a sequence, Average and Sum are computed from the accumulators of a previous render
+    // with the same properties, by subtracting the frames that left the range and adding the frames that entered it.
+    // Random access, parameter changes, and interactive renders (where upstream images may have changed) use the full accumulation.
+    if (args.sequentialRenderStatus && n > 0 &&
+        (operation == eOperationAverage || operation == eOperationSum)) {
+        std::list<FrameBlendCacheEntry> entryList;
+        FrameBlendCacheEntry key;
+        key.renderWindow = renderWindow;
+        key.renderScale = args.renderScale;
+        key.field = args.fieldToRender;
+        key.nComponents = dstNComponents;
+        key.bitDepth = dstBitDepth;
+        key.operation = operation;
+        key.fgM = fgM;
+        key.interval = interval;
+        key.n = n;
+        key.min = min;
+        key.updates = 0;
+        {
+            OFX::MultiThread::AutoMutex guard(_cacheMutex);
+            for (std::list<FrameBlendCacheEntry>::iterator it = _cache.begin(); it != _cache.end(); ++it) {
+                if (it->matches(key)) {
+                    // take the entry out of the cache, so that no other render uses it meanwhile
+                    entryList.splice(entryList.begin(), _cache, it);
+                    break;
+                }
+            }
+        }
+        std::vector<int> leaving;
+        std::vector<int> entering;
+        if (entryList.empty()) {
+            takeAccumulators(&entryList);
+            FrameBlendCacheEntry& entry = entryList.front();
+            std::vector<float> accumulator;
+            std::vector<unsigned short> count;
+            accumulator.swap(entry.accumulator);
+            count.swap(entry.count);
+            entry = key;
+            entry.accumulator.swap(accumulator);
+            entry.count.swap(count);
+            entry.accumulator.assign(nPixels * dstNComponents, 0.f);
+            entry.count.assign(nPixels, 0);
+            for (int i = 0; i < n; ++i) {
+                entering.push_back(min + i*interval);
+            }
+        } else {
+            FrameBlendCacheEntry& entry = entryList.front();
+            const int shift = (min - entry.min) / interval;
+            for (int i = 0; i < std::abs(shift); ++i) {
+                if (shift > 0) {
+                    leaving.push_back(entry.min + i*interval);
+                    entering.push_back(entry.min + (n + i)*interval);
+                } else {
+                    leaving.push_back(entry.min + (n - 1 - i)*interval);
+                    entering.push_back(min + i*interval);
+                }
+            }
+            entry.min = min;
+            ++entry.updates;
+        }
+        FrameBlendCacheEntry& entry = entryList.front();
+        processor.setAccumulators(&entry.accumulator.front(), &entry.count.front());
+        processor.setValues(processR, processG, processB, processA,
+                            false, outputCount, mix);
+        const int chunk = getFrameChunk(memoryBudget, accumulatorBytes, frameBytes, n);
+        if (!accumulate(processor, args, leaving, chunk, true) ||
+            !accumulate(processor, args, entering, chunk, false)) {
+            return; // aborted: the accumulators are incomplete, do not keep them
+        }
+
+        // last pass: compute the output from the accumulators
+        processor.setDstImg(dst.get());
+        processor.setSrcImgs(src.get(), std::vector<const OFX::Image*>());
+        processor.setFgMImgs(std::vector<const OFX::Image*>());
+        processor.setSubtract(false);
+        processor.setValues(processR, processG, processB, processA,
+                            true, outputCount, mix);
+        processor.process();
+
+        if (!abort()) {
+            OFX::MultiThread::AutoMutex guard(_cacheMutex);
+            _cache.splice(_cache.begin(), entryList);
+            if (_cache.size() > kSlidingWindowCacheSize) {
+                std::list<FrameBlendCacheEntry>::iterator last = _cache.end();
+                --last;
+                entryList.splice(entryList.begin(), _cache, last);
+            }
+        }
+        if (!entryList.empty()) {
+            giveAccumulators(&entryList, memoryBudget);
+        }
+        return;
+    }
+
+    // Median and Percentile.
+    // All the values of each pixel are stored, so that the percentile can be selected.
+    // The render window is processed by bands of rows, so that the stored values fit in the memory budget:
+    // for each band, all the frames are fetched and their values are stored, then the output is computed.
+    if (operation == eOperationMedian || operation == eOperationPercentile) {
+        if (n <= 0) {
+            return;
+        }
+        double percentile = kParamPercentileDefault;
+        _percentile->getValueAtTime(time, percentile);
+        processor.setPercentile(percentile);
+
+        const int width = renderWindow.x2 - renderWindow.x1;
+        const int height = renderWindow.y2 - renderWindow.y1;
+        // half of the budget is used by the stored values, the other half by the images that are fetched simultaneously
+        const size_t stackRowBytes = (size_t)width * dstNComponents * n * getBytesPerComponent(dstBitDepth);
+        const size_t rowBytes = stackRowBytes + (size_t)width * sizeof(unsigned short);
+        const int bandHeight = (int)std::max((size_t)1, std::min((size_t)height, (memoryBudget / 2) / std::max((size_t)1, rowBytes)));
+        const int chunk = getFrameChunk(memoryBudget / 2, 0, frameBytes, n);
+        std::auto_ptr<OFX::ImageMemory> stack(new OFX::ImageMemory(bandHeight * stackRowBytes, this));
+        void *stackData = stack->lock();
+        std::auto_ptr<OFX::ImageMemory> count(new OFX::ImageMemory(bandHeight * width * sizeof(unsigned short), this));
+        unsigned short *countData = (unsigned short*)count->lock();
+
+        std::vector<int> times;
+        for (int i = 0; i < n; ++i) {
+            times.push_back(min + i*interval);
+        }
+        OfxRectI band = renderWindow;
+        for (band.y1 = renderWindow.y1; band.y1 < renderWindow.y2; band.y1 = band.y2) {
+            band.y2 = std::min(band.y1 + bandHeight, renderWindow.y2);
+            std::fill(countData, countData + (size_t)(band.y2 - band.y1) * width, 0);
+            processor.setRenderWindow(band);
+            processor.setAccumulators(0, countData);
+            processor.setStack(stackData, n);
+            processor.setValues(processR, processG, processB, processA,
+                                false, outputCount, mix);
+            if (!accumulate(processor, args, times, chunk, false)) {
+                return;
+            }
+
+            // last pass: compute the output from the stored values
+            processor.setDstImg(dst.get());
+            processor.setSrcImgs(src.get(), std::vector<const OFX::Image*>());
+            processor.setFgMImgs(std::vector<const OFX::Image*>());
+            processor.setValues(processR, processG, processB, processA,
+                                true, outputCount, mix);
+            processor.process();
+            if (abort()) {
+                return;
+            }
+        }
+        return;
+    }
+
+    // accumulator image, taken from the pool and given back when done
+    std::list<FrameBlendCacheEntry> accumulators;
+    float *accumulatorData = NULL;
+    unsigned short *countData = NULL;
 
     // Main processing loop.
-    // We process the frame range by chunks, to avoid using too much memory.
+    // We process the frame range by chunks, to avoid using too much memory:
+    // the chunk size is given by the memory budget, so that the accumulators are read and written as few times as possible.
+    const int chunk = getFrameChunk(memoryBudget, accumulatorBytes, frameBytes, n);
     int imin;
     int imax = 0;
     while (imax < n) {
         imin = imax;
-        imax = std::min(imin + kFrameChunk, n);
+        imax = std::min(imin + chunk, n);
         bool lastPass = (imax == n);
 
         if (!lastPass) {
+            if (accumulators.empty()) {
+                takeAccumulators(&accumulators);
+            }
             // Initialize accumulator image (always use float)
             if (!accumulatorData) {
-                int dstNComponents = _dstClip->getPixelComponentCount();
-                accumulator.reset(new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this));
-                accumulatorData = (float*)accumulator->lock();
+                std::vector<float>& accumulator = accumulators.front().accumulator;
                 switch (operation) {
                     case eOperationAverage:
                     case eOperationSum:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
+                    case eOperationMedian:
+                    case eOperationPercentile:
+                        accumulator.assign(nPixels * dstNComponents, 0.f);
                         break;
                     case eOperationMin:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, std::numeric_limits<float>::infinity());
+                        accumulator.assign(nPixels * dstNComponents, std::numeric_limits<float>::infinity());
                         break;
                     case eOperationMax:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, -std::numeric_limits<float>::infinity());
+                        accumulator.assign(nPixels * dstNComponents, -std::numeric_limits<float>::infinity());
                         break;
                     case eOperationProduct:
-                        std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 1.);
+                        accumulator.assign(nPixels * dstNComponents, 1.f);
                         break;
                 }
-
+                accumulatorData = &accumulator.front();
             }
             // Initialize count image if operator is average or outputCount is true and output has alpha (use short)
             if (!countData && (operation == eOperationAverage || outputCount)) {
-                count.reset(new OFX::ImageMemory(nPixels * sizeof(unsigned short), this));
-                countData = (unsigned short*)count->lock();
-                std::fill(countData, countData + nPixels, 0);
+                std::vector<unsigned short>& count = accumulators.front().count;
+                count.assign(nPixels, 0);
+                countData = &count.front();
             }
         }
 
-        // fetch the source images
-        OptionalImagesHolder_RAII srcImgs;
+        // fetch the source images and the foreground mattes
+        std::vector<int> times;
         for (int i = imin; i < imax; ++i) {
-            if (abort()) {
-                return;
-            }
-            const OFX::Image* src = _srcClip ? _srcClip->fetchImage(min + i*interval) : 0;
-            if (src) {
-                if (src->getRenderScale().x != args.renderScale.x ||
-                    src->getRenderScale().y != args.renderScale.y ||
-                    (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-                OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
-                OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
-                if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
-                    OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
-                }
-            }
-            srcImgs.images.push_back(src);
+            times.push_back(min + i*interval);
         }
-        // fetch the foreground mattes
+        OptionalImagesHolder_RAII srcImgs;
         OptionalImagesHolder_RAII fgMImgs;
-        for (int i = imin; i < imax; ++i) {
-            if (abort()) {
-                return;
-            }
-            const OFX::Image* mask = (_fgMClip && _fgMClip->isConnected()) ? _fgMClip->fetchImage(min + i*interval) : 0;
-            if (mask) {
-                assert(_fgMClip->isConnected());
-                if (mask->getRenderScale().x != args.renderScale.x ||
-                    mask->getRenderScale().y != args.renderScale.y ||
-                    (mask->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && mask->getField() != args.fieldToRender)) {
-                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                    OFX::throwSuiteStatusException(kOfxStatFailed);
-                }
-            }
-            fgMImgs.images.push_back(mask);
+        if (!fetchImages(args, times, 0, times.size(), &srcImgs.images, &fgMImgs.images)) {
+            return;
         }
 
         // set the images
@@ -733,8 +1056,6 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
         }
         processor.setSrcImgs(lastPass ? src.get() : 0, srcImgs.images);
         processor.setFgMImgs(fgMImgs.images);
-        // set the render window
-        processor.setRenderWindow(renderWindow);
         processor.setAccumulators(accumulatorData, countData);
 
         processor.setValues(processR, processG, processB, processA,
@@ -743,6 +1064,115 @@ FrameBlendPlugin::setupAndProcess(FrameBlendProcessorBase &processor, const OFX:
         // Call the base class process member, this will call the derived templated process code
         processor.process();
     }
+    if (!accumulators.empty()) {
+        giveAccumulators(&accumulators, memoryBudget);
+    }
+}
+
+/* fetch the source images and foreground mattes at times[imin..imax-1] */
+bool
+FrameBlendPlugin::fetchImages(const OFX::RenderArguments &args, const std::vector<int> &times, size_t imin, size_t imax,
+                              std::vector<const OFX::Image*> *srcImgs, std::vector<const OFX::Image*> *fgMImgs)
+{
+    OFX::BitDepthEnum dstBitDepth = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents = _dstClip->getPixelComponents();
+
+    // fetch the source images
+    for (size_t i = imin; i < imax; ++i) {
+        if (abort()) {
+            return false;
+        }
+        const OFX::Image* src = _srcClip ? _srcClip->fetchImage(times[i]) : 0;
+        // push it first, so that it is freed by the caller if an exception is thrown
+        srcImgs->push_back(src);
+        if (src) {
+            if (src->getRenderScale().x != args.renderScale.x ||
+                src->getRenderScale().y != args.renderScale.y ||
+                (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
+                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                OFX::throwSuiteStatusException(kOfxStatFailed);
+            }
+            OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
+            OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
+            if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
+                OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+            }
+        }
+    }
+    // fetch the foreground mattes
+    for (size_t i = imin; i < imax; ++i) {
+        if (abort()) {
+            return false;
+        }
+        const OFX::Image* mask = (_fgMClip && _fgMClip->isConnected()) ? _fgMClip->fetchImage(times[i]) : 0;
+        fgMImgs->push_back(mask);
+        if (mask) {
+            assert(_fgMClip->isConnected());
+            if (mask->getRenderScale().x != args.renderScale.x ||
+                mask->getRenderScale().y != args.renderScale.y ||
+                (mask->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && mask->getField() != args.fieldToRender)) {
+                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                OFX::throwSuiteStatusException(kOfxStatFailed);
+            }
+        }
+    }
+    return true;
+}
+
+/* add (or subtract) the frames at the given times to the accumulators of the processor, by chunks */
+bool
+FrameBlendPlugin::accumulate(FrameBlendProcessorBase &processor, const OFX::RenderArguments &args, const std::vector<int> &times, int chunk, bool subtract)
+{
+    assert(chunk > 0);
+    for (size_t imin = 0; imin < times.size(); imin += chunk) {
+        size_t imax = std::min(imin + chunk, times.size());
+        OptionalImagesHolder_RAII srcImgs;
+        OptionalImagesHolder_RAII fgMImgs;
+        if (!fetchImages(args, times, imin, imax, &srcImgs.images, &fgMImgs.images)) {
+            return false;
+        }
+        processor.setSrcImgs(0, srcImgs.images);
+        processor.setFgMImgs(fgMImgs.images);
+        processor.setSubtract(subtract);
+        processor.process();
+        if (abort()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* take accumulators from the pool, or new ones if the pool is empty */
+void
+FrameBlendPlugin::takeAccumulators(std::list<FrameBlendCacheEntry> *accumulators)
+{
+    {
+        OFX::MultiThread::AutoMutex guard(_cacheMutex);
+        if (!_pool.empty()) {
+            accumulators->splice(accumulators->begin(), _pool, _pool.begin());
+            return;
+        }
+    }
+    accumulators->push_front(FrameBlendCacheEntry());
+}
+
+/* give the accumulators back to the pool, keeping at most memoryBudget bytes in the pool */
+void
+FrameBlendPlugin::giveAccumulators(std::list<FrameBlendCacheEntry> *accumulators, size_t memoryBudget)
+{
+    OFX::MultiThread::AutoMutex guard(_cacheMutex);
+    _pool.splice(_pool.begin(), *accumulators);
+    size_t poolBytes = 0;
+    std::list<FrameBlendCacheEntry>::iterator it = _pool.begin();
+    while (it != _pool.end()) {
+        const size_t bytes = it->accumulator.capacity() * sizeof(float) + it->count.capacity() * sizeof(unsigned short);
+        if (poolBytes + bytes > memoryBudget) {
+            it = _pool.erase(it);
+        } else {
+            poolBytes += bytes;
+            ++it;
+        }
+    }
 }
 
 // the overridden render function
@@ -815,6 +1245,14 @@ FrameBlendPlugin::renderForBitDepth(const OFX::RenderArguments &args)
             renderForOperation<PIX, nComponents, maxValue, eOperationProduct>(args);
             break;
 
+        case eOperationMedian:
+            renderForOperation<PIX, nComponents, maxValue, eOperationMedian>(args);
+            break;
+
+        case eOperationPercentile:
+            renderForOperation<PIX, nComponents, maxValue, eOperationPercentile>(args);
+            break;
+
     }
 }
 
@@ -822,7 +1260,7 @@ template <class PIX, int nComponents, int maxValue, OperationEnum operation>
 void
 FrameBlendPlugin::renderForOperation(const OFX::RenderArguments &args)
 {
-    FrameBlendProcessor<PIX, nComponents, maxValue, eOperationAverage> fred(*this);
+    FrameBlendProcessor<PIX, nComponents, maxValue, operation> fred(*this);
     setupAndProcess(fred, args);
 }
 
@@ -959,6 +1397,11 @@ FrameBlendPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &
 void
 FrameBlendPlugin::changedParam(const InstanceChangedArgs &args, const std::string &paramName)
 {
+    purgeCaches();
+    if (paramName == kParamOperation) {
+        OperationEnum operation = (OperationEnum)_operation->getValueAtTime(args.time);
+        _percentile->setEnabled(operation == eOperationPercentile);
+    }
     if (paramName == kParamInputRangeName && args.reason == eChangeUserEdit) {
         OfxRangeD range;
         if ( _srcClip && _srcClip->isConnected() ) {
@@ -971,6 +1414,21 @@ FrameBlendPlugin::changedParam(const InstanceChangedArgs &args, const std::strin
     }
 }
 
+void
+FrameBlendPlugin::changedClip(const InstanceChangedArgs &/*args*/, const std::string &/*clipName*/)
+{
+    purgeCaches();
+}
+
+/** @brief free the accumulators kept for sliding window accumulation */
+void
+FrameBlendPlugin::purgeCaches()
+{
+    OFX::MultiThread::AutoMutex guard(_cacheMutex);
+    _cache.clear();
+    _pool.clear();
+}
+
 
 mDeclarePluginFactory(FrameBlendPluginFactory, {}, {});
 
@@ -1148,12 +1606,28 @@ void FrameBlendPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         param->appendOption(kParamOperationOptionSum, kParamOperationOptionSumHint);
         assert(param->getNOptions() == (int)eOperationProduct);
         param->appendOption(kParamOperationOptionProduct, kParamOperationOptionProductHint);
+        assert(param->getNOptions() == (int)eOperationMedian);
+        param->appendOption(kParamOperationOptionMedian, kParamOperationOptionMedianHint);
+        assert(param->getNOptions() == (int)eOperationPercentile);
+        param->appendOption(kParamOperationOptionPercentile, kParamOperationOptionPercentileHint);
         param->setDefault((int)kParamOperationDefault);
         if (page) {
             page->addChild(*param);
         }
     }
 
+    {
+        DoubleParamDescriptor *param = desc.defineDoubleParam(kParamPercentileName);
+        param->setLabel(kParamPercentileLabel);
+        param->setHint(kParamPercentileHint);
+        param->setRange(0., 100.);
+        param->setDisplayRange(0., 100.);
+        param->setDefault(kParamPercentileDefault);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         BooleanParamDescriptor *param = desc.defineBooleanParam(kParamOutputCountName);
         param->setLabel(kParamOutputCountLabel);
@@ -1164,6 +1638,19 @@ void FrameBlendPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc
         }
     }
 
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMemoryBudgetName);
+        param->setLabel(kParamMemoryBudgetLabel);
+        param->setHint(kParamMemoryBudgetHint);
+        param->setRange(1, INT_MAX);
+        param->setDisplayRange(16, 4096);
+        param->setDefault(kParamMemoryBudgetDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     ofxsMaskMixDescribeParams(desc, page);
 }
 
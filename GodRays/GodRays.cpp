@@ -45,8 +45,11 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 "This plugin concatenates transforms upstream."
 
 #define kPluginIdentifier "net.sf.openfx.GodRays"
+// History:
+// version 1.0: initial version
+// version 1.1: recursive method, computing the rays in steps passes
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsMultipleClipPARs false
 #define kSupportsMultipleClipDepths false
@@ -69,6 +72,24 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamSteps "steps"
 #define kParamStepsLabel "Steps"
 #define kParamStepsHint "The number of intermediate images is 2^steps, i.e. 32 for steps=5."
+
+#define kParamMethod "method"
+#define kParamMethodLabel "Method"
+#define kParamMethodHint "How the 2^steps intermediate images are combined."
+#define kParamMethodOptionSamples "Samples"
+#define kParamMethodOptionSamplesHint "Each output pixel averages 2^steps samples of the source image. The cost doubles with each step."
+#define kParamMethodOptionRecursive "Recursive"
+#define kParamMethodOptionRecursiveHint "The image is averaged with a transformed copy of itself, which doubles the number of intermediate images at each pass, so that steps passes are done instead of taking 2^steps samples per pixel. " \
+"The intermediate images are interpolated bilinearly, so that rays are slightly softer than with the Samples method. " \
+"The result is the same as with the Samples method if gamma is 1 and the transform is a uniform scale and a rotation, else the colors and transforms of the intermediate images are approximated."
+
+enum MethodEnum
+{
+    eMethodSamples = 0,
+    eMethodRecursive,
+};
+
+#define kGodRaysRecursiveMaxBytes (128*1024*1024) // maximum memory used by the two intermediate images of the recursive method
 #endif
 
 #define kParamMax "max"
@@ -81,6 +102,141 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 
 #define kParamPremultChanged "premultChanged"
 
+#define kGodRaysLineChunk 64 // number of pixels of a line whose transformed coordinates are computed at once
+
+// Is H an affine transform, for which the perspective divide can be skipped?
+inline bool
+godRaysIsAffine(const OFX::Matrix3x3 &H)
+{
+    return H.g == 0. && H.h == 0. && H.i != 0.;
+}
+
+// Compute the transformed coordinates of the centers of the n pixels starting at (x, y), by forward differences
+// along the line. There is no dependency between pixels, so that the compiler can vectorize the loops.
+// If perspective is false, H must be affine, and fz is set to 1.
+template <bool perspective>
+inline void
+godRaysTransformLine(const OFX::Matrix3x3 &H,
+                     int x,
+                     int y,
+                     int n,
+                     double *fx,
+                     double *fy,
+                     double *fz)
+{
+    const double X = H.a * (x + 0.5) + H.b * (y + 0.5) + H.c;
+    const double Y = H.d * (x + 0.5) + H.e * (y + 0.5) + H.f;
+    const double Z = H.g * (x + 0.5) + H.h * (y + 0.5) + H.i;
+    if (perspective) {
+        for (int i = 0; i < n; ++i) {
+            const double z = Z + i * H.g;
+            fz[i] = z;
+            fx[i] = (X + i * H.a) / z;
+            fy[i] = (Y + i * H.d) / z;
+        }
+    } else {
+        const double zinv = 1. / Z;
+        const double X0 = X * zinv;
+        const double Y0 = Y * zinv;
+        const double dX = H.a * zinv;
+        const double dY = H.d * zinv;
+        for (int i = 0; i < n; ++i) {
+            fz[i] = 1.;
+            fx[i] = X0 + i * dX;
+            fy[i] = Y0 + i * dY;
+        }
+    }
+}
+
+#ifdef USE_STEPS
+// An intermediate image of the recursive method.
+struct GodRaysBuffer
+{
+    OfxRectI bounds;
+    std::vector<float> data;
+};
+
+// Compute the bounding box of the image of rect by the homography H, plus one pixel for interpolation.
+// Returns false if a part of rect is sent to infinity or behind the camera.
+inline bool
+godRaysTransformedBounds(const OFX::Matrix3x3 &H,
+                         const OfxRectI &rect,
+                         OfxRectI *bounds)
+{
+    double xmin = DBL_MAX, xmax = -DBL_MAX, ymin = DBL_MAX, ymax = -DBL_MAX;
+    for (int i = 0; i < 4; ++i) {
+        OFX::Point3D p;
+        p.x = (i & 1) ? rect.x2 : rect.x1;
+        p.y = (i & 2) ? rect.y2 : rect.y1;
+        p.z = 1.;
+        OFX::Point3D q = H * p;
+        if (q.z <= 0.) {
+            return false;
+        }
+        xmin = std::min(xmin, q.x / q.z);
+        xmax = std::max(xmax, q.x / q.z);
+        ymin = std::min(ymin, q.y / q.z);
+        ymax = std::max(ymax, q.y / q.z);
+    }
+    if (xmin < kOfxFlagInfiniteMin || kOfxFlagInfiniteMax < xmax ||
+        ymin < kOfxFlagInfiniteMin || kOfxFlagInfiniteMax < ymax) {
+        return false;
+    }
+    bounds->x1 = (int)std::floor(xmin) - 1;
+    bounds->x2 = (int)std::ceil(xmax) + 1;
+    bounds->y1 = (int)std::floor(ymin) - 1;
+    bounds->y2 = (int)std::ceil(ymax) + 1;
+    return true;
+}
+
+// Run one pass of the recursive method on several threads, by splitting the window into bands of lines.
+template <class ENGINE>
+class GodRaysPassProcessor : public OFX::MultiThread::Processor
+{
+public:
+    GodRaysPassProcessor(OFX::ImageEffect &effect,
+                         ENGINE &engine,
+                         bool sourcePass,
+                         const OfxRectI &window)
+    : _effect(effect)
+    , _engine(engine)
+    , _sourcePass(sourcePass)
+    , _window(window)
+    {
+    }
+
+    void process()
+    {
+        if (OFX::Coords::rectIsEmpty(_window)) {
+            return;
+        }
+        multiThread(std::max(1u, std::min((unsigned int)(_window.y2 - _window.y1), OFX::MultiThread::getNumCPUs())));
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _window.y2 - _window.y1;
+        const int y1 = _window.y1 + (int)(((long long)h * threadId) / nThreads);
+        const int y2 = _window.y1 + (int)(((long long)h * (threadId + 1)) / nThreads);
+        for (int y = y1; y < y2; ++y) {
+            if (_effect.abort()) {
+                return;
+            }
+            if (_sourcePass) {
+                _engine.recursiveSourceLine(y, _window.x1, _window.x2);
+            } else {
+                _engine.recursiveCombineLine(y, _window.x1, _window.x2);
+            }
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    ENGINE &_engine;
+    bool _sourcePass;
+    OfxRectI _window;
+};
+#endif
 
 class GodRaysProcessorBase
 : public Transform3x3ProcessorBase
@@ -133,6 +289,16 @@ public:
 #endif
         _max = max;
     }
+
+#ifdef USE_STEPS
+    /** @brief render with the recursive method.
+     *
+     * setValues() must have been given a single transform, from the destination to the source image (usually
+     * the identity composed with the upstream transform), and stepInvtransform is the inverse transform between two
+     * consecutive intermediate images, in pixel coordinates.
+     */
+    virtual void processRecursive(const OFX::Matrix3x3 &stepInvtransform) = 0;
+#endif
 };
 
 // The "filter" and "clamp" template parameters allow filter-specific optimization
@@ -144,6 +310,10 @@ class GodRaysProcessor
 public:
     GodRaysProcessor(OFX::ImageEffect &instance)
     : GodRaysProcessorBase(instance)
+#ifdef USE_STEPS
+    , _passSrc(0)
+    , _passDst(0)
+#endif
     {
     }
 
@@ -173,61 +343,75 @@ private:
                            bool max) OVERRIDE FINAL
     {
         GodRaysProcessorBase::setValues(invtransform, invtransformsize, blackOutside, motionblur, mix, fromColor, toColor, gamma, steps, max);
-        _color.resize(invtransformsize);
-#ifdef GODRAYS_LINEAR_INTERPOLATION
-        // Linear interpolation is usually not whant the user wants, because in real life crepuscular rays have an exponential decrease in intensity.
-        int range = std::max(1, (int)invtransformsize); // works even if invtransformsize = 1
-        // Same as Nuke: toColor is never completely reached.
-        for (int i=0; i < (int)invtransformsize; ++i) {
-            double alpha = (i+1) / (double)range; // alpha is never 0
-            for (int c = 0; c < nComponents; ++c) {
-                int ci = (nComponents == 1) ? 3 : c;
-                double g = gamma[ci];
-                if (g != 1.) {
-                    _color[i][c] = std::pow(std::pow(std::max(0.,fromColor[ci]),g) * alpha +
-                                            std::pow(std::max(0.,toColor[ci]),  g) * (1-alpha), 1./g);
-                } else {
-                    _color[i][c] = fromColor[ci] * alpha + toColor[ci] * (1.-alpha);
-                }
-            }
-        }
-#else
-        // exponential decrease for gamma = 1, less than exponential for gamma > 1
-        for (int c = 0; c < nComponents; ++c) {
-            int ci = (nComponents == 1) ? 3 : c;
-            double g = gamma[ci];
-            double col1 = std::max(0.001,fromColor[ci]);
-            double col2 = std::max(0.001,toColor[ci]);
-            for (int i = invtransformsize-1; i >= 0; --i) {
-                double col = col1 * std::pow(col2/col1, (invtransformsize-1-i)/(double)invtransformsize);
-                if (g == 1. || col1 == col2) {
-                    _color[i][c] = col;
-                } else {
-                    // "gamma"-interpolation
-                    // reinterpret the color descrease in a different gamma space
-                    double alpha = (col - col2)/(col1 - col2);
-                    _color[i][c] = std::pow(std::pow(col1,g) * alpha +
-                                            std::pow(col2,g) * (1-alpha), 1./g);
-                }
-            }
-        }
-#endif
+        computeColors(invtransformsize, &_color);
     }
 
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE
     {
         assert(_invtransform);
+        bool perspective = false;
+        for (size_t t = 0; t < _invtransformsize; ++t) {
+            perspective = perspective || !godRaysIsAffine(_invtransform[t]);
+        }
         if (_motionblur == 0.) { // no motion blur
-            return multiThreadProcessImagesNoBlur(procWindow);
+            if (perspective) {
+                return multiThreadProcessImagesNoBlur<true>(procWindow);
+            } else {
+                return multiThreadProcessImagesNoBlur<false>(procWindow);
+            }
         } else { // motion blur
+#ifdef USE_STEPS
+            if (perspective) {
+                return multiThreadProcessImagesSteps<true>(procWindow);
+            } else {
+                return multiThreadProcessImagesSteps<false>(procWindow);
+            }
+#else
             return multiThreadProcessImagesMotionBlur(procWindow);
+#endif
         }
     } // multiThreadProcessImages
 
 private:
+    // sample the source image at (fx, fy), the transform by H of a pixel center, z being its homogeneous coordinate
+    template <bool perspective>
+    void sampleSource(const OFX::Matrix3x3 &H,
+                      double fx,
+                      double fy,
+                      double z,
+                      float *tmpPix)
+    {
+        if ( !_srcImg || (perspective && z == 0.) ) {
+            // the back-transformed point is at infinity
+            for (int c = 0; c < nComponents; ++c) {
+                tmpPix[c] = 0;
+            }
+        } else if (filter == eFilterImpulse) {
+            ofxsFilterInterpolate2D<PIX,nComponents,filter,clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+        } else {
+            double Jxx, Jxy, Jyx, Jyy;
+            if (perspective) {
+                Jxx = (H.a - fx*H.g)/z;
+                Jxy = (H.b - fx*H.h)/z;
+                Jyx = (H.d - fy*H.g)/z;
+                Jyy = (H.e - fy*H.h)/z;
+            } else {
+                Jxx = H.a/H.i;
+                Jxy = H.b/H.i;
+                Jyx = H.d/H.i;
+                Jyy = H.e/H.i;
+            }
+            ofxsFilterInterpolate2DSuper<PIX,nComponents,filter,clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+        }
+    }
+
+    template <bool perspective>
     void multiThreadProcessImagesNoBlur(const OfxRectI &procWindow)
     {
         float tmpPix[nComponents];
+        double fx[kGodRaysLineChunk];
+        double fy[kGodRaysLineChunk];
+        double fz[kGodRaysLineChunk];
         const OFX::Matrix3x3 & H = _invtransform[0];
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if ( _effect.abort() ) {
@@ -236,52 +420,75 @@ private:
 
             PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
 
-            // the coordinates of the center of the pixel in canonical coordinates
-            // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
-            OFX::Point3D canonicalCoords;
-            canonicalCoords.z = 1;
-            canonicalCoords.y = (double)y + 0.5;
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+            for (int x1 = procWindow.x1; x1 < procWindow.x2; x1 += kGodRaysLineChunk) {
+                const int n = std::min(kGodRaysLineChunk, procWindow.x2 - x1);
                 // NON-GENERIC TRANSFORM
+                godRaysTransformLine<perspective>(H, x1, y, n, fx, fy, fz);
+                for (int i = 0; i < n; ++i, dstPix += nComponents) {
+                    sampleSource<perspective>(H, fx[i], fy[i], fz[i], tmpPix);
+                    ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x1 + i, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+                }
+            }
+        }
+    }
 
-                // the coordinates of the center of the pixel in canonical coordinates
-                // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
-                canonicalCoords.x = (double)x + 0.5;
-                OFX::Point3D transformed = H * canonicalCoords;
-                if ( !_srcImg || (transformed.z == 0.) ) {
-                    // the back-transformed point is at infinity
-                    for (int c = 0; c < nComponents; ++c) {
-                        tmpPix[c] = 0;
+#ifdef USE_STEPS
+    // Each chunk of a line is transformed by all the transforms in turn, so that the coordinates are computed
+    // incrementally and the source image is read coherently.
+    template <bool perspective>
+    void multiThreadProcessImagesSteps(const OfxRectI &procWindow)
+    {
+        float tmpPix[nComponents];
+        double fx[kGodRaysLineChunk];
+        double fy[kGodRaysLineChunk];
+        double fz[kGodRaysLineChunk];
+        double accPix[kGodRaysLineChunk * nComponents];
+        float maxPix[kGodRaysLineChunk * nComponents];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if ( _effect.abort() ) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            for (int x1 = procWindow.x1; x1 < procWindow.x2; x1 += kGodRaysLineChunk) {
+                const int n = std::min(kGodRaysLineChunk, procWindow.x2 - x1);
+                std::fill(accPix, accPix + n * nComponents, 0.);
+                std::fill(maxPix, maxPix + n * nComponents, 0.f);
+                for (size_t t = 0; t < _invtransformsize; ++t) {
+                    // NON-GENERIC TRANSFORM
+                    const OFX::Matrix3x3& H = _invtransform[t];
+                    godRaysTransformLine<perspective>(H, x1, y, n, fx, fy, fz);
+                    for (int i = 0; i < n; ++i) {
+                        sampleSource<perspective>(H, fx[i], fy[i], fz[i], tmpPix);
+                        for (int c = 0; c < nComponents; ++c) {
+                            // multiply by color
+                            tmpPix[c] *= _color[t][c];
+                            if (_max) {
+                                maxPix[i * nComponents + c] = std::max(maxPix[i * nComponents + c], tmpPix[c]);
+                            }
+                            accPix[i * nComponents + c] += tmpPix[c];
+                        }
                     }
-                } else {
-                    double fx = transformed.z != 0 ? transformed.x / transformed.z : transformed.x;
-                    double fy = transformed.z != 0 ? transformed.y / transformed.z : transformed.y;
-                    if (filter == eFilterImpulse) {
-                        ofxsFilterInterpolate2D<PIX,nComponents,filter,clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
-                    } else {
-                        double Jxx = (H.a*transformed.z - transformed.x*H.g)/(transformed.z*transformed.z);
-                        double Jxy = (H.b*transformed.z - transformed.x*H.h)/(transformed.z*transformed.z);
-                        double Jyx = (H.d*transformed.z - transformed.y*H.g)/(transformed.z*transformed.z);
-                        double Jyy = (H.e*transformed.z - transformed.y*H.h)/(transformed.z*transformed.z);
-                        ofxsFilterInterpolate2DSuper<PIX,nComponents,filter,clamp>(fx, fy, Jxx, Jxy, Jyx, Jyy, _srcImg, _blackOutside, tmpPix);
+                }
+                for (int i = 0; i < n; ++i, dstPix += nComponents) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = _max ? maxPix[i * nComponents + c] : (float)(accPix[i * nComponents + c] / _invtransformsize);
                     }
+                    ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x1 + i, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
                 }
-
-                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
             }
         }
     }
 
+#else
     void multiThreadProcessImagesMotionBlur(const OfxRectI &procWindow)
     {
         float tmpPix[nComponents];
-#ifndef USE_STEPS
         const double maxErr2 = kTransform3x3ProcessorMotionBlurMaxError * kTransform3x3ProcessorMotionBlurMaxError; // maximum expected squared error
         const int maxIt = kTransform3x3ProcessorMotionBlurMaxIterations; // maximum number of iterations
         // Monte Carlo integration, starting with at least 13 regularly spaced samples, and then low discrepancy
         // samples from the van der Corput sequence.
-#endif
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if ( _effect.abort() ) {
                 break;
@@ -299,33 +506,22 @@ private:
                 float max[nComponents];
                 double accPix[nComponents];
                 double mean[nComponents];
-#ifndef USE_STEPS
                 double accPix2[nComponents];
                 double var[nComponents];
-#endif
                 for (int c = 0; c < nComponents; ++c) {
                     max[c] = 0;
                     accPix[c] = 0;
                     mean[c] = 0.;
-#ifndef USE_STEPS
                     accPix2[c] = 0;
                     var[c] = (double)maxValue * maxValue;
-#endif
                 }
                 int sample = 0;
-#ifdef USE_STEPS
-                const int minsamples = _invtransformsize;
-#else
                 const int minsamples = kTransform3x3ProcessorMotionBlurMinIterations; // minimum number of samples (at most maxIt/3
                 unsigned int seed = (unsigned int)(hash(hash(x + (unsigned int)(0x10000 * _motionblur)) + y));
-#endif
                 int maxsamples = minsamples;
                 while (sample < maxsamples) {
                     for (; sample < maxsamples; ++sample) {
                         int t;
-#ifdef USE_STEPS
-                        t = sample;
-#else
                         //int t = 0.5*(van_der_corput<2>(seed1) + van_der_corput<3>(seed2)) * _invtransform.size();
                         if (sample < minsamples) {
                             // distribute the first samples evenly over the interval
@@ -334,7 +530,6 @@ private:
                             t = (int)(van_der_corput<2>(seed) * _invtransformsize);
                         }
                         ++seed;
-#endif
                         // NON-GENERIC TRANSFORM
 
                         // the coordinates of the center of the pixel in canonical coordinates
@@ -367,12 +562,9 @@ private:
                                 max[c] = std::max(max[c], tmpPix[c]);
                             }
                             accPix[c] += tmpPix[c];
-#ifndef USE_STEPS
                             accPix2[c] += tmpPix[c] * tmpPix[c];
-#endif
                         }
                     }
-#ifndef USE_STEPS
                     // compute mean and variance (unbiased)
                     for (int c = 0; c < nComponents; ++c) {
                         mean[c] = sample ? accPix[c] / sample : 0;
@@ -392,18 +584,12 @@ private:
                             }
                         }
                     }
-#endif
                 }
                 if (_max) {
                     for (int c = 0; c < nComponents; ++c) {
                         tmpPix[c] = (float)max[c];
                     }
                 } else {
-#ifdef USE_STEPS
-                    for (int c = 0; c < nComponents; ++c) {
-                        mean[c] = sample ? accPix[c] / sample : 0;
-                    }
-#endif
                     for (int c = 0; c < nComponents; ++c) {
                         tmpPix[c] = (float)mean[c];
                     }
@@ -413,7 +599,6 @@ private:
         }
     }
 
-#ifndef USE_STEPS
     // Compute the /seed/th element of the van der Corput sequence
     // see http://en.wikipedia.org/wiki/Van_der_Corput_sequence
     template <int base>
@@ -461,6 +646,338 @@ private:
         float _data[nComponents];
     };
 
+    // compute the color by which each of the n intermediate images is multiplied
+    void computeColors(size_t n, std::vector<Pix> *colors) const
+    {
+        colors->resize(n);
+#ifdef GODRAYS_LINEAR_INTERPOLATION
+        // Linear interpolation is usually not whant the user wants, because in real life crepuscular rays have an exponential decrease in intensity.
+        int range = std::max(1, (int)n); // works even if n = 1
+        // Same as Nuke: toColor is never completely reached.
+        for (int i=0; i < (int)n; ++i) {
+            double alpha = (i+1) / (double)range; // alpha is never 0
+            for (int c = 0; c < nComponents; ++c) {
+                int ci = (nComponents == 1) ? 3 : c;
+                double g = _gamma[ci];
+                if (g != 1.) {
+                    (*colors)[i][c] = std::pow(std::pow(std::max(0.,_fromColor[ci]),g) * alpha +
+                                               std::pow(std::max(0.,_toColor[ci]),  g) * (1-alpha), 1./g);
+                } else {
+                    (*colors)[i][c] = _fromColor[ci] * alpha + _toColor[ci] * (1.-alpha);
+                }
+            }
+        }
+#else
+        // exponential decrease for gamma = 1, less than exponential for gamma > 1
+        for (int c = 0; c < nComponents; ++c) {
+            int ci = (nComponents == 1) ? 3 : c;
+            double g = _gamma[ci];
+            double col1 = std::max(0.001,_fromColor[ci]);
+            double col2 = std::max(0.001,_toColor[ci]);
+            for (int i = (int)n-1; i >= 0; --i) {
+                double col = col1 * std::pow(col2/col1, (n-1-i)/(double)n);
+                if (g == 1. || col1 == col2) {
+                    (*colors)[i][c] = col;
+                } else {
+                    // "gamma"-interpolation
+                    // reinterpret the color descrease in a different gamma space
+                    double alpha = (col - col2)/(col1 - col2);
+                    (*colors)[i][c] = std::pow(std::pow(col1,g) * alpha +
+                                               std::pow(col2,g) * (1-alpha), 1./g);
+                }
+            }
+        }
+#endif
+    }
+
+#ifdef USE_STEPS
+    friend class GodRaysPassProcessor<GodRaysProcessor>;
+
+    // The recursive method.
+    // Let I be the source image seen through the upstream transform, P the inverse transform between two
+    // consecutive intermediate images, and P_k = P^(2^k). The first intermediate image is J_0 = I, and each pass computes
+    //   J_{k+1}(x) = J_k(x) + w_k J_k(P_k x)
+    // so that after steps passes, J_steps(x) is the sum over i < 2^steps of w(i) I(P^i x), where w(i) is the product
+    // of the w_k for the bits k set in i. With the Max option, the sum is replaced by a max.
+    // This is the same as the Samples method, which uses the transforms at amounts i/(2^steps-1), if these are the
+    // powers of P (e.g. a uniform scale and a rotation about the center), and if the colors are a geometric
+    // progression (gamma = 1). Otherwise, the w_k are fitted to the colors in log space.
+    virtual void processRecursive(const OFX::Matrix3x3 &stepInvtransform) OVERRIDE FINAL
+    {
+        assert(_srcImg && _invtransformsize == 1 && _steps > 0);
+        const int steps = _steps;
+        const size_t n = (size_t)1 << steps;
+
+        // the transform of each pass
+        std::vector<OFX::Matrix3x3> passInvtransform(steps);
+        passInvtransform[0] = stepInvtransform;
+        for (int k = 1; k < steps; ++k) {
+            passInvtransform[k] = passInvtransform[k - 1] * passInvtransform[k - 1];
+        }
+
+        // the region where each intermediate image is needed, starting from the render window
+        std::vector<OfxRectI> bounds(steps + 1);
+        bounds[steps] = _renderWindow;
+        bool ok = true;
+        for (int k = steps - 1; ok && k >= 0; --k) {
+            OfxRectI transformed;
+            ok = godRaysTransformedBounds(passInvtransform[k], bounds[k + 1], &transformed);
+            if (ok) {
+                OFX::Coords::rectBoundingBox(bounds[k + 1], transformed, &bounds[k]);
+            }
+        }
+        if (ok && _blackOutside) {
+            // J_0 is black outside of the source image
+            const OFX::Matrix3x3 &srcInvtransform = _invtransform[0];
+            const double det = srcInvtransform.determinant();
+            OfxRectI srcBounds;
+            if ( (det != 0.) && godRaysTransformedBounds(srcInvtransform.inverse(det), _srcImg->getBounds(), &srcBounds) ) {
+                // leave room for the filter support
+                srcBounds.x1 -= 2;
+                srcBounds.x2 += 2;
+                srcBounds.y1 -= 2;
+                srcBounds.y2 += 2;
+                if ( !OFX::Coords::rectIntersection(bounds[0], srcBounds, &bounds[0]) ) {
+                    bounds[0].x1 = bounds[0].x2 = bounds[0].y1 = bounds[0].y2 = 0;
+                }
+            }
+        }
+        // two intermediate images of nComponents floats are alive at once, and each keeps the size of the largest one it held
+        double maxPixels = 0.;
+        for (int k = 0; ok && k < steps; ++k) {
+            maxPixels = std::max(maxPixels, (double)(bounds[k].x2 - bounds[k].x1) * (bounds[k].y2 - bounds[k].y1));
+        }
+        if ( !ok || ( 2. * maxPixels * nComponents * sizeof(float) > kGodRaysRecursiveMaxBytes ) ) {
+            // the intermediate images would be too large: take the 2^steps samples
+            std::vector<OFX::Matrix3x3> invtransform(n);
+            invtransform[0] = _invtransform[0];
+            for (size_t i = 1; i < n; ++i) {
+                invtransform[i] = invtransform[i - 1] * stepInvtransform;
+            }
+            setValues(&invtransform.front(), n, _blackOutside, -1., _mix, _fromColor, _toColor, _gamma, steps, _max);
+            process();
+
+            return;
+        }
+
+        // Fit log(color(i)) by a + sum_k beta_k bit_k(i).
+        // Since the 2^steps samples are taken, half of them have bit k set, and the least squares solution
+        // is beta_k = mean(log(color) | bit k set) - mean(log(color) | bit k not set).
+        std::vector<Pix> colors;
+        computeColors(n, &colors);
+        std::vector<Pix> passWeight(steps);
+        std::vector<double> bitSum(steps);
+        for (int c = 0; c < nComponents; ++c) {
+            double sum = 0.;
+            std::fill(bitSum.begin(), bitSum.end(), 0.);
+            for (size_t i = 0; i < n; ++i) {
+                const double l = std::log((double)colors[i][c]);
+                sum += l;
+                for (int k = 0; k < steps; ++k) {
+                    if ( (i >> k) & 1 ) {
+                        bitSum[k] += l;
+                    }
+                }
+            }
+            double a = sum / n;
+            for (int k = 0; k < steps; ++k) {
+                const double beta = 2. * (2. * bitSum[k] - sum) / n;
+                a -= beta / 2.;
+                passWeight[k][c] = (float)std::exp(beta);
+            }
+            _passScale[c] = (float)(_max ? std::exp(a) : std::exp(a) / n);
+        }
+
+        GodRaysBuffer buffers[2];
+        buffers[0].bounds = bounds[0];
+        buffers[0].data.resize( (size_t)(bounds[0].x2 - bounds[0].x1) * (bounds[0].y2 - bounds[0].y1) * nComponents );
+        _passDst = &buffers[0];
+        {
+            GodRaysPassProcessor<GodRaysProcessor> pass(_effect, *this, true, bounds[0]);
+            pass.process();
+        }
+        for (int k = 0; k < steps; ++k) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            _passSrc = &buffers[k & 1];
+            _passInvtransform = passInvtransform[k];
+            _passWeight = passWeight[k];
+            if (k < steps - 1) {
+                _passDst = &buffers[(k + 1) & 1];
+                _passDst->bounds = bounds[k + 1];
+                _passDst->data.resize( (size_t)(bounds[k + 1].x2 - bounds[k + 1].x1) * (bounds[k + 1].y2 - bounds[k + 1].y1) * nComponents );
+            } else {
+                // the last pass writes to the destination image
+                _passDst = 0;
+            }
+            GodRaysPassProcessor<GodRaysProcessor> pass(_effect, *this, false, bounds[k + 1]);
+            pass.process();
+        }
+    } // processRecursive
+
+    // compute a line of J_0, which is the source image seen through the upstream transform
+    void recursiveSourceLine(int y,
+                             int x1,
+                             int x2)
+    {
+        if ( godRaysIsAffine(_invtransform[0]) ) {
+            recursiveSourceLine<false>(y, x1, x2);
+        } else {
+            recursiveSourceLine<true>(y, x1, x2);
+        }
+    }
+
+    template <bool perspective>
+    void recursiveSourceLine(int y,
+                             int x1,
+                             int x2)
+    {
+        const OFX::Matrix3x3 & H = _invtransform[0];
+        const OfxRectI &bounds = _passDst->bounds;
+        float *dstPix = &_passDst->data[( (size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x1 - bounds.x1) ) * nComponents];
+        double fx[kGodRaysLineChunk];
+        double fy[kGodRaysLineChunk];
+        double fz[kGodRaysLineChunk];
+        for (int x = x1; x < x2; x += kGodRaysLineChunk) {
+            const int n = std::min(kGodRaysLineChunk, x2 - x);
+            godRaysTransformLine<perspective>(H, x, y, n, fx, fy, fz);
+            for (int i = 0; i < n; ++i, dstPix += nComponents) {
+                sampleSource<perspective>(H, fx[i], fy[i], fz[i], dstPix);
+            }
+        }
+    }
+
+    // get a pixel of the previous intermediate image: black outside if blackOutside, else the nearest edge pixel
+    const float* recursiveTexel(int x,
+                                int y) const
+    {
+        const OfxRectI &bounds = _passSrc->bounds;
+        if ( (x < bounds.x1) || (bounds.x2 <= x) || (y < bounds.y1) || (bounds.y2 <= y) ) {
+            if ( _blackOutside || OFX::Coords::rectIsEmpty(bounds) ) {
+                return 0;
+            }
+            x = std::max( bounds.x1, std::min(x, bounds.x2 - 1) );
+            y = std::max( bounds.y1, std::min(y, bounds.y2 - 1) );
+        }
+
+        return &_passSrc->data[( (size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x - bounds.x1) ) * nComponents];
+    }
+
+    // compute a line of J_{k+1}, or of the destination image for the last pass
+    void recursiveCombineLine(int y,
+                              int x1,
+                              int x2)
+    {
+        if ( godRaysIsAffine(_passInvtransform) ) {
+            recursiveCombineLine<false>(y, x1, x2);
+        } else {
+            recursiveCombineLine<true>(y, x1, x2);
+        }
+    }
+
+    template <bool perspective>
+    void recursiveCombineLine(int y,
+                              int x1,
+                              int x2)
+    {
+        const OFX::Matrix3x3 & H = _passInvtransform;
+        const OfxRectI &srcBounds = _passSrc->bounds;
+        const int srcWidth = srcBounds.x2 - srcBounds.x1;
+        const int srcHeight = srcBounds.y2 - srcBounds.y1;
+        float *bufPix = 0;
+        PIX *dstPix = 0;
+        if (_passDst) {
+            const OfxRectI &bounds = _passDst->bounds;
+            bufPix = &_passDst->data[( (size_t)(y - bounds.y1) * (bounds.x2 - bounds.x1) + (x1 - bounds.x1) ) * nComponents];
+        } else {
+            dstPix = (PIX *) _dstImg->getPixelAddress(x1, y);
+        }
+        float tmpPix[nComponents];
+        double fx[kGodRaysLineChunk];
+        double fy[kGodRaysLineChunk];
+        double fz[kGodRaysLineChunk];
+        int ix[kGodRaysLineChunk];
+        int iy[kGodRaysLineChunk];
+        float dx[kGodRaysLineChunk];
+        float dy[kGodRaysLineChunk];
+        for (int xc = x1; xc < x2; xc += kGodRaysLineChunk) {
+            const int n = std::min(kGodRaysLineChunk, x2 - xc);
+            godRaysTransformLine<perspective>(H, xc, y, n, fx, fy, fz);
+            // bilinear positions and weights of J_k(P_k x), relative to the buffer origin.
+            // Far away positions are clamped, which does not change the result, so that the conversion to int is safe.
+            for (int i = 0; i < n; ++i) {
+                const double u = std::max( -2., std::min(fx[i] - 0.5 - srcBounds.x1, srcWidth + 1.) );
+                const double v = std::max( -2., std::min(fy[i] - 0.5 - srcBounds.y1, srcHeight + 1.) );
+                const double fu = std::floor(u);
+                const double fv = std::floor(v);
+                ix[i] = (int)fu;
+                iy[i] = (int)fv;
+                dx[i] = (float)(u - fu);
+                dy[i] = (float)(v - fv);
+            }
+            for (int i = 0; i < n; ++i) {
+                const int x = xc + i;
+                float shifted[nComponents];
+                for (int c = 0; c < nComponents; ++c) {
+                    shifted[c] = 0.f;
+                }
+                if ( !perspective || (fz[i] != 0.) ) {
+                    const float w[4] = { (1.f - dx[i]) * (1.f - dy[i]), dx[i] * (1.f - dy[i]), (1.f - dx[i]) * dy[i], dx[i] * dy[i] };
+                    if ( (0 <= ix[i]) && (ix[i] + 1 < srcWidth) && (0 <= iy[i]) && (iy[i] + 1 < srcHeight) ) {
+                        // the four pixels are in the buffer
+                        const float *p00 = &_passSrc->data[( (size_t)iy[i] * srcWidth + ix[i] ) * nComponents];
+                        const float *p01 = p00 + (size_t)srcWidth * nComponents;
+                        for (int c = 0; c < nComponents; ++c) {
+                            shifted[c] = w[0] * p00[c] + w[1] * p00[nComponents + c] + w[2] * p01[c] + w[3] * p01[nComponents + c];
+                        }
+                    } else {
+                        for (int t = 0; t < 4; ++t) {
+                            const float *p = recursiveTexel(srcBounds.x1 + ix[i] + (t & 1), srcBounds.y1 + iy[i] + (t >> 1));
+                            if (p) {
+                                for (int c = 0; c < nComponents; ++c) {
+                                    shifted[c] += w[t] * p[c];
+                                }
+                            }
+                        }
+                    }
+                }
+                const float *p = recursiveTexel(x, y);
+                for (int c = 0; c < nComponents; ++c) {
+                    const float v = p ? p[c] : 0.f;
+                    if (_max) {
+                        tmpPix[c] = std::max(v, _passWeight[c] * shifted[c]);
+                    } else {
+                        tmpPix[c] = v + _passWeight[c] * shifted[c];
+                    }
+                }
+                if (bufPix) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        bufPix[c] = tmpPix[c];
+                    }
+                    bufPix += nComponents;
+                } else {
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] *= _passScale[c];
+                        if (_max) {
+                            tmpPix[c] = std::max(0.f, tmpPix[c]);
+                        }
+                    }
+                    ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+                    dstPix += nComponents;
+                }
+            }
+        }
+    }
+
+    // state of the current pass of the recursive method
+    const GodRaysBuffer *_passSrc;
+    GodRaysBuffer *_passDst;
+    OFX::Matrix3x3 _passInvtransform;
+    Pix _passWeight;
+    Pix _passScale;
+#endif
+
     std::vector<Pix > _color;
 };
 
@@ -486,6 +1003,7 @@ public:
     , _gamma(0)
 #ifdef USE_STEPS
     , _steps(0)
+    , _method(0)
 #endif
     , _max(0)
     , _premultChanged(0)
@@ -510,7 +1028,8 @@ public:
         _gamma = fetchRGBAParam(kParamGamma);
 #ifdef USE_STEPS
         _steps = fetchIntParam(kParamSteps);
-        assert(_steps);
+        _method = fetchChoiceParam(kParamMethod);
+        assert(_steps && _method);
 #endif
         _max = fetchBooleanParam(kParamMax);
 
@@ -567,6 +1086,9 @@ private:
     RGBAParam* _toColor;
     RGBAParam* _gamma;
     IntParam* _steps;
+#ifdef USE_STEPS
+    ChoiceParam* _method;
+#endif
     BooleanParam* _max;
     OFX::BooleanParam* _premultChanged; // set to true the first time the user connects src
 };
@@ -845,6 +1367,8 @@ GodRaysPlugin::setupAndProcess(GodRaysProcessorBase &processor,
     double mix = 1.;
 #ifdef USE_STEPS
     int steps = 5;
+    bool recursive = false;
+    OFX::Matrix3x3 stepInvtransform;
 #endif
 
     if ( !src.get() ) {
@@ -894,11 +1418,30 @@ GodRaysPlugin::setupAndProcess(GodRaysProcessorBase &processor,
             _steps->getValueAtTime(time, steps);
         }
         invtransformsizealloc = 1 << std::max(0,steps);
+        int method = eMethodSamples;
+        if (_method) {
+            _method->getValueAtTime(time, method);
+        }
+        if (method == eMethodRecursive && invtransformsizealloc > 1) {
+            // only the transform between two consecutive intermediate images is needed
+            const double amount = 1. / (invtransformsizealloc - 1);
+            recursive = (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, srcpixelAspectRatio, dstpixelAspectRatio, invert, amount, amount, &stepInvtransform, 0, 1) == 1);
+        }
 #else
         invtransformsizealloc = kTransform3x3MotionBlurCount;
 #endif
-        invtransform.resize(invtransformsizealloc);
-        invtransformsize = getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, srcpixelAspectRatio, dstpixelAspectRatio, invert, 0., 1., &invtransform.front(), 0, invtransformsizealloc);
+#ifdef USE_STEPS
+        if (recursive) {
+            // the first intermediate image is the source image (amount = 0)
+            invtransformsizealloc = 1;
+            invtransform.resize(invtransformsizealloc);
+            invtransformsize = getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, srcpixelAspectRatio, dstpixelAspectRatio, invert, 0., 0., &invtransform.front(), 0, invtransformsizealloc);
+        } else
+#endif
+        {
+            invtransform.resize(invtransformsizealloc);
+            invtransformsize = getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, srcpixelAspectRatio, dstpixelAspectRatio, invert, 0., 1., &invtransform.front(), 0, invtransformsizealloc);
+        }
         if (invtransformsize == 1) {
             motionblur  = 0.;
         }
@@ -987,6 +1530,13 @@ GodRaysPlugin::setupAndProcess(GodRaysProcessorBase &processor,
 #endif
                         max);
 
+#ifdef USE_STEPS
+    if (recursive) {
+        processor.processRecursive(stepInvtransform);
+
+        return;
+    }
+#endif
     // Call the base class process member, this will call the derived templated process code
     processor.process();
 } // setupAndProcess
@@ -1204,6 +1754,21 @@ void GodRaysPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, O
             page->addChild(*param);
         }
     }
+
+    // method
+    {
+        ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamMethod);
+        param->setLabel(kParamMethodLabel);
+        param->setHint(kParamMethodHint);
+        assert(param->getNOptions() == eMethodSamples);
+        param->appendOption(kParamMethodOptionSamples, kParamMethodOptionSamplesHint);
+        assert(param->getNOptions() == eMethodRecursive);
+        param->appendOption(kParamMethodOptionRecursive, kParamMethodOptionRecursiveHint);
+        param->setDefault((int)eMethodSamples);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 #else
     // motionBlur
     {
@@ -22,6 +22,11 @@
 
 #include <cmath>
 #include <climits>
+#include <cstring>
+#include <ctime>
+#include <stdio.h> // for snprintf & _snprintf
+#include <limits>
+#include <vector>
 #include <algorithm>
 
 #include "ofxsProcessing.H"
@@ -40,6 +45,9 @@
 #ifdef _WINDOWS
 #include <windows.h>
 #define isnan _isnan
+#  if defined(_MSC_VER) && _MSC_VER < 1900
+#    define snprintf _snprintf
+#  endif
 #else
 using std::isnan;
 #endif
@@ -53,14 +61,16 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription \
 "Compute image statistics over the whole image or over a rectangle. " \
 "The statistics can be computed either on RGBA components or in the HSVL colorspace " \
-"(which is the HSV coilorspace with an additional L component from HSL)."
+"(which is the HSV coilorspace with an additional L component from HSL).\n" \
+"The median, percentiles and clipped pixel counts are computed from a histogram of the values, " \
+"gathered in the same pass as the other statistics."
 #define kPluginIdentifier "net.sf.openfx.ImageStatistics"
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 3 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
-#define kSupportsRenderScale 0 // no renderscale support: statistics are computed at full resolution
+#define kSupportsRenderScale 1 // statistics are only updated at full resolution, unless proxy statistics are enabled
 #define kSupportsMultipleClipPARs false
 #define kSupportsMultipleClipDepths false
 #define kRenderThreadSafety eRenderFullySafe
@@ -90,6 +100,28 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamAutoUpdateLabel "Auto Update"
 #define kParamAutoUpdateHint "Automatically update values when input or rectangle changes if an analysis was performed at current frame. If not checked, values are only updated if the plugin parameters change. "
 
+#define kParamAnalyzeSkipExisting "analyzeSkipExisting"
+#define kParamAnalyzeSkipExistingLabel "Skip Analyzed Frames"
+#define kParamAnalyzeSkipExistingHint "When analyzing a sequence, only analyze frames that do not have an analysis yet. Frames which were analyzed before are updated by Auto Update when they are rendered, and can be re-analyzed using Clear Frame or Clear Sequence."
+
+#define kParamAnalyzeParallelFrames "analyzeParallelFrames"
+#define kParamAnalyzeParallelFramesLabel "Parallel Frames"
+#define kParamAnalyzeParallelFramesHint "Number of frames analyzed concurrently when analyzing a sequence. If 1, frames are analyzed one by one, each frame being analyzed by several threads. Values greater than 1 require a host that can fetch images from several threads during an analysis."
+#define kParamAnalyzeParallelFramesDefault 1
+
+#define kParamAnalysisStatus "analysisStatus"
+#define kParamAnalysisStatusLabel "Sequence Analysis"
+#define kParamAnalysisStatusHint "Progress and estimated remaining time of the sequence analysis."
+
+#define kParamProxyStatistics "proxyStatistics"
+#define kParamProxyStatisticsLabel "Proxy Statistics"
+#define kParamProxyStatisticsHint "Let Auto Update compute the statistics from reduced-resolution (proxy) images, and from a subset of the pixels if Sampling Step is greater than 1. The statistics are then estimates: the Mean Error gives the precision of the mean, the clipped pixel counts are extrapolated to full resolution, and the other values are approximate. If not checked, Auto Update only updates the statistics when rendering at full resolution. Analyze Frame and Analyze Sequence always use all the pixels of the images given by the host, so they can be used to refine the statistics at full resolution."
+
+#define kParamProxySamplingStep "proxySamplingStep"
+#define kParamProxySamplingStepLabel "Sampling Step"
+#define kParamProxySamplingStepHint "When Proxy Statistics is checked, Auto Update only analyzes one pixel out of Sampling Step in each direction."
+#define kParamProxySamplingStepDefault 1
+
 #define kParamGroupRGBA "RGBA"
 
 #define kParamStatMin "statMin"
@@ -104,6 +136,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStatMeanLabel "Mean"
 #define kParamStatMeanHint "The mean is the average. Add up the values, and divide by the number of values."
 
+#define kParamStatMeanError "statMeanError"
+#define kParamStatMeanErrorLabel "Mean Error"
+#define kParamStatMeanErrorHint "Half-width of the 95% confidence interval of the mean, when the statistics were estimated from a proxy image or from a subset of the pixels (see Proxy Statistics), or 0 if all pixels were analyzed at full resolution."
+
 #define kParamStatSDev "statSDev"
 #define kParamStatSDevLabel "S.Dev."
 #define kParamStatSDevHint "The standard deviation (S.Dev.) quantifies variability or scatter, and it is expressed in the same units as your data."
@@ -130,6 +166,34 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
 
+#define kParamStatMedian "statMedian"
+#define kParamStatMedianLabel "Median"
+#define kParamStatMedianHint "The median separates the higher half of the values from the lower half. Percentiles are computed using the nearest-rank method."
+
+#define kParamStatP1 "statP1"
+#define kParamStatP1Label "1st Pct."
+#define kParamStatP1Hint "1st percentile: 1% of the values are lower than or equal to this value."
+
+#define kParamStatP5 "statP5"
+#define kParamStatP5Label "5th Pct."
+#define kParamStatP5Hint "5th percentile: 5% of the values are lower than or equal to this value."
+
+#define kParamStatP95 "statP95"
+#define kParamStatP95Label "95th Pct."
+#define kParamStatP95Hint "95th percentile: 95% of the values are lower than or equal to this value."
+
+#define kParamStatP99 "statP99"
+#define kParamStatP99Label "99th Pct."
+#define kParamStatP99Hint "99th percentile: 99% of the values are lower than or equal to this value."
+
+#define kParamStatClippedLow "statClippedLow"
+#define kParamStatClippedLowLabel "Clipped Low"
+#define kParamStatClippedLowHint "Number of pixels with a value lower than or equal to 0."
+
+#define kParamStatClippedHigh "statClippedHigh"
+#define kParamStatClippedHighLabel "Clipped High"
+#define kParamStatClippedHighHint "Number of pixels with a value greater than or equal to the maximum value (1 for floating-point images, 255 for 8-bit images, 65535 for 16-bit images)."
+
 #define kParamGroupHSVL "HSVL"
 
 #define kParamAnalyzeFrameHSVL "analyzeFrameHSVL"
@@ -160,6 +224,10 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamStatHSVLMeanLabel "HSVL Mean"
 #define kParamStatHSVLMeanHint "The mean is the average. Add up the values, and divide by the number of values."
 
+#define kParamStatHSVLMeanError "statHSVLMeanError"
+#define kParamStatHSVLMeanErrorLabel "HSVL Mean Error"
+#define kParamStatHSVLMeanErrorHint "Half-width of the 95% confidence interval of the mean, when the statistics were estimated from a proxy image or from a subset of the pixels (see Proxy Statistics), or 0 if all pixels were analyzed at full resolution."
+
 #define kParamStatHSVLSDev "statHSVLSDev"
 #define kParamStatHSVLSDevLabel "HSVL S.Dev."
 #define kParamStatHSVLSDevHint "The standard deviation (S.Dev.) quantifies variability or scatter, and it is expressed in the same units as your data."
@@ -185,6 +253,34 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 "• The skewness is unitless.\n" \
 "• Any threshold or rule of thumb is arbitrary, but here is one: If the skewness is greater than 1.0 (or less than -1.0), the skewness is substantial and the distribution is far from symmetrical."
 
+#define kParamStatHSVLMedian "statHSVLMedian"
+#define kParamStatHSVLMedianLabel "HSVL Median"
+#define kParamStatHSVLMedianHint "The median separates the higher half of the values from the lower half. Percentiles are computed using the nearest-rank method."
+
+#define kParamStatHSVLP1 "statHSVLP1"
+#define kParamStatHSVLP1Label "HSVL 1st Pct."
+#define kParamStatHSVLP1Hint "1st percentile: 1% of the values are lower than or equal to this value."
+
+#define kParamStatHSVLP5 "statHSVLP5"
+#define kParamStatHSVLP5Label "HSVL 5th Pct."
+#define kParamStatHSVLP5Hint "5th percentile: 5% of the values are lower than or equal to this value."
+
+#define kParamStatHSVLP95 "statHSVLP95"
+#define kParamStatHSVLP95Label "HSVL 95th Pct."
+#define kParamStatHSVLP95Hint "95th percentile: 95% of the values are lower than or equal to this value."
+
+#define kParamStatHSVLP99 "statHSVLP99"
+#define kParamStatHSVLP99Label "HSVL 99th Pct."
+#define kParamStatHSVLP99Hint "99th percentile: 99% of the values are lower than or equal to this value."
+
+#define kParamStatHSVLClippedLow "statHSVLClippedLow"
+#define kParamStatHSVLClippedLowLabel "HSVL Clipped Low"
+#define kParamStatHSVLClippedLowHint "Number of pixels with a value lower than or equal to 0. Always 0 for the hue, which is not clipped."
+
+#define kParamStatHSVLClippedHigh "statHSVLClippedHigh"
+#define kParamStatHSVLClippedHighLabel "HSVL Clipped High"
+#define kParamStatHSVLClippedHighHint "Number of pixels with a value greater than or equal to 1. Always 0 for the hue, which is not clipped."
+
 #define POINT_TOLERANCE 6
 #define POINT_SIZE 5
 
@@ -199,33 +295,134 @@ struct Results {
     RGBAValues min;
     RGBAValues max;
     RGBAValues mean;
+    RGBAValues meanError;
     RGBAValues sdev;
     RGBAValues skewness;
     RGBAValues kurtosis;
+    RGBAValues median;
+    RGBAValues p1;
+    RGBAValues p5;
+    RGBAValues p95;
+    RGBAValues p99;
+    RGBAValues clippedLow;
+    RGBAValues clippedHigh;
+};
+
+// percentiles computed from the histogram: p1, p5, median, p95, p99
+#define kPercentilesCount 5
+static const double kPercentiles[kPercentilesCount] = { 1., 5., 50., 95., 99. };
+#define kRefineBits 8 // number of bits of the float keys resolved by each refinement pass
+#define kRefineBins (1U << kRefineBits)
+
+// Running central moments of one component.
+// Partial moments (per line, per thread) are merged using the parallel algorithm by Chan et al.,
+// generalized to higher-order moments by Pebay, see
+// "Formulas for Robust, One-Pass Parallel Computation of Covariances and Arbitrary-Order Statistical Moments",
+// P. Pebay, Sandia Report SAND2008-6212, 2008.
+struct Moments {
+    double n;
+    double mean;
+    double m2, m3, m4; // sums of (v-mean)^k
+    double min, max;
+
+    Moments()
+    : n(0), mean(0), m2(0), m3(0), m4(0)
+    , min(+std::numeric_limits<double>::infinity())
+    , max(-std::numeric_limits<double>::infinity())
+    {}
+
+    // compute the moments of a set of values using the two-pass algorithm
+    // (the values are in cache, and this is more accurate than Welford's update)
+    void set(const double *v, int count, int stride)
+    {
+        *this = Moments();
+        if (count <= 0) {
+            return;
+        }
+        double sum = 0.;
+        for (int i = 0; i < count; ++i) {
+            const double x = v[i*stride];
+            sum += x;
+            min = std::min(min, x);
+            max = std::max(max, x);
+        }
+        n = count;
+        mean = sum / count;
+        for (int i = 0; i < count; ++i) {
+            const double d = v[i*stride] - mean;
+            const double d2 = d * d;
+            m2 += d2;
+            m3 += d2 * d;
+            m4 += d2 * d2;
+        }
+    }
+
+    // merge the moments of another set of values
+    void add(const Moments& b)
+    {
+        if (b.n == 0) {
+            return;
+        }
+        if (n == 0) {
+            *this = b;
+            return;
+        }
+        const double na = n, nb = b.n;
+        const double nn = na + nb;
+        const double delta = b.mean - mean;
+        const double delta_n = delta / nn;
+        const double delta_n2 = delta_n * delta_n;
+        const double term1 = delta * delta_n * na * nb;
+        m4 += b.m4 + term1 * delta_n2 * (na*na - na*nb + nb*nb) + 6. * delta_n2 * (na*na*b.m2 + nb*nb*m2) + 4. * delta_n * (na*b.m3 - nb*m3);
+        m3 += b.m3 + term1 * delta_n * (na - nb) + 3. * delta_n * (na*b.m2 - nb*m2);
+        m2 += b.m2 + term1;
+        mean += delta_n * nb;
+        n = nn;
+        min = std::min(min, b.min);
+        max = std::max(max, b.max);
+    }
 };
 
 class ImageStatisticsProcessorBase : public OFX::ImageProcessor
 {
 protected:
     OFX::MultiThread::Mutex _mutex; //< this is used so we can multi-thread the analysis and protect the shared results
-    unsigned long _count;
+    int _samplingStep; //< analyze one pixel out of _samplingStep in each direction
+    double _countScale; //< factor from the number of analyzed pixels to the number of full resolution pixels
+    bool _estimate; //< the image is subsampled or at a reduced resolution
 
 public:
     ImageStatisticsProcessorBase(OFX::ImageEffect &instance)
     : OFX::ImageProcessor(instance)
     , _mutex()
-    , _count(0)
+    , _samplingStep(1)
+    , _countScale(1.)
+    , _estimate(false)
     {
     }
 
-    virtual ~ImageStatisticsProcessorBase()
+    void setSampling(int samplingStep, const OfxPointD& renderScale)
     {
+        _samplingStep = std::max(1, samplingStep);
+        _countScale = (_samplingStep * _samplingStep) / (renderScale.x * renderScale.y);
+        _estimate = (_samplingStep > 1 || renderScale.x != 1. || renderScale.y != 1.);
     }
 
-    virtual void setPrevResults(const Results &results) = 0;
+    virtual ~ImageStatisticsProcessorBase()
+    {
+    }
 
     virtual void getResults(Results *results) = 0;
 
+    // prepare another pass over the image, if the results require it
+    virtual bool startRefinement() { return false; }
+
+    // process the whole render window in the calling thread (used when frames are analyzed concurrently)
+    void processSingleThreaded()
+    {
+        multiThreadProcessImages(_renderWindow);
+    }
+
 protected:
 
     template<class PIX, int nComponents, int maxValue>
@@ -277,598 +474,460 @@ protected:
             hsvl[0] = hsvl[1] = hsvl[2] = hsvl[3] = 0.f;
         }
     }
-
-    template<class PIX, int nComponents, int maxValue>
-    void toComponents(const RGBAValues& rgba, PIX *p)
-    {
-        if (nComponents == 4) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[2] = rgba.b * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[3] = rgba.a * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 3) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[2] = rgba.b * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 2) {
-            p[0] = rgba.r * maxValue + ((maxValue != 1) ? 0.5 : 0);
-            p[1] = rgba.g * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        } else if (nComponents == 1) {
-            p[0] = rgba.a * maxValue + ((maxValue != 1) ? 0.5 : 0);
-        }
-    }
 };
 
 
-template <class PIX, int nComponents, int maxValue>
-class ImageMinMaxMeanProcessor : public ImageStatisticsProcessorBase
+// Computes min, max, mean, sdev, skewness, kurtosis, percentiles and clipped pixel counts in a single pass.
+// Each thread accumulates the moments, histogram and clipped counts of its lines, and merges them once into the shared results.
+//
+// Integer images use one histogram bin per pixel value, so that the percentiles are exact.
+// Floating-point values are binned using the 16 most significant bits of their IEEE-754 representation,
+// which gives bins with a constant relative width (less than 1%) over the whole float range, whatever the range of the data.
+// The percentiles are then refined by two more passes, which bin the values falling into the bins that contain a percentile
+// by the next 8 bits of their representation, so that the percentiles are exact without storing the values.
+// A pass is skipped when the percentiles are already known, e.g. for a constant image.
+template <int nComponentsStat>
+class ImageMomentsProcessorBase : public ImageStatisticsProcessorBase
 {
 private:
-    double _min[nComponents];
-    double _max[nComponents];
-    double _sum[nComponents];
+    Moments _moments[nComponentsStat];
+    const bool _exactBins; // one bin per value (integer images)
+    const double _clipHigh; // values >= _clipHigh are clipped high, values <= 0 are clipped low
+    const int _clipFirst; // components before _clipFirst (e.g. the hue) have no clipped pixel count
+    const int _nBins;
+    std::vector<unsigned int> _histogram; // _nBins bins for each component
+    double _clippedLow[nComponentsStat];
+    double _clippedHigh[nComponentsStat];
+    int _unknownBits; // number of low bits of the percentile keys that are not known yet (float images only)
+    bool _located; // true when the percentiles are known
+    unsigned int _targetBin[nComponentsStat][kPercentilesCount]; // bin (or key prefix) containing each percentile
+    size_t _targetRank[nComponentsStat][kPercentilesCount]; // rank of each percentile within its bin
+    bool _targetDone[nComponentsStat][kPercentilesCount]; // true if _targetBin is the whole key of the percentile
+    std::vector<unsigned int> _subHistogram; // kRefineBins bins for each target bin (float images only)
+    unsigned int _keyRange[nComponentsStat][kPercentilesCount][2]; // range of the keys found in each target bin (float images only)
+
 public:
-    ImageMinMaxMeanProcessor(OFX::ImageEffect &instance)
+    ImageMomentsProcessorBase(OFX::ImageEffect &instance, int maxValue, bool exactBins, int clipFirst)
     : ImageStatisticsProcessorBase(instance)
+    , _exactBins(exactBins)
+    , _clipHigh(maxValue)
+    , _clipFirst(clipFirst)
+    , _nBins(exactBins ? maxValue + 1 : 1 << 16)
+    , _histogram()
+    , _unknownBits(32)
+    , _located(false)
+    , _subHistogram()
     {
-        std::fill(_min, _min+nComponents, +std::numeric_limits<double>::infinity());
-        std::fill(_max, _max+nComponents, -std::numeric_limits<double>::infinity());
-        std::fill(_sum, _sum+nComponents, 0.);
+        std::fill(_clippedLow, _clippedLow + nComponentsStat, 0.);
+        std::fill(_clippedHigh, _clippedHigh + nComponentsStat, 0.);
     }
 
-    ~ImageMinMaxMeanProcessor()
+    // locate the percentiles in the histogram, or in the sub-histograms of the target bins after a refinement pass.
+    // Returns true if another pass over the image is necessary to refine them.
+    bool startRefinement() OVERRIDE FINAL
     {
-    }
-
-    void setPrevResults(const Results &/*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 0) {
-            toRGBA<double, nComponents, 1>(_min, &results->min);
-            toRGBA<double, nComponents, 1>(_max, &results->max);
-            double mean[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                mean[c] = _sum[c]/_count;
+        const double count = _moments[0].n;
+        if (count <= 0 || _histogram.empty()) {
+            return false;
+        }
+        if (_unknownBits == 32) {
+            for (int c = 0; c < nComponentsStat; ++c) {
+                const unsigned int *h = &_histogram[c * _nBins];
+                size_t cumul = 0; // number of values in the bins before bin
+                unsigned int bin = 0;
+                for (int i = 0; i < kPercentilesCount; ++i) {
+                    // nearest-rank method: the percentile is the smallest value such that at least p% of the values are lower or equal
+                    size_t rank = (size_t)std::ceil(kPercentiles[i] / 100. * count);
+                    rank = std::max((size_t)1, std::min(rank, (size_t)count)) - 1;
+                    while (cumul + h[bin] <= rank) {
+                        cumul += h[bin];
+                        ++bin;
+                    }
+                    assert((int)bin < _nBins);
+                    _targetBin[c][i] = bin;
+                    _targetRank[c][i] = rank - cumul;
+                    _targetDone[c][i] = _exactBins;
+                    _keyRange[c][i][0] = floatKey((float)_moments[c].min);
+                    _keyRange[c][i][1] = floatKey((float)_moments[c].max);
+                }
             }
-            toRGBA<double, nComponents, 1>(mean, &results->mean);
-        }
-    }
-
-private:
-
-    void addResults(double min[nComponents], double max[nComponents], double sum[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
-    {
-        double min[nComponents], max[nComponents], sum[nComponents];
-        std::fill(min, min+nComponents, +std::numeric_limits<double>::infinity());
-        std::fill(max, max+nComponents, -std::numeric_limits<double>::infinity());
-        std::fill(sum, sum + nComponents, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
+            _unknownBits = _exactBins ? 0 : 16;
+        } else {
+            // locate the percentiles in the sub-histograms of their bins
+            unsigned int targetBin[nComponentsStat][kPercentilesCount];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                for (int i = 0; i < kPercentilesCount; ++i) {
+                    targetBin[c][i] = _targetBin[c][i];
+                    if (_targetDone[c][i]) {
+                        continue;
+                    }
+                    const int j = firstTarget(c, i);
+                    const unsigned int *h = &_subHistogram[(c * kPercentilesCount + j) * kRefineBins];
+                    size_t cumul = 0;
+                    unsigned int bin = 0;
+                    while (cumul + h[bin] <= _targetRank[c][i]) {
+                        cumul += h[bin];
+                        ++bin;
+                    }
+                    assert(bin < kRefineBins);
+                    targetBin[c][i] = (_targetBin[c][i] << kRefineBits) | bin;
+                    _targetRank[c][i] -= cumul;
+                    _keyRange[c][i][0] = _keyRange[c][j][0];
+                    _keyRange[c][i][1] = _keyRange[c][j][1];
+                }
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = *dstPix;
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                    ++dstPix;
+            for (int c = 0; c < nComponentsStat; ++c) {
+                std::copy(targetBin[c], targetBin[c] + kPercentilesCount, _targetBin[c]);
+            }
+            _unknownBits -= kRefineBits;
+        }
+        // a bin whose keys within the range of the keys found in it (the whole [min,max] after the first pass)
+        // reduce to a single one contains a single value (e.g. a constant channel), and needs no refinement
+        bool refine = false;
+        for (int c = 0; c < nComponentsStat; ++c) {
+            for (int i = 0; i < kPercentilesCount; ++i) {
+                if (_targetDone[c][i]) {
+                    continue;
+                }
+                const unsigned int mask = (_unknownBits == 0) ? 0U : ((1U << _unknownBits) - 1U);
+                const unsigned int lo = std::max(_targetBin[c][i] << _unknownBits, _keyRange[c][i][0]);
+                const unsigned int hi = std::min((_targetBin[c][i] << _unknownBits) | mask, _keyRange[c][i][1]);
+                if (_unknownBits == 0 || lo >= hi) {
+                    _targetBin[c][i] = (_unknownBits == 0) ? _targetBin[c][i] : lo;
+                    _targetDone[c][i] = true;
+                } else {
+                    refine = true;
                 }
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum[c] += sumLine[c];
+        }
+        if (refine) {
+            _subHistogram.assign(nComponentsStat * kPercentilesCount * kRefineBins, 0);
+            for (int c = 0; c < nComponentsStat; ++c) {
+                for (int i = 0; i < kPercentilesCount; ++i) {
+                    _keyRange[c][i][0] = 0xFFFFFFFFU;
+                    _keyRange[c][i][1] = 0U;
+                }
             }
-            count += procWindow.x2 - procWindow.x1;
+        } else {
+            _unknownBits = 0;
+            _subHistogram.clear();
+            _located = true;
         }
 
-        addResults(min, max, sum, count);
-    }
-};
-
-
-
-
-template <class PIX, int nComponents, int maxValue>
-class ImageSDevProcessor : public ImageStatisticsProcessorBase
-{
-private:
-    double _mean[nComponents];
-    double _sum_p2[nComponents];
-public:
-    ImageSDevProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponents, 0.);
-        std::fill(_sum_p2, _sum_p2+nComponents, 0.);
-    }
-
-    ~ImageSDevProcessor()
-    {
-    }
-
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
+        return refine;
     }
 
     void getResults(Results *results) OVERRIDE FINAL
     {
-        if (_count > 1) {
-            double sdev[nComponents];
-            for (int c = 0; c < nComponents; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt(std::max(0., _sum_p2[c]/(_count-1)));
+        const double count = _moments[0].n;
+        if (count > 0) {
+            double min[nComponentsStat], max[nComponentsStat], mean[nComponentsStat];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                min[c] = _moments[c].min;
+                max[c] = _moments[c].max;
+                mean[c] = _moments[c].mean;
+            }
+            toRGBA<double, nComponentsStat, 1>(min, &results->min);
+            toRGBA<double, nComponentsStat, 1>(max, &results->max);
+            toRGBA<double, nComponentsStat, 1>(mean, &results->mean);
+            double clippedLow[nComponentsStat], clippedHigh[nComponentsStat];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                clippedLow[c] = _clippedLow[c] * _countScale;
+                clippedHigh[c] = _clippedHigh[c] * _countScale;
+            }
+            toRGBA<double, nComponentsStat, 1>(clippedLow, &results->clippedLow);
+            toRGBA<double, nComponentsStat, 1>(clippedHigh, &results->clippedHigh);
+        }
+        if (count > 0 && _located) {
+            double percentile[kPercentilesCount][nComponentsStat];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                for (int i = 0; i < kPercentilesCount; ++i) {
+                    percentile[i][c] = _exactBins ? (double)_targetBin[c][i] : (double)keyFloat(_targetBin[c][i]);
+                }
             }
-            toRGBA<double, nComponents, 1>(sdev, &results->sdev);
+            toRGBA<double, nComponentsStat, 1>(percentile[0], &results->p1);
+            toRGBA<double, nComponentsStat, 1>(percentile[1], &results->p5);
+            toRGBA<double, nComponentsStat, 1>(percentile[2], &results->median);
+            toRGBA<double, nComponentsStat, 1>(percentile[3], &results->p95);
+            toRGBA<double, nComponentsStat, 1>(percentile[4], &results->p99);
         }
-    }
-
-private:
-
-    void addResults(double sum_p2[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p2[c] += sum_p2[c];
+        double sdev[nComponentsStat];
+        std::fill(sdev, sdev + nComponentsStat, 0.);
+        if (count > 1) {
+            for (int c = 0; c < nComponentsStat; ++c) {
+                // sdev^2 is an unbiased estimator for the population variance
+                sdev[c] = std::sqrt(std::max(0., _moments[c].m2/(count-1)));
+            }
+            toRGBA<double, nComponentsStat, 1>(sdev, &results->sdev);
+            if (_estimate) {
+                // 95% confidence interval of the mean, assuming the analyzed pixels are a random sample of the image
+                double meanError[nComponentsStat];
+                for (int c = 0; c < nComponentsStat; ++c) {
+                    meanError[c] = 1.96 * sdev[c] / std::sqrt(count);
+                }
+                toRGBA<double, nComponentsStat, 1>(meanError, &results->meanError);
+            }
         }
-        _count += count;
-        _mutex.unlock();
-    }
-
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
-    {
-        double sum_p2[nComponents];
-        std::fill(sum_p2, sum_p2 + nComponents, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
+        // sums of the standardized moments (v-mean)/sdev
+        double sum_p3[nComponentsStat], sum_p4[nComponentsStat];
+        for (int c = 0; c < nComponentsStat; ++c) {
+            if (count > 1 && sdev[c] > 0.) {
+                const double sdev2 = sdev[c] * sdev[c];
+                sum_p3[c] = _moments[c].m3 / (sdev2 * sdev[c]);
+                sum_p4[c] = _moments[c].m4 / (sdev2 * sdev2);
+            } else {
+                sum_p3[c] = sum_p4[c] = 0.;
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p2[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    double v = (*dstPix - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                    ++dstPix;
-                }
+        }
+        if (count > 2) {
+            double skewness[nComponentsStat];
+            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
+            double skewfac = (count*count) / ((count-1)*(count-2));
+            assert(!isnan(skewfac));
+            for (int c = 0; c < nComponentsStat; ++c) {
+                skewness[c] = skewfac * sum_p3[c] / count;
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p2[c] += sumLine_p2[c];
+            toRGBA<double, nComponentsStat, 1>(skewness, &results->skewness);
+            assert(!isnan(results->skewness.r) && !isnan(results->skewness.g) && !isnan(results->skewness.b) && !isnan(results->skewness.a));
+        }
+        if (count > 3) {
+            double kurtosis[nComponentsStat];
+            double kurtfac = ((count+1)*count) / ((count-1)*(count-2)*(count-3));
+            double kurtshift = -3 * ((count-1)*(count-1)) / ((count-2)*(count-3));
+            assert(!isnan(kurtfac) && !isnan(kurtshift));
+            for (int c = 0; c < nComponentsStat; ++c) {
+                kurtosis[c] = kurtfac * sum_p4[c] + kurtshift;
             }
-            count += procWindow.x2 - procWindow.x1;
+            toRGBA<double, nComponentsStat, 1>(kurtosis, &results->kurtosis);
+            assert(!isnan(results->kurtosis.r) && !isnan(results->kurtosis.g) && !isnan(results->kurtosis.b) && !isnan(results->kurtosis.a));
         }
-
-        addResults(sum_p2, count);
     }
-};
-
 
+protected:
 
+    // fill a line of width interleaved values to analyze, taking one pixel out of step from (x1,y)
+    virtual void fillLine(int x1, int y, int width, int step, double *line) = 0;
 
-template <class PIX, int nComponents, int maxValue>
-class ImageSkewnessKurtosisProcessor : public ImageStatisticsProcessorBase
-{
 private:
-    double _mean[nComponents];
-    double _sdev[nComponents];
-    double _sum_p3[nComponents];
-    double _sum_p4[nComponents];
-public:
-    ImageSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponents, 0.);
-        std::fill(_sdev, _sdev+nComponents, 0.);
-        std::fill(_sum_p3, _sum_p3+nComponents, 0.);
-        std::fill(_sum_p4, _sum_p4+nComponents, 0.);
-    }
 
-    ~ImageSkewnessKurtosisProcessor()
+    // map a float to an unsigned int with the same ordering
+    static unsigned int floatKey(float f)
     {
+        unsigned int u;
+        std::memcpy(&u, &f, sizeof(u));
+        return (u & 0x80000000U) ? ~u : (u | 0x80000000U);
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
+    // the float of a key given by floatKey()
+    static float keyFloat(unsigned int u)
     {
-        toComponents<double, nComponents, 1>(results.mean, _mean);
-        toComponents<double, nComponents, 1>(results.sdev, _sdev);
+        u = (u & 0x80000000U) ? (u & 0x7FFFFFFFU) : ~u;
+        float f;
+        std::memcpy(&f, &u, sizeof(f));
+        return f;
     }
 
-    void getResults(Results *results) OVERRIDE FINAL
+    // percentiles in the same bin share the sub-histogram of the first one
+    int firstTarget(int c, int i) const
     {
-        if (_count > 2) {
-            double skewness[nComponents];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ((double)_count*_count) / ((double)(_count-1)*(_count-2));
-            assert(!isnan(skewfac));
-            for (int c = 0; c < nComponents; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
-            }
-            toRGBA<double, nComponents, 1>(skewness, &results->skewness);
-            assert(!isnan(results->skewness.r) && !isnan(results->skewness.g) && !isnan(results->skewness.b) && !isnan(results->skewness.a));
-        }
-        if (_count > 3) {
-            double kurtosis[nComponents];
-            double kurtfac = ((double)(_count+1)*_count) / ((double)(_count-1)*(_count-2)*(_count-3));
-            double kurtshift = -3 * ((double)(_count-1)*(_count-1)) / ((double)(_count-2)*(_count-3));
-            assert(!isnan(kurtfac) && !isnan(kurtshift));
-            for (int c = 0; c < nComponents; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
-            }
-            toRGBA<double, nComponents, 1>(kurtosis, &results->kurtosis);
-            assert(!isnan(results->kurtosis.r) && !isnan(results->kurtosis.g) && !isnan(results->kurtosis.b) && !isnan(results->kurtosis.a));
+        while (i > 0 && _targetBin[c][i-1] == _targetBin[c][i]) {
+            --i;
         }
+        return i;
     }
 
-private:
-
-    void addResults(double sum_p3[nComponents], double sum_p4[nComponents], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponents; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
+    unsigned int binIndex(double v) const
+    {
+        if (_exactBins) {
+            return (unsigned int)std::max(0, std::min((int)v, _nBins - 1));
         }
-        _count += count;
-        _mutex.unlock();
+        return floatKey((float)v) >> 16;
     }
 
-
     void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
     {
-        double sum_p3[nComponents];
-        double sum_p4[nComponents];
-        std::fill(sum_p3, sum_p3 + nComponents, 0.);
-        std::fill(sum_p4, sum_p4 + nComponents, 0.);
-        unsigned long count = 0;
+        const int width = (procWindow.x2 - procWindow.x1 + _samplingStep - 1) / _samplingStep;
+        std::vector<double> line(width * nComponentsStat);
         assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
                _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
+        if (_unknownBits > 0 && _unknownBits < 32) {
+            // refinement pass: bin the values of the bins containing the percentiles by their next bits
+            std::vector<unsigned int> subHistogram(_subHistogram.size(), 0);
+            unsigned int keyRange[nComponentsStat][kPercentilesCount][2];
+            for (int c = 0; c < nComponentsStat; ++c) {
+                for (int i = 0; i < kPercentilesCount; ++i) {
+                    keyRange[c][i][0] = 0xFFFFFFFFU;
+                    keyRange[c][i][1] = 0U;
+                }
+            }
+            const int shift = _unknownBits - kRefineBits;
+            for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+                if (_effect.abort()) {
+                    break;
+                }
+                if ((y - _renderWindow.y1) % _samplingStep != 0) {
+                    continue;
+                }
+                fillLine(procWindow.x1, y, width, _samplingStep, &line[0]);
+                for (int x = 0; x < width; ++x) {
+                    for (int c = 0; c < nComponentsStat; ++c) {
+                        const unsigned int key = floatKey((float)line[x * nComponentsStat + c]);
+                        const unsigned int bin = key >> _unknownBits;
+                        for (int i = 0; i < kPercentilesCount; ++i) {
+                            if (!_targetDone[c][i] && _targetBin[c][i] == bin) {
+                                ++subHistogram[(c * kPercentilesCount + i) * kRefineBins + ((key >> shift) & (kRefineBins - 1))];
+                                keyRange[c][i][0] = std::min(keyRange[c][i][0], key);
+                                keyRange[c][i][1] = std::max(keyRange[c][i][1], key);
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+            addSubHistogram(subHistogram, keyRange);
+
+            return;
+        }
+
+        Moments moments[nComponentsStat];
+        std::vector<unsigned int> histogram(nComponentsStat * _nBins, 0);
+        double clippedLow[nComponentsStat], clippedHigh[nComponentsStat];
+        std::fill(clippedLow, clippedLow + nComponentsStat, 0.);
+        std::fill(clippedHigh, clippedHigh + nComponentsStat, 0.);
         for (int y = procWindow.y1; y < procWindow.y2; ++y) {
             if (_effect.abort()) {
                 break;
             }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine_p3[nComponents]; // partial sum to avoid underflows
-            double sumLine_p4[nComponents]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponents, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponents, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                for (int c = 0; c < nComponents; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (*dstPix - _mean[c])/_sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
+            if ((y - _renderWindow.y1) % _samplingStep != 0) {
+                continue;
+            }
+            fillLine(procWindow.x1, y, width, _samplingStep, &line[0]);
+            addLine(line, width, moments);
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < nComponentsStat; ++c) {
+                    const double v = line[x * nComponentsStat + c];
+                    ++histogram[c * _nBins + binIndex(v)];
+                    if (c < _clipFirst) {
+                        continue;
+                    }
+                    if (v <= 0.) {
+                        ++clippedLow[c];
+                    } else if (v >= _clipHigh) {
+                        ++clippedHigh[c];
                     }
-                    ++dstPix;
                 }
             }
-            for (int c = 0; c < nComponents; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
         }
-        
-        addResults(sum_p3, sum_p4, count);
-    }
-};
 
-#define nComponentsHSVL 4
-
-template <class PIX, int nComponents, int maxValue>
-class ImageHSVLMinMaxMeanProcessor : public ImageStatisticsProcessorBase
-{
-private:
-    double _min[nComponentsHSVL];
-    double _max[nComponentsHSVL];
-    double _sum[nComponentsHSVL];
-public:
-    ImageHSVLMinMaxMeanProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_min, _min+nComponentsHSVL, +std::numeric_limits<double>::infinity());
-        std::fill(_max, _max+nComponentsHSVL, -std::numeric_limits<double>::infinity());
-        std::fill(_sum, _sum+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLMinMaxMeanProcessor()
-    {
+        addResults(moments, histogram, clippedLow, clippedHigh);
     }
 
-    void setPrevResults(const Results &/*results*/) OVERRIDE FINAL {}
-
-    void getResults(Results *results) OVERRIDE FINAL
+    // merge the results computed by one thread: called once per thread
+    void addResults(const Moments moments[nComponentsStat],
+                    std::vector<unsigned int>& histogram,
+                    const double clippedLow[nComponentsStat],
+                    const double clippedHigh[nComponentsStat])
     {
-        if (_count > 0) {
-            toRGBA<double, nComponentsHSVL, 1>(_min, &results->min);
-            toRGBA<double, nComponentsHSVL, 1>(_max, &results->max);
-            double mean[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                mean[c] = _sum[c]/_count;
+        _mutex.lock();
+        for (int c = 0; c < nComponentsStat; ++c) {
+            _moments[c].add(moments[c]);
+            _clippedLow[c] += clippedLow[c];
+            _clippedHigh[c] += clippedHigh[c];
+        }
+        if (_histogram.empty()) {
+            _histogram.swap(histogram);
+        } else {
+            for (size_t i = 0; i < _histogram.size(); ++i) {
+                _histogram[i] += histogram[i];
             }
-            toRGBA<double, nComponentsHSVL, 1>(mean, &results->mean);
         }
+        _mutex.unlock();
     }
 
-private:
-
-    void addResults(double min[nComponentsHSVL], double max[nComponentsHSVL], double sum[nComponentsHSVL], unsigned long count) {
+    // merge the sub-histograms of the target bins computed by one thread: called once per thread
+    void addSubHistogram(const std::vector<unsigned int>& subHistogram,
+                         const unsigned int keyRange[nComponentsStat][kPercentilesCount][2])
+    {
         _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _min[c] = std::min(_min[c], min[c]);
-            _max[c] = std::max(_max[c], max[c]);
-            _sum[c] += sum[c];
+        for (size_t i = 0; i < _subHistogram.size(); ++i) {
+            _subHistogram[i] += subHistogram[i];
+        }
+        for (int c = 0; c < nComponentsStat; ++c) {
+            for (int i = 0; i < kPercentilesCount; ++i) {
+                _keyRange[c][i][0] = std::min(_keyRange[c][i][0], keyRange[c][i][0]);
+                _keyRange[c][i][1] = std::max(_keyRange[c][i][1], keyRange[c][i][1]);
+            }
         }
-        _count += count;
         _mutex.unlock();
     }
 
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    // accumulate the moments of a line of interleaved values
+    static void addLine(const std::vector<double>& line, int width, Moments moments[nComponentsStat])
     {
-        double min[nComponentsHSVL], max[nComponentsHSVL], sum[nComponentsHSVL];
-        std::fill(min, min+nComponentsHSVL, +std::numeric_limits<double>::infinity());
-        std::fill(max, max+nComponentsHSVL, -std::numeric_limits<double>::infinity());
-        std::fill(sum, sum + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
-
-            double sumLine[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine, sumLine + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = hsvl[c];
-                    min[c] = std::min(min[c], v);
-                    max[c] = std::max(max[c], v);
-                    sumLine[c] += v;
-                }
-                dstPix += nComponents;
-            }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum[c] += sumLine[c];
-            }
-            count += procWindow.x2 - procWindow.x1;
+        for (int c = 0; c < nComponentsStat; ++c) {
+            Moments lineMoments;
+            lineMoments.set(&line[c], width, nComponentsStat);
+            moments[c].add(lineMoments);
         }
-
-        addResults(min, max, sum, count);
     }
 };
 
 
-
-
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSDevProcessor : public ImageStatisticsProcessorBase
+class ImageStatisticsProcessor : public ImageMomentsProcessorBase<nComponents>
 {
-private:
-    double _mean[nComponentsHSVL];
-    double _sum_p2[nComponentsHSVL];
 public:
-    ImageHSVLSDevProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponentsHSVL, 0.);
-        std::fill(_sum_p2, _sum_p2+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLSDevProcessor()
-    {
-    }
-
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
+    ImageStatisticsProcessor(OFX::ImageEffect &instance)
+    : ImageMomentsProcessorBase<nComponents>(instance, maxValue, maxValue != 1, 0)
     {
-        if (_count > 1) {
-            double sdev[nComponentsHSVL];
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                // sdev^2 is an unbiased estimator for the population variance
-                sdev[c] = std::sqrt(std::max(0., _sum_p2[c]/(_count-1)));
-            }
-            toRGBA<double, nComponentsHSVL, 1>(sdev, &results->sdev);
-        }
     }
 
 private:
 
-    void addResults(double sum_p2[nComponentsHSVL], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p2[c] += sum_p2[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    void fillLine(int x1, int y, int width, int step, double *line) OVERRIDE FINAL
     {
-        double sum_p2[nComponentsHSVL];
-        std::fill(sum_p2, sum_p2 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+        const PIX *dstPix = (const PIX *) this->_dstImg->getPixelAddress(x1, y);
 
-            double sumLine_p2[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p2, sumLine_p2 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    double v = (hsvl[c] - _mean[c]);
-                    sumLine_p2[c] += v * v;
-                }
-                dstPix += nComponents;
+        if (step == 1) {
+            for (int i = 0; i < width * nComponents; ++i) {
+                line[i] = dstPix[i];
             }
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p2[c] += sumLine_p2[c];
+        } else {
+            for (int x = 0; x < width; ++x) {
+                for (int c = 0; c < nComponents; ++c) {
+                    line[x * nComponents + c] = dstPix[c];
+                }
+                dstPix += step * nComponents;
             }
-            count += procWindow.x2 - procWindow.x1;
         }
-
-        addResults(sum_p2, count);
     }
 };
 
-
-
+#define nComponentsHSVL 4
 
 template <class PIX, int nComponents, int maxValue>
-class ImageHSVLSkewnessKurtosisProcessor : public ImageStatisticsProcessorBase
+class ImageHSVLStatisticsProcessor : public ImageMomentsProcessorBase<nComponentsHSVL>
 {
-private:
-    double _mean[nComponentsHSVL];
-    double _sdev[nComponentsHSVL];
-    double _sum_p3[nComponentsHSVL];
-    double _sum_p4[nComponentsHSVL];
 public:
-    ImageHSVLSkewnessKurtosisProcessor(OFX::ImageEffect &instance)
-    : ImageStatisticsProcessorBase(instance)
-    {
-        std::fill(_mean, _mean+nComponentsHSVL, 0.);
-        std::fill(_sdev, _sdev+nComponentsHSVL, 0.);
-        std::fill(_sum_p3, _sum_p3+nComponentsHSVL, 0.);
-        std::fill(_sum_p4, _sum_p4+nComponentsHSVL, 0.);
-    }
-
-    ~ImageHSVLSkewnessKurtosisProcessor()
+    ImageHSVLStatisticsProcessor(OFX::ImageEffect &instance)
+    : ImageMomentsProcessorBase<nComponentsHSVL>(instance, 1, false, 1) // the hue (0-360) is never clipped
     {
     }
 
-    void setPrevResults(const Results &results) OVERRIDE FINAL
-    {
-        toComponents<double, nComponentsHSVL, 1>(results.mean, _mean);
-        toComponents<double, nComponentsHSVL, 1>(results.sdev, _sdev);
-    }
-
-    void getResults(Results *results) OVERRIDE FINAL
-    {
-        if (_count > 2) {
-            double skewness[nComponentsHSVL];
-            // factor for the adjusted Fisher-Pearson standardized moment coefficient G_1
-            double skewfac = ((double)_count*_count) / ((double)(_count-1)*(_count-2));
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                skewness[c] = skewfac * _sum_p3[c] / _count;
-            }
-            toRGBA<double, nComponentsHSVL, 1>(skewness, &results->skewness);
-        }
-        if (_count > 3) {
-            double kurtosis[nComponentsHSVL];
-            double kurtfac = ((double)(_count+1)*_count) / ((double)(_count-1)*(_count-2)*(_count-3));
-            double kurtshift = -3 * ((double)(_count-1)*(_count-1)) / ((double)(_count-2)*(_count-3));
-            for (int c = 0; c < nComponentsHSVL; ++c) {
-                kurtosis[c] = kurtfac * _sum_p4[c] + kurtshift;
-            }
-            toRGBA<double, nComponentsHSVL, 1>(kurtosis, &results->kurtosis);
-        }
-    }
-
 private:
 
-    void addResults(double sum_p3[nComponentsHSVL], double sum_p4[nComponentsHSVL], unsigned long count) {
-        _mutex.lock();
-        for (int c = 0; c < nComponentsHSVL; ++c) {
-            _sum_p3[c] += sum_p3[c];
-            _sum_p4[c] += sum_p4[c];
-        }
-        _count += count;
-        _mutex.unlock();
-    }
-
-
-    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    void fillLine(int x1, int y, int width, int step, double *line) OVERRIDE FINAL
     {
-        double sum_p3[nComponentsHSVL];
-        double sum_p4[nComponentsHSVL];
-        std::fill(sum_p3, sum_p3 + nComponentsHSVL, 0.);
-        std::fill(sum_p4, sum_p4 + nComponentsHSVL, 0.);
-        unsigned long count = 0;
-        assert(_dstImg->getBounds().x1 <= procWindow.x1 && procWindow.y2 <= _dstImg->getBounds().y2 &&
-               _dstImg->getBounds().y1 <= procWindow.y1 && procWindow.y2 <= _dstImg->getBounds().y2);
-        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
-            if (_effect.abort()) {
-                break;
-            }
-
-            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+        const PIX *dstPix = (const PIX *) _dstImg->getPixelAddress(x1, y);
 
-            double sumLine_p3[nComponentsHSVL]; // partial sum to avoid underflows
-            double sumLine_p4[nComponentsHSVL]; // partial sum to avoid underflows
-            std::fill(sumLine_p3, sumLine_p3 + nComponentsHSVL, 0.);
-            std::fill(sumLine_p4, sumLine_p4 + nComponentsHSVL, 0.);
-
-            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
-                float hsvl[nComponentsHSVL];
-                pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
-                for (int c = 0; c < nComponentsHSVL; ++c) {
-                    if (_sdev[c] > 0.) {
-                        double v = (hsvl[c] - _mean[c])/_sdev[c];
-                        double v2 = v * v;
-                        sumLine_p3[c] += v2 * v;
-                        sumLine_p4[c] += v2 * v2;
-                    }
-                }
-                dstPix += nComponents;
-            }
+        for (int x = 0; x < width; ++x) {
+            float hsvl[nComponentsHSVL];
+            pixToHSVL<PIX, nComponents, maxValue>(dstPix, hsvl);
             for (int c = 0; c < nComponentsHSVL; ++c) {
-                sum_p3[c] += sumLine_p3[c];
-                sum_p4[c] += sumLine_p4[c];
+                line[x * nComponentsHSVL + c] = hsvl[c];
             }
-            count += procWindow.x2 - procWindow.x1;
+            dstPix += step * nComponents;
         }
-        
-        addResults(sum_p3, sum_p4, count);
     }
 };
 
@@ -906,23 +965,48 @@ public:
         _statMin = fetchRGBAParam(kParamStatMin);
         _statMax = fetchRGBAParam(kParamStatMax);
         _statMean = fetchRGBAParam(kParamStatMean);
+        _statMeanError = fetchRGBAParam(kParamStatMeanError);
         _statSDev = fetchRGBAParam(kParamStatSDev);
         _statSkewness = fetchRGBAParam(kParamStatSkewness);
         _statKurtosis = fetchRGBAParam(kParamStatKurtosis);
-        assert(_statMin && _statMax && _statMean && _statSDev && _statSkewness);
+        _statMedian = fetchRGBAParam(kParamStatMedian);
+        _statP1 = fetchRGBAParam(kParamStatP1);
+        _statP5 = fetchRGBAParam(kParamStatP5);
+        _statP95 = fetchRGBAParam(kParamStatP95);
+        _statP99 = fetchRGBAParam(kParamStatP99);
+        _statClippedLow = fetchRGBAParam(kParamStatClippedLow);
+        _statClippedHigh = fetchRGBAParam(kParamStatClippedHigh);
+        assert(_statMedian && _statP1 && _statP5 && _statP95 && _statP99 && _statClippedLow && _statClippedHigh);
+        assert(_statMin && _statMax && _statMean && _statMeanError && _statSDev && _statSkewness);
         _analyzeFrame = fetchPushButtonParam(kParamAnalyzeFrame);
         _analyzeSequence = fetchPushButtonParam(kParamAnalyzeSequence);
         assert(_analyzeFrame && _analyzeSequence);
         _statHSVLMin = fetchRGBAParam(kParamStatHSVLMin);
         _statHSVLMax = fetchRGBAParam(kParamStatHSVLMax);
         _statHSVLMean = fetchRGBAParam(kParamStatHSVLMean);
+        _statHSVLMeanError = fetchRGBAParam(kParamStatHSVLMeanError);
         _statHSVLSDev = fetchRGBAParam(kParamStatHSVLSDev);
         _statHSVLSkewness = fetchRGBAParam(kParamStatHSVLSkewness);
         _statHSVLKurtosis = fetchRGBAParam(kParamStatHSVLKurtosis);
-        assert(_statHSVLMin && _statHSVLMax && _statHSVLMean && _statHSVLSDev && _statHSVLSkewness);
+        _statHSVLMedian = fetchRGBAParam(kParamStatHSVLMedian);
+        _statHSVLP1 = fetchRGBAParam(kParamStatHSVLP1);
+        _statHSVLP5 = fetchRGBAParam(kParamStatHSVLP5);
+        _statHSVLP95 = fetchRGBAParam(kParamStatHSVLP95);
+        _statHSVLP99 = fetchRGBAParam(kParamStatHSVLP99);
+        _statHSVLClippedLow = fetchRGBAParam(kParamStatHSVLClippedLow);
+        _statHSVLClippedHigh = fetchRGBAParam(kParamStatHSVLClippedHigh);
+        assert(_statHSVLMedian && _statHSVLP1 && _statHSVLP5 && _statHSVLP95 && _statHSVLP99 && _statHSVLClippedLow && _statHSVLClippedHigh);
+        assert(_statHSVLMin && _statHSVLMax && _statHSVLMean && _statHSVLMeanError && _statHSVLSDev && _statHSVLSkewness);
         _analyzeFrameHSVL = fetchPushButtonParam(kParamAnalyzeFrameHSVL);
         _analyzeSequenceHSVL = fetchPushButtonParam(kParamAnalyzeSequenceHSVL);
         assert(_analyzeFrameHSVL && _analyzeSequenceHSVL);
+        _analyzeSkipExisting = fetchBooleanParam(kParamAnalyzeSkipExisting);
+        _analyzeParallelFrames = fetchIntParam(kParamAnalyzeParallelFrames);
+        _analysisStatus = fetchStringParam(kParamAnalysisStatus);
+        assert(_analyzeSkipExisting && _analyzeParallelFrames && _analysisStatus);
+        _proxyStatistics = fetchBooleanParam(kParamProxyStatistics);
+        _proxySamplingStep = fetchIntParam(kParamProxySamplingStep);
+        assert(_proxyStatistics && _proxySamplingStep);
 
         // update visibility
         bool restrictToRectangle = _restrictToRectangle->getValue();
@@ -933,6 +1017,7 @@ public:
         bool doUpdate = _autoUpdate->getValue();
         _interactive->setEnabled(restrictToRectangle && doUpdate);
         _interactive->setIsSecret(!restrictToRectangle || !doUpdate);
+        _proxySamplingStep->setEnabled(_proxyStatistics->getValue());
     }
 
 private:
@@ -950,37 +1035,48 @@ private:
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
     /* set up and run a processor */
-    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results &prevResults, Results *results);
+    void setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep, bool singleThreaded, Results *results);
+
+    // get the sampling step used by Auto Update at the given render scale.
+    // Returns false if the statistics should not be updated.
+    bool getAutoUpdateSampling(double time, const OfxPointD& renderScale, int *samplingStep);
 
     // compute computation window in srcImg
     bool computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow);
 
     // update image statistics
-    void update(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
-    void updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow);
+    void update(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, int samplingStep);
+    void updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI& analysisWindow, int samplingStep);
+
+    // set the statistics parameters at a given time
+    void setResults(double time, const Results& results);
+    void setResultsHSVL(double time, const Results& results);
+
+    // analyze a range of frames
+    void analyzeSequence(bool doRGBA, bool doHSVL, const OfxPointD& renderScale);
 
     template <template<class PIX, int nComponents, int maxValue> class Processor, class PIX, int nComponents, int maxValue>
-    void updateSubComponentsDepth(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    void updateSubComponentsDepth(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep, bool singleThreaded, Results* results)
     {
         Processor<PIX, nComponents, maxValue> fred(*this);
-        setupAndProcess(fred, srcImg, time, analysisWindow, prevResults, results);
+        setupAndProcess(fred, srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
     }
 
     template <template<class PIX, int nComponents, int maxValue> class Processor, int nComponents>
-    void updateSubComponents(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    void updateSubComponents(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep, bool singleThreaded, Results* results)
     {
         OFX::BitDepthEnum srcBitDepth = srcImg->getPixelDepth();
         switch (srcBitDepth) {
             case OFX::eBitDepthUByte: {
-                updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<Processor, unsigned char, nComponents, 255>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
                 break;
             }
             case OFX::eBitDepthUShort: {
-                updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<Processor, unsigned short, nComponents, 65535>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
                 break;
             }
             case OFX::eBitDepthFloat: {
-                updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, prevResults, results);
+                updateSubComponentsDepth<Processor, float, nComponents, 1>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
                 break;
             }
             default:
@@ -989,16 +1085,16 @@ private:
     }
 
     template <template<class PIX, int nComponents, int maxValue> class Processor>
-    void updateSub(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, const Results& prevResults, Results* results)
+    void updateSub(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep, bool singleThreaded, Results* results)
     {
         OFX::PixelComponentEnum srcComponents  = srcImg->getPixelComponents();
         assert(srcComponents == OFX::ePixelComponentAlpha ||srcComponents == OFX::ePixelComponentRGB || srcComponents == OFX::ePixelComponentRGBA);
         if (srcComponents == OFX::ePixelComponentAlpha) {
-            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 1>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
         } else if (srcComponents == OFX::ePixelComponentRGBA) {
-            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 4>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
         } else if (srcComponents == OFX::ePixelComponentRGB) {
-            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, prevResults, results);
+            updateSubComponents<Processor, 3>(srcImg, time, analysisWindow, samplingStep, singleThreaded, results);
         } else {
             // coverity[dead_error_line]
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
@@ -1019,19 +1115,100 @@ private:
     RGBAParam* _statMin;
     RGBAParam* _statMax;
     RGBAParam* _statMean;
+    RGBAParam* _statMeanError;
     RGBAParam* _statSDev;
     RGBAParam* _statSkewness;
     RGBAParam* _statKurtosis;
+    RGBAParam* _statMedian;
+    RGBAParam* _statP1;
+    RGBAParam* _statP5;
+    RGBAParam* _statP95;
+    RGBAParam* _statP99;
+    RGBAParam* _statClippedLow;
+    RGBAParam* _statClippedHigh;
     PushButtonParam* _analyzeFrame;
     PushButtonParam* _analyzeSequence;
     RGBAParam* _statHSVLMin;
     RGBAParam* _statHSVLMax;
     RGBAParam* _statHSVLMean;
+    RGBAParam* _statHSVLMeanError;
     RGBAParam* _statHSVLSDev;
     RGBAParam* _statHSVLSkewness;
     RGBAParam* _statHSVLKurtosis;
+    RGBAParam* _statHSVLMedian;
+    RGBAParam* _statHSVLP1;
+    RGBAParam* _statHSVLP5;
+    RGBAParam* _statHSVLP95;
+    RGBAParam* _statHSVLP99;
+    RGBAParam* _statHSVLClippedLow;
+    RGBAParam* _statHSVLClippedHigh;
     PushButtonParam* _analyzeFrameHSVL;
     PushButtonParam* _analyzeSequenceHSVL;
+    BooleanParam* _analyzeSkipExisting;
+    IntParam* _analyzeParallelFrames;
+    StringParam* _analysisStatus;
+    BooleanParam* _proxyStatistics;
+    IntParam* _proxySamplingStep;
+
+    // analyzes a set of frames concurrently, each frame being analyzed by a single thread.
+    // Results are stored, and the parameters are set by the main thread.
+    class SequenceAnalyzer : public OFX::MultiThread::Processor
+    {
+    public:
+        SequenceAnalyzer(ImageStatisticsPlugin &plugin, const std::vector<int>& frames, bool doRGBA, bool doHSVL, const OfxPointD& renderScale)
+        : _plugin(plugin)
+        , _frames(frames)
+        , _doRGBA(doRGBA)
+        , _doHSVL(doHSVL)
+        , _renderScale(renderScale)
+        , _results(frames.size())
+        , _resultsHSVL(frames.size())
+        , _valid(frames.size(), 0)
+        {
+        }
+
+        bool isValid(size_t i) const { return _valid[i] != 0; }
+        const Results& getResults(size_t i) const { return _results[i]; }
+        const Results& getResultsHSVL(size_t i) const { return _resultsHSVL[i]; }
+
+    private:
+        virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+        {
+            for (size_t i = threadId; i < _frames.size(); i += nThreads) {
+                if (_plugin.abort()) {
+                    return;
+                }
+                const int t = _frames[i];
+                std::auto_ptr<const OFX::Image> src(_plugin._srcClip->fetchImage(t));
+                if (!src.get() ||
+                    src->getRenderScale().x != _renderScale.x ||
+                    src->getRenderScale().y != _renderScale.y) {
+                    // exceptions cannot be thrown from a spawned thread: the frame is skipped
+                    continue;
+                }
+                OfxRectI analysisWindow;
+                if (!_plugin.computeWindow(src.get(), t, &analysisWindow)) {
+                    continue;
+                }
+                if (_doRGBA) {
+                    _plugin.updateSub<ImageStatisticsProcessor>(src.get(), t, analysisWindow, 1, true, &_results[i]);
+                }
+                if (_doHSVL) {
+                    _plugin.updateSub<ImageHSVLStatisticsProcessor>(src.get(), t, analysisWindow, 1, true, &_resultsHSVL[i]);
+                }
+                _valid[i] = 1;
+            }
+        }
+
+        ImageStatisticsPlugin &_plugin;
+        const std::vector<int>& _frames;
+        bool _doRGBA;
+        bool _doHSVL;
+        OfxPointD _renderScale;
+        std::vector<Results> _results;
+        std::vector<Results> _resultsHSVL;
+        std::vector<char> _valid; // not std::vector<bool>, which is not thread-safe
+    };
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1087,13 +1264,14 @@ ImageStatisticsPlugin::render(const OFX::RenderArguments &args)
             int k = _statMean->getKeyIndex(args.time, eKeySearchNear);
             OfxRectI analysisWindow;
             bool intersect = computeWindow(src.get(), args.time, &analysisWindow);
-            if (intersect) {
+            int samplingStep;
+            if (intersect && getAutoUpdateSampling(args.time, args.renderScale, &samplingStep)) {
                 if (k != -1) {
-                    update(src.get(), args.time, analysisWindow);
+                    update(src.get(), args.time, analysisWindow, samplingStep);
                 }
                 k = _statHSVLMean->getKeyIndex(args.time, eKeySearchNear);
                 if (k != -1) {
-                    updateHSVL(src.get(), args.time, analysisWindow);
+                    updateHSVL(src.get(), args.time, analysisWindow, samplingStep);
                 }
             }
         }
@@ -1178,6 +1356,9 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _interactive->setIsSecret(!restrictToRectangle);
         doUpdate = true;
     }
+    if (paramName == kParamProxyStatistics) {
+        _proxySamplingStep->setEnabled(_proxyStatistics->getValueAtTime(time));
+    }
     if (paramName == kParamAutoUpdate) {
         bool restrictToRectangle = _restrictToRectangle->getValueAtTime(time);
         doUpdate = _autoUpdate->getValueAtTime(time);
@@ -1205,35 +1386,68 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         _statMin->deleteKeyAtTime(args.time);
         _statMax->deleteKeyAtTime(args.time);
         _statMean->deleteKeyAtTime(args.time);
+        _statMeanError->deleteKeyAtTime(args.time);
         _statSDev->deleteKeyAtTime(args.time);
         _statSkewness->deleteKeyAtTime(args.time);
         _statKurtosis->deleteKeyAtTime(args.time);
+        _statMedian->deleteKeyAtTime(args.time);
+        _statP1->deleteKeyAtTime(args.time);
+        _statP5->deleteKeyAtTime(args.time);
+        _statP95->deleteKeyAtTime(args.time);
+        _statP99->deleteKeyAtTime(args.time);
+        _statClippedLow->deleteKeyAtTime(args.time);
+        _statClippedHigh->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequence) {
         _statMin->deleteAllKeys();
         _statMax->deleteAllKeys();
         _statMean->deleteAllKeys();
+        _statMeanError->deleteAllKeys();
         _statSDev->deleteAllKeys();
         _statSkewness->deleteAllKeys();
         _statKurtosis->deleteAllKeys();
+        _statMedian->deleteAllKeys();
+        _statP1->deleteAllKeys();
+        _statP5->deleteAllKeys();
+        _statP95->deleteAllKeys();
+        _statP99->deleteAllKeys();
+        _statClippedLow->deleteAllKeys();
+        _statClippedHigh->deleteAllKeys();
     }
     if (paramName == kParamClearFrameHSVL) {
         _statHSVLMin->deleteKeyAtTime(args.time);
         _statHSVLMax->deleteKeyAtTime(args.time);
         _statHSVLMean->deleteKeyAtTime(args.time);
+        _statHSVLMeanError->deleteKeyAtTime(args.time);
         _statHSVLSDev->deleteKeyAtTime(args.time);
         _statHSVLSkewness->deleteKeyAtTime(args.time);
         _statHSVLKurtosis->deleteKeyAtTime(args.time);
+        _statHSVLMedian->deleteKeyAtTime(args.time);
+        _statHSVLP1->deleteKeyAtTime(args.time);
+        _statHSVLP5->deleteKeyAtTime(args.time);
+        _statHSVLP95->deleteKeyAtTime(args.time);
+        _statHSVLP99->deleteKeyAtTime(args.time);
+        _statHSVLClippedLow->deleteKeyAtTime(args.time);
+        _statHSVLClippedHigh->deleteKeyAtTime(args.time);
     }
     if (paramName == kParamClearSequenceHSVL) {
         _statHSVLMin->deleteAllKeys();
         _statHSVLMax->deleteAllKeys();
         _statHSVLMean->deleteAllKeys();
+        _statHSVLMeanError->deleteAllKeys();
         _statHSVLSDev->deleteAllKeys();
         _statHSVLSkewness->deleteAllKeys();
         _statHSVLKurtosis->deleteAllKeys();
-    }
-    if (doUpdate) {
+        _statHSVLMedian->deleteAllKeys();
+        _statHSVLP1->deleteAllKeys();
+        _statHSVLP5->deleteAllKeys();
+        _statHSVLP95->deleteAllKeys();
+        _statHSVLP99->deleteAllKeys();
+        _statHSVLClippedLow->deleteAllKeys();
+        _statHSVLClippedHigh->deleteAllKeys();
+    }
+    int samplingStep = 1;
+    if (doUpdate && getAutoUpdateSampling(time, args.renderScale, &samplingStep)) {
         // check if there is already a Keyframe, if yes update it
         int k = _statMean->getKeyIndex(args.time, eKeySearchNear);
         doAnalyzeRGBA = (k != -1);
@@ -1256,10 +1470,10 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
                 getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
 #             endif
                 if (doAnalyzeRGBA) {
-                    update(src.get(), args.time, analysisWindow);
+                    update(src.get(), args.time, analysisWindow, samplingStep);
                 }
                 if (doAnalyzeHSVL) {
-                    updateHSVL(src.get(), args.time, analysisWindow);
+                    updateHSVL(src.get(), args.time, analysisWindow, samplingStep);
                 }
 #             ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
                 getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
@@ -1268,49 +1482,108 @@ ImageStatisticsPlugin::changedParam(const OFX::InstanceChangedArgs &args,
         }
     }
     if ((doAnalyzeSequenceRGBA || doAnalyzeSequenceHSVL) && _srcClip && _srcClip->isConnected()) {
-#     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
-        getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
-#     endif
-        progressStart("Analyzing sequence...");
-        OfxRangeD range = _srcClip->getFrameRange();
-        //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
-        int tmin = (int)std::ceil(range.min);
-        int tmax = (int)std::floor(range.max);
-        for (int t = tmin; t <= tmax; ++t) {
-            std::auto_ptr<OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
-                                          _srcClip->fetchImage(t) : 0);
+        analyzeSequence(doAnalyzeSequenceRGBA, doAnalyzeSequenceHSVL, args.renderScale);
+    }
+}
+
+void
+ImageStatisticsPlugin::analyzeSequence(bool doRGBA, bool doHSVL, const OfxPointD& renderScale)
+{
+    OfxRangeD range = _srcClip->getFrameRange();
+    //timeLineGetBounds(range.min, range.max); // wrong: we want the input frame range only
+    int tmin = (int)std::ceil(range.min);
+    int tmax = (int)std::floor(range.max);
+    const bool skipExisting = _analyzeSkipExisting->getValue();
+    const int parallelFrames = std::max(1, _analyzeParallelFrames->getValue());
+
+    // list the frames to analyze
+    std::vector<int> frames;
+    for (int t = tmin; t <= tmax; ++t) {
+        if (skipExisting &&
+            (!doRGBA || _statMean->getKeyIndex(t, eKeySearchNear) != -1) &&
+            (!doHSVL || _statHSVLMean->getKeyIndex(t, eKeySearchNear) != -1)) {
+            continue;
+        }
+        frames.push_back(t);
+    }
+    const int nSkipped = (tmax - tmin + 1) - (int)frames.size();
+    if (frames.empty()) {
+        char status[256];
+        snprintf(status, sizeof(status), "%d frames, all analyzed", nSkipped);
+        _analysisStatus->setValue(status);
+        return;
+    }
+
+#   ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 1, false);
+#   endif
+    progressStart("Analyzing sequence...");
+    const std::time_t startTime = std::time(NULL);
+    size_t done = 0;
+    while (done < frames.size()) {
+        const size_t batchSize = std::min((size_t)parallelFrames, frames.size() - done);
+        std::vector<int> batch(frames.begin() + done, frames.begin() + done + batchSize);
+        if (parallelFrames == 1) {
+            // analyze one frame, using all threads
+            const int t = batch[0];
+            std::auto_ptr<OFX::Image> src(_srcClip->fetchImage(t));
             if (src.get()) {
-                if (src->getRenderScale().x != args.renderScale.x ||
-                    src->getRenderScale().y != args.renderScale.y) {
+                if (src->getRenderScale().x != renderScale.x ||
+                    src->getRenderScale().y != renderScale.y) {
+                    progressEnd();
                     setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
                     OFX::throwSuiteStatusException(kOfxStatFailed);
                 }
+                OfxRectI analysisWindow;
                 bool intersect = computeWindow(src.get(), t, &analysisWindow);
                 if (intersect) {
-                    if (doAnalyzeSequenceRGBA) {
-                        update(src.get(), t, analysisWindow);
+                    if (doRGBA) {
+                        update(src.get(), t, analysisWindow, 1);
                     }
-                    if (doAnalyzeSequenceHSVL) {
-                        updateHSVL(src.get(), t, analysisWindow);
+                    if (doHSVL) {
+                        updateHSVL(src.get(), t, analysisWindow, 1);
                     }
                 }
             }
-            if (tmax != tmin) {
-                if (!progressUpdate((t-tmin)/(double)(tmax-tmin))) {
-                    break;
+        } else {
+            // analyze several frames concurrently, one thread per frame
+            SequenceAnalyzer analyzer(*this, batch, doRGBA, doHSVL, renderScale);
+            analyzer.multiThread((unsigned int)batchSize);
+            if (!abort()) {
+                for (size_t i = 0; i < batch.size(); ++i) {
+                    if (analyzer.isValid(i)) {
+                        if (doRGBA) {
+                            setResults(batch[i], analyzer.getResults(i));
+                        }
+                        if (doHSVL) {
+                            setResultsHSVL(batch[i], analyzer.getResultsHSVL(i));
+                        }
+                    }
                 }
             }
         }
-        progressEnd();
-#     ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
-        getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
-#     endif
+        done += batchSize;
+
+        // report progress and estimated remaining time
+        const double elapsed = std::difftime(std::time(NULL), startTime);
+        const int remaining = (int)(elapsed * (frames.size() - done) / done + 0.5);
+        char status[256];
+        snprintf(status, sizeof(status), "%d/%d frames analyzed (%d skipped), %d s remaining",
+                 (int)done, (int)frames.size(), nSkipped, remaining);
+        _analysisStatus->setValue(status);
+        if (abort() || !progressUpdate(done / (double)frames.size())) {
+            break;
+        }
     }
+    progressEnd();
+#   ifdef kOfxImageEffectPropInAnalysis // removed from OFX 1.4
+    getPropertySet().propSetInt(kOfxImageEffectPropInAnalysis, 0, false);
+#   endif
 }
 
 /* set up and run a processor */
 void
-ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double /*time*/, const OfxRectI &analysisWindow, const Results &prevResults, Results *results)
+ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor, const OFX::Image* srcImg, double /*time*/, const OfxRectI &analysisWindow, int samplingStep, bool singleThreaded, Results *results)
 {
 
     // set the images
@@ -1319,16 +1592,42 @@ ImageStatisticsPlugin::setupAndProcess(ImageStatisticsProcessorBase &processor,
     // set the render window
     processor.setRenderWindow(analysisWindow);
 
-    processor.setPrevResults(prevResults);
+    processor.setSampling(samplingStep, srcImg->getRenderScale());
 
     // Call the base class process member, this will call the derived templated process code
-    processor.process();
+    if (singleThreaded) {
+        processor.processSingleThreaded();
+    } else {
+        processor.process();
+    }
+
+    // more passes over the image may be necessary to refine the percentiles
+    while (!abort() && processor.startRefinement()) {
+        if (singleThreaded) {
+            processor.processSingleThreaded();
+        } else {
+            processor.process();
+        }
+    }
 
     if (!abort()) {
         processor.getResults(results);
     }
 }
 
+bool
+ImageStatisticsPlugin::getAutoUpdateSampling(double time, const OfxPointD& renderScale, int *samplingStep)
+{
+    if (!_proxyStatistics->getValueAtTime(time)) {
+        *samplingStep = 1;
+
+        return renderScale.x == 1. && renderScale.y == 1.;
+    }
+    *samplingStep = std::max(1, _proxySamplingStep->getValueAtTime(time));
+
+    return true;
+}
+
 bool
 ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, double time, OfxRectI *analysisWindow)
 {
@@ -1365,56 +1664,72 @@ ImageStatisticsPlugin::computeWindow(const OFX::Image* srcImg, double time, OfxR
 }
 // update image statistics
 void
-ImageStatisticsPlugin::update(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow)
+ImageStatisticsPlugin::update(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep)
 {
     // TODO: CHECK if checkDoubleAnalysis param is true and analysisWindow is the same as btmLeft/sizeAnalysis
     Results results;
     if (!abort()) {
-        updateSub<ImageMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
-    }
-    if (!abort()) {
-        updateSub<ImageSDevProcessor>(srcImg, time, analysisWindow, results, &results);
-    }
-    if (!abort()) {
-        updateSub<ImageSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+        updateSub<ImageStatisticsProcessor>(srcImg, time, analysisWindow, samplingStep, false, &results);
     }
     if (abort()) {
         return;
     }
+    setResults(time, results);
+}
+
+void
+ImageStatisticsPlugin::setResults(double time, const Results& results)
+{
     beginEditBlock("updateStatisticsRGBA");
     _statMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
     _statMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
     _statMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+    _statMeanError->setValueAtTime(time, results.meanError.r, results.meanError.g, results.meanError.b, results.meanError.a);
     _statSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
     _statSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
    // printf("skewness = %g %g %g %g\n", results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
     _statKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+    _statMedian->setValueAtTime(time, results.median.r, results.median.g, results.median.b, results.median.a);
+    _statP1->setValueAtTime(time, results.p1.r, results.p1.g, results.p1.b, results.p1.a);
+    _statP5->setValueAtTime(time, results.p5.r, results.p5.g, results.p5.b, results.p5.a);
+    _statP95->setValueAtTime(time, results.p95.r, results.p95.g, results.p95.b, results.p95.a);
+    _statP99->setValueAtTime(time, results.p99.r, results.p99.g, results.p99.b, results.p99.a);
+    _statClippedLow->setValueAtTime(time, results.clippedLow.r, results.clippedLow.g, results.clippedLow.b, results.clippedLow.a);
+    _statClippedHigh->setValueAtTime(time, results.clippedHigh.r, results.clippedHigh.g, results.clippedHigh.b, results.clippedHigh.a);
     endEditBlock();
 }
 
 void
-ImageStatisticsPlugin::updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow)
+ImageStatisticsPlugin::updateHSVL(const OFX::Image* srcImg, double time, const OfxRectI &analysisWindow, int samplingStep)
 {
     Results results;
     if (!abort()) {
-        updateSub<ImageHSVLMinMaxMeanProcessor>(srcImg, time, analysisWindow, results, &results);
-    }
-    if (!abort()) {
-        updateSub<ImageHSVLSDevProcessor>(srcImg, time, analysisWindow, results, &results);
-    }
-    if (!abort()) {
-        updateSub<ImageHSVLSkewnessKurtosisProcessor>(srcImg, time, analysisWindow, results, &results);
+        updateSub<ImageHSVLStatisticsProcessor>(srcImg, time, analysisWindow, samplingStep, false, &results);
     }
     if (abort()) {
         return;
     }
+    setResultsHSVL(time, results);
+}
+
+void
+ImageStatisticsPlugin::setResultsHSVL(double time, const Results& results)
+{
     beginEditBlock("updateStatisticsHSVL");
     _statHSVLMin->setValueAtTime(time, results.min.r, results.min.g, results.min.b, results.min.a);
     _statHSVLMax->setValueAtTime(time, results.max.r, results.max.g, results.max.b, results.max.a);
     _statHSVLMean->setValueAtTime(time, results.mean.r, results.mean.g, results.mean.b, results.mean.a);
+    _statHSVLMeanError->setValueAtTime(time, results.meanError.r, results.meanError.g, results.meanError.b, results.meanError.a);
     _statHSVLSDev->setValueAtTime(time, results.sdev.r, results.sdev.g, results.sdev.b, results.sdev.a);
     _statHSVLSkewness->setValueAtTime(time, results.skewness.r, results.skewness.g, results.skewness.b, results.skewness.a);
     _statHSVLKurtosis->setValueAtTime(time, results.kurtosis.r, results.kurtosis.g, results.kurtosis.b, results.kurtosis.a);
+    _statHSVLMedian->setValueAtTime(time, results.median.r, results.median.g, results.median.b, results.median.a);
+    _statHSVLP1->setValueAtTime(time, results.p1.r, results.p1.g, results.p1.b, results.p1.a);
+    _statHSVLP5->setValueAtTime(time, results.p5.r, results.p5.g, results.p5.b, results.p5.a);
+    _statHSVLP95->setValueAtTime(time, results.p95.r, results.p95.g, results.p95.b, results.p95.a);
+    _statHSVLP99->setValueAtTime(time, results.p99.r, results.p99.g, results.p99.b, results.p99.a);
+    _statHSVLClippedLow->setValueAtTime(time, results.clippedLow.r, results.clippedLow.g, results.clippedLow.b, results.clippedLow.a);
+    _statHSVLClippedHigh->setValueAtTime(time, results.clippedHigh.r, results.clippedHigh.g, results.clippedHigh.b, results.clippedHigh.a);
     endEditBlock();
 }
 
@@ -1617,6 +1932,74 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
         }
     }
 
+    // analyzeSkipExisting
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamAnalyzeSkipExisting);
+        param->setLabel(kParamAnalyzeSkipExistingLabel);
+        param->setHint(kParamAnalyzeSkipExistingHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // analyzeParallelFrames
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamAnalyzeParallelFrames);
+        param->setLabel(kParamAnalyzeParallelFramesLabel);
+        param->setHint(kParamAnalyzeParallelFramesHint);
+        param->setDefault(kParamAnalyzeParallelFramesDefault);
+        param->setRange(1, 64);
+        param->setDisplayRange(1, 16);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // analysisStatus
+    {
+        StringParamDescriptor *param = desc.defineStringParam(kParamAnalysisStatus);
+        param->setLabel(kParamAnalysisStatusLabel);
+        param->setHint(kParamAnalysisStatusHint);
+        param->setStringType(eStringTypeLabel);
+        param->setAnimates(false);
+        param->setEvaluateOnChange(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // proxyStatistics
+    {
+        BooleanParamDescriptor *param = desc.defineBooleanParam(kParamProxyStatistics);
+        param->setLabel(kParamProxyStatisticsLabel);
+        param->setHint(kParamProxyStatisticsHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        param->setLayoutHint(eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // proxySamplingStep
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamProxySamplingStep);
+        param->setLabel(kParamProxySamplingStepLabel);
+        param->setHint(kParamProxySamplingStepHint);
+        param->setDefault(kParamProxySamplingStepDefault);
+        param->setRange(1, 64);
+        param->setDisplayRange(1, 16);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         GroupParamDescriptor* group = desc.defineGroupParam(kParamGroupRGBA);
         if (group) {
@@ -1668,6 +2051,21 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statMeanError
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMeanError);
+            param->setLabel(kParamStatMeanErrorLabel);
+            param->setHint(kParamStatMeanErrorHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // statSDev
         {
             RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatSDev);
@@ -1713,6 +2111,111 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatMedian);
+            param->setLabel(kParamStatMedianLabel);
+            param->setHint(kParamStatMedianHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statP1
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP1);
+            param->setLabel(kParamStatP1Label);
+            param->setHint(kParamStatP1Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statP5
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP5);
+            param->setLabel(kParamStatP5Label);
+            param->setHint(kParamStatP5Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statP95
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP95);
+            param->setLabel(kParamStatP95Label);
+            param->setHint(kParamStatP95Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statP99
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatP99);
+            param->setLabel(kParamStatP99Label);
+            param->setHint(kParamStatP99Hint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statClippedLow
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatClippedLow);
+            param->setLabel(kParamStatClippedLowLabel);
+            param->setHint(kParamStatClippedLowHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statClippedHigh
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatClippedHigh);
+            param->setLabel(kParamStatClippedHighLabel);
+            param->setHint(kParamStatClippedHighHint);
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // analyzeFrame
         {
             PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFrame);
@@ -1823,6 +2326,22 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statHSVLMeanError
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLMeanError);
+            param->setLabel(kParamStatHSVLMeanErrorLabel);
+            param->setHint(kParamStatHSVLMeanErrorHint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // statHSVLSDev
         {
             RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLSDev);
@@ -1871,6 +2390,118 @@ void ImageStatisticsPluginFactory::describeInContext(OFX::ImageEffectDescriptor
             }
         }
 
+        // statHSVLMedian
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLMedian);
+            param->setLabel(kParamStatHSVLMedianLabel);
+            param->setHint(kParamStatHSVLMedianHint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLP1
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP1);
+            param->setLabel(kParamStatHSVLP1Label);
+            param->setHint(kParamStatHSVLP1Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLP5
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP5);
+            param->setLabel(kParamStatHSVLP5Label);
+            param->setHint(kParamStatHSVLP5Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLP95
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP95);
+            param->setLabel(kParamStatHSVLP95Label);
+            param->setHint(kParamStatHSVLP95Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLP99
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLP99);
+            param->setLabel(kParamStatHSVLP99Label);
+            param->setHint(kParamStatHSVLP99Hint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLClippedLow
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLClippedLow);
+            param->setLabel(kParamStatHSVLClippedLowLabel);
+            param->setHint(kParamStatHSVLClippedLowHint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
+        // statHSVLClippedHigh
+        {
+            RGBAParamDescriptor* param = desc.defineRGBAParam(kParamStatHSVLClippedHigh);
+            param->setLabel(kParamStatHSVLClippedHighLabel);
+            param->setHint(kParamStatHSVLClippedHighHint);
+            param->setDimensionLabels("h", "s", "v", "l");
+            param->setEvaluateOnChange(false);
+            param->setAnimates(true);
+            if (group) {
+                param->setParent(*group);
+            }
+            if (page) {
+                page->addChild(*param);
+            }
+        }
+
         // analyzeFrameHSVL
         {
             PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamAnalyzeFrameHSVL);
@@ -0,0 +1,211 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+//
+//  FrameCache.h
+//
+//  A cache of source images converted to float, used by the temporal plugins (TimeBlur, SlitScan) to reuse
+//  the source images of a frame in the next frames of a sequential render.
+//
+
+#ifndef Misc_FrameCache_h
+#define Misc_FrameCache_h
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+#include <list>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsMultiThread.h"
+
+// A source image converted to float.
+// KEY describes the image, and must have a method bool matches(const KEY& key, const OfxRectI& window) const,
+// which tells if the image can be used by a render described by key, which needs its pixels in window.
+template <class KEY>
+struct FrameCacheEntry
+{
+    KEY key;
+    bool ready; // false while the image is being converted, protected by the cache mutex
+    int users; // number of renders using the image, it is not evicted while it is used
+    std::vector<float> data; // set together with ready
+};
+
+// Evict the unused images only to fit in the cache budget.
+struct FrameCacheKeepAll
+{
+    template <class KEY>
+    bool operator()(const KEY& /*key*/) const { return false; }
+};
+
+// The cache. The images are converted without the cache mutex, and published under the mutex by ready().
+// Only the ready images are returned by acquire(): a render that does not find an image converts it too.
+template <class KEY>
+class FrameCache
+{
+public:
+    typedef FrameCacheEntry<KEY> Entry;
+
+    FrameCache()
+    : _mutex()
+    , _entries()
+    , _hits(0)
+    , _misses(0)
+    {
+    }
+
+    /* find a ready image matching key, which contains the pixels in window, and mark it as used.
+       Returns NULL if there is none. */
+    Entry* acquire(const KEY& key, const OfxRectI& window)
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        for (typename std::list<Entry>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            if (it->ready && it->key.matches(key, window)) {
+                // move it to the front (pointers to list elements remain valid)
+                _entries.splice(_entries.begin(), _entries, it);
+                Entry* entry = &_entries.front();
+                ++entry->users;
+                ++_hits;
+                return entry;
+            }
+        }
+        ++_misses;
+        return NULL;
+    }
+
+    /* add a new image to the cache, marked as used and not ready. */
+    Entry* insert(const KEY& key)
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        _entries.push_front(Entry());
+        Entry* entry = &_entries.front();
+        entry->key = key;
+        entry->ready = false;
+        entry->users = 1;
+        return entry;
+    }
+
+    /* give its converted pixels to an image returned by insert(), and mark it as ready. data is swapped with the image data. */
+    void ready(Entry* entry, std::vector<float>* data)
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        assert(entry->users > 0 && !entry->ready);
+        entry->data.swap(*data);
+        entry->ready = true;
+    }
+
+    /* mark the images as unused (an image may appear several times), and evict first the unused images that are not
+       ready or for which stale(key) is true, then the least recently used ones, to fit in cacheBytes. */
+    template <class STALE>
+    void release(const std::vector<Entry*>& entries, size_t cacheBytes, const STALE& stale)
+    {
+        if (entries.empty()) {
+            return;
+        }
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        size_t bytes = 0;
+        for (typename std::list<Entry>::iterator it = _entries.begin(); it != _entries.end();) {
+            const int count = (int)std::count(entries.begin(), entries.end(), &*it);
+            if (count > 0) {
+                assert(it->users >= count);
+                it->users -= count;
+            }
+            if (it->users == 0 && (!it->ready || stale(it->key))) {
+                // the image was not completely converted, or is not needed anymore
+                it = _entries.erase(it);
+                continue;
+            }
+            bytes += it->data.size() * sizeof(float);
+            ++it;
+        }
+        // evict the least recently used images
+        for (typename std::list<Entry>::reverse_iterator it = _entries.rbegin(); it != _entries.rend() && bytes > cacheBytes;) {
+            if (it->users == 0) {
+                bytes -= it->data.size() * sizeof(float);
+                it = typename std::list<Entry>::reverse_iterator(_entries.erase(--it.base()));
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void release(const std::vector<Entry*>& entries, size_t cacheBytes)
+    {
+        release(entries, cacheBytes, FrameCacheKeepAll());
+    }
+
+    /* free the images that are not used by a render, and reset the statistics */
+    void purge()
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        for (typename std::list<Entry>::iterator it = _entries.begin(); it != _entries.end();) {
+            if (it->users == 0) {
+                it = _entries.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        _hits = 0;
+        _misses = 0;
+    }
+
+    /* the number of hits and misses of acquire() since the last purge, and the number and size of the images */
+    void getStats(unsigned long* hits, unsigned long* misses, size_t* count, size_t* bytes) const
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        *hits = _hits;
+        *misses = _misses;
+        *count = _entries.size();
+        *bytes = 0;
+        for (typename std::list<Entry>::const_iterator it = _entries.begin(); it != _entries.end(); ++it) {
+            *bytes += it->data.size() * sizeof(float);
+        }
+    }
+
+private:
+    mutable OFX::MultiThread::Mutex _mutex;
+    std::list<Entry> _entries; // most recently used first, protected by _mutex
+    unsigned long _hits; // protected by _mutex
+    unsigned long _misses; // protected by _mutex
+};
+
+// To ensure that the cached images are always released even in case of exceptions, use a RAII class.
+template <class KEY, class STALE = FrameCacheKeepAll>
+struct FrameCacheHolder_RAII
+{
+    FrameCache<KEY> &cache;
+    size_t cacheBytes;
+    STALE stale;
+    std::vector<FrameCacheEntry<KEY>*> entries;
+
+    FrameCacheHolder_RAII(FrameCache<KEY> &c, size_t bytes, const STALE& s = STALE())
+    : cache(c)
+    , cacheBytes(bytes)
+    , stale(s)
+    , entries()
+    {
+    }
+
+    ~FrameCacheHolder_RAII()
+    {
+        cache.release(entries, cacheBytes, stale);
+    }
+};
+
+#endif // Misc_FrameCache_h
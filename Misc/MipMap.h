@@ -0,0 +1,966 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+//
+//  MipMap.h
+//
+//  A mipmap pyramid of the source image, used by the Transform and Reformat plugins to resample
+//  with a large minification: each level is prefiltered once, and the destination pixels are
+//  interpolated trilinearly between the two levels closest to their footprint.
+//
+
+#ifndef Misc_MipMap_h
+#define Misc_MipMap_h
+
+#include <cmath>
+#include <cstddef>
+#include <cassert>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <algorithm>
+
+#include "ofxsImageEffect.h"
+#include "ofxsProcessing.H"
+#include "ofxsMultiThread.h"
+#include "ofxsMaskMix.h"
+#include "ofxsFilter.h"
+#include "ofxsMatrix2D.h"
+#include "ofxsCoords.h"
+#include "ofxsMacros.h"
+
+#include "SourceTransform.h"
+
+#define kParamMipMap "mipmap"
+#define kParamMipMapLabel "Pyramid"
+#define kParamMipMapHint \
+"When the image is shrunk by a factor of two or more, sample a prefiltered pyramid of the source image instead of filtering all the source pixels under each destination pixel. " \
+"This is much faster for large minifications (e.g. thumbnails of large images), but the image is slightly blurrier. " \
+"The whole source image is fetched, and its pyramid is shared by all the tiles of the frame."
+
+#define kParamMipMapPrefilter "mipmapPrefilter"
+#define kParamMipMapPrefilterLabel "Pyramid Filter"
+#define kParamMipMapPrefilterHint "Filter used to compute each level of the pyramid from the previous one."
+#define kParamMipMapPrefilterOptionBox "Box"
+#define kParamMipMapPrefilterOptionBoxHint "Average of 2x2 pixels. Fast, but may leave some aliasing."
+#define kParamMipMapPrefilterOptionLanczos "Lanczos"
+#define kParamMipMapPrefilterOptionLanczosHint "Lanczos-2 windowed sinc on 8x8 pixels. Sharper, with less aliasing, but may produce slight ringing."
+
+// number of lines of a level computed at once by each thread
+#define kMipMapBandLines 32
+
+// the last released pyramid is kept for the next renders (e.g. the next tiles of the same frame) whatever its size,
+// and the other unused pyramids as long as they fit in this budget, most recently used first
+#define kMipMapCacheBytes (64 * 1024 * 1024)
+
+// number of cells along each side of the grid where the highest level of detail of a rectangle is estimated
+#define kMipMapLodGrid 4
+
+// level of detail of a rectangle crossed by the horizon, more than the number of levels of any image
+#define kMipMapHorizonLod 32.
+
+namespace OFX {
+
+enum MipMapPrefilterEnum
+{
+    eMipMapPrefilterBox = 0,
+    eMipMapPrefilterLanczos,
+};
+
+// A level of the pyramid, stored as interleaved float components.
+// Pixel (i,j) of level l covers the source pixels [x1+i*2^l,x1+(i+1)*2^l)x[y1+j*2^l,y1+(j+1)*2^l),
+// where (x1,y1) is the lower left corner of the source bounds.
+struct MipMapLevel
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    MipMapLevel()
+    : width(0)
+    , height(0)
+    , data()
+    {
+    }
+};
+
+// The pyramid of a source image. Level 0 is the source image itself, and is not stored.
+// The levels are computed with buildMutex locked, and a level is never modified once it is counted in levelsCount.
+struct MipMap
+{
+    std::string srcIdentifier; // the unique identifier of the source image, empty if the host does not give one
+    OfxRectI srcBounds;
+    OFX::BitDepthEnum bitDepth;
+    int nComponents;
+    MipMapPrefilterEnum prefilter;
+    std::vector<MipMapLevel> levels; // levels[l-1] is level l, down to 1x1 pixel
+    int levelsCount; // number of levels that were computed, not counting level 0, protected by buildMutex
+    int users; // number of renders using the pyramid, it is not evicted while it is used
+    OFX::MultiThread::Mutex *buildMutex; // created and deleted by MipMapCache
+
+    // the memory used by the computed levels
+    size_t bytes() const
+    {
+        size_t b = 0;
+        for (size_t l = 0; l < levels.size(); ++l) {
+            b += levels[l].data.size() * sizeof(float);
+        }
+
+        return b;
+    }
+
+    // true if this pyramid was computed from the same image
+    bool matches(const MipMap& other) const
+    {
+        return (!srcIdentifier.empty() && srcIdentifier == other.srcIdentifier &&
+                srcBounds.x1 == other.srcBounds.x1 && srcBounds.y1 == other.srcBounds.y1 &&
+                srcBounds.x2 == other.srcBounds.x2 && srcBounds.y2 == other.srcBounds.y2 &&
+                bitDepth == other.bitDepth &&
+                nComponents == other.nComponents &&
+                prefilter == other.prefilter);
+    }
+};
+
+// The level of detail, i.e. log2 of the footprint size of a destination pixel in source pixels, from the Jacobian.
+// The footprint size is the length of the longest axis: the pyramid is isotropic, and anisotropic footprints are blurred
+// rather than aliased.
+inline double
+mipmapLod(double Jxx, double Jxy, double Jyx, double Jyy)
+{
+    const double rho2 = std::max(Jxx * Jxx + Jyx * Jyx, Jxy * Jxy + Jyy * Jyy);
+    if (rho2 <= 0.) {
+        return 0.;
+    }
+
+    return 0.5 * std::log(rho2) * 1.4426950408889634; // 1/ln(2)
+}
+
+// The level of detail at the center of destination pixel (x,y).
+// Returns false if the back-transformed point is at infinity.
+inline bool
+mipmapLodAt(const OFX::Matrix3x3 &H, double x, double y, double *lod)
+{
+    OFX::Point3D p;
+    p.x = x;
+    p.y = y;
+    p.z = 1.;
+    OFX::Point3D transformed = H * p;
+    if (transformed.z == 0.) {
+        return false;
+    }
+    const double z2 = transformed.z * transformed.z;
+    *lod = mipmapLod((H.a * transformed.z - transformed.x * H.g) / z2,
+                     (H.b * transformed.z - transformed.x * H.h) / z2,
+                     (H.d * transformed.z - transformed.y * H.g) / z2,
+                     (H.e * transformed.z - transformed.y * H.h) / z2);
+
+    return true;
+}
+
+// An estimate of the highest level of detail on a rectangle of the destination image, from the levels of detail on a
+// grid of kMipMapLodGrid x kMipMapLodGrid cells covering it.
+// A maximum between the grid points is sampled from the coarsest level computed, which only leaves some aliasing.
+// The level of detail grows without bound near the horizon (z = 0), so if it crosses the rectangle,
+// kMipMapHorizonLod is returned, which is more than the number of levels of any image.
+inline double
+mipmapMaxLod(const OFX::Matrix3x3 &H, const OfxRectD &rect)
+{
+    // z is affine, so its extrema on the rectangle are at the corners
+    const double z11 = H.g * rect.x1 + H.h * rect.y1 + H.i;
+    const double z12 = H.g * rect.x1 + H.h * rect.y2 + H.i;
+    const double z21 = H.g * rect.x2 + H.h * rect.y1 + H.i;
+    const double z22 = H.g * rect.x2 + H.h * rect.y2 + H.i;
+    if (std::min(std::min(z11, z12), std::min(z21, z22)) <= 0. &&
+        std::max(std::max(z11, z12), std::max(z21, z22)) >= 0.) {
+        return kMipMapHorizonLod;
+    }
+
+    double maxLod = 0.;
+    for (int i = 0; i <= kMipMapLodGrid; ++i) {
+        const double x = rect.x1 + (rect.x2 - rect.x1) * i / kMipMapLodGrid;
+        for (int j = 0; j <= kMipMapLodGrid; ++j) {
+            const double y = rect.y1 + (rect.y2 - rect.y1) * j / kMipMapLodGrid;
+            double lod;
+            if (mipmapLodAt(H, x, y, &lod)) {
+                maxLod = std::max(maxLod, lod);
+            }
+        }
+    }
+
+    return maxLod;
+}
+
+// An estimate of the highest level of detail on the render window, whose corners are the centers of its corner pixels.
+inline double
+mipmapMaxLod(const OFX::Matrix3x3 &H, const OfxRectI &renderWindow)
+{
+    OfxRectD rect;
+    rect.x1 = renderWindow.x1 + 0.5;
+    rect.y1 = renderWindow.y1 + 0.5;
+    rect.x2 = renderWindow.x2 - 0.5;
+    rect.y2 = renderWindow.y2 - 0.5;
+
+    return mipmapMaxLod(H, rect);
+}
+
+// The prefilter taps along one axis: level pixel i is the weighted sum of the previous level pixels 2i+first ... 2i+first+taps-1.
+struct MipMapPrefilterTaps
+{
+    int first;
+    int taps;
+    float weight[8];
+
+    MipMapPrefilterTaps(MipMapPrefilterEnum prefilter)
+    : first(0)
+    , taps(0)
+    {
+        if (prefilter == eMipMapPrefilterBox) {
+            first = 0;
+            taps = 2;
+            weight[0] = weight[1] = 0.5f;
+        } else {
+            // Lanczos-2 stretched by 2: the previous level pixel centers are at distances -3.5 ... 3.5
+            // from the center of the level pixel, i.e. -1.75 ... 1.75 in level pixels
+            first = -3;
+            taps = 8;
+            double sum = 0.;
+            double w[8];
+            for (int k = 0; k < 8; ++k) {
+                const double x = (k - 3.5) / 2.;
+                const double px = M_PI * x;
+                w[k] = (std::sin(px) / px) * (std::sin(px / 2.) / (px / 2.));
+                sum += w[k];
+            }
+            for (int k = 0; k < 8; ++k) {
+                weight[k] = (float)(w[k] / sum);
+            }
+        }
+    }
+};
+
+// Compute a level of the pyramid from the previous one (which may be the source image, of any pixel type).
+// The level is computed by bands of lines: the previous level lines used by the band are first filtered horizontally,
+// then vertically. Pixels outside of the previous level are the nearest edge pixel.
+template <class SRC, int nComponents>
+class MipMapDownsampler : public OFX::MultiThread::Processor
+{
+public:
+    MipMapDownsampler(OFX::ImageEffect &effect,
+                      const SRC *src,
+                      std::ptrdiff_t srcStride, // distance between two lines of src, in components
+                      int srcWidth,
+                      int srcHeight,
+                      MipMapPrefilterEnum prefilter,
+                      MipMapLevel *dst)
+    : _effect(effect)
+    , _src(src)
+    , _srcStride(srcStride)
+    , _srcWidth(srcWidth)
+    , _srcHeight(srcHeight)
+    , _taps(prefilter)
+    , _dst(dst)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        const int h = _dst->height;
+        const int j1 = (int)(((long long)h * threadId) / nThreads);
+        const int j2 = (int)(((long long)h * (threadId + 1)) / nThreads);
+        std::vector<float> lines; // the horizontally filtered lines of the previous level
+        for (int band1 = j1; band1 < j2; band1 += kMipMapBandLines) {
+            if (_effect.abort()) {
+                return;
+            }
+            const int band2 = std::min(j2, band1 + kMipMapBandLines);
+            processBand(band1, band2, lines);
+        }
+    }
+
+    void processBand(int band1, int band2, std::vector<float> &lines)
+    {
+        const int w = _dst->width;
+        const int n = w * nComponents;
+        const int taps = _taps.taps;
+        const int line1 = 2 * band1 + _taps.first;
+        const int line2 = 2 * (band2 - 1) + _taps.first + taps;
+        lines.resize((size_t)(line2 - line1) * n);
+
+        // horizontal pass
+        for (int l = line1; l < line2; ++l) {
+            const SRC *srcLine = _src + std::max(0, std::min(l, _srcHeight - 1)) * _srcStride;
+            float *linePix = &lines[(size_t)(l - line1) * n];
+            for (int i = 0; i < w; ++i, linePix += nComponents) {
+                float tmpPix[nComponents];
+                for (int c = 0; c < nComponents; ++c) {
+                    tmpPix[c] = 0.f;
+                }
+                const int k0 = 2 * i + _taps.first;
+                if (0 <= k0 && k0 + taps <= _srcWidth) {
+                    const SRC *srcPix = srcLine + k0 * nComponents;
+                    for (int k = 0; k < taps; ++k, srcPix += nComponents) {
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] += _taps.weight[k] * srcPix[c];
+                        }
+                    }
+                } else {
+                    for (int k = 0; k < taps; ++k) {
+                        const SRC *srcPix = srcLine + std::max(0, std::min(k0 + k, _srcWidth - 1)) * nComponents;
+                        for (int c = 0; c < nComponents; ++c) {
+                            tmpPix[c] += _taps.weight[k] * srcPix[c];
+                        }
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    linePix[c] = tmpPix[c];
+                }
+            }
+        }
+
+        // vertical pass
+        for (int j = band1; j < band2; ++j) {
+            float *dstPix = &_dst->data[(size_t)j * n];
+            std::fill(dstPix, dstPix + n, 0.f);
+            for (int k = 0; k < taps; ++k) {
+                const float wk = _taps.weight[k];
+                const float *linePix = &lines[(size_t)(2 * j + _taps.first + k - line1) * n];
+                for (int i = 0; i < n; ++i) {
+                    dstPix[i] += wk * linePix[i];
+                }
+            }
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    const SRC *_src;
+    std::ptrdiff_t _srcStride;
+    int _srcWidth;
+    int _srcHeight;
+    MipMapPrefilterTaps _taps;
+    MipMapLevel *_dst;
+};
+
+// The pyramids of the last source images.
+// A pyramid is computed once per frame: the tiles of the same frame share the same source image
+// (identified by its unique identifier), and the first tile computes it for the others.
+// The cache mutex is only held to find, insert and evict the pyramids: the levels are computed with the mutex
+// of the pyramid locked, so that the other tiles of the frame wait for it, without blocking the other frames or purge().
+class MipMapCache
+{
+public:
+    MipMapCache()
+    : _mutex()
+    , _entries()
+    {
+    }
+
+    ~MipMapCache()
+    {
+        for (std::list<MipMap>::iterator it = _entries.begin(); it != _entries.end();) {
+            it = erase(it);
+        }
+    }
+
+    /* get the pyramid of src with at least nLevels levels (not counting level 0), computing the missing levels.
+       levelsCount is set to the number of levels that can be used by the caller, which may be less than nLevels
+       if the render was aborted.
+       The pyramid must be released by release(). */
+    template <class PIX, int nComponents>
+    const MipMap* acquire(OFX::ImageEffect &effect,
+                          const OFX::Image *src,
+                          MipMapPrefilterEnum prefilter,
+                          int nLevels,
+                          int *levelsCount)
+    {
+        MipMap key;
+        key.srcIdentifier = src->getUniqueIdentifier();
+        key.srcBounds = src->getBounds();
+        key.bitDepth = src->getPixelDepth();
+        key.nComponents = nComponents;
+        key.prefilter = prefilter;
+        key.levelsCount = 0;
+        key.users = 0;
+        key.buildMutex = 0;
+
+        MipMap *mipmap = 0;
+        {
+            OFX::MultiThread::AutoMutex guard(_mutex);
+            for (std::list<MipMap>::iterator it = _entries.begin(); it != _entries.end(); ++it) {
+                if (it->matches(key)) {
+                    // move it to the front (pointers to list elements remain valid)
+                    _entries.splice(_entries.begin(), _entries, it);
+                    mipmap = &_entries.front();
+                    break;
+                }
+            }
+            if (!mipmap) {
+                _entries.push_front(key);
+                mipmap = &_entries.front();
+                mipmap->buildMutex = new OFX::MultiThread::Mutex;
+                // allocate all the levels, so that computing more levels never moves the existing ones
+                int w = key.srcBounds.x2 - key.srcBounds.x1;
+                int h = key.srcBounds.y2 - key.srcBounds.y1;
+                while (w > 1 || h > 1) {
+                    w = (w + 1) / 2;
+                    h = (h + 1) / 2;
+                    MipMapLevel level;
+                    level.width = w;
+                    level.height = h;
+                    mipmap->levels.push_back(level);
+                }
+            }
+            ++mipmap->users;
+        }
+
+        // the pyramid is used, so it cannot be evicted while its levels are computed without the cache mutex
+        OFX::MultiThread::AutoMutex buildGuard(*mipmap->buildMutex);
+        nLevels = std::min(nLevels, (int)mipmap->levels.size());
+        while (mipmap->levelsCount < nLevels) {
+            MipMapLevel &level = mipmap->levels[mipmap->levelsCount];
+            level.data.resize((size_t)level.width * level.height * nComponents);
+            const unsigned int nThreads = std::max(1u, std::min((unsigned int)level.height, OFX::MultiThread::getNumCPUs()));
+            if (mipmap->levelsCount == 0) {
+                const OfxRectI &bounds = mipmap->srcBounds;
+                MipMapDownsampler<PIX, nComponents> downsampler(effect,
+                                                                (const PIX *)src->getPixelAddress(bounds.x1, bounds.y1),
+                                                                src->getRowBytes() / (int)sizeof(PIX),
+                                                                bounds.x2 - bounds.x1, bounds.y2 - bounds.y1,
+                                                                prefilter, &level);
+                downsampler.multiThread(nThreads);
+            } else {
+                const MipMapLevel &prev = mipmap->levels[mipmap->levelsCount - 1];
+                MipMapDownsampler<float, nComponents> downsampler(effect,
+                                                                  &prev.data.front(),
+                                                                  prev.width * nComponents,
+                                                                  prev.width, prev.height,
+                                                                  prefilter, &level);
+                downsampler.multiThread(nThreads);
+            }
+            if (effect.abort()) {
+                // the level is incomplete
+                level.data.clear();
+                break;
+            }
+            ++mipmap->levelsCount;
+        }
+        *levelsCount = mipmap->levelsCount;
+
+        return mipmap;
+    }
+
+    /* mark the pyramid as unused, and evict the unused pyramids that do not fit in the cache budget.
+       The released pyramid is kept whatever its size, since the next tiles of its frame may still need it:
+       the budget only applies to the other unused pyramids. */
+    void release(const MipMap *mipmap)
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        size_t bytes = 0;
+        for (std::list<MipMap>::iterator it = _entries.begin(); it != _entries.end();) {
+            const bool released = (&*it == mipmap);
+            if (released) {
+                assert(it->users > 0);
+                --it->users;
+            }
+            if (it->users == 0) {
+                // no render is using it, so its levels are not being computed
+                if (!released) {
+                    bytes += it->bytes();
+                }
+                if (it->srcIdentifier.empty() || (!released && bytes > kMipMapCacheBytes)) {
+                    it = erase(it);
+                    continue;
+                }
+            }
+            ++it;
+        }
+    }
+
+    /* free the pyramids that are not used by a render */
+    void purge()
+    {
+        OFX::MultiThread::AutoMutex guard(_mutex);
+        for (std::list<MipMap>::iterator it = _entries.begin(); it != _entries.end();) {
+            if (it->users == 0) {
+                it = erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    // remove an entry, which must not be used
+    std::list<MipMap>::iterator erase(std::list<MipMap>::iterator it)
+    {
+        assert(it->users == 0);
+        delete it->buildMutex;
+
+        return _entries.erase(it);
+    }
+
+    OFX::MultiThread::Mutex _mutex;
+    std::list<MipMap> _entries; // most recently used first, protected by _mutex
+};
+
+// To ensure that the pyramid is always released even in case of exceptions, use a RAII class.
+struct MipMapHolder_RAII
+{
+    MipMapCache &cache;
+    const MipMap *mipmap;
+
+    MipMapHolder_RAII(MipMapCache &c, const MipMap *m)
+    : cache(c)
+    , mipmap(m)
+    {
+    }
+
+    ~MipMapHolder_RAII()
+    {
+        cache.release(mipmap);
+    }
+};
+
+// Resample the source image through the inverse transform H (from destination pixels to source pixels).
+// Where the footprint of the destination pixel is smaller than two source pixels, the source image is interpolated
+// with the user filter, as in the regular Transform3x3 render. Elsewhere, the pyramid is interpolated trilinearly.
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+class MipMapTransformProcessor : public OFX::ImageProcessor
+{
+public:
+    MipMapTransformProcessor(OFX::ImageEffect &instance)
+    : OFX::ImageProcessor(instance)
+    , _srcImg(0)
+    , _maskImg(0)
+    , _domask(false)
+    , _maskInvert(false)
+    , _mipmap(0)
+    , _levelsCount(0)
+    , _invtransform()
+    , _blackOutside(false)
+    , _mix(1.)
+    {
+    }
+
+    void setSrcImg(const OFX::Image *v) { _srcImg = v; }
+
+    void setMaskImg(const OFX::Image *v, bool maskInvert) { _maskImg = v; _maskInvert = maskInvert; }
+
+    void doMasking(bool v) { _domask = v; }
+
+    void setValues(const MipMap *mipmap,
+                   int levelsCount,
+                   const OFX::Matrix3x3 &invtransform,
+                   bool blackOutside,
+                   double mix)
+    {
+        _mipmap = mipmap;
+        _levelsCount = levelsCount;
+        _invtransform = invtransform;
+        _blackOutside = blackOutside;
+        _mix = mix;
+    }
+
+private:
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(_mipmap);
+        float tmpPix[nComponents];
+        const OFX::Matrix3x3 &H = _invtransform;
+        // for affine transforms, the level of detail is constant
+        const bool affine = (H.g == 0. && H.h == 0.);
+        double affineLod = 0.;
+        if (affine && H.i != 0.) {
+            affineLod = mipmapLod(H.a / H.i, H.b / H.i, H.d / H.i, H.e / H.i);
+        }
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) _dstImg->getPixelAddress(procWindow.x1, y);
+
+            // the coordinates of the center of the pixel in canonical coordinates
+            // see http://openfx.sourceforge.net/Documentation/1.3/ofxProgrammingReference.html#CanonicalCoordinates
+            OFX::Point3D canonicalCoords;
+            canonicalCoords.z = 1;
+            canonicalCoords.y = (double)y + 0.5;
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x, dstPix += nComponents) {
+                canonicalCoords.x = (double)x + 0.5;
+                OFX::Point3D transformed = H * canonicalCoords;
+                if (!_srcImg || transformed.z == 0.) {
+                    // the back-transformed point is at infinity
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = 0;
+                    }
+                } else {
+                    const double fx = transformed.x / transformed.z;
+                    const double fy = transformed.y / transformed.z;
+                    double lod = affineLod;
+                    if (!affine) {
+                        const double z2 = transformed.z * transformed.z;
+                        lod = mipmapLod((H.a * transformed.z - transformed.x * H.g) / z2,
+                                        (H.b * transformed.z - transformed.x * H.h) / z2,
+                                        (H.d * transformed.z - transformed.y * H.g) / z2,
+                                        (H.e * transformed.z - transformed.y * H.h) / z2);
+                    }
+                    sample(fx, fy, lod, tmpPix);
+                }
+
+                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _srcImg, _domask, _maskImg, (float)_mix, _maskInvert, dstPix);
+            }
+        }
+    }
+
+    void sample(double fx, double fy, double lod, float *tmpPix)
+    {
+        if (lod <= 0.) {
+            ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+
+            return;
+        }
+        int l = (int)lod;
+        float t = (float)(lod - l);
+        if (l >= _levelsCount) {
+            // the coarsest computed level
+            l = _levelsCount;
+            t = 0.f;
+        }
+        if (l == 0) {
+            ofxsFilterInterpolate2D<PIX, nComponents, filter, clamp>(fx, fy, _srcImg, _blackOutside, tmpPix);
+        } else {
+            sampleLevel(l, fx, fy, tmpPix);
+        }
+        if (t > 0.f) {
+            float tmpPix1[nComponents];
+            sampleLevel(l + 1, fx, fy, tmpPix1);
+            for (int c = 0; c < nComponents; ++c) {
+                tmpPix[c] += t * (tmpPix1[c] - tmpPix[c]);
+            }
+        }
+    }
+
+    // bilinear interpolation in level l >= 1
+    void sampleLevel(int l, double fx, double fy, float *tmpPix)
+    {
+        assert(1 <= l && l <= _levelsCount);
+        const MipMapLevel &level = _mipmap->levels[l - 1];
+        const double s = 1. / (double)(1 << l);
+        const double u = (fx - _mipmap->srcBounds.x1) * s - 0.5;
+        const double v = (fy - _mipmap->srcBounds.y1) * s - 0.5;
+        const int i0 = (int)std::floor(u);
+        const int j0 = (int)std::floor(v);
+        const float a = (float)(u - i0);
+        const float b = (float)(v - j0);
+        const float w[4] = { (1.f - a) * (1.f - b), a * (1.f - b), (1.f - a) * b, a * b };
+        for (int c = 0; c < nComponents; ++c) {
+            tmpPix[c] = 0.f;
+        }
+        for (int k = 0; k < 4; ++k) {
+            int i = i0 + (k & 1);
+            int j = j0 + (k >> 1);
+            if (i < 0 || level.width <= i || j < 0 || level.height <= j) {
+                if (_blackOutside) {
+                    continue;
+                }
+                i = std::max(0, std::min(i, level.width - 1));
+                j = std::max(0, std::min(j, level.height - 1));
+            }
+            const float *pix = &level.data[((size_t)j * level.width + i) * nComponents];
+            for (int c = 0; c < nComponents; ++c) {
+                tmpPix[c] += w[k] * pix[c];
+            }
+        }
+    }
+
+    const OFX::Image *_srcImg;
+    const OFX::Image *_maskImg;
+    bool _domask;
+    bool _maskInvert;
+    const MipMap *_mipmap;
+    int _levelsCount; // the levels computed when the pyramid was acquired: other renders may compute more levels meanwhile
+    OFX::Matrix3x3 _invtransform;
+    bool _blackOutside;
+    double _mix;
+};
+
+template <class PIX, int nComponents, int maxValue, FilterEnum filter, bool clamp>
+void
+mipmapTransformProcess(OFX::ImageEffect &effect,
+                       const MipMap *mipmap,
+                       int levelsCount,
+                       const OFX::Image *src,
+                       OFX::Image *dst,
+                       const OFX::Image *mask,
+                       bool maskInvert,
+                       const OfxRectI &renderWindow,
+                       const OFX::Matrix3x3 &invtransform,
+                       bool blackOutside,
+                       double mix)
+{
+    MipMapTransformProcessor<PIX, nComponents, maxValue, filter, clamp> processor(effect);
+    processor.setDstImg(dst);
+    processor.setSrcImg(src);
+    if (mask) {
+        processor.doMasking(true);
+        processor.setMaskImg(mask, maskInvert);
+    }
+    processor.setRenderWindow(renderWindow);
+    processor.setValues(mipmap, levelsCount, invtransform, blackOutside, mix);
+    processor.process();
+}
+
+/* Render the transformed source image using its pyramid, computing the pyramid levels if they are not in the cache.
+   invtransform is the transform from destination pixels to source pixels. */
+template <class PIX, int nComponents, int maxValue>
+void
+mipmapTransformRender(OFX::ImageEffect &effect,
+                      MipMapCache &cache,
+                      MipMapPrefilterEnum prefilter,
+                      const OFX::Image *src,
+                      OFX::Image *dst,
+                      const OFX::Image *mask,
+                      bool maskInvert,
+                      const OfxRectI &renderWindow,
+                      const OFX::Matrix3x3 &invtransform,
+                      FilterEnum filter,
+                      bool clamp,
+                      bool blackOutside,
+                      double mix)
+{
+    // trilinear interpolation uses the level above the highest level of detail
+    const int nLevels = (int)std::ceil(mipmapMaxLod(invtransform, renderWindow)) + 1;
+    int levelsCount = 0;
+    MipMapHolder_RAII mipmap(cache, cache.acquire<PIX, nComponents>(effect, src, prefilter, nLevels, &levelsCount));
+    if (effect.abort()) {
+        return;
+    }
+
+    // as in the generic render, only the filters with negative lobes need explicit clamping
+#define MIPMAP_PROCESS(f, c) mipmapTransformProcess<PIX, nComponents, maxValue, f, c>(effect, mipmap.mipmap, levelsCount, src, dst, mask, maskInvert, renderWindow, invtransform, blackOutside, mix)
+    switch (filter) {
+        case eFilterImpulse:
+            MIPMAP_PROCESS(eFilterImpulse, false);
+            break;
+        case eFilterBilinear:
+            MIPMAP_PROCESS(eFilterBilinear, false);
+            break;
+        case eFilterCubic:
+            MIPMAP_PROCESS(eFilterCubic, false);
+            break;
+        case eFilterKeys:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterKeys, true);
+            } else {
+                MIPMAP_PROCESS(eFilterKeys, false);
+            }
+            break;
+        case eFilterSimon:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterSimon, true);
+            } else {
+                MIPMAP_PROCESS(eFilterSimon, false);
+            }
+            break;
+        case eFilterRifman:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterRifman, true);
+            } else {
+                MIPMAP_PROCESS(eFilterRifman, false);
+            }
+            break;
+        case eFilterMitchell:
+            if (clamp) {
+                MIPMAP_PROCESS(eFilterMitchell, true);
+            } else {
+                MIPMAP_PROCESS(eFilterMitchell, false);
+            }
+            break;
+        case eFilterParzen:
+            MIPMAP_PROCESS(eFilterParzen, false);
+            break;
+        case eFilterNotch:
+            MIPMAP_PROCESS(eFilterNotch, false);
+            break;
+    }
+#undef MIPMAP_PROCESS
+}
+
+/* Fetch the source and destination images, and render the transformed source image using its pyramid,
+   if the transform minifies the render window by at least 2.
+   invtransform is the transform from destination pixels to source pixels, and is composed with the transform attached
+   to the source image, if any. maskClip is NULL if there is no masking.
+   Returns false if the pyramid cannot be used: the caller must then do the regular render. */
+template <class PIX, int nComponents, int maxValue>
+bool
+mipmapRenderForBitDepth(OFX::ImageEffect &effect,
+                        MipMapCache &cache,
+                        const OFX::RenderArguments &args,
+                        OFX::Clip *srcClip,
+                        OFX::Clip *dstClip,
+                        OFX::Clip *maskClip,
+                        bool maskInvert,
+                        const OFX::Matrix3x3 &invtransform,
+                        MipMapPrefilterEnum prefilter,
+                        FilterEnum filter,
+                        bool clamp,
+                        bool blackOutside,
+                        double mix)
+{
+    const double time = args.time;
+    std::auto_ptr<const OFX::Image> src((srcClip && srcClip->isConnected()) ?
+                                        srcClip->fetchImage(time) : 0);
+    if (!src.get() || OFX::Coords::rectIsEmpty(src->getBounds()) || OFX::Coords::rectIsEmpty(args.renderWindow)) {
+        return false;
+    }
+    std::auto_ptr<OFX::Image> dst(dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        effect.setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (src->getPixelDepth() != dst->getPixelDepth() ||
+        src->getPixelComponents() != dst->getPixelComponents()) {
+        return false;
+    }
+
+    // compose with the input transform
+    OFX::Matrix3x3 srcInvtransform = invtransform;
+    if (!sourceInverseTransform(*src, &srcInvtransform)) {
+        return false;
+    }
+    if (mipmapMaxLod(srcInvtransform, args.renderWindow) < 1.) {
+        // not minified enough for the pyramid to be useful
+        return false;
+    }
+
+    std::auto_ptr<const OFX::Image> mask((maskClip && maskClip->isConnected()) ? maskClip->fetchImage(time) : 0);
+
+    mipmapTransformRender<PIX, nComponents, maxValue>(effect, cache, prefilter, src.get(), dst.get(), mask.get(), maskInvert,
+                                                      args.renderWindow, srcInvtransform, filter, clamp, blackOutside, mix);
+
+    return true;
+}
+
+template <int nComponents>
+bool
+mipmapRenderForComponents(OFX::ImageEffect &effect,
+                          MipMapCache &cache,
+                          const OFX::RenderArguments &args,
+                          OFX::BitDepthEnum dstBitDepth,
+                          OFX::Clip *srcClip,
+                          OFX::Clip *dstClip,
+                          OFX::Clip *maskClip,
+                          bool maskInvert,
+                          const OFX::Matrix3x3 &invtransform,
+                          MipMapPrefilterEnum prefilter,
+                          FilterEnum filter,
+                          bool clamp,
+                          bool blackOutside,
+                          double mix)
+{
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte:
+            return mipmapRenderForBitDepth<unsigned char, nComponents, 255>(effect, cache, args, srcClip, dstClip, maskClip, maskInvert,
+                                                                            invtransform, prefilter, filter, clamp, blackOutside, mix);
+        case OFX::eBitDepthUShort:
+            return mipmapRenderForBitDepth<unsigned short, nComponents, 65535>(effect, cache, args, srcClip, dstClip, maskClip, maskInvert,
+                                                                               invtransform, prefilter, filter, clamp, blackOutside, mix);
+        case OFX::eBitDepthFloat:
+            return mipmapRenderForBitDepth<float, nComponents, 1>(effect, cache, args, srcClip, dstClip, maskClip, maskInvert,
+                                                                  invtransform, prefilter, filter, clamp, blackOutside, mix);
+        default:
+            return false;
+    }
+}
+
+/* The pyramid render of the Transform and Reformat plugins, see mipmapRenderForBitDepth(). */
+inline bool
+mipmapRender(OFX::ImageEffect &effect,
+             MipMapCache &cache,
+             const OFX::RenderArguments &args,
+             OFX::Clip *srcClip,
+             OFX::Clip *dstClip,
+             OFX::Clip *maskClip,
+             bool maskInvert,
+             const OFX::Matrix3x3 &invtransform,
+             MipMapPrefilterEnum prefilter,
+             FilterEnum filter,
+             bool clamp,
+             bool blackOutside,
+             double mix)
+{
+    OFX::BitDepthEnum dstBitDepth = dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents = dstClip->getPixelComponents();
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        return mipmapRenderForComponents<4>(effect, cache, args, dstBitDepth, srcClip, dstClip, maskClip, maskInvert,
+                                            invtransform, prefilter, filter, clamp, blackOutside, mix);
+    } else if (dstComponents == OFX::ePixelComponentRGB) {
+        return mipmapRenderForComponents<3>(effect, cache, args, dstBitDepth, srcClip, dstClip, maskClip, maskInvert,
+                                            invtransform, prefilter, filter, clamp, blackOutside, mix);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        return mipmapRenderForComponents<2>(effect, cache, args, dstBitDepth, srcClip, dstClip, maskClip, maskInvert,
+                                            invtransform, prefilter, filter, clamp, blackOutside, mix);
+    } else if (dstComponents == OFX::ePixelComponentAlpha) {
+        return mipmapRenderForComponents<1>(effect, cache, args, dstBitDepth, srcClip, dstClip, maskClip, maskInvert,
+                                            invtransform, prefilter, filter, clamp, blackOutside, mix);
+    }
+
+    return false;
+}
+
+inline void
+mipmapDescribeParams(OFX::ImageEffectDescriptor &desc,
+                     OFX::PageParamDescriptor *page)
+{
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamMipMap);
+        param->setLabel(kParamMipMapLabel);
+        param->setHint(kParamMipMapHint);
+        param->setDefault(false);
+        param->setAnimates(true);
+        param->setLayoutHint(OFX::eLayoutHintNoNewLine, 1);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::ChoiceParamDescriptor* param = desc.defineChoiceParam(kParamMipMapPrefilter);
+        param->setLabel(kParamMipMapPrefilterLabel);
+        param->setHint(kParamMipMapPrefilterHint);
+        assert(param->getNOptions() == eMipMapPrefilterBox);
+        param->appendOption(kParamMipMapPrefilterOptionBox, kParamMipMapPrefilterOptionBoxHint);
+        assert(param->getNOptions() == eMipMapPrefilterLanczos);
+        param->appendOption(kParamMipMapPrefilterOptionLanczos, kParamMipMapPrefilterOptionLanczosHint);
+        param->setDefault((int)eMipMapPrefilterBox);
+        param->setAnimates(true);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+}
+
+} // namespace OFX
+
+#endif // Misc_MipMap_h
@@ -0,0 +1,63 @@
+/* ***** BEGIN LICENSE BLOCK *****
+ * This file is part of openfx-misc <https://github.com/devernay/openfx-misc>,
+ * Copyright (C) 2015 INRIA
+ *
+ * openfx-misc is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * openfx-misc is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with openfx-misc.  If not, see <http://www.gnu.org/licenses/gpl-2.0.html>
+ * ***** END LICENSE BLOCK ***** */
+
+//
+//  SourceTransform.h
+//
+//  Concatenation of the transform attached to a source image (kFnOfxImageEffectCanTransform) with the
+//  inverse transform of a plugin that renders its own resampling.
+//
+
+#ifndef Misc_SourceTransform_h
+#define Misc_SourceTransform_h
+
+#include "ofxsImageEffect.h"
+#include "ofxsMatrix2D.h"
+
+/* Compose invtransform, the transform from destination pixels to source pixels, with the inverse of the transform
+   attached to src, if any, so that it gives the pixel coordinates in src.
+   Returns false if the attached transform is not invertible, in which case invtransform is left unchanged. */
+inline bool
+sourceInverseTransform(const OFX::Image &src,
+                       OFX::Matrix3x3 *invtransform)
+{
+    if (src.getTransformIsIdentity()) {
+        return true;
+    }
+    double srcTransform[9]; // transform to apply to the source image, in pixel coordinates, from source to destination
+    src.getTransform(srcTransform);
+    OFX::Matrix3x3 srcTransformMat;
+    srcTransformMat.a = srcTransform[0];
+    srcTransformMat.b = srcTransform[1];
+    srcTransformMat.c = srcTransform[2];
+    srcTransformMat.d = srcTransform[3];
+    srcTransformMat.e = srcTransform[4];
+    srcTransformMat.f = srcTransform[5];
+    srcTransformMat.g = srcTransform[6];
+    srcTransformMat.h = srcTransform[7];
+    srcTransformMat.i = srcTransform[8];
+    const double det = srcTransformMat.determinant();
+    if (det == 0.) {
+        return false;
+    }
+    *invtransform = srcTransformMat.inverse(det) * (*invtransform);
+
+    return true;
+}
+
+#endif // Misc_SourceTransform_h
@@ -23,6 +23,7 @@
 #include <cmath>
 #include <iostream>
 #include <limits>
+#include <vector>
 #include <algorithm>
 #ifdef _WINDOWS
 #include <windows.h>
@@ -32,6 +33,10 @@
 #include "ofxsTransformInteract.h"
 #include "ofxsFormatResolution.h"
 #include "ofxsCoords.h"
+#include "ofxsMultiThread.h"
+
+#include "MipMap.h"
+#include "SourceTransform.h"
 
 using namespace OFX;
 
@@ -42,8 +47,12 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDescription "Convert the image to another format or size\n"\
 "This plugin concatenates transforms."
 #define kPluginIdentifier "net.sf.openfx.Reformat"
+// History:
+// version 1.0: initial version
+// version 1.1: optional separable resampling when the transform is a scale and a translation
+// version 1.2: optional pyramid resampling for large minifications
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kParamType "reformatType"
 #define kParamTypeLabel "Type"
@@ -138,10 +147,303 @@ enum ResizeEnum
 "Normally, all pixels outside of the outside format are clipped off. If this is checked, the whole image RoD is kept.\n" \
 "By default, transforms are only concatenated upstream, i.e. the image is rendered by this effect by concatenating upstream transforms (e.g. CornerPin, Transform...), and the original image is resampled only once. If checked, and there are concatenating transform effects downstream, the image is rendered by the last consecutive concatenating effect."
 
+#define kParamSeparable "separable"
+#define kParamSeparableLabel "Separable Filter"
+#define kParamSeparableHint \
+"When the transform is a scale and a translation (no Turn), resample the rows and then the columns, which is faster, especially for large minifications. " \
+"The filter weights are not computed exactly as when this is unchecked, so the result may differ slightly, mostly when the image is shrunk."
+
 
 static bool gHostCanTransform;
 static bool gHostIsNatron = false;
 
+// number of destination lines resampled at once by each thread of the separable resampler
+#define kSeparableBandLines 64
+
+////////////////////////////////////////////////////////////////////////////////
+// Separable resampling.
+// When the transform has no rotation, no skew and no perspective (To Format, To Box or Scale, without Turn),
+// each destination pixel is a weighted sum of the source pixels in a rectangle, and the weights are the product
+// of a horizontal and a vertical weight. The image is resampled horizontally into a float buffer, and then
+// vertically: the weights are computed once per column and once per line.
+
+// support (half-width) of the filter, in source pixels, before minification
+static double
+separableFilterSupport(FilterEnum filter)
+{
+    switch (filter) {
+        case eFilterImpulse:
+            return 0.5;
+        case eFilterBilinear:
+        case eFilterCubic:
+            return 1.;
+        default:
+            return 2.;
+    }
+}
+
+// the filter kernel at distance x from the sample.
+// The cubic filters are the Mitchell-Netravali cubics with parameters (B,C), which are used by ofxsFilter.h:
+// Cubic (0,0), Keys (0,1/2), Simon (0,3/4), Rifman (0,1), Mitchell (1/3,1/3), Parzen (1,0), Notch (3/2,-1/4).
+static double
+separableFilterKernel(FilterEnum filter, double x)
+{
+    double B = 0., C = 0.;
+    switch (filter) {
+        case eFilterImpulse:
+            return (-0.5 <= x && x < 0.5) ? 1. : 0.;
+        case eFilterBilinear:
+            x = std::abs(x);
+            return x < 1. ? 1. - x : 0.;
+        case eFilterCubic:
+            break;
+        case eFilterKeys:
+            C = 0.5;
+            break;
+        case eFilterSimon:
+            C = 0.75;
+            break;
+        case eFilterRifman:
+            C = 1.;
+            break;
+        case eFilterMitchell:
+            B = 1. / 3.;
+            C = 1. / 3.;
+            break;
+        case eFilterParzen:
+            B = 1.;
+            break;
+        case eFilterNotch:
+            B = 1.5;
+            C = -0.25;
+            break;
+    }
+    x = std::abs(x);
+    if (x < 1.) {
+        return ((12. - 9. * B - 6. * C) * x * x * x + (-18. + 12. * B + 6. * C) * x * x + (6. - 2. * B)) / 6.;
+    } else if (x < 2.) {
+        return ((-B - 6. * C) * x * x * x + (6. * B + 30. * C) * x * x + (-12. * B - 48. * C) * x + (8. * B + 24. * C)) / 6.;
+    }
+
+    return 0.;
+}
+
+// The source pixels and weights of each destination pixel, along one axis.
+// The destination pixel i is centered at scale*(i+0.5)+offset in source pixel coordinates.
+struct SeparableAxisWeights
+{
+    int taps; // number of source pixels per destination pixel
+    std::vector<int> index; // taps source pixel indices per destination pixel, relative to src1, within the source bounds
+    std::vector<float> weight; // taps weights per destination pixel
+
+    SeparableAxisWeights()
+    : taps(0)
+    , index()
+    , weight()
+    {
+    }
+
+    void compute(FilterEnum filter,
+                 bool blackOutside,
+                 double scale,
+                 double offset,
+                 int dst1,
+                 int dst2,
+                 int src1,
+                 int src2)
+    {
+        assert(dst1 < dst2 && src1 < src2);
+        // when minifying, the filter is stretched to the size of a destination pixel
+        const double stretch = (filter == eFilterImpulse) ? 1. : std::max(1., std::abs(scale));
+        const double support = separableFilterSupport(filter) * stretch;
+        taps = (filter == eFilterImpulse) ? 1 : (int)std::ceil(2 * support);
+        index.resize((size_t)(dst2 - dst1) * taps);
+        weight.resize((size_t)(dst2 - dst1) * taps);
+        for (int i = dst1; i < dst2; ++i) {
+            const double u = scale * (i + 0.5) + offset;
+            int *idx = &index[(size_t)(i - dst1) * taps];
+            float *w = &weight[(size_t)(i - dst1) * taps];
+            // the first source pixel whose center is within the support
+            const int j0 = (filter == eFilterImpulse) ? (int)std::floor(u) : (int)std::floor(u - 0.5 - support) + 1;
+            double sum = 0.;
+            for (int k = 0; k < taps; ++k) {
+                const double wk = (filter == eFilterImpulse) ? 1. : separableFilterKernel(filter, (j0 + k + 0.5 - u) / stretch);
+                w[k] = (float)wk;
+                sum += wk;
+            }
+            for (int k = 0; k < taps; ++k) {
+                const int j = j0 + k;
+                if (sum != 0.) {
+                    w[k] = (float)(w[k] / sum);
+                }
+                if (j < src1 || src2 <= j) {
+                    // outside of the source image: either black, or the nearest edge pixel
+                    if (blackOutside) {
+                        w[k] = 0.f;
+                    }
+                    idx[k] = std::max(src1, std::min(j, src2 - 1)) - src1;
+                } else {
+                    idx[k] = j - src1;
+                }
+            }
+        }
+    }
+};
+
+template <class PIX, int nComponents, int maxValue, bool clamp>
+class SeparableResampler : public OFX::MultiThread::Processor
+{
+public:
+    SeparableResampler(OFX::ImageEffect &effect,
+                       const OFX::Image *src,
+                       OFX::Image *dst,
+                       const OfxRectI &renderWindow,
+                       const SeparableAxisWeights &xWeights,
+                       const SeparableAxisWeights &yWeights)
+    : _effect(effect)
+    , _src(src)
+    , _dst(dst)
+    , _renderWindow(renderWindow)
+    , _xWeights(xWeights)
+    , _yWeights(yWeights)
+    {
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        // each thread processes a contiguous range of lines, by bands of kSeparableBandLines lines
+        const int h = _renderWindow.y2 - _renderWindow.y1;
+        const int y1 = _renderWindow.y1 + (int)(((long long)h * threadId) / nThreads);
+        const int y2 = _renderWindow.y1 + (int)(((long long)h * (threadId + 1)) / nThreads);
+        std::vector<float> lines; // the horizontally resampled source lines
+        std::vector<float> acc(nComponents * (_renderWindow.x2 - _renderWindow.x1));
+        for (int band1 = y1; band1 < y2; band1 += kSeparableBandLines) {
+            if (_effect.abort()) {
+                return;
+            }
+            const int band2 = std::min(y2, band1 + kSeparableBandLines);
+            processBand(band1, band2, lines, acc);
+        }
+    }
+
+    void processBand(int band1, int band2, std::vector<float> &lines, std::vector<float> &acc)
+    {
+        const OfxRectI &srcBounds = _src->getBounds();
+        const int dw = _renderWindow.x2 - _renderWindow.x1;
+        const int xTaps = _xWeights.taps;
+        const int yTaps = _yWeights.taps;
+        // the source lines used by this band
+        const int *yIndex = &_yWeights.index[(size_t)(band1 - _renderWindow.y1) * yTaps];
+        const int *yIndexEnd = &_yWeights.index[0] + (size_t)(band2 - _renderWindow.y1) * yTaps;
+        const int line1 = *std::min_element(yIndex, yIndexEnd);
+        const int line2 = *std::max_element(yIndex, yIndexEnd) + 1;
+        lines.resize((size_t)(line2 - line1) * dw * nComponents);
+        // when minifying, some lines between line1 and line2 may not be used
+        std::vector<bool> used(line2 - line1, false);
+        for (int y = band1; y < band2; ++y) {
+            for (int k = 0; k < yTaps; ++k) {
+                const size_t i = (size_t)(y - _renderWindow.y1) * yTaps + k;
+                if (_yWeights.weight[i] != 0.f) {
+                    used[_yWeights.index[i] - line1] = true;
+                }
+            }
+        }
+
+        // horizontal pass
+        for (int l = line1; l < line2; ++l) {
+            if (!used[l - line1]) {
+                continue;
+            }
+            const PIX *srcPix = (const PIX *)_src->getPixelAddress(srcBounds.x1, srcBounds.y1 + l);
+            float *linePix = &lines[(size_t)(l - line1) * dw * nComponents];
+            assert(srcPix);
+            const int *xIndex = &_xWeights.index[0];
+            const float *xWeight = &_xWeights.weight[0];
+            for (int x = 0; x < dw; ++x, xIndex += xTaps, xWeight += xTaps, linePix += nComponents) {
+                float tmpPix[nComponents];
+                for (int c = 0; c < nComponents; ++c) {
+                    tmpPix[c] = 0.f;
+                }
+                for (int k = 0; k < xTaps; ++k) {
+                    const PIX *pix = srcPix + xIndex[k] * nComponents;
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] += xWeight[k] * pix[c];
+                    }
+                }
+                if (clamp) {
+                    // clamp to the range of the source pixels
+                    float pmin[nComponents], pmax[nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        pmin[c] = std::numeric_limits<float>::max();
+                        pmax[c] = -std::numeric_limits<float>::max();
+                    }
+                    for (int k = 0; k < xTaps; ++k) {
+                        if (xWeight[k] != 0.f) {
+                            const PIX *pix = srcPix + xIndex[k] * nComponents;
+                            for (int c = 0; c < nComponents; ++c) {
+                                pmin[c] = std::min(pmin[c], (float)pix[c]);
+                                pmax[c] = std::max(pmax[c], (float)pix[c]);
+                            }
+                        }
+                    }
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] = std::max(pmin[c], std::min(tmpPix[c], pmax[c]));
+                    }
+                }
+                for (int c = 0; c < nComponents; ++c) {
+                    linePix[c] = tmpPix[c];
+                }
+            }
+        }
+
+        // vertical pass
+        const int n = dw * nComponents;
+        for (int y = band1; y < band2; ++y) {
+            const int *idx = &_yWeights.index[(size_t)(y - _renderWindow.y1) * yTaps];
+            const float *w = &_yWeights.weight[(size_t)(y - _renderWindow.y1) * yTaps];
+            std::fill(acc.begin(), acc.end(), 0.f);
+            for (int k = 0; k < yTaps; ++k) {
+                if (w[k] == 0.f) {
+                    continue;
+                }
+                const float wk = w[k];
+                const float *linePix = &lines[(size_t)(idx[k] - line1) * n];
+                float *accPix = &acc[0];
+                for (int i = 0; i < n; ++i) {
+                    accPix[i] += wk * linePix[i];
+                }
+            }
+            if (clamp) {
+                for (int i = 0; i < n; ++i) {
+                    float pmin = std::numeric_limits<float>::max();
+                    float pmax = -std::numeric_limits<float>::max();
+                    for (int k = 0; k < yTaps; ++k) {
+                        if (w[k] != 0.f) {
+                            const float v = lines[(size_t)(idx[k] - line1) * n + i];
+                            pmin = std::min(pmin, v);
+                            pmax = std::max(pmax, v);
+                        }
+                    }
+                    acc[i] = std::max(pmin, std::min(acc[i], pmax));
+                }
+            }
+            PIX *dstPix = (PIX *)_dst->getPixelAddress(_renderWindow.x1, y);
+            assert(dstPix);
+            for (int i = 0; i < n; ++i) {
+                dstPix[i] = ofxsClampIfInt<PIX, maxValue>(acc[i], 0, maxValue);
+            }
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_src;
+    OFX::Image *_dst;
+    OfxRectI _renderWindow;
+    const SeparableAxisWeights &_xWeights;
+    const SeparableAxisWeights &_yWeights;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class ReformatPlugin : public Transform3x3Plugin
@@ -163,6 +465,10 @@ public:
     , _flip(0)
     , _flop(0)
     , _turn(0)
+    , _separable(0)
+    , _mipmap(0)
+    , _mipmapPrefilter(0)
+    , _mipmapCache()
     {
         
         _filter = fetchChoiceParam(kParamFilterType);
@@ -184,6 +490,11 @@ public:
         _flop = fetchBooleanParam(kParamFlop);
         _turn = fetchBooleanParam(kParamTurn);
         assert(_type && _format && _boxSize && _boxFixed && _boxPAR && _scale && _scaleUniform && _preserveBB && _resize && _center && _flip && _flop && _turn);
+        _separable = fetchBooleanParam(kParamSeparable);
+        assert(_separable);
+        _mipmap = fetchBooleanParam(kParamMipMap);
+        _mipmapPrefilter = fetchChoiceParam(kParamMipMapPrefilter);
+        assert(_mipmap && _mipmapPrefilter);
 
         _boxSize_saved = _boxSize->getValue();
         _boxPAR_saved = _boxPAR->getValue();
@@ -240,6 +551,8 @@ public:
 private:
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
 
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
     virtual bool isIdentity(double time) OVERRIDE FINAL;
 
     virtual bool getInverseTransformCanonical(double time, int view, double amount, bool invert, OFX::Matrix3x3* invtransform) const OVERRIDE FINAL;
@@ -247,6 +560,20 @@ private:
     virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
     virtual void getClipPreferences(OFX::ClipPreferencesSetter &clipPreferences) OVERRIDE FINAL;
+
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    /* pyramid render, which returns false if the image is not minified by at least 2 */
+    bool renderPyramid(const OFX::RenderArguments &args);
+
+    /* separable render functions, which return false if the transform is not a scale and a translation */
+    template <class PIX, int nComponents, int maxValue>
+    bool renderSeparableForBitDepth(const OFX::RenderArguments &args);
+
+    template <int nComponents>
+    bool renderSeparable(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
     
     void refreshVisibility();
     
@@ -269,6 +596,11 @@ private:
     OFX::BooleanParam* _flip;
     OFX::BooleanParam* _flop;
     OFX::BooleanParam* _turn;
+    OFX::BooleanParam* _separable;
+    OFX::BooleanParam* _mipmap;
+    OFX::ChoiceParam* _mipmapPrefilter;
+
+    MipMapCache _mipmapCache;
 
     // saved values for user-specified box
     OfxPointI _boxSize_saved;
@@ -354,6 +686,32 @@ ReformatPlugin::getRegionOfDefinition(const RegionOfDefinitionArguments &args,
     return true;
 }
 
+// override the roi call
+void
+ReformatPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                     OFX::RegionOfInterestSetter &rois)
+{
+    Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+    const double time = args.time;
+    if (!_srcClip || !_srcClip->isConnected() || !_mipmap->getValueAtTime(time)) {
+        return;
+    }
+    // The pyramid is computed from the whole source image, so that all the tiles of the frame can share it.
+    OFX::Matrix3x3 invtransform;
+    if (!getInverseTransformCanonical(time, 0, 1., false, &invtransform) ||
+        mipmapMaxLod(invtransform, args.regionOfInterest) < 1.) {
+        return;
+    }
+    OfxRectD srcRoD = _srcClip->getRegionOfDefinition(time);
+    if (srcRoD.x1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= srcRoD.x2 ||
+        srcRoD.y1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= srcRoD.y2 ||
+        Coords::rectIsEmpty(srcRoD)) {
+        return;
+    }
+    rois.setRegionOfInterest(*_srcClip, srcRoD);
+}
+
 // overridden is identity
 bool
 ReformatPlugin::isIdentity(const double time)
@@ -539,6 +897,171 @@ ReformatPlugin::getInverseTransformCanonical(const double time,
     return true;
 }
 
+template <class PIX, int nComponents, int maxValue>
+bool
+ReformatPlugin::renderSeparableForBitDepth(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    if (_maskClip && _maskClip->isConnected()) {
+        return false;
+    }
+    std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(time) : 0);
+    if (!src.get() ||
+        src->getPixelDepth() != dst->getPixelDepth() ||
+        src->getPixelComponents() != dst->getPixelComponents()) {
+        return false;
+    }
+
+    // the transform from destination pixels to source pixels
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    OFX::Matrix3x3 invtransform;
+    if (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, src->getPixelAspectRatio(), dst->getPixelAspectRatio(), false, 0., 1., &invtransform, 0, 1) != 1) {
+        return false;
+    }
+    // compose with the input transform
+    if (!sourceInverseTransform(*src, &invtransform)) {
+        return false;
+    }
+    if (invtransform.b != 0. || invtransform.d != 0. ||
+        invtransform.g != 0. || invtransform.h != 0. || invtransform.i == 0. ||
+        invtransform.a == 0. || invtransform.e == 0.) {
+        // rotation, skew or perspective: use the generic Transform3x3 render
+        return false;
+    }
+
+    FilterEnum filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && _filter) {
+        filter = (FilterEnum)_filter->getValueAtTime(time);
+    }
+    bool clamp = false;
+    if (_clamp) {
+        clamp = _clamp->getValueAtTime(time);
+    }
+    bool blackOutside = false;
+    if (_blackOutside) {
+        blackOutside = _blackOutside->getValueAtTime(time);
+    }
+
+    const OfxRectI &renderWindow = args.renderWindow;
+    const OfxRectI &srcBounds = src->getBounds();
+    if (Coords::rectIsEmpty(renderWindow) || Coords::rectIsEmpty(srcBounds)) {
+        return false;
+    }
+    SeparableAxisWeights xWeights;
+    SeparableAxisWeights yWeights;
+    xWeights.compute(filter, blackOutside, invtransform.a / invtransform.i, invtransform.c / invtransform.i,
+                     renderWindow.x1, renderWindow.x2, srcBounds.x1, srcBounds.x2);
+    yWeights.compute(filter, blackOutside, invtransform.e / invtransform.i, invtransform.f / invtransform.i,
+                     renderWindow.y1, renderWindow.y2, srcBounds.y1, srcBounds.y2);
+
+    // as in the generic render, only the filters with negative lobes need explicit clamping
+    const unsigned int nThreads = std::max(1u, std::min((unsigned int)(renderWindow.y2 - renderWindow.y1), OFX::MultiThread::getNumCPUs()));
+    if (clamp && (filter == eFilterKeys || filter == eFilterSimon || filter == eFilterRifman || filter == eFilterMitchell)) {
+        SeparableResampler<PIX, nComponents, maxValue, true> resampler(*this, src.get(), dst.get(), renderWindow, xWeights, yWeights);
+        resampler.multiThread(nThreads);
+    } else {
+        SeparableResampler<PIX, nComponents, maxValue, false> resampler(*this, src.get(), dst.get(), renderWindow, xWeights, yWeights);
+        resampler.multiThread(nThreads);
+    }
+
+    return true;
+}
+
+bool
+ReformatPlugin::renderPyramid(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    if (!_srcClip || !_srcClip->isConnected()) {
+        return false;
+    }
+
+    // the transform from destination pixels to source pixels
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    OFX::Matrix3x3 invtransform;
+    if (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, _srcClip->getPixelAspectRatio(), _dstClip->getPixelAspectRatio(), false, 0., 1., &invtransform, 0, 1) != 1) {
+        return false;
+    }
+
+    FilterEnum filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && _filter) {
+        filter = (FilterEnum)_filter->getValueAtTime(time);
+    }
+    bool clamp = false;
+    if (_clamp) {
+        clamp = _clamp->getValueAtTime(time);
+    }
+    bool blackOutside = false;
+    if (_blackOutside) {
+        blackOutside = _blackOutside->getValueAtTime(time);
+    }
+    MipMapPrefilterEnum prefilter = (MipMapPrefilterEnum)_mipmapPrefilter->getValueAtTime(time);
+
+    return mipmapRender(*this, _mipmapCache, args, _srcClip, _dstClip, 0, false,
+                        invtransform, prefilter, filter, clamp, blackOutside, 1.);
+}
+
+template <int nComponents>
+bool
+ReformatPlugin::renderSeparable(const OFX::RenderArguments &args,
+                                OFX::BitDepthEnum dstBitDepth)
+{
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte:
+            return renderSeparableForBitDepth<unsigned char, nComponents, 255>(args);
+        case OFX::eBitDepthUShort:
+            return renderSeparableForBitDepth<unsigned short, nComponents, 65535>(args);
+        case OFX::eBitDepthFloat:
+            return renderSeparableForBitDepth<float, nComponents, 1>(args);
+        default:
+            return false;
+    }
+}
+
+// the overridden render function
+void
+ReformatPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+
+    bool rendered = false;
+    if (_mipmap->getValueAtTime(args.time)) {
+        rendered = renderPyramid(args);
+    }
+    if (!rendered && _separable->getValueAtTime(args.time)) {
+        if (dstComponents == OFX::ePixelComponentRGBA) {
+            rendered = renderSeparable<4>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentRGB) {
+            rendered = renderSeparable<3>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentXY) {
+            rendered = renderSeparable<2>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentAlpha) {
+            rendered = renderSeparable<1>(args, dstBitDepth);
+        }
+    }
+    if (!rendered) {
+        Transform3x3Plugin::render(args);
+    }
+}
+
+/** @brief free the pyramids that are not used by a render */
+void
+ReformatPlugin::purgeCaches()
+{
+    _mipmapCache.purge();
+}
+
 void ReformatPlugin::setBoxValues(const double time)
 {
     ReformatTypeEnum type = (ReformatTypeEnum)_type->getValue();
@@ -944,6 +1467,21 @@ void ReformatPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
 
     // clamp, filter, black outside
     ofxsFilterDescribeParamsInterpolate2D(desc, page, /*blackOutsideDefault*/false);
+
+    // separable
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSeparable);
+        param->setLabel(kParamSeparableLabel);
+        param->setHint(kParamSeparableHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
+    // pyramid
+    mipmapDescribeParams(desc, page);
 }
 
 OFX::ImageEffect* ReformatPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
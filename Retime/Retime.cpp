@@ -26,13 +26,15 @@
  - propose a "timewarp" curve (as ParametricParam)
  - selection of the integration filter (box or nearest) and shutter time
  - handle fielded input correctly
- 
- - retiming based on optical flow computation will be done separately
  */
 
 #include <cmath> // for floor
 #include <cfloat> // for FLT_MAX
+#include <cstdlib> // for abs
 #include <cassert>
+#include <algorithm>
+#include <list>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -40,6 +42,8 @@
 #include "ofxsProcessing.H"
 #include "ofxsImageBlender.H"
 #include "ofxsCopier.h"
+#include "ofxsCoords.h"
+#include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
 
 using namespace OFX;
@@ -50,8 +54,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping "Time"
 #define kPluginDescription "Change the timing of the input clip."
 #define kPluginIdentifier "net.sf.openfx.Retime"
+// version 1.1: motion-compensated interpolation
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -82,6 +87,8 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamFilterOptionNearestHint "Pick input image with nearest integer time."
 #define kParamFilterOptionLinear "Linear"
 #define kParamFilterOptionLinearHint "Blend the two nearest images with linear interpolation."
+#define kParamFilterOptionMotion "Motion"
+#define kParamFilterOptionMotionHint "Estimate the motion between the two nearest images, and blend them after moving their content to the output time. Regions where the motion vectors from both images do not agree (occlusions) are mostly taken from the image where they are visible."
 // TODO:
 #define kParamFilterOptionBox "Box"
 #define kParamFilterOptionBoxHint "Weighted average of images over the shutter time (shutter time is defined in the output sequence)." // requires shutter parameter
@@ -90,10 +97,28 @@ enum FilterEnum {
     eFilterNone,
     eFilterNearest,
     eFilterLinear,
+    eFilterMotion,
     //eFilterBox,
 };
 #define kParamFilterDefault eFilterLinear
 
+#define kParamMotionBlockSize "motionBlockSize"
+#define kParamMotionBlockSizeLabel "Block Size"
+#define kParamMotionBlockSizeHint "Size in pixels of the blocks used to estimate the motion vectors (Motion filter only). Large blocks give smoother and more reliable vectors, small blocks follow small moving objects better."
+#define kParamMotionBlockSizeDefault 16
+
+#define kParamMotionMax "motionMax"
+#define kParamMotionMaxLabel "Max Motion"
+#define kParamMotionMaxHint "Largest displacement in pixels between two consecutive input images that can be detected (Motion filter only). Larger values are slower, and need a larger region of the input images."
+#define kParamMotionMaxDefault 64
+
+#define kMotionBlockSizeMin 4 // smallest block size (in pixels), when rendering at a lower scale
+#define kMotionSearchRadius 2 // search radius (in pixels) around the predicted vector at each pyramid level
+#define kMotionSearchRadiusCoarse 4 // search radius (in pixels) at the coarsest pyramid level
+#define kMotionMaxSamples 8 // at most kMotionMaxSamples x kMotionMaxSamples pixels are compared for each block
+#define kMotionPenalty 1e-4 // cost of each pixel of motion, so that the smallest vector is picked in uniform areas
+#define kMotionCacheSize 4 // number of motion fields kept for sequential renders
+
 #define kPageTimeWarp "timeWarp"
 #define kPageTimeWarpLabel "Time Warp"
 
@@ -102,6 +127,529 @@ enum FilterEnum {
 #define kParamWarpHint "Curve that maps input range (after applying speed) to the output range. A low positive slope slows down the input clip, and a negative slope plays it backwards."
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Motion estimation
+
+// Motion vectors between two images, estimated on a grid of blocks.
+// Vectors are in pixels at the render scale, and are interpolated between block centers.
+// The grid is anchored at multiples of the block size in pixel coordinates, whatever the render window,
+// so that adjacent tiles use the same blocks.
+struct RetimeMotionField
+{
+    OfxRectI bounds; // pixel region covered by the blocks, aligned on the block grid
+    int blockSize;
+    int nx; // number of blocks along x
+    int ny; // number of blocks along y
+    std::vector<float> forward; // displacement from the first image to the second image (2 values per block)
+    std::vector<float> backward; // displacement from the second image to the first image (2 values per block)
+
+    RetimeMotionField()
+    : blockSize(1)
+    , nx(0)
+    , ny(0)
+    , forward()
+    , backward()
+    {
+        bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
+    }
+
+    // bilinear interpolation of the vectors v at pixel position (x,y)
+    void vectorAt(const std::vector<float>& v, double x, double y, double *dx, double *dy) const
+    {
+        if (nx <= 0 || ny <= 0) {
+            *dx = *dy = 0.;
+
+            return;
+        }
+        // position in the grid of block centers
+        double gx = (x - bounds.x1) / blockSize - 0.5;
+        double gy = (y - bounds.y1) / blockSize - 0.5;
+        gx = std::max(0., std::min(gx, (double)(nx - 1)));
+        gy = std::max(0., std::min(gy, (double)(ny - 1)));
+        int i0 = std::min((int)gx, nx - 1);
+        int j0 = std::min((int)gy, ny - 1);
+        int i1 = std::min(i0 + 1, nx - 1);
+        int j1 = std::min(j0 + 1, ny - 1);
+        double fx = gx - i0;
+        double fy = gy - j0;
+        const float *v00 = &v[2 * (j0 * nx + i0)];
+        const float *v10 = &v[2 * (j0 * nx + i1)];
+        const float *v01 = &v[2 * (j1 * nx + i0)];
+        const float *v11 = &v[2 * (j1 * nx + i1)];
+        *dx = (1 - fy) * ((1 - fx) * v00[0] + fx * v10[0]) + fy * ((1 - fx) * v01[0] + fx * v11[0]);
+        *dy = (1 - fy) * ((1 - fx) * v00[1] + fx * v10[1]) + fy * ((1 - fx) * v01[1] + fx * v11[1]);
+    }
+
+    // distance between the starting point and the point reached after following the vectors v and back with the vectors w.
+    // A large value means that the point at (x,y) is occluded in the other image, or that the motion is unreliable.
+    double inconsistencyAt(const std::vector<float>& v, const std::vector<float>& w, double x, double y) const
+    {
+        double vx, vy, wx, wy;
+        vectorAt(v, x, y, &vx, &vy);
+        vectorAt(w, x + vx, y + vy, &wx, &wy);
+
+        return std::sqrt((vx + wx) * (vx + wx) + (vy + wy) * (vy + wy));
+    }
+};
+
+// Luminance of an image region, used for motion estimation
+struct RetimeLuminance
+{
+    int width;
+    int height;
+    std::vector<float> data;
+
+    RetimeLuminance()
+    : width(0)
+    , height(0)
+    , data()
+    {
+    }
+
+    // value at (x,y), clamped to the image edges
+    float at(int x, int y) const
+    {
+        x = std::max(0, std::min(x, width - 1));
+        y = std::max(0, std::min(y, height - 1));
+
+        return data[(size_t)y * width + x];
+    }
+
+    // box-filtered image at half resolution
+    void downsample(RetimeLuminance *dst) const
+    {
+        dst->width = (width + 1) / 2;
+        dst->height = (height + 1) / 2;
+        dst->data.resize((size_t)dst->width * dst->height);
+        for (int y = 0; y < dst->height; ++y) {
+            for (int x = 0; x < dst->width; ++x) {
+                dst->data[(size_t)y * dst->width + x] = 0.25f * (at(2 * x, 2 * y) + at(2 * x + 1, 2 * y) +
+                                                                 at(2 * x, 2 * y + 1) + at(2 * x + 1, 2 * y + 1));
+            }
+        }
+    }
+};
+
+// Estimates the vectors of all blocks at one level of the image pyramids, by block matching around predicted vectors.
+// The predicted vectors are the ones of the block and of its neighbours at the previous (coarser) level.
+// Vectors are always stored in pixels at the finest level.
+class RetimeBlockMatcher : public OFX::MultiThread::Processor
+{
+public:
+    RetimeBlockMatcher(OFX::ImageEffect &effect,
+                       const RetimeLuminance &src,
+                       const RetimeLuminance &dst,
+                       int level,
+                       int blockSize,
+                       int nx,
+                       int ny,
+                       int radius,
+                       const std::vector<float> &predicted,
+                       std::vector<float> *vectors)
+    : _effect(effect)
+    , _src(src)
+    , _dst(dst)
+    , _level(level)
+    , _blockSize(blockSize)
+    , _step(std::max(1, blockSize / kMotionMaxSamples))
+    , _nx(nx)
+    , _ny(ny)
+    , _radius(radius)
+    , _predicted(predicted)
+    , _vectors(*vectors)
+    {
+        assert((int)_predicted.size() == 2 * nx * ny && (int)_vectors.size() == 2 * nx * ny);
+    }
+
+private:
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        // each thread processes a set of block rows
+        for (int j = (int)threadId; j < _ny; j += (int)nThreads) {
+            if (_effect.abort()) {
+                return;
+            }
+            for (int i = 0; i < _nx; ++i) {
+                matchBlock(i, j);
+            }
+        }
+    }
+
+    // mean absolute difference between the block centered at (cx,cy) in src and the block displaced by (vx,vy) in dst
+    double difference(int cx, int cy, int vx, int vy) const
+    {
+        const int half = _blockSize / 2;
+        double sum = 0.;
+        int n = 0;
+        for (int y = cy - half; y < cy + half; y += _step) {
+            for (int x = cx - half; x < cx + half; x += _step) {
+                sum += std::abs(_src.at(x, y) - _dst.at(x + vx, y + vy));
+                ++n;
+            }
+        }
+
+        return n ? sum / n : 0.;
+    }
+
+    double cost(int cx, int cy, int vx, int vy) const
+    {
+        return difference(cx, cy, vx, vy) + kMotionPenalty * (std::abs(vx) + std::abs(vy)) * (1 << _level);
+    }
+
+    void matchBlock(int i, int j)
+    {
+        const double scale = 1. / (1 << _level);
+        // block center at this level
+        const int cx = (int)std::floor((i + 0.5) * _blockSize * scale);
+        const int cy = (int)std::floor((j + 0.5) * _blockSize * scale);
+
+        // best predicted vector
+        int bestx = 0;
+        int besty = 0;
+        double best = cost(cx, cy, 0, 0);
+        const int neighbours[5][2] = { {0, 0}, {-1, 0}, {1, 0}, {0, -1}, {0, 1} };
+        for (int n = 0; n < 5; ++n) {
+            int ni = i + neighbours[n][0];
+            int nj = j + neighbours[n][1];
+            if (ni < 0 || ni >= _nx || nj < 0 || nj >= _ny) {
+                continue;
+            }
+            const float *p = &_predicted[2 * (nj * _nx + ni)];
+            int vx = (int)std::floor(p[0] * scale + 0.5);
+            int vy = (int)std::floor(p[1] * scale + 0.5);
+            double c = cost(cx, cy, vx, vy);
+            if (c < best) {
+                best = c;
+                bestx = vx;
+                besty = vy;
+            }
+        }
+
+        // search around it
+        const int px = bestx;
+        const int py = besty;
+        for (int dy = -_radius; dy <= _radius; ++dy) {
+            for (int dx = -_radius; dx <= _radius; ++dx) {
+                if (dx == 0 && dy == 0) {
+                    continue;
+                }
+                double c = cost(cx, cy, px + dx, py + dy);
+                if (c < best) {
+                    best = c;
+                    bestx = px + dx;
+                    besty = py + dy;
+                }
+            }
+        }
+
+        double vx = bestx;
+        double vy = besty;
+        if (_level == 0) {
+            // sub-pixel refinement, by fitting a parabola to the costs around the best vector
+            double c0 = difference(cx, cy, bestx, besty);
+            double cl = difference(cx, cy, bestx - 1, besty);
+            double cr = difference(cx, cy, bestx + 1, besty);
+            double cb = difference(cx, cy, bestx, besty - 1);
+            double ct = difference(cx, cy, bestx, besty + 1);
+            double denx = cl - 2 * c0 + cr;
+            double deny = cb - 2 * c0 + ct;
+            if (denx > 0.) {
+                vx += std::max(-0.5, std::min(0.5 * (cl - cr) / denx, 0.5));
+            }
+            if (deny > 0.) {
+                vy += std::max(-0.5, std::min(0.5 * (cb - ct) / deny, 0.5));
+            }
+        }
+        float *v = &_vectors[2 * (j * _nx + i)];
+        v[0] = (float)(vx / scale);
+        v[1] = (float)(vy / scale);
+    }
+
+    OFX::ImageEffect &_effect;
+    const RetimeLuminance &_src;
+    const RetimeLuminance &_dst;
+    int _level;
+    int _blockSize;
+    int _step;
+    int _nx;
+    int _ny;
+    int _radius;
+    const std::vector<float> &_predicted;
+    std::vector<float> &_vectors;
+};
+
+// 3x3 median filter on each component of the vectors, to remove isolated wrong vectors
+static void
+medianFilterVectors(int nx,
+                    int ny,
+                    std::vector<float> *vectors)
+{
+    std::vector<float> src(*vectors);
+    float window[9];
+    for (int j = 0; j < ny; ++j) {
+        for (int i = 0; i < nx; ++i) {
+            for (int c = 0; c < 2; ++c) {
+                int n = 0;
+                for (int nj = std::max(0, j - 1); nj <= std::min(ny - 1, j + 1); ++nj) {
+                    for (int ni = std::max(0, i - 1); ni <= std::min(nx - 1, i + 1); ++ni) {
+                        window[n++] = src[2 * (nj * nx + ni) + c];
+                    }
+                }
+                std::nth_element(window, window + n / 2, window + n);
+                (*vectors)[2 * (j * nx + i) + c] = window[n / 2];
+            }
+        }
+    }
+}
+
+// Estimate the motion vectors from src to dst, by hierarchical block matching:
+// the vectors found at each level of the image pyramids predict the vectors at the next finer level,
+// which are refined by a small search.
+static void
+estimateMotionVectors(OFX::ImageEffect &effect,
+                      const std::vector<RetimeLuminance> &srcPyramid,
+                      const std::vector<RetimeLuminance> &dstPyramid,
+                      int blockSize,
+                      int nx,
+                      int ny,
+                      std::vector<float> *vectors)
+{
+    assert(!srcPyramid.empty() && srcPyramid.size() == dstPyramid.size());
+    const int levels = (int)srcPyramid.size();
+    std::vector<float> predicted(2 * nx * ny, 0.f);
+    vectors->assign(2 * nx * ny, 0.f);
+    const unsigned int nThreads = std::max(1u, std::min((unsigned int)ny, OFX::MultiThread::getNumCPUs()));
+    for (int level = levels - 1; level >= 0; --level) {
+        if (effect.abort()) {
+            return;
+        }
+        RetimeBlockMatcher matcher(effect, srcPyramid[level], dstPyramid[level], level, blockSize, nx, ny,
+                                   (level == levels - 1) ? kMotionSearchRadiusCoarse : kMotionSearchRadius,
+                                   predicted, vectors);
+        matcher.multiThread(nThreads);
+        predicted = *vectors;
+    }
+    medianFilterVectors(nx, ny, vectors);
+}
+
+// number of pyramid levels necessary to detect the largest motion.
+// It does not depend on the image size, so that all the tiles of an image use the same pyramids.
+static int
+motionLevels(int maxMotion)
+{
+    int levels = 1;
+    while ((kMotionSearchRadiusCoarse << (levels - 1)) < maxMotion) {
+        ++levels;
+    }
+
+    return levels;
+}
+
+// alignment (in pixels) of the motion bounds: the blocks must be at the same place in all tiles,
+// and the pixels must be grouped the same way when downsampling the pyramids
+static int
+motionAlignment(int blockSize,
+                int levels)
+{
+    // least common multiple of the block size and of the size of a pixel at the coarsest level, which is a power of 2
+    int align = blockSize;
+    while (align % (1 << (levels - 1)) != 0) {
+        align *= 2;
+    }
+
+    return align;
+}
+
+// Estimate the forward and backward motion between two images, given their luminance over the motion bounds.
+static void
+estimateMotion(OFX::ImageEffect &effect,
+               const RetimeLuminance &from,
+               const RetimeLuminance &to,
+               int levels,
+               RetimeMotionField *motion)
+{
+    const int blockSize = motion->blockSize;
+    motion->nx = (from.width + blockSize - 1) / blockSize;
+    motion->ny = (from.height + blockSize - 1) / blockSize;
+    if (motion->nx <= 0 || motion->ny <= 0) {
+        motion->nx = motion->ny = 0;
+
+        return;
+    }
+
+    std::vector<RetimeLuminance> fromPyramid(levels);
+    std::vector<RetimeLuminance> toPyramid(levels);
+    fromPyramid[0] = from;
+    toPyramid[0] = to;
+    for (int level = 1; level < levels; ++level) {
+        fromPyramid[level - 1].downsample(&fromPyramid[level]);
+        toPyramid[level - 1].downsample(&toPyramid[level]);
+    }
+
+    estimateMotionVectors(effect, fromPyramid, toPyramid, blockSize, motion->nx, motion->ny, &motion->forward);
+    estimateMotionVectors(effect, toPyramid, fromPyramid, blockSize, motion->nx, motion->ny, &motion->backward);
+}
+
+// A motion field, kept to be reused by the next renders between the same source images
+struct RetimeMotionCacheEntry
+{
+    double fromTime;
+    double toTime;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    int maxMotion;
+    RetimeMotionField motion;
+
+    bool matches(double fromTime_, double toTime_, const OfxPointD& renderScale_, OFX::FieldEnum field_, int maxMotion_, const OfxRectI& bounds, int blockSize) const
+    {
+        return (fromTime == fromTime_ && toTime == toTime_ &&
+                renderScale.x == renderScale_.x && renderScale.y == renderScale_.y &&
+                field == field_ &&
+                maxMotion == maxMotion_ &&
+                motion.blockSize == blockSize &&
+                motion.bounds.x1 == bounds.x1 && motion.bounds.y1 == bounds.y1 &&
+                motion.bounds.x2 == bounds.x2 && motion.bounds.y2 == bounds.y2);
+    }
+};
+
+// Blends two images after moving them to the output time along the motion vectors.
+class RetimeMotionProcessorBase : public OFX::ImageBlenderBase
+{
+protected:
+    const RetimeMotionField *_motion;
+
+public:
+    RetimeMotionProcessorBase(OFX::ImageEffect &instance)
+    : OFX::ImageBlenderBase(instance)
+    , _motion(0)
+    {
+    }
+
+    void setMotion(const RetimeMotionField *v) {_motion = v;}
+
+    // compute the luminance of img over bounds, extending the image edges
+    virtual void getLuminance(const OFX::Image *img, const OfxRectI &bounds, RetimeLuminance *lum) const = 0;
+};
+
+template <class PIX, int nComponents, int maxValue>
+class RetimeMotionProcessor : public RetimeMotionProcessorBase
+{
+public:
+    RetimeMotionProcessor(OFX::ImageEffect &instance)
+    : RetimeMotionProcessorBase(instance)
+    {
+    }
+
+    virtual void getLuminance(const OFX::Image *img, const OfxRectI &bounds, RetimeLuminance *lum) const OVERRIDE FINAL
+    {
+        lum->width = bounds.x2 - bounds.x1;
+        lum->height = bounds.y2 - bounds.y1;
+        lum->data.assign((size_t)lum->width * lum->height, 0.f);
+        if (!img) {
+            return;
+        }
+        const OfxRectI &imgBounds = img->getBounds();
+        if (imgBounds.x1 >= imgBounds.x2 || imgBounds.y1 >= imgBounds.y2) {
+            return;
+        }
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            const int sy = std::max(imgBounds.y1, std::min(y, imgBounds.y2 - 1));
+            float *dst = &lum->data[(size_t)(y - bounds.y1) * lum->width];
+            for (int x = bounds.x1; x < bounds.x2; ++x, ++dst) {
+                const int sx = std::max(imgBounds.x1, std::min(x, imgBounds.x2 - 1));
+                const PIX *srcPix = (const PIX *)img->getPixelAddress(sx, sy);
+                float l;
+                if (nComponents >= 3) {
+                    l = 0.2126f * srcPix[0] + 0.7152f * srcPix[1] + 0.0722f * srcPix[2];
+                } else if (nComponents == 2) {
+                    l = 0.5f * (srcPix[0] + srcPix[1]);
+                } else {
+                    l = srcPix[0];
+                }
+                *dst = l / maxValue;
+            }
+        }
+    }
+
+private:
+    // bilinear interpolation of img at (x,y), extending the image edges
+    static void sample(const OFX::Image *img, double x, double y, float *pix)
+    {
+        std::fill(pix, pix + nComponents, 0.f);
+        if (!img) {
+            return;
+        }
+        const OfxRectI &bounds = img->getBounds();
+        if (bounds.x1 >= bounds.x2 || bounds.y1 >= bounds.y2) {
+            return;
+        }
+        // pixel centers are at integer+0.5
+        x -= 0.5;
+        y -= 0.5;
+        const int ix = (int)std::floor(x);
+        const int iy = (int)std::floor(y);
+        const float fx = (float)(x - ix);
+        const float fy = (float)(y - iy);
+        const int x0 = std::max(bounds.x1, std::min(ix, bounds.x2 - 1));
+        const int x1 = std::max(bounds.x1, std::min(ix + 1, bounds.x2 - 1));
+        const int y0 = std::max(bounds.y1, std::min(iy, bounds.y2 - 1));
+        const int y1 = std::max(bounds.y1, std::min(iy + 1, bounds.y2 - 1));
+        const PIX *p00 = (const PIX *)img->getPixelAddress(x0, y0);
+        const PIX *p10 = (const PIX *)img->getPixelAddress(x1, y0);
+        const PIX *p01 = (const PIX *)img->getPixelAddress(x0, y1);
+        const PIX *p11 = (const PIX *)img->getPixelAddress(x1, y1);
+        for (int c = 0; c < nComponents; ++c) {
+            pix[c] = (1 - fy) * ((1 - fx) * p00[c] + fx * p10[c]) + fy * ((1 - fx) * p01[c] + fx * p11[c]);
+        }
+    }
+
+    void multiThreadProcessImages(OfxRectI procWindow) OVERRIDE FINAL
+    {
+        assert(_motion);
+        const double t = _blend;
+        float fromPix[nComponents];
+        float toPix[nComponents];
+        for (int y = procWindow.y1; y < procWindow.y2; ++y) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = (PIX *) getDstPixelAddress(procWindow.x1, y);
+            assert(dstPix);
+            if (!dstPix) {
+                // coverity[dead_error_line]
+                continue;
+            }
+
+            for (int x = procWindow.x1; x < procWindow.x2; ++x) {
+                const double px = x + 0.5;
+                const double py = y + 0.5;
+                double fdx, fdy, bdx, bdy;
+                _motion->vectorAt(_motion->forward, px, py, &fdx, &fdy);
+                _motion->vectorAt(_motion->backward, px, py, &bdx, &bdy);
+                // the point at p at time t was at p-t*forward in the first image, and is at p-(1-t)*backward in the second image
+                const double ax = px - t * fdx;
+                const double ay = py - t * fdy;
+                const double bx = px - (1. - t) * bdx;
+                const double by = py - (1. - t) * bdy;
+                sample(_fromImg, ax, ay, fromPix);
+                sample(_toImg, bx, by, toPix);
+                // points which are occluded in the other image, or whose motion is unreliable, get a lower weight
+                const double ea = _motion->inconsistencyAt(_motion->forward, _motion->backward, ax, ay);
+                const double eb = _motion->inconsistencyAt(_motion->backward, _motion->forward, bx, by);
+                const double wa = (1. - t) / (1. + ea * ea);
+                const double wb = t / (1. + eb * eb);
+                const double wsum = wa + wb;
+                for (int c = 0; c < nComponents; ++c) {
+                    float v = (wsum > 0.) ? (float)((wa * fromPix[c] + wb * toPix[c]) / wsum) : fromPix[c];
+                    dstPix[c] = ofxsClampIfInt<PIX,maxValue>(v, 0, maxValue);
+                }
+                dstPix += nComponents;
+            }
+        }
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class RetimePlugin : public OFX::ImageEffect
@@ -117,6 +665,11 @@ protected:
     OFX::ParametricParam  *_warp;      /**< @brief only used in the filter or general context. */
     OFX::DoubleParam  *_duration;   /**< @brief how long the output should be as a proportion of input. General context only. */
     OFX::ChoiceParam  *_filter;   /**< @brief how images are interpolated (or not). */
+    OFX::IntParam  *_motionBlockSize;
+    OFX::IntParam  *_motionMax;
+
+    OFX::MultiThread::Mutex _motionCacheMutex;
+    std::list<RetimeMotionCacheEntry> _motionCache; // most recently used first, protected by _motionCacheMutex
 
 public:
     /** @brief ctor */
@@ -130,6 +683,10 @@ public:
     , _warp(0)
     , _duration(0)
     , _filter(0)
+    , _motionBlockSize(0)
+    , _motionMax(0)
+    , _motionCacheMutex()
+    , _motionCache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         _srcClip = getContext() == OFX::eContextGenerator ? NULL : fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -154,7 +711,11 @@ public:
             }
         }
         _filter = fetchChoiceParam(kParamFilter);
-        assert(_filter);
+        _motionBlockSize = fetchIntParam(kParamMotionBlockSize);
+        _motionMax = fetchIntParam(kParamMotionMax);
+        assert(_filter && _motionBlockSize && _motionMax);
+
+        updateVisibility();
     }
 
     /* Override the render */
@@ -173,10 +734,30 @@ public:
 
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
     
-    /* set up and run a processor */
-    void setupAndProcess(OFX::ImageBlenderBase &, const OFX::RenderArguments &args, double sourceTime, FilterEnum filter);
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    /* set up and run a processor. motionProcessor is the processor itself for the Motion filter, and NULL otherwise. */
+    void setupAndProcess(OFX::ImageBlenderBase &, const OFX::RenderArguments &args, double sourceTime, FilterEnum filter, RetimeMotionProcessorBase *motionProcessor);
     
 private:
+    /* the time in the source clip for the output time */
+    double getSourceTime(double time);
+
+    /* the block size, the largest motion (in pixels at renderScale), the number of pyramid levels,
+       and the alignment of the block grid used by the Motion filter at time */
+    void getMotionParams(double time, const OfxPointD& renderScale, int *blockSize, int *maxMotion, int *levels, int *align);
+
+    /* the motion between fromImg and toImg, which is estimated or taken from the cache */
+    void getMotion(const RetimeMotionProcessorBase &processor, const OFX::RenderArguments &args, double fromTime, double toTime,
+                   const OFX::Image *fromImg, const OFX::Image *toImg, RetimeMotionField *motion);
+
+    void updateVisibility();
     
     
     bool isIdentityInternal(OfxTime time, OFX::Clip* &identityClip, OfxTime &identityTime);
@@ -235,12 +816,43 @@ static void framesNeeded(double sourceTime, OFX::FieldEnum fieldToRender, double
     *blendp = blend;
 }
 
+double
+RetimePlugin::getSourceTime(double time)
+{
+    if (getContext() == OFX::eContextRetimer) {
+        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
+        return _sourceTime->getValueAtTime(time);
+    }
+    if (!_srcClip) {
+        return time;
+    }
+    bool reverse_input;
+    OfxRangeD srcRange = _srcClip->getFrameRange();
+    _reverse_input->getValueAtTime(time, reverse_input);
+    // we have our own param, which is a speed, so we integrate it to get the time we want
+    double sourceTime;
+    if (reverse_input) {
+        sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
+    } else {
+        sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
+    }
+    if (_warp) {
+        double r = srcRange.max - srcRange.min;
+        if (r != 0.) {
+            sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
+        }
+    }
+
+    return sourceTime;
+}
+
 /* set up and run a processor */
 void
 RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor,
                               const OFX::RenderArguments &args,
                               double sourceTime,
-                              FilterEnum filter)
+                              FilterEnum filter,
+                              RetimeMotionProcessorBase *motionProcessor)
 {
     const double time = args.time;
     // get a dst image
@@ -314,6 +926,17 @@ RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor,
         checkComponents(*toImg, dstBitDepth, dstComponents);
     }
 
+    // estimate the motion
+    RetimeMotionField motion;
+    if (motionProcessor) {
+        assert(filter == eFilterMotion);
+        getMotion(*motionProcessor, args, fromTime, toTime, fromImg.get(), toImg.get(), &motion);
+        if (abort()) {
+            return;
+        }
+        motionProcessor->setMotion(&motion);
+    }
+
     // set the images
     processor.setDstImg(dst.get());
     processor.setFromImg(fromImg.get());
@@ -329,6 +952,95 @@ RetimePlugin::setupAndProcess(OFX::ImageBlenderBase &processor,
     processor.process();
 }
 
+void
+RetimePlugin::getMotionParams(double time,
+                              const OfxPointD& renderScale,
+                              int *blockSize,
+                              int *maxMotion,
+                              int *levels,
+                              int *align)
+{
+    *blockSize = std::max(kMotionBlockSizeMin, (int)std::floor(_motionBlockSize->getValueAtTime(time) * renderScale.x + 0.5));
+    *maxMotion = std::max(0, (int)std::ceil(_motionMax->getValueAtTime(time) * renderScale.x));
+    *levels = motionLevels(*maxMotion);
+    *align = motionAlignment(*blockSize, *levels);
+}
+
+void
+RetimePlugin::getMotion(const RetimeMotionProcessorBase &processor,
+                        const OFX::RenderArguments &args,
+                        double fromTime,
+                        double toTime,
+                        const OFX::Image *fromImg,
+                        const OFX::Image *toImg,
+                        RetimeMotionField *motion)
+{
+    int blockSize, maxMotion, levels, align;
+    getMotionParams(args.time, args.renderScale, &blockSize, &maxMotion, &levels, &align);
+
+    // the motion is estimated over the render window, enlarged by the largest motion, and restricted to the source images.
+    // The bounds are then aligned on the block grid, so that all the tiles estimate the same blocks.
+    OfxRectI bounds = args.renderWindow;
+    bounds.x1 -= maxMotion + blockSize;
+    bounds.y1 -= maxMotion + blockSize;
+    bounds.x2 += maxMotion + blockSize;
+    bounds.y2 += maxMotion + blockSize;
+    motion->blockSize = blockSize;
+    if (!fromImg || !toImg) {
+        // no motion
+        return;
+    }
+    OfxRectI srcBounds;
+    OFX::Coords::rectBoundingBox(fromImg->getBounds(), toImg->getBounds(), &srcBounds);
+    if (!OFX::Coords::rectIntersection(bounds, srcBounds, &bounds)) {
+        // no motion
+        return;
+    }
+    // round towards -infinity and +infinity (the pixel coordinates may be negative)
+    bounds.x1 = (int)std::floor(bounds.x1 / (double)align) * align;
+    bounds.y1 = (int)std::floor(bounds.y1 / (double)align) * align;
+    bounds.x2 = (int)std::ceil(bounds.x2 / (double)align) * align;
+    bounds.y2 = (int)std::ceil(bounds.y2 / (double)align) * align;
+    motion->bounds = bounds;
+
+    // Motion fields are only reused during sequential renders: in interactive renders, the source images may have changed.
+    // Consecutive output frames between the same two source frames, which are common when slowing down a clip,
+    // then only estimate the motion once.
+    const bool useCache = args.sequentialRenderStatus;
+    if (useCache) {
+        OFX::MultiThread::AutoMutex guard(_motionCacheMutex);
+        for (std::list<RetimeMotionCacheEntry>::iterator it = _motionCache.begin(); it != _motionCache.end(); ++it) {
+            if (it->matches(fromTime, toTime, args.renderScale, args.fieldToRender, maxMotion, bounds, blockSize)) {
+                *motion = it->motion;
+                _motionCache.splice(_motionCache.begin(), _motionCache, it);
+
+                return;
+            }
+        }
+    }
+
+    RetimeLuminance fromLuminance;
+    RetimeLuminance toLuminance;
+    processor.getLuminance(fromImg, bounds, &fromLuminance);
+    processor.getLuminance(toImg, bounds, &toLuminance);
+    estimateMotion(*this, fromLuminance, toLuminance, levels, motion);
+
+    if (useCache && !abort()) {
+        RetimeMotionCacheEntry entry;
+        entry.fromTime = fromTime;
+        entry.toTime = toTime;
+        entry.renderScale = args.renderScale;
+        entry.field = args.fieldToRender;
+        entry.maxMotion = maxMotion;
+        entry.motion = *motion;
+        OFX::MultiThread::AutoMutex guard(_motionCacheMutex);
+        _motionCache.push_front(entry);
+        if (_motionCache.size() > kMotionCacheSize) {
+            _motionCache.pop_back();
+        }
+    }
+}
+
 void
 RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
                                OFX::FramesNeededSetter &frames)
@@ -337,27 +1049,7 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
         return;
     }
     const double time = args.time;
-    double sourceTime;
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = _sourceTime->getValueAtTime(time);
-    } else {
-        bool reverse_input;
-        OfxRangeD srcRange = _srcClip->getFrameRange();
-        _reverse_input->getValueAtTime(time, reverse_input);
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        if (reverse_input) {
-            sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
-        } else {
-            sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
-        }
-        if (_warp) {
-            double r = srcRange.max - srcRange.min;
-            if (r != 0.) {
-                sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
-            }
-        }
-    }
+    double sourceTime = getSourceTime(time);
 
     FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
 
@@ -367,7 +1059,7 @@ RetimePlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
         range.max = sourceTime;
     } else if (filter == eFilterNearest) {
         range.min = range.max = std::floor(sourceTime + 0.5);
-    } else if (filter == eFilterLinear) {
+    } else if (filter == eFilterLinear || filter == eFilterMotion) {
         // figure the two images we are blending between
         double fromTime, toTime;
         double blend;
@@ -394,33 +1086,72 @@ RetimePlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args
     return true;
 }
 
+// override the roi call
+// Required if the plugin requires a region from the inputs which is different from the rendered region of the output.
+// (this is the case with the Motion filter, which needs the neighbourhood of the render window to estimate the motion)
+void
+RetimePlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois)
+{
+    if (!_srcClip) {
+        return;
+    }
+    const double time = args.time;
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    if (filter != eFilterMotion) {
+        return;
+    }
+    // the same margin as in getMotion(), including the alignment on the block grid, in canonical coordinates
+    int blockSize, maxMotion, levels, align;
+    getMotionParams(time, args.renderScale, &blockSize, &maxMotion, &levels, &align);
+    const double margin = (maxMotion + blockSize + align + 1) / args.renderScale.x;
+    const double par = _srcClip->getPixelAspectRatio();
+    OfxRectD roi = args.regionOfInterest;
+    roi.x1 -= margin * par;
+    roi.x2 += margin * par;
+    roi.y1 -= margin;
+    roi.y2 += margin;
+    rois.setRegionOfInterest(*_srcClip, roi);
+}
+
+void
+RetimePlugin::updateVisibility()
+{
+    FilterEnum filter = (FilterEnum)_filter->getValue();
+    bool motion = (filter == eFilterMotion);
+    _motionBlockSize->setEnabled(motion);
+    _motionMax->setEnabled(motion);
+}
+
+void
+RetimePlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, const std::string &paramName)
+{
+    if (paramName == kParamFilter) {
+        updateVisibility();
+    }
+    // the motion may be estimated differently
+    purgeCaches();
+}
+
+void
+RetimePlugin::changedClip(const OFX::InstanceChangedArgs &/*args*/, const std::string &/*clipName*/)
+{
+    purgeCaches();
+}
+
+void
+RetimePlugin::purgeCaches()
+{
+    OFX::MultiThread::AutoMutex guard(_motionCacheMutex);
+    _motionCache.clear();
+}
+
 bool
 RetimePlugin::isIdentityInternal(OfxTime time, OFX::Clip* &identityClip, OfxTime &identityTime)
 {
     if (!_srcClip) {
         return false;
     }
-    double sourceTime;
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = _sourceTime->getValueAtTime(time);
-    } else {
-        bool reverse_input;
-        OfxRangeD srcRange = _srcClip->getFrameRange();
-        _reverse_input->getValueAtTime(time, reverse_input);
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        if (reverse_input) {
-            sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
-        } else {
-            sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
-        }
-        if (_warp) {
-            double r = srcRange.max - srcRange.min;
-            if (r != 0.) {
-                sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
-            }
-        }
-    }
+    double sourceTime = getSourceTime(time);
     FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
 
     if (sourceTime == (int)sourceTime || filter == eFilterNone) {
@@ -481,18 +1212,33 @@ RetimePlugin::renderInternal(const OFX::RenderArguments &args,
 {
     switch (dstBitDepth) {
         case OFX::eBitDepthUByte: {
-            OFX::ImageBlender<unsigned char, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+            if (filter == eFilterMotion) {
+                RetimeMotionProcessor<unsigned char, nComponents, 255> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, &fred);
+            } else {
+                OFX::ImageBlender<unsigned char, nComponents> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, NULL);
+            }
             break;
         }
         case OFX::eBitDepthUShort: {
-            OFX::ImageBlender<unsigned short, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+            if (filter == eFilterMotion) {
+                RetimeMotionProcessor<unsigned short, nComponents, 65535> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, &fred);
+            } else {
+                OFX::ImageBlender<unsigned short, nComponents> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, NULL);
+            }
             break;
         }
         case OFX::eBitDepthFloat: {
-            OFX::ImageBlender<float, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+            if (filter == eFilterMotion) {
+                RetimeMotionProcessor<float, nComponents, 1> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, &fred);
+            } else {
+                OFX::ImageBlender<float, nComponents> fred(*this);
+                setupAndProcess(fred, args, sourceTime, filter, NULL);
+            }
             break;
         }
         default:
@@ -513,29 +1259,7 @@ RetimePlugin::render(const OFX::RenderArguments &args)
     assert(kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth());
 
     // figure the frame we should be retiming from
-    double sourceTime = time;
-
-    if (getContext() == OFX::eContextRetimer) {
-        // the host is specifying it, so fetch it from the kOfxImageEffectRetimerParamName pseudo-param
-        sourceTime = _sourceTime->getValueAtTime(time);
-    } else if (_srcClip) {
-        bool reverse_input;
-
-        OfxRangeD srcRange = _srcClip->getFrameRange();
-        _reverse_input->getValueAtTime(time, reverse_input);
-        // we have our own param, which is a speed, so we integrate it to get the time we want
-        if (reverse_input) {
-            sourceTime = srcRange.max - _speed->integrate(srcRange.min, time);
-        } else {
-            sourceTime = srcRange.min + _speed->integrate(srcRange.min, time);
-        }
-        if (_warp) {
-            double r = srcRange.max - srcRange.min;
-            if (r != 0.) {
-                sourceTime = srcRange.min + r * _warp->getValue(0, time, (sourceTime-srcRange.min)/r);
-            }
-        }
-    }
+    double sourceTime = getSourceTime(time);
 
     FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
 
@@ -737,6 +1461,8 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
         param->appendOption(kParamFilterOptionNearest, kParamFilterOptionNearestHint);
         assert(param->getNOptions() == eFilterLinear);
         param->appendOption(kParamFilterOptionLinear, kParamFilterOptionLinearHint);
+        assert(param->getNOptions() == eFilterMotion);
+        param->appendOption(kParamFilterOptionMotion, kParamFilterOptionMotionHint);
         //assert(param->getNOptions() == eFilterBox);
         //param->appendOption(kParamFilterOptionBox, kParamFilterOptionBoxHint);
         param->setDefault((int)kParamFilterDefault);
@@ -744,6 +1470,30 @@ void RetimePluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, Co
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMotionBlockSize);
+        param->setLabel(kParamMotionBlockSizeLabel);
+        param->setHint(kParamMotionBlockSizeHint);
+        param->setDefault(kParamMotionBlockSizeDefault);
+        param->setRange(kMotionBlockSizeMin, 256);
+        param->setDisplayRange(kMotionBlockSizeMin, 64);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamMotionMax);
+        param->setLabel(kParamMotionMaxLabel);
+        param->setHint(kParamMotionMaxHint);
+        param->setDefault(kParamMotionMaxDefault);
+        param->setRange(0, 1024);
+        param->setDisplayRange(0, 256);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 }
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref OFX::ImageEffect class */
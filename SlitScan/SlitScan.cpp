@@ -59,11 +59,11 @@
  Et il y aura aussi un paramètre pourri qui s'appellera "maximum input frame range". Ce paramètre permettra de préfetcher toutes les images nécessaires à l'effet avant son exécution. On pourra dépasser ce range sous Natron, mais pas sous Nuke (Natron est plus tolérant).
 */
 
-#ifdef DEBUG
-
 #include <cmath> // for floor
 #include <climits> // for INT_MAX
 #include <cassert>
+#include <algorithm>
+#include <vector>
 
 #include "ofxsImageEffect.h"
 #include "ofxsMultiThread.h"
@@ -73,6 +73,8 @@
 #include "ofxsCoords.h"
 #include "ofxsMacros.h"
 
+#include "FrameCache.h"
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -99,8 +101,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginIdentifier "net.sf.openfx.SlitScan"
 // History:
 // version 1.0: initial version
+// version 1.1: implement rendering, fetching each source frame once and only over the pixels that use it
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -134,7 +137,7 @@ enum RetimeFunctionEnum {
 #define kParamRetimeOffsetDefault 0.
 
 #define kParamRetimeGain "retimeGain"
-#define kParamRetimeGainLabel "Retime Offset"
+#define kParamRetimeGainLabel "Retime Gain"
 #define kParamRetimeGainHint "Gain applied to the retime map (after offset). With the horizontal or vertical slits, to get one line or column per frame you should use respectively (height-1) or (width-1)."
 #define kParamRetimeGainDefault -10
 
@@ -168,6 +171,213 @@ enum FilterEnum {
 };
 #define kParamFilterDefault eFilterNearest
 
+#define kParamCacheSize "frameCacheSize"
+#define kParamCacheSizeLabel "Frame Cache (MB)"
+#define kParamCacheSizeHint \
+"Memory (in megabytes) used to keep the source frames during sequential renders.\n" \
+"Consecutive output frames mostly use the same source frames, which are then fetched only once. Frames outside of the input frame range of the rendered frame are released. 0 disables the cache."
+#define kParamCacheSizeDefault 512
+
+// A source frame converted to float, kept to be reused by the next renders
+struct SlitScanCacheKey
+{
+    int frame;
+    OfxRectI bounds;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    int nComponents;
+    OFX::BitDepthEnum bitDepth;
+
+    // true if this frame can be used by a render with the same properties as other, which needs the pixels in window
+    bool matches(const SlitScanCacheKey& other, const OfxRectI& window) const
+    {
+        return (frame == other.frame &&
+                bounds.x1 <= window.x1 && window.x2 <= bounds.x2 &&
+                bounds.y1 <= window.y1 && window.y2 <= bounds.y2 &&
+                renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                field == other.field &&
+                nComponents == other.nComponents &&
+                bitDepth == other.bitDepth);
+    }
+};
+
+// The frames outside of the input frame range of the rendered frame are not needed anymore.
+struct SlitScanFrameOutside
+{
+    int fmin;
+    int fmax;
+
+    SlitScanFrameOutside(int fmin_, int fmax_)
+    : fmin(fmin_)
+    , fmax(fmax_)
+    {
+    }
+
+    bool operator()(const SlitScanCacheKey& key) const
+    {
+        return key.frame < fmin || fmax < key.frame;
+    }
+};
+
+// weight of the source frame in the value of a pixel at time t
+static inline float
+frameWeight(int frame,
+            double t,
+            FilterEnum filter)
+{
+    if (filter == eFilterNearest) {
+        return (std::floor(t + 0.5) == frame) ? 1.f : 0.f;
+    }
+    double t0 = std::floor(t);
+    if (frame == t0) {
+        return (float)(1. - (t - t0));
+    }
+    if (frame == t0 + 1) {
+        return (float)(t - t0);
+    }
+
+    return 0.f;
+}
+
+class SlitScanProcessorBase : public OFX::PixelProcessor
+{
+protected:
+    const OFX::Image *_srcImg;
+    const float *_srcBuffer; // source frame converted to float, if _srcImg is NULL
+    OfxRectI _srcBufferBounds;
+    const double *_times; // source time of each pixel of _window
+    float *_accumulatorData; // accumulated value of each pixel of _window
+    OfxRectI _window; // the full render window (passes may process only a part of it)
+    int _frame;
+    FilterEnum _filter;
+    bool _lastPass; // copy the accumulator to the destination image
+
+public:
+
+    SlitScanProcessorBase(OFX::ImageEffect &instance)
+    : OFX::PixelProcessor(instance)
+    , _srcImg(0)
+    , _srcBuffer(0)
+    , _times(0)
+    , _accumulatorData(0)
+    , _frame(0)
+    , _filter(eFilterNearest)
+    , _lastPass(false)
+    {
+        _srcBufferBounds.x1 = _srcBufferBounds.y1 = _srcBufferBounds.x2 = _srcBufferBounds.y2 = 0;
+        _window.x1 = _window.y1 = _window.x2 = _window.y2 = 0;
+    }
+
+    void setSrcImg(const OFX::Image *v) {_srcImg = v;}
+
+    void setSrcBuffer(const float *data, const OfxRectI& bounds) {_srcBuffer = data; _srcBufferBounds = bounds;}
+
+    void setTimes(const double *times, float *accumulatorData, const OfxRectI& window)
+    {
+        _times = times;
+        _accumulatorData = accumulatorData;
+        _window = window;
+    }
+
+    void setValues(int frame, FilterEnum filter, bool lastPass)
+    {
+        _frame = frame;
+        _filter = filter;
+        _lastPass = lastPass;
+    }
+
+    // get the (normalized) values of the single-channel retime map over window
+    virtual void getRetimeMap(const OFX::Image *map, const OfxRectI& window, float *values) const = 0;
+
+    // convert the source frame to float over bounds
+    virtual void getBuffer(const OFX::Image *src, const OfxRectI& bounds, float *data) const = 0;
+};
+
+template <class PIX, int nComponents, int maxValue>
+class SlitScanProcessor : public SlitScanProcessorBase
+{
+public:
+    SlitScanProcessor(OFX::ImageEffect &instance)
+    : SlitScanProcessorBase(instance)
+    {
+    }
+
+    virtual void getRetimeMap(const OFX::Image *map, const OfxRectI& window, float *values) const OVERRIDE FINAL
+    {
+        for (int y = window.y1; y < window.y2; ++y) {
+            for (int x = window.x1; x < window.x2; ++x, ++values) {
+                const PIX *mapPix = (const PIX *) (map ? map->getPixelAddress(x, y) : 0);
+                *values = mapPix ? (float)mapPix[0] / maxValue : 0.f;
+            }
+        }
+    }
+
+    virtual void getBuffer(const OFX::Image *src, const OfxRectI& bounds, float *data) const OVERRIDE FINAL
+    {
+        for (int y = bounds.y1; y < bounds.y2; ++y) {
+            for (int x = bounds.x1; x < bounds.x2; ++x, data += nComponents) {
+                const PIX *srcPix = (const PIX *) (src ? src->getPixelAddress(x, y) : 0);
+                for (int c = 0; c < nComponents; ++c) {
+                    data[c] = srcPix ? srcPix[c] : 0.f;
+                }
+            }
+        }
+    }
+
+private:
+
+    void multiThreadProcessImages(OfxRectI procWindow)
+    {
+        assert(_times && _accumulatorData);
+        assert(!_lastPass || _dstPixelData);
+        for (int y = procWindow.y1; y < procWindow.y2; y++) {
+            if (_effect.abort()) {
+                break;
+            }
+
+            PIX *dstPix = _lastPass ? (PIX *) getDstPixelAddress(procWindow.x1, y) : 0;
+            assert(!_lastPass || dstPix);
+            if (_lastPass && !dstPix) {
+                // coverity[dead_error_line]
+                continue;
+            }
+
+            for (int x = procWindow.x1; x < procWindow.x2; x++) {
+                size_t windowPix = ((_window.x2 - _window.x1) * (y - _window.y1) +
+                                    (x - _window.x1));
+                float *accPix = &_accumulatorData[windowPix * nComponents];
+                if (_lastPass) {
+                    for (int c = 0; c < nComponents; ++c) {
+                        dstPix[c] = ofxsClampIfInt<PIX,maxValue>(accPix[c], 0, maxValue);
+                    }
+                    // increment the dst pixel
+                    dstPix += nComponents;
+                    continue;
+                }
+                float w = frameWeight(_frame, _times[windowPix], _filter);
+                if (w == 0.f) {
+                    continue;
+                }
+                if (_srcImg) {
+                    const PIX *srcPix = (const PIX *) _srcImg->getPixelAddress(x, y);
+                    if (srcPix) {
+                        for (int c = 0; c < nComponents; ++c) {
+                            accPix[c] += w * srcPix[c];
+                        }
+                    }
+                } else if (_srcBuffer &&
+                           _srcBufferBounds.x1 <= x && x < _srcBufferBounds.x2 &&
+                           _srcBufferBounds.y1 <= y && y < _srcBufferBounds.y2) {
+                    const float *srcPix = &_srcBuffer[((size_t)(_srcBufferBounds.x2 - _srcBufferBounds.x1) * (y - _srcBufferBounds.y1) +
+                                                       (x - _srcBufferBounds.x1)) * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        accPix[c] += w * srcPix[c];
+                    }
+                }
+            }
+        }
+    }
+};
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -185,6 +395,9 @@ protected:
     OFX::BooleanParam *_retimeAbsolute;
     OFX::Int2DParam *_frameRange;
     OFX::ChoiceParam *_filter;   /**< @brief how images are interpolated (or not). */
+    OFX::IntParam *_cacheSize;
+
+    FrameCache<SlitScanCacheKey> _cache;
 
 public:
     /** @brief ctor */
@@ -199,6 +412,8 @@ public:
     , _retimeAbsolute(0)
     , _frameRange(0)
     , _filter(0)
+    , _cacheSize(0)
+    , _cache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         _srcClip = fetchClip(kOfxImageEffectSimpleSourceClipName);
@@ -210,24 +425,39 @@ public:
         _retimeAbsolute = fetchBooleanParam(kParamRetimeAbsolute);
         _frameRange = fetchInt2DParam(kParamFrameRange);
         _filter = fetchChoiceParam(kParamFilter);
-        assert(_retimeFunction && _retimeOffset && _retimeGain && _retimeAbsolute && _frameRange && _filter);
+        _cacheSize = fetchIntParam(kParamCacheSize);
+        assert(_retimeFunction && _retimeOffset && _retimeGain && _retimeAbsolute && _frameRange && _filter && _cacheSize);
     }
 
 private:
     /* Override the render */
     virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
 
-    //template <int nComponents>
-    //void renderInternal(const OFX::RenderArguments &args, double sourceTime, FilterEnum filter, OFX::BitDepthEnum dstBitDepth);
+    template <int nComponents>
+    void renderForComponents(const OFX::RenderArguments &args);
+
+    template <class PIX, int nComponents, int maxValue>
+    void renderForBitDepth(const OFX::RenderArguments &args);
+
+    /* set up and run a processor */
+    void setupAndProcess(SlitScanProcessorBase &, const OFX::RenderArguments &args);
 
     /** Override the get frames needed action */
     virtual void getFramesNeeded(const OFX::FramesNeededArguments &args, OFX::FramesNeededSetter &frames) OVERRIDE FINAL;
 
     virtual bool isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &identityClip, double &identityTime) OVERRIDE FINAL;
 
-    /* set up and run a processor */
-    //void setupAndProcess(OFX::SlitScanerBase &, const OFX::RenderArguments &args, double sourceTime, FilterEnum filter);
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
 
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    /* the range of source times used at time (before rounding to frames) */
+    void getTimeRange(double time, double *tmin, double *tmax);
+
+    /* the range of source frames used at time */
+    void getFrameRange(double time, int *fmin, int *fmax);
 };
 
 
@@ -252,15 +482,9 @@ checkComponents(const OFX::Image &src,
     }
 }
 
-
 void
-SlitScanPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
-                              OFX::FramesNeededSetter &frames)
+SlitScanPlugin::getTimeRange(double time, double *tminp, double *tmaxp)
 {
-    if (!_srcClip) {
-        return;
-    }
-    const double time = args.time;
     double tmin, tmax;
     bool retimeAbsolute;
     _retimeAbsolute->getValueAtTime(time, retimeAbsolute);
@@ -285,20 +509,39 @@ SlitScanPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
             tmin += time;
             tmax += time;
         }
-        FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
-        if (filter == eFilterNearest) {
-            tmin = std::floor(tmin + 0.5);
-            tmax = std::floor(tmax + 0.5);
-        } else if (filter == eFilterLinear) {
-            tmin = std::floor(tmin);
-            tmax = std::ceil(tmax);
-        }
+    }
+    *tminp = tmin;
+    *tmaxp = tmax;
+}
 
+void
+SlitScanPlugin::getFrameRange(double time, int *fmin, int *fmax)
+{
+    double tmin, tmax;
+    getTimeRange(time, &tmin, &tmax);
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    if (filter == eFilterNearest) {
+        *fmin = (int)std::floor(tmin + 0.5);
+        *fmax = (int)std::floor(tmax + 0.5);
+    } else {
+        *fmin = (int)std::floor(tmin);
+        *fmax = (int)std::ceil(tmax);
     }
+}
+
+void
+SlitScanPlugin::getFramesNeeded(const OFX::FramesNeededArguments &args,
+                              OFX::FramesNeededSetter &frames)
+{
+    if (!_srcClip) {
+        return;
+    }
+    int fmin, fmax;
+    getFrameRange(args.time, &fmin, &fmax);
 
     OfxRangeD range;
-    range.min = tmin;
-    range.max = tmax;
+    range.min = fmin;
+    range.max = fmax;
     frames.setFramesNeeded(*_srcClip, range);
 }
 
@@ -335,13 +578,10 @@ SlitScanPlugin::isIdentity(const OFX::IsIdentityArguments &args, OFX::Clip * &id
     return false;
 }
 
-#if 0
-/* set up and run a processor for a standard horizontal slit scan with linear time interpolation */
+/* set up and run a processor */
 void
-SlitScanPlugin::setupAndProcessSlitScanLinear(OFX::ImageBlenderBase &processor,
-                                              const OFX::RenderArguments &args,
-                                              double sourceTime,
-                                              FilterEnum filter)
+SlitScanPlugin::setupAndProcess(SlitScanProcessorBase &processor,
+                                const OFX::RenderArguments &args)
 {
     const double time = args.time;
     // get a dst image
@@ -363,150 +603,254 @@ SlitScanPlugin::setupAndProcessSlitScanLinear(OFX::ImageBlenderBase &processor,
         OFX::throwSuiteStatusException(kOfxStatFailed);
     }
 
-    // TODO: loop over lines
-    if (sourceTime == (int)sourceTime || filter == eFilterNone || filter == eFilterNearest) {
-        // should have been caught by isIdentity...
-        std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
-                                            _srcClip->fetchImage(sourceTime) : 0);
-        if (src.get()) {
-            if (src->getRenderScale().x != args.renderScale.x ||
-                src->getRenderScale().y != args.renderScale.y ||
-                (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
-                setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-                OFX::throwSuiteStatusException(kOfxStatFailed);
+    const OfxRectI& renderWindow = args.renderWindow;
+    if (renderWindow.x1 >= renderWindow.x2 || renderWindow.y1 >= renderWindow.y2) {
+        return;
+    }
+    const int width = renderWindow.x2 - renderWindow.x1;
+    const size_t nPixels = (size_t)width * (renderWindow.y2 - renderWindow.y1);
+    const int dstNComponents = _dstClip->getPixelComponentCount();
+    const double par = _dstClip->getPixelAspectRatio();
+
+    // compute the source time of each pixel
+    RetimeFunctionEnum retimeFunction = (RetimeFunctionEnum)_retimeFunction->getValueAtTime(time);
+    double retimeOffset, retimeGain;
+    _retimeOffset->getValueAtTime(time, retimeOffset);
+    _retimeGain->getValueAtTime(time, retimeGain);
+    bool retimeAbsolute;
+    _retimeAbsolute->getValueAtTime(time, retimeAbsolute);
+    FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+    double tmin, tmax;
+    getTimeRange(time, &tmin, &tmax);
+    int fmin, fmax;
+    getFrameRange(time, &fmin, &fmax);
+
+    std::vector<float> retimeMap;
+    OfxRectI srcRoD = {0, 0, 0, 0};
+    if (retimeFunction == eRetimeFunctionRetimeMap) {
+        retimeMap.assign(nPixels, 0.f);
+        if (_retimeMapClip && _retimeMapClip->isConnected()) {
+            std::auto_ptr<const OFX::Image> map(_retimeMapClip->fetchImage(time));
+            if (map.get()) {
+                if (map->getRenderScale().x != args.renderScale.x ||
+                    map->getRenderScale().y != args.renderScale.y ||
+                    (map->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && map->getField() != args.fieldToRender)) {
+                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                    OFX::throwSuiteStatusException(kOfxStatFailed);
+                }
             }
-            OFX::BitDepthEnum    srcBitDepth      = src->getPixelDepth();
-            OFX::PixelComponentEnum srcComponents = src->getPixelComponents();
-            if (srcBitDepth != dstBitDepth || srcComponents != dstComponents) {
-                OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
+            processor.getRetimeMap(map.get(), renderWindow, &retimeMap.front());
+        }
+    } else if (_srcClip && _srcClip->isConnected()) {
+        // the slit goes from the center of the first line (or column) of the source image to the center of the last one
+        OFX::Coords::toPixelEnclosing(_srcClip->getRegionOfDefinition(time), args.renderScale, par, &srcRoD);
+    }
+    std::vector<double> times(nPixels);
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
+            size_t windowPix = (size_t)width * (y - renderWindow.y1) + (x - renderWindow.x1);
+            double value = 0.;
+            if (retimeFunction == eRetimeFunctionRetimeMap) {
+                value = retimeMap[windowPix];
+            } else if (retimeFunction == eRetimeFunctionHorizontalSlit) {
+                if (srcRoD.y2 - srcRoD.y1 > 1) {
+                    value = std::max(0., std::min((double)(y - srcRoD.y1) / (srcRoD.y2 - srcRoD.y1 - 1), 1.));
+                }
+            } else {
+                if (srcRoD.x2 - srcRoD.x1 > 1) {
+                    value = std::max(0., std::min((double)(x - srcRoD.x1) / (srcRoD.x2 - srcRoD.x1 - 1), 1.));
+                }
+            }
+            double t = retimeOffset + retimeGain * value;
+            if (!retimeAbsolute) {
+                t += time;
             }
+            // never use frames that were not declared in getFramesNeeded
+            times[windowPix] = std::max(tmin, std::min(t, tmax));
         }
-        copyPixels(*this, args.renderWindow, src.get(), dst.get());
-        return;
     }
 
-    // figure the two images we are blending between
-    double fromTime, toTime;
-    double blend;
-    framesNeeded(sourceTime, args.fieldToRender, &fromTime, &toTime, &blend);
-
-    // fetch the two source images
-    std::auto_ptr<OFX::Image> fromImg((_srcClip && _srcClip->isConnected()) ?
-                                      _srcClip->fetchImage(fromTime) : 0);
-    std::auto_ptr<OFX::Image> toImg((_srcClip && _srcClip->isConnected()) ?
-                                    _srcClip->fetchImage(toTime) : 0);
-
-    // make sure bit depths are sane
-    if (fromImg.get()) {
-        if (fromImg->getRenderScale().x != args.renderScale.x ||
-            fromImg->getRenderScale().y != args.renderScale.y ||
-            (fromImg->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && fromImg->getField() != args.fieldToRender)) {
-            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
-        }
-        checkComponents(*fromImg, dstBitDepth, dstComponents);
-    }
-    if (toImg.get()) {
-        if (toImg->getRenderScale().x != args.renderScale.x ||
-            toImg->getRenderScale().y != args.renderScale.y ||
-            (toImg->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && toImg->getField() != args.fieldToRender)) {
-            setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
-            OFX::throwSuiteStatusException(kOfxStatFailed);
+    // the pixels that use each source frame: with the slits, these are bands of lines or columns
+    const OfxRectI emptyRect = {INT_MAX, INT_MAX, INT_MIN, INT_MIN};
+    std::vector<OfxRectI> frameWindows(fmax - fmin + 1, emptyRect);
+    for (int y = renderWindow.y1; y < renderWindow.y2; ++y) {
+        for (int x = renderWindow.x1; x < renderWindow.x2; ++x) {
+            const double t = times[(size_t)width * (y - renderWindow.y1) + (x - renderWindow.x1)];
+            int f0, f1;
+            if (filter == eFilterNearest) {
+                f0 = f1 = (int)std::floor(t + 0.5);
+            } else {
+                f0 = (int)std::floor(t);
+                f1 = (t > f0) ? f0 + 1 : f0;
+            }
+            for (int f = std::max(f0, fmin); f <= std::min(f1, fmax); ++f) {
+                OfxRectI &r = frameWindows[f - fmin];
+                r.x1 = std::min(r.x1, x);
+                r.x2 = std::max(r.x2, x + 1);
+                r.y1 = std::min(r.y1, y);
+                r.y2 = std::max(r.y2, y + 1);
+            }
         }
-        checkComponents(*toImg, dstBitDepth, dstComponents);
     }
 
-    // set the images
-    processor.setDstImg(dst.get());
-    processor.setFromImg(fromImg.get());
-    processor.setToImg(toImg.get());
+    // accumulator image (always use float)
+    std::auto_ptr<OFX::ImageMemory> accumulator(new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this));
+    float *accumulatorData = (float*)accumulator->lock();
+    std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.f);
+    processor.setTimes(&times.front(), accumulatorData, renderWindow);
+
+    // Frame cache.
+    // When the host renders a sequence, the source frames are converted to float and kept in the cache,
+    // so that the next frames only fetch the frames that were not used before.
+    // Interactive renders (where upstream images may have changed) do not use the cache.
+    const size_t cacheBytes = (size_t)std::max(0, _cacheSize->getValueAtTime(time)) * 1024 * 1024;
+    const bool useCache = (args.sequentialRenderStatus && cacheBytes > 0 &&
+                           nPixels * dstNComponents * sizeof(float) <= cacheBytes);
+    SlitScanCacheKey key;
+    key.frame = 0;
+    key.bounds = renderWindow;
+    key.renderScale = args.renderScale;
+    key.field = args.fieldToRender;
+    key.nComponents = dstNComponents;
+    key.bitDepth = dstBitDepth;
+
+    // Main processing loop: each source frame is fetched once, and only over the pixels that use it.
+    for (int f = fmin; f <= fmax; ++f) {
+        const OfxRectI &frameWindow = frameWindows[f - fmin];
+        if (frameWindow.x1 >= frameWindow.x2 || frameWindow.y1 >= frameWindow.y2) {
+            // frame not used
+            continue;
+        }
+        if (abort()) {
+            return;
+        }
+        std::auto_ptr<const OFX::Image> src;
+        FrameCacheHolder_RAII<SlitScanCacheKey, SlitScanFrameOutside> cacheEntries(_cache, cacheBytes, SlitScanFrameOutside(fmin, fmax));
+        FrameCacheEntry<SlitScanCacheKey>* entry = 0;
+        if (useCache) {
+            key.frame = f;
+            entry = _cache.acquire(key, frameWindow);
+            if (entry) {
+                cacheEntries.entries.push_back(entry);
+            }
+        }
+        if (!entry && _srcClip && _srcClip->isConnected()) {
+            // when caching, fetch the whole render window: the next frames will use other parts of this source frame
+            OfxRectD bounds;
+            OFX::Coords::toCanonical(useCache ? renderWindow : frameWindow, args.renderScale, par, &bounds);
+            src.reset(_srcClip->fetchImage(f, bounds));
+            if (src.get()) {
+                if (src->getRenderScale().x != args.renderScale.x ||
+                    src->getRenderScale().y != args.renderScale.y ||
+                    (src->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && src->getField() != args.fieldToRender)) {
+                    setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+                    OFX::throwSuiteStatusException(kOfxStatFailed);
+                }
+                checkComponents(*src, dstBitDepth, dstComponents);
+            }
+            if (useCache) {
+                entry = _cache.insert(key);
+                cacheEntries.entries.push_back(entry);
+                // the frame is converted without the cache lock, then published under the lock
+                std::vector<float> data(nPixels * dstNComponents);
+                processor.getBuffer(src.get(), renderWindow, &data.front());
+                _cache.ready(entry, &data);
+                src.reset(0);
+            }
+        }
 
-    // set the render window
-    processor.setRenderWindow(args.renderWindow);
+        if (entry) {
+            processor.setSrcImg(0);
+            processor.setSrcBuffer(&entry->data.front(), entry->key.bounds);
+        } else {
+            processor.setSrcImg(src.get());
+            processor.setSrcBuffer(0, renderWindow);
+        }
+        processor.setRenderWindow(frameWindow);
+        processor.setValues(f, filter, false);
 
-    // set the blend between
-    processor.setBlend((float)blend);
+        // Call the base class process member, this will call the derived templated process code
+        processor.process();
+    }
 
-    // Call the base class process member, this will call the derived templated process code
+    // copy the accumulator to the destination image
+    processor.setDstImg(dst.get());
+    processor.setSrcImg(0);
+    processor.setSrcBuffer(0, renderWindow);
+    processor.setRenderWindow(renderWindow);
+    processor.setValues(0, filter, true);
     processor.process();
 }
 
-// the internal render function for a standard horizontal slit scan with linear time interpolation
+template <class PIX, int nComponents, int maxValue>
+void
+SlitScanPlugin::renderForBitDepth(const OFX::RenderArguments &args)
+{
+    SlitScanProcessor<PIX, nComponents, maxValue> fred(*this);
+    setupAndProcess(fred, args);
+}
 
 template <int nComponents>
 void
-SlitScanPlugin::renderInternalSlitScanLinear(const OFX::RenderArguments &args,
-                                             double sourceTime,
-                                             FilterEnum filter,
-                                             OFX::BitDepthEnum dstBitDepth)
+SlitScanPlugin::renderForComponents(const OFX::RenderArguments &args)
 {
+    OFX::BitDepthEnum dstBitDepth = _dstClip->getPixelDepth();
     switch (dstBitDepth) {
-        case OFX::eBitDepthUByte: {
-            OFX::ImageBlender<unsigned char, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+        case OFX::eBitDepthUByte:
+            renderForBitDepth<unsigned char, nComponents, 255>(args);
             break;
-        }
-        case OFX::eBitDepthUShort: {
-            OFX::ImageBlender<unsigned short, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+
+        case OFX::eBitDepthUShort:
+            renderForBitDepth<unsigned short, nComponents, 65535>(args);
             break;
-        }
-        case OFX::eBitDepthFloat: {
-            OFX::ImageBlender<float, nComponents> fred(*this);
-            setupAndProcess(fred, args, sourceTime, filter);
+
+        case OFX::eBitDepthFloat:
+            renderForBitDepth<float, nComponents, 1>(args);
             break;
-        }
         default:
             OFX::throwSuiteStatusException(kOfxStatErrUnsupported);
     }
 }
-#endif
 
 // the overridden render function
 void
 SlitScanPlugin::render(const OFX::RenderArguments &args)
 {
-    const double time = args.time;
     // instantiate the render code based on the pixel depth of the dst clip
-    OFX::BitDepthEnum       dstBitDepth    = _dstClip->getPixelDepth();
     OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
 
     assert(kSupportsMultipleClipPARs   || !_srcClip || _srcClip->getPixelAspectRatio() == _dstClip->getPixelAspectRatio());
     assert(kSupportsMultipleClipDepths || !_srcClip || _srcClip->getPixelDepth()       == _dstClip->getPixelDepth());
+    assert(dstComponents == OFX::ePixelComponentAlpha || dstComponents == OFX::ePixelComponentXY || dstComponents == OFX::ePixelComponentRGB || dstComponents == OFX::ePixelComponentRGBA);
+    if (dstComponents == OFX::ePixelComponentRGBA) {
+        renderForComponents<4>(args);
+    } else if (dstComponents == OFX::ePixelComponentAlpha) {
+        renderForComponents<1>(args);
+    } else if (dstComponents == OFX::ePixelComponentXY) {
+        renderForComponents<2>(args);
+    } else {
+        assert(dstComponents == OFX::ePixelComponentRGB);
+        renderForComponents<3>(args);
+    }
+}
 
-    RetimeFunctionEnum retimeFunction = (RetimeFunctionEnum)_retimeFunction->getValueAtTime(time);
-#if 0
+void
+SlitScanPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, const std::string &/*paramName*/)
+{
+    purgeCaches();
+}
 
-    if (_retimeMapClip && _retimeMapClip->isConnected()) {
-#pragma message WARN("TODO")
-        OFX::throwSuiteStatusException(kOfxStatFailed);
-        return;
-    } else {
-        FilterEnum filter = (FilterEnum)_filter->getValueAtTime(time);
+void
+SlitScanPlugin::changedClip(const OFX::InstanceChangedArgs &/*args*/, const std::string &/*clipName*/)
+{
+    purgeCaches();
+}
 
-        switch (filter) {
-            case eFilterNearest:
-#pragma message WARN("TODO")
-                OFX::throwSuiteStatusException(kOfxStatFailed);
-                break;
-            case eFilterLinear:
-                // do the rendering
-                if (dstComponents == OFX::ePixelComponentRGBA) {
-                    renderInternalSlitScanHorizontal<4>(args, dstBitDepth);
-                } else if (dstComponents == OFX::ePixelComponentRGB) {
-                    renderInternalSlitScanLinear<3>(args, dstBitDepth);
-                } else if (dstComponents == OFX::ePixelComponentXY) {
-                    renderInternalSlitScanLinear<2>(args, dstBitDepth);
-                } else {
-                    assert(dstComponents == OFX::ePixelComponentAlpha);
-                    renderInternalSlitScanLinear<1>(args, dstBitDepth);
-                }
-                break;
-        }
-    }
-#else
-    OFX::throwSuiteStatusException(kOfxStatFailed);
-#endif
+/** @brief free the frames that are not used by a render */
+void
+SlitScanPlugin::purgeCaches()
+{
+    _cache.purge();
 }
 
 
@@ -657,6 +1001,18 @@ void SlitScanPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCacheSize);
+        param->setLabel(kParamCacheSizeLabel);
+        param->setHint(kParamCacheSizeHint);
+        param->setDefault(kParamCacheSizeDefault);
+        param->setRange(0, INT_MAX);
+        param->setDisplayRange(0, 4096);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 }
 
 /** @brief The create instance function, the plugin must return an object derived from the \ref OFX::ImageEffect class */
@@ -670,5 +1026,3 @@ mRegisterPluginFactoryInstance(p)
 
 OFXS_NAMESPACE_ANONYMOUS_EXIT
 
-#endif
-
@@ -24,6 +24,8 @@
 #include <climits> // for INT_MAX
 #include <cassert>
 #include <algorithm>
+#include <vector>
+#include <sstream>
 #ifdef DEBUG
 #include <cstdio>
 #endif
@@ -37,6 +39,8 @@
 #include "ofxsMaskMix.h"
 #include "ofxsMacros.h"
 
+#include "FrameCache.h"
+
 using namespace OFX;
 
 OFXS_NAMESPACE_ANONYMOUS_ENTER
@@ -50,8 +54,9 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 // History:
 // version 1.0: initial version
 // version 2.0: use kNatronOfxParamProcess* parameters
+// version 1.1: sequential renders reuse the source samples of the previous frames
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 1 // Increment this when you have fixed a bug or made it faster.
 
 #define kSupportsTiles 1
 #define kSupportsMultiResolution 1
@@ -64,13 +69,26 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kParamDivisionsLabel "Divisions"
 #define kParamDivisionsHint  "Number of time samples along the shutter time."
 
+#define kParamCacheSize "sampleCacheSize"
+#define kParamCacheSizeLabel "Sample Cache (MB)"
+#define kParamCacheSizeHint \
+"Memory (in megabytes) used to keep the source samples of the previous renders, converted to floating point.\n" \
+"When the host renders a sequence with a shutter larger than 1, consecutive frames share some of their samples, which are then fetched only once. 0 disables the cache."
+#define kParamCacheSizeDefault 256
+
+#define kParamCacheInfo "sampleCacheInfo"
+#define kParamCacheInfoLabel "Sample Cache Info..."
+#define kParamCacheInfoHint "Show the hit rate and the memory usage of the sample cache."
+
 #define kFrameChunk 4 // how many frames to process simultaneously
+#define kTimeEpsilon 1e-6 // samples closer than this (in frames) are considered to be at the same time
 
 
 class TimeBlurProcessorBase : public OFX::PixelProcessor
 {
 protected:
     std::vector<const OFX::Image*> _srcImgs;
+    std::vector<const float*> _srcBuffers;
     float *_accumulatorData;
     int _divisions; // 0 for all passes except the last one
 
@@ -79,12 +97,15 @@ public:
     TimeBlurProcessorBase(OFX::ImageEffect &instance)
     : OFX::PixelProcessor(instance)
     , _srcImgs(0)
+    , _srcBuffers(0)
     , _accumulatorData(0)
     , _divisions(0)
     {
     }
 
     void setSrcImgs(const std::vector<const OFX::Image*> &v) {_srcImgs = v;}
+    // source samples already converted to float, with the same bounds as the render window
+    void setSrcBuffers(const std::vector<const float*> &v) {_srcBuffers = v;}
     void setAccumulator(float *accumulatorData) {_accumulatorData = accumulatorData;}
 
     void setValues(int divisions)
@@ -143,6 +164,12 @@ private:
                         }
                     }
                 }
+                for (unsigned i = 0; i < _srcBuffers.size(); ++i) {
+                    const float *srcPixi = &_srcBuffers[i][renderPix * nComponents];
+                    for (int c = 0; c < nComponents; ++c) {
+                        tmpPix[c] += srcPixi[c];
+                    }
+                }
                 if (!lastPass) {
                     assert(_accumulatorData);
                     if (_accumulatorData) {
@@ -162,6 +189,29 @@ private:
 };
 
 
+// A source sample converted to float, kept to be reused by the next renders
+struct TimeBlurCacheKey
+{
+    double time;
+    OfxRectI renderWindow;
+    OfxPointD renderScale;
+    OFX::FieldEnum field;
+    int nComponents;
+    OFX::BitDepthEnum bitDepth;
+
+    // true if this sample can be used by a render with the same properties as other, on the render window window
+    bool matches(const TimeBlurCacheKey& other, const OfxRectI& window) const
+    {
+        return (std::abs(time - other.time) < kTimeEpsilon &&
+                renderWindow.x1 == window.x1 && renderWindow.y1 == window.y1 &&
+                renderWindow.x2 == window.x2 && renderWindow.y2 == window.y2 &&
+                renderScale.x == other.renderScale.x && renderScale.y == other.renderScale.y &&
+                field == other.field &&
+                nComponents == other.nComponents &&
+                bitDepth == other.bitDepth);
+    }
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
 class TimeBlurPlugin : public OFX::ImageEffect
@@ -176,6 +226,8 @@ public:
     , _shutter(0)
     , _shutteroffset(0)
     , _shuttercustomoffset(0)
+    , _cacheSize(0)
+    , _cache()
     {
         _dstClip = fetchClip(kOfxImageEffectOutputClipName);
         assert(_dstClip && (_dstClip->getPixelComponents() == ePixelComponentAlpha ||
@@ -193,6 +245,8 @@ public:
         _shutteroffset = fetchChoiceParam(kParamShutterOffset);
         _shuttercustomoffset = fetchDoubleParam(kParamShutterCustomOffset);
         assert(_divisions && _shutter && _shutteroffset && _shuttercustomoffset);
+        _cacheSize = fetchIntParam(kParamCacheSize);
+        assert(_cacheSize);
     }
 
 private:
@@ -209,7 +263,12 @@ private:
 
     virtual bool getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &args, OfxRectD &rod) OVERRIDE FINAL;
 
-private:
+    virtual void changedParam(const OFX::InstanceChangedArgs &args, const std::string &paramName) OVERRIDE FINAL;
+
+    virtual void changedClip(const OFX::InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
 
     template<int nComponents>
     void renderForComponents(const OFX::RenderArguments &args);
@@ -224,6 +283,9 @@ private:
     OFX::DoubleParam* _shutter;
     OFX::ChoiceParam* _shutteroffset;
     OFX::DoubleParam* _shuttercustomoffset;
+    OFX::IntParam* _cacheSize;
+
+    FrameCache<TimeBlurCacheKey> _cache;
 };
 
 
@@ -292,6 +354,21 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
 
     const OfxRectI& renderWindow = args.renderWindow;
     size_t nPixels = (renderWindow.y2 - renderWindow.y1) * (renderWindow.x2 - renderWindow.x1);
+    int dstNComponents = _dstClip->getPixelComponentCount();
+
+    // Sample cache.
+    // When the host renders a sequence, the source samples are converted to float and kept in the cache,
+    // so that the next frames only fetch the samples that were not used before.
+    // Interactive renders (where upstream images may have changed) do not use the cache.
+    const size_t cacheBytes = (size_t)std::max(0, _cacheSize->getValueAtTime(time)) * 1024 * 1024;
+    const bool useCache = (args.sequentialRenderStatus && cacheBytes > 0 && _srcClip && _srcClip->isConnected());
+    TimeBlurCacheKey key;
+    key.time = 0.;
+    key.renderWindow = renderWindow;
+    key.renderScale = args.renderScale;
+    key.field = args.fieldToRender;
+    key.nComponents = dstNComponents;
+    key.bitDepth = dstBitDepth;
 
     // Main processing loop.
     // We process the frame range by chunks, to avoid using too much memory.
@@ -306,19 +383,29 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
         if (!lastPass) {
             // Initialize accumulator image (always use float)
             if (!accumulatorData) {
-                int dstNComponents = _dstClip->getPixelComponentCount();
                 accumulator.reset(new OFX::ImageMemory(nPixels * dstNComponents * sizeof(float), this));
                 accumulatorData = (float*)accumulator->lock();
                 std::fill(accumulatorData, accumulatorData + nPixels * dstNComponents, 0.);
             }
         }
 
-        // fetch the source images
+        // fetch the source images, or get them from the cache
         OptionalImagesHolder_RAII srcImgs;
+        FrameCacheHolder_RAII<TimeBlurCacheKey> cacheEntries(_cache, cacheBytes);
+        std::vector<const float*> srcBuffers;
         for (int i = imin; i < imax; ++i) {
             if (abort()) {
                 return;
             }
+            if (useCache) {
+                key.time = range.min + i * interval;
+                FrameCacheEntry<TimeBlurCacheKey>* entry = _cache.acquire(key, renderWindow);
+                if (entry) {
+                    cacheEntries.entries.push_back(entry);
+                    srcBuffers.push_back(&entry->data.front());
+                    continue;
+                }
+            }
             const OFX::Image* src = _srcClip ? _srcClip->fetchImage(range.min + i * interval) : 0;
             //std::printf("TimeBlur: fetchimage(%g)\n", range.min + i * interval);
             if (src) {
@@ -334,7 +421,28 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
                     OFX::throwSuiteStatusException(kOfxStatErrImageFormat);
                 }
             }
-            srcImgs.images.push_back(src);
+            if (useCache) {
+                // convert the sample to float, and add it to the cache
+                OptionalImagesHolder_RAII srcImg;
+                srcImg.images.push_back(src);
+                FrameCacheEntry<TimeBlurCacheKey>* entry = _cache.insert(key);
+                cacheEntries.entries.push_back(entry);
+                // the sample is converted without the cache lock, then published under the lock
+                std::vector<float> data(nPixels * dstNComponents, 0.f);
+                processor.setSrcImgs(srcImg.images);
+                processor.setSrcBuffers(std::vector<const float*>());
+                processor.setRenderWindow(renderWindow);
+                processor.setAccumulator(&data.front());
+                processor.setValues(0);
+                processor.process();
+                if (abort()) {
+                    return;
+                }
+                _cache.ready(entry, &data);
+                srcBuffers.push_back(&entry->data.front());
+            } else {
+                srcImgs.images.push_back(src);
+            }
         }
 
         // set the images
@@ -342,6 +450,7 @@ TimeBlurPlugin::setupAndProcess(TimeBlurProcessorBase &processor, const OFX::Ren
             processor.setDstImg(dst.get());
         }
         processor.setSrcImgs(srcImgs.images);
+        processor.setSrcBuffers(srcBuffers);
         // set the render window
         processor.setRenderWindow(renderWindow);
         processor.setAccumulator(accumulatorData);
@@ -484,6 +593,42 @@ TimeBlurPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArguments &ar
     return true;
 }
 
+void
+TimeBlurPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, const std::string &paramName)
+{
+    if (paramName == kParamCacheInfo) {
+        unsigned long hits, misses;
+        size_t count, bytes;
+        _cache.getStats(&hits, &misses, &count, &bytes);
+        std::ostringstream oss;
+        oss << "Sample cache: " << hits << " hits, " << misses << " misses";
+        if (hits + misses) {
+            oss << " (hit rate " << (100. * hits) / (hits + misses) << "%)";
+        }
+        oss << ".\n" << count << " samples in cache, using " << bytes / (1024. * 1024.) << " MB.";
+        if (count == 0 && hits + misses == 0) {
+            oss << "\nThe cache is only used when the host renders a sequence.";
+        }
+        sendMessage(OFX::Message::eMessageMessage, "", oss.str());
+        return;
+    }
+    // any other parameter may change the samples
+    purgeCaches();
+}
+
+void
+TimeBlurPlugin::changedClip(const OFX::InstanceChangedArgs &/*args*/, const std::string &/*clipName*/)
+{
+    purgeCaches();
+}
+
+/** @brief free the samples that are not used by a render */
+void
+TimeBlurPlugin::purgeCaches()
+{
+    _cache.purge();
+}
+
 mDeclarePluginFactory(TimeBlurPluginFactory, {}, {});
 
 void TimeBlurPluginFactory::describe(OFX::ImageEffectDescriptor &desc)
@@ -554,6 +699,27 @@ void TimeBlurPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     }
 
     OFX::shutterDescribeInContext(desc, context, page);
+
+    {
+        IntParamDescriptor *param = desc.defineIntParam(kParamCacheSize);
+        param->setLabel(kParamCacheSizeLabel);
+        param->setHint(kParamCacheSizeHint);
+        param->setDefault(kParamCacheSizeDefault);
+        param->setRange(0, INT_MAX);
+        param->setDisplayRange(0, 4096);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        PushButtonParamDescriptor *param = desc.definePushButtonParam(kParamCacheInfo);
+        param->setLabel(kParamCacheInfoLabel);
+        param->setHint(kParamCacheInfoHint);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
 }
 
 OFX::ImageEffect* TimeBlurPluginFactory::createInstance(OfxImageEffectHandle handle, OFX::ContextEnum /*context*/)
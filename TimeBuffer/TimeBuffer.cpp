@@ -22,10 +22,23 @@
 
 #include <cmath>
 #include <cfloat>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 #include <algorithm>
 //#include <iostream>
 #ifdef _WINDOWS
 #include <windows.h>
+#include <malloc.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #endif
 #ifdef DEBUG
 #include <iostream>
@@ -58,10 +71,16 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginGrouping "Time"
 // History:
 // version 1.0: initial version
+// version 1.1: TimeBufferRead is woken up as soon as the buffer is written, instead of polling
+// version 1.2: multi-slot ring buffer
+// version 1.3: support tiles in TimeBufferRead, and share reference-counted frame buffers instead of copying them under the lock
+// version 1.4: optional persistent backing file, to resume a render after the host was restarted
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 4 // Increment this when you have fixed a bug or made it faster.
 
-#define kSupportsTilesRead 0
+#define kSupportsTilesRead 1
+// TimeBufferWrite must write the whole frame: if the host only rendered the requested window (crop, zoomed viewer, downstream RoI),
+// the slot would never be complete, and TimeBufferRead would wait until the time-out
 #define kSupportsTilesWrite 0
 #define kSupportsMultiResolution 1
 #define kSupportsRenderScale 1
@@ -107,6 +126,21 @@ enum UnorderedRenderEnum {
 #define kParamTimeOutLabel "Time-out"
 #define kParamTimeOutHint "Time-out (in ms) for all operations. Should be larger than the execution time of the whole graphe. 0 means infinite."
 
+#define kParamSlots "slots"
+#define kParamSlotsLabel "Slots"
+#define kParamSlotsHint \
+"Number of frames that may be in flight in the buffer.\n"\
+"With a single slot, TimeBufferRead at frame t+1 must be rendered after TimeBufferRead at frame t, else the render is considered as unordered.\n"\
+"With several slots, TimeBufferRead at frame t+1 may be rendered before TimeBufferRead at frame t, and waits until the image written by TimeBufferWrite at frame t is available, so that the host can render the parts of the graph that do not depend on the buffer in parallel. Changing this resets the buffer."
+#define kParamSlotsDefault 1
+
+#define kParamBackingFile "backingFile"
+#define kParamBackingFileLabel "Backing File"
+#define kParamBackingFileHint \
+"Optional file where the last image written by TimeBufferWrite is stored, with its time and properties. The file is memory-mapped and updated at each frame.\n"\
+"If the buffer has no image for the frame rendered by TimeBufferRead (e.g. because the host was restarted), but the backing file holds the image for that frame, it is restored from the file, so that a render may be resumed at any frame without rendering all the previous frames.\n"\
+"Leave empty to keep the buffer in memory only."
+
 #define kParamReset "reset"
 #define kParamResetLabel "Reset Buffer"
 #define kParamResetHint "Reset the buffer state. Should be done on the TimeBufferRead effect if possible."
@@ -116,6 +150,11 @@ enum UnorderedRenderEnum {
 #define kParamInfoLabel "Info..."
 #define kParamInfoHint "Reset the buffer state."
 
+#define kWaitSlice 50 // maximum time (in ms) between two checks of abort() and time-out when waiting for the buffer
+#define kPageSize 4096 // alignment of the frame buffers
+#define kBackingFileMagic "OFXTBUF" // 7 characters, plus the terminating zero
+#define kBackingFileVersion 1
+
 inline void
 sleep(const unsigned int milliseconds)
 {
@@ -129,40 +168,214 @@ sleep(const unsigned int milliseconds)
 #endif
 }
 
+// wall-clock time in milliseconds, used to measure the time spent waiting
+inline double
+currentTimeMs()
+{
+#ifdef _WINDOWS
+    return (double)GetTickCount();
+#else
+    struct timeval now;
+    gettimeofday(&now, 0);
+    return now.tv_sec * 1000. + now.tv_usec / 1000.;
+#endif
+}
+
+// Windows XP has no condition variables: fall back to polling
+#if defined(_WINDOWS) && defined(_WIN32_WINNT) && (_WIN32_WINNT < 0x0600)
+#define TIMEBUFFER_POLLING
+#endif
+
+/*
+ A notification sent by TimeBufferWrite to wake up TimeBufferRead as soon as the buffer is written.
+
+ The multithread suite has no condition variables, so this uses the native ones.
+ The waiter gets the generation count while holding the buffer mutex, and waits until it changes:
+ a notification sent after the buffer mutex is released, but before the waiter starts waiting, is not lost.
+ If native condition variables are not available, wait() simply sleeps.
+ */
+class TimeBufferEvent
+{
+public:
+    TimeBufferEvent()
+    : _generation(0)
+    {
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+        InitializeCriticalSection(&_mutex);
+        InitializeConditionVariable(&_cond);
+#  else
+        pthread_mutex_init(&_mutex, 0);
+        pthread_cond_init(&_cond, 0);
+#  endif
+#endif
+    }
+
+    ~TimeBufferEvent()
+    {
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+        DeleteCriticalSection(&_mutex);
+#  else
+        pthread_cond_destroy(&_cond);
+        pthread_mutex_destroy(&_mutex);
+#  endif
+#endif
+    }
+
+    unsigned int generation()
+    {
+        lock();
+        unsigned int g = _generation;
+        unlock();
+        return g;
+    }
+
+    // wait until a notification is sent after generation was read, or until milliseconds have elapsed
+    void wait(unsigned int generation, unsigned int milliseconds)
+    {
+#ifdef TIMEBUFFER_POLLING
+        (void)generation;
+        sleep(milliseconds);
+#else
+#  ifdef _WINDOWS
+        DWORD end = GetTickCount() + milliseconds;
+        EnterCriticalSection(&_mutex);
+        while (_generation == generation) {
+            DWORD now = GetTickCount();
+            if ((int)(end - now) <= 0 ||
+                !SleepConditionVariableCS(&_cond, &_mutex, end - now)) {
+                break;
+            }
+        }
+        LeaveCriticalSection(&_mutex);
+#  else
+        struct timeval now;
+        gettimeofday(&now, 0);
+        struct timespec end;
+        end.tv_sec = now.tv_sec + milliseconds / 1000;
+        end.tv_nsec = now.tv_usec * 1000 + (milliseconds % 1000) * 1000000;
+        if (end.tv_nsec >= 1000000000) {
+            ++end.tv_sec;
+            end.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&_mutex);
+        while (_generation == generation) {
+            if (pthread_cond_timedwait(&_cond, &_mutex, &end) == ETIMEDOUT) {
+                break;
+            }
+        }
+        pthread_mutex_unlock(&_mutex);
+#  endif
+#endif
+    }
+
+    // wake up all waiters
+    void notify()
+    {
+        lock();
+        ++_generation;
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+        WakeAllConditionVariable(&_cond);
+#  else
+        pthread_cond_broadcast(&_cond);
+#  endif
+#endif
+        unlock();
+    }
+
+private:
+    void lock()
+    {
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+        EnterCriticalSection(&_mutex);
+#  else
+        pthread_mutex_lock(&_mutex);
+#  endif
+#endif
+    }
+
+    void unlock()
+    {
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+        LeaveCriticalSection(&_mutex);
+#  else
+        pthread_mutex_unlock(&_mutex);
+#  endif
+#endif
+    }
+
+#ifndef TIMEBUFFER_POLLING
+#  ifdef _WINDOWS
+    CRITICAL_SECTION _mutex;
+    CONDITION_VARIABLE _cond;
+#  else
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+#  endif
+#endif
+    unsigned int _generation;
+
+private:
+    // non-copyable
+    TimeBufferEvent(const TimeBufferEvent&);
+    TimeBufferEvent& operator=(const TimeBufferEvent&);
+};
+
 /*
  We maintain a global map from the buffer name to the buffer data.
  
  The buffer data contains:
- - an image buffers stored with its valid read time (which is the write time +1), or an invalid date
+ - a ring of slots (the number of slots is given by the "Slots" parameter of TimeBufferRead, plus one). Each slot stores an image with its valid read time (which is the write time +1), and a state:
+   - free: the slot is not used
+   - pending: TimeBufferRead(t-1) reserved the slot for time t, and TimeBufferWrite(t-1) has not written it yet
+   - written: TimeBufferWrite(t-1) wrote the whole slot, and it can be read by TimeBufferRead(t)
+   TimeBufferWrite does not support tiles, so that the slot is written by a single render.
  - the pointer to the read and the write instances, which should be unique, or NULL if it is not yet created.
+ - the path of the optional backing file, which holds the last image written by TimeBufferWrite, so that a render can be resumed after the host was restarted.
+
+ The slot for time t goes from free to pending to written. It can only be written by TimeBufferWrite(t-1), and only be read by TimeBufferRead(t), so that the operations on each frame stay ordered.
+ A written slot stays readable until the ring is full and it is the oldest slot, so that all the tiles of TimeBufferRead(t) can read it: this is why the ring has one more slot than the "Slots" parameter.
+ With several slots, TimeBufferRead(t+1) may be called before TimeBufferRead(t) has reserved the slot for t+1: it waits for that slot instead of considering the render as unordered.
+
+ The image of a slot is a page-aligned, reference-counted buffer holding the whole frame. Pixels are never copied while the buffer is locked:
+ a render action retains the slot image under the lock, copies its own render window without the lock, and releases the image under the lock.
+ If the slot is recycled or the buffer is reset meanwhile, the image stays alive until it is released.
 
 
  When TimeBufferReadPlugin::render(t) is called:
  * if the write instance does not exist, an error is displayed and render fails
  * if t <= startTime:
    - a black image is rendered
-   - if t == startTime, the buffer is locked and marked as dirty, with date t+1, then unlocked
+   - if t == startTime, the buffer is locked, all slots are freed and the slot for t+1 is reserved, then unlocked. If the slot for t+1 is the latest slot and is still pending, this was already done by another tile of the same frame, and the buffer is left as is.
  * if t > startTime:
-   - the buffer is locked, and if it doesn't have date t, then either the render fails, a black image is rendered, or the buffer is used anyway, depending on the user-chosen strategy
-   - if it is marked as dirty, it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-   - when the buffer is locked and clean, it is copied to output and unlocked
-   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
+   - the buffer is locked, and if there is no slot for t, but the backing file holds the image for t, the file is read with the buffer unlocked, then the slot for t is restored from it, unless it was reserved meanwhile
+   - if there is still no slot for t (and, with several slots, no earlier frame is in flight), then either the render fails, a black image is rendered, or the latest slot is used anyway, depending on the user-chosen strategy
+   - if the slot is not written, the buffer is unlocked, and TimeBufferRead waits until TimeBufferWrite notifies that a slot changed, then it is locked and checked again. The wait is interrupted regularly to check abort() and the time-out.
+   - when the buffer is locked and the slot is written, its image is retained, the slot for t+1 is reserved (if it is not yet), and the buffer is unlocked
+   - the render window is copied from the slot image to output, then the image is released
 
  When TimeBufferReadPlugin::getRegionOfDefinition(t) is called:
  * if the write instance does not exist, an error is displayed and render fails
  * if t <= startTime:
  - the RoD is empty
  * if t > startTime:
- - the buffer is locked, and if it doesn't have date t, then either getRoD fails, a black image with an empty RoD is rendered, or the RoD from buffer is used anyway, depending on the user-chosen strategy
- - if it is marked as dirty ,it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
- - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
+ - the buffer is locked, and if there is no slot for t, then either getRoD fails, a black image with an empty RoD is rendered, or the RoD from the latest slot is used anyway, depending on the user-chosen strategy
+ - if the slot is not written, the buffer is unlocked, and TimeBufferRead waits until TimeBufferWrite notifies that a slot changed, then it is locked and checked again. The wait is interrupted regularly to check abort() and the time-out.
+ - when the buffer is locked and the slot is written, the slot's RoD is returned and the buffer is unlocked
 
 
  When TimeBufferWritePlugin::render(t) is called:
  - if the read instance does not exist, an error is displayed and render fails
  - if the "Sync" input is not connected, issue an error message (it should be connected to TimeBufferRead)
- - the buffer is locked for writing, and if it doesn't have date t+1 or is not dirty, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
- - src is copied to the buffer, and it is marked as not dirty, then unlocked
+ - the buffer is locked for writing, and if there is no pending slot for t+1, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
+ - if the slot has no image yet, an image covering the whole output RoD is allocated. The image is retained, then the buffer is unlocked
+ - the render window of src is copied to the slot image
+ - the buffer is locked, the image is released, the slot is marked as written and TimeBufferRead is notified. The buffer is unlocked.
+ - if the slot was written and there is a backing file, the image is saved to the backing file. The file is only written by one render at a time, and never with an earlier frame than the one it holds.
  - src is also copied to output.
 
 
@@ -176,14 +389,82 @@ sleep(const unsigned int milliseconds)
 
  */
 
-struct TimeBuffer {
-    OFX::ImageEffect *readInstance; // written only once, not protected by mutex
-    OFX::ImageEffect *writeInstance; // written only once, not protected by mutex
+enum SlotStateEnum {
+    eSlotStateFree = 0,
+    eSlotStatePending, // reserved by TimeBufferRead, waiting for TimeBufferWrite
+    eSlotStateWritten, // written by TimeBufferWrite, waiting for TimeBufferRead
+};
 
-    mutable OFX::MultiThread::Mutex mutex;
+// A page-aligned image buffer, shared by a slot and the render actions that read or write it.
+// The reference count is only modified with the TimeBuffer mutex locked.
+class TimeBufferData
+{
+public:
+    // returns NULL if the memory could not be allocated
+    static TimeBufferData* create(size_t size)
+    {
+        void* data = 0;
+#ifdef _WINDOWS
+        data = _aligned_malloc(size, kPageSize);
+#else
+        if (posix_memalign(&data, kPageSize, size) != 0) {
+            data = 0;
+        }
+#endif
+        if (!data) {
+            return NULL;
+        }
+        return new TimeBufferData(data, size);
+    }
+
+    void retain()
+    {
+        ++_refCount;
+    }
+
+    void release()
+    {
+        assert(_refCount > 0);
+        if (--_refCount == 0) {
+            delete this;
+        }
+    }
+
+    void* data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+private:
+    TimeBufferData(void* data, size_t size)
+    : _data(data)
+    , _size(size)
+    , _refCount(1)
+    {
+    }
+
+    ~TimeBufferData()
+    {
+#ifdef _WINDOWS
+        _aligned_free(_data);
+#else
+        free(_data);
+#endif
+    }
+
+    void* _data;
+    size_t _size;
+    int _refCount;
+
+private:
+    // non-copyable
+    TimeBufferData(const TimeBufferData&);
+    TimeBufferData& operator=(const TimeBufferData&);
+};
+
+struct TimeBufferSlot {
     double time; // can store any integer from 0 to 2^53
-    bool dirty; // TimeBufferRead sets this to true and sets date to t+1, TimeBufferWrite sets this to false
-    std::vector<unsigned char> pixelData;
+    SlotStateEnum state;
+    TimeBufferData* data; // the whole frame, or NULL until TimeBufferWrite starts writing it
     OfxRectI bounds;
     OFX::PixelComponentEnum pixelComponents;
     int pixelComponentCount;
@@ -192,13 +473,10 @@ struct TimeBuffer {
     OfxPointD renderScale;
     double par;
 
-    TimeBuffer()
-    : readInstance(0)
-    , writeInstance(0)
-    , mutex()
-    , time(-DBL_MAX)
-    , dirty(true)
-    , pixelData()
+    TimeBufferSlot()
+    : time(-DBL_MAX)
+    , state(eSlotStateFree)
+    , data(0)
     , pixelComponents(ePixelComponentNone)
     , pixelComponentCount(0)
     , bitDepth(eBitDepthNone)
@@ -208,6 +486,371 @@ struct TimeBuffer {
         bounds.x1 = bounds.y1 = bounds.x2 = bounds.y2 = 0;
         renderScale.x = renderScale.y = 1;
     }
+
+    // must be called with the TimeBuffer mutex locked
+    void clear(double t, SlotStateEnum s)
+    {
+        if (data) {
+            data->release();
+            data = 0;
+        }
+        time = t;
+        state = s;
+    }
+};
+
+// The header of the backing file, followed by the pixels of the slot.
+// The file is only usable on the architecture that wrote it.
+struct TimeBufferFileHeader {
+    char magic[8]; // kBackingFileMagic
+    int version; // kBackingFileVersion
+    int valid; // 0 while the pixels are being written
+    double time;
+    OfxRectI bounds;
+    int pixelComponents;
+    int pixelComponentCount;
+    int bitDepth;
+    int rowBytes;
+    OfxPointD renderScale;
+    double par;
+    unsigned long long dataSize;
+};
+
+// A file mapped in memory, unmapped and closed on destruction.
+class TimeBufferMappedFile
+{
+public:
+    TimeBufferMappedFile()
+    : _data(0)
+    , _size(0)
+#ifdef _WINDOWS
+    , _file(INVALID_HANDLE_VALUE)
+    , _mapping(0)
+#else
+    , _fd(-1)
+#endif
+    {
+    }
+
+    ~TimeBufferMappedFile()
+    {
+#ifdef _WINDOWS
+        if (_data) {
+            UnmapViewOfFile(_data);
+        }
+        if (_mapping) {
+            CloseHandle(_mapping);
+        }
+        if (_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(_file);
+        }
+#else
+        if (_data) {
+            munmap(_data, _size);
+        }
+        if (_fd >= 0) {
+            close(_fd);
+        }
+#endif
+    }
+
+    // map the whole file for reading. Returns false on failure.
+    bool openRead(const std::string& path)
+    {
+#ifdef _WINDOWS
+        _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (_file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0) {
+            return false;
+        }
+        _size = (size_t)size.QuadPart;
+        _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!_mapping) {
+            return false;
+        }
+        _data = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        _fd = open(path.c_str(), O_RDONLY);
+        if (_fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(_fd, &st) != 0 || st.st_size == 0) {
+            return false;
+        }
+        _size = (size_t)st.st_size;
+        void* data = mmap(0, _size, PROT_READ, MAP_SHARED, _fd, 0);
+        _data = (data == MAP_FAILED) ? 0 : data;
+#endif
+        return _data != 0;
+    }
+
+    // create or truncate the file to size bytes, and map it for writing. Returns false on failure.
+    bool openWrite(const std::string& path, size_t size)
+    {
+        _size = size;
+#ifdef _WINDOWS
+        _file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (_file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER offset;
+        offset.QuadPart = (LONGLONG)size;
+        if (!SetFilePointerEx(_file, offset, NULL, FILE_BEGIN) || !SetEndOfFile(_file)) {
+            return false;
+        }
+        _mapping = CreateFileMappingA(_file, NULL, PAGE_READWRITE, 0, 0, NULL);
+        if (!_mapping) {
+            return false;
+        }
+        _data = MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, 0);
+#else
+        _fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) {
+            return false;
+        }
+        if (ftruncate(_fd, (off_t)size) != 0) {
+            return false;
+        }
+        void* data = mmap(0, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        _data = (data == MAP_FAILED) ? 0 : data;
+#endif
+        return _data != 0;
+    }
+
+    // write the mapped memory back to the file
+    bool flush()
+    {
+#ifdef _WINDOWS
+        return FlushViewOfFile(_data, 0) && FlushFileBuffers(_file);
+#else
+        return msync(_data, _size, MS_SYNC) == 0;
+#endif
+    }
+
+    void* data() const { return _data; }
+
+    size_t size() const { return _size; }
+
+private:
+    void* _data;
+    size_t _size;
+#ifdef _WINDOWS
+    HANDLE _file;
+    HANDLE _mapping;
+#else
+    int _fd;
+#endif
+
+private:
+    // non-copyable
+    TimeBufferMappedFile(const TimeBufferMappedFile&);
+    TimeBufferMappedFile& operator=(const TimeBufferMappedFile&);
+};
+
+// save the pixels of a written slot, described by header, to the backing file.
+// The header is marked as valid only once the pixels are on disk, so that a partially written file is never restored.
+static bool
+saveBackingFile(const std::string& path, const TimeBufferFileHeader& header, const void* data)
+{
+    TimeBufferMappedFile file;
+    if (!file.openWrite(path, sizeof(TimeBufferFileHeader) + header.dataSize)) {
+        return false;
+    }
+    TimeBufferFileHeader* fileHeader = (TimeBufferFileHeader*)file.data();
+    *fileHeader = header;
+    fileHeader->valid = 0;
+    std::memcpy((char*)file.data() + sizeof(TimeBufferFileHeader), data, header.dataSize);
+    if (!file.flush()) {
+        return false;
+    }
+    fileHeader->valid = 1;
+    return file.flush();
+}
+
+// load the pixels for time from the backing file.
+// Returns NULL if the file does not exist, is not valid, or holds another frame.
+static TimeBufferData*
+loadBackingFile(const std::string& path, double time, TimeBufferFileHeader* header)
+{
+    TimeBufferMappedFile file;
+    if (!file.openRead(path) || file.size() < sizeof(TimeBufferFileHeader)) {
+        return NULL;
+    }
+    *header = *(const TimeBufferFileHeader*)file.data();
+    if (std::strncmp(header->magic, kBackingFileMagic, sizeof(header->magic)) != 0 ||
+        header->version != kBackingFileVersion ||
+        !header->valid ||
+        header->time != time ||
+        header->bounds.x2 < header->bounds.x1 ||
+        header->bounds.y2 < header->bounds.y1 ||
+        header->dataSize != (unsigned long long)header->rowBytes * (header->bounds.y2 - header->bounds.y1) ||
+        file.size() < sizeof(TimeBufferFileHeader) + header->dataSize) {
+        return NULL;
+    }
+    TimeBufferData* data = TimeBufferData::create(std::max((size_t)1, (size_t)header->dataSize));
+    if (data) {
+        std::memcpy(data->data(), (const char*)file.data() + sizeof(TimeBufferFileHeader), header->dataSize);
+    }
+    return data;
+}
+
+struct TimeBuffer {
+    OFX::ImageEffect *readInstance; // written only once, not protected by mutex
+    OFX::ImageEffect *writeInstance; // written only once, not protected by mutex
+
+    mutable OFX::MultiThread::Mutex mutex;
+    TimeBufferEvent changed; // notified whenever a slot is reserved or written
+    int slotCount; // the number of frames that may be in flight
+    std::vector<TimeBufferSlot> slots; // slotCount+1 slots, so that the slot being read is not recycled by the next reservation
+    std::string backingFile; // empty if the buffer is not persistent
+
+    unsigned int restartCount; // incremented each time the sequence is restarted at startFrame
+    mutable OFX::MultiThread::Mutex fileMutex; // serializes the accesses to the backing file, locked without the buffer mutex
+    double fileTime; // the time of the image in the backing file, protected by fileMutex
+    unsigned int fileRestartCount; // the value of restartCount when the backing file was last cleared, protected by fileMutex
+
+    TimeBuffer()
+    : readInstance(0)
+    , writeInstance(0)
+    , mutex()
+    , changed()
+    , slotCount(1)
+    , slots(2)
+    , backingFile()
+    , restartCount(0)
+    , fileMutex()
+    , fileTime(-DBL_MAX)
+    , fileRestartCount(0)
+    {
+    }
+
+    ~TimeBuffer()
+    {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            slots[i].clear(-DBL_MAX, eSlotStateFree);
+        }
+    }
+
+    // Must be called with fileMutex locked, and without the mutex.
+    // Bring the backing file up to date with the restart number count (a value of restartCount): if the sequence was
+    // restarted since the file was last cleared, the file is removed, since it holds a frame of the previous run, which
+    // may be later than the frames of the new run.
+    // Returns false if count is older than the last restart, i.e. the frame to save belongs to a previous run.
+    bool updateFileRestart(const std::string& path, unsigned int count)
+    {
+        if (count < fileRestartCount) {
+            return false;
+        }
+        if (count > fileRestartCount) {
+            fileRestartCount = count;
+            fileTime = -DBL_MAX;
+            if (!path.empty()) {
+                std::remove(path.c_str());
+            }
+        }
+        return true;
+    }
+
+    // All the following functions must be called with the mutex locked.
+
+    // free all slots, and set the number of slots
+    void reset(int count)
+    {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            slots[i].clear(-DBL_MAX, eSlotStateFree);
+        }
+        slotCount = std::max(1, count);
+        slots.assign(slotCount + 1, TimeBufferSlot());
+    }
+
+    // the slot for time, or NULL if there is none
+    TimeBufferSlot* findSlot(double time)
+    {
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].state != eSlotStateFree && slots[i].time == time) {
+                return &slots[i];
+            }
+        }
+        return NULL;
+    }
+
+    // the slot with the latest time, or NULL if all slots are free
+    TimeBufferSlot* latestSlot()
+    {
+        TimeBufferSlot* latest = NULL;
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].state != eSlotStateFree && (!latest || slots[i].time > latest->time)) {
+                latest = &slots[i];
+            }
+        }
+        return latest;
+    }
+
+    // true if the slot for time may still be reserved by an earlier frame in flight
+    bool isExpected(double time) const
+    {
+        if (slotCount <= 1) {
+            return false;
+        }
+        for (size_t i = 0; i < slots.size(); ++i) {
+            if (slots[i].state != eSlotStateFree && slots[i].time < time && slots[i].time >= time - slotCount) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // reserve the slot for time if it is not reserved yet, reusing the oldest slot if no slot is free
+    void reserve(double time)
+    {
+        if (findSlot(time)) {
+            return;
+        }
+        TimeBufferSlot* slot = 0;
+        for (size_t i = 0; !slot && i < slots.size(); ++i) {
+            if (slots[i].state == eSlotStateFree) {
+                slot = &slots[i];
+            }
+        }
+        if (!slot) {
+            slot = &slots[0];
+            for (size_t i = 1; i < slots.size(); ++i) {
+                if (slots[i].time < slot->time) {
+                    slot = &slots[i];
+                }
+            }
+        }
+        slot->clear(time, eSlotStatePending);
+        changed.notify();
+    }
+
+    // publish the image for time, loaded from the backing file, as a written slot.
+    // Returns false, and releases data, if the slot for time was reserved meanwhile.
+    bool restore(double time, TimeBufferData* data, const TimeBufferFileHeader& header)
+    {
+        if (findSlot(time)) {
+            data->release();
+            return false;
+        }
+        reserve(time);
+        TimeBufferSlot* slot = findSlot(time);
+        assert(slot);
+        slot->clear(time, eSlotStateWritten);
+        slot->data = data;
+        slot->bounds = header.bounds;
+        slot->pixelComponents = (OFX::PixelComponentEnum)header.pixelComponents;
+        slot->pixelComponentCount = header.pixelComponentCount;
+        slot->bitDepth = (OFX::BitDepthEnum)header.bitDepth;
+        slot->rowBytes = header.rowBytes;
+        slot->renderScale = header.renderScale;
+        slot->par = header.par;
+        changed.notify();
+        return true;
+    }
 };
 
 // This is the global map from buffer names to buffers.
@@ -233,6 +876,8 @@ public:
     , _startFrame(0)
     , _unorderedRender(0)
     , _timeOut(0)
+    , _slots(0)
+    , _backingFile(0)
     , _resetTrigger(0)
     , _sublabel(0)
     , _buffer(0)
@@ -251,9 +896,11 @@ public:
         _startFrame = fetchIntParam(kParamStartFrame);
         _unorderedRender = fetchChoiceParam(kParamUnorderedRender);
         _timeOut = fetchDoubleParam(kParamTimeOut);
+        _slots = fetchIntParam(kParamSlots);
+        _backingFile = fetchStringParam(kParamBackingFile);
         _resetTrigger = fetchBooleanParam(kParamResetTrigger);
         _sublabel = fetchStringParam(kNatronOfxParamStringSublabelName);
-        assert(_bufferName && _startFrame && _unorderedRender && _sublabel);
+        assert(_bufferName && _startFrame && _unorderedRender && _slots && _backingFile && _sublabel);
 
         std::string name;
         _bufferName->getValue(name);
@@ -320,6 +967,11 @@ private:
                 _buffer = new TimeBuffer;
             }
             _buffer->readInstance = this;
+            {
+                OFX::MultiThread::AutoMutex guard(_buffer->mutex);
+                _buffer->reset(_slots->getValue());
+                _backingFile->getValue(_buffer->backingFile);
+            }
             _name = name;
             {
                 OFX::MultiThread::AutoMutex guard(*gTimeBufferMapMutex);
@@ -375,6 +1027,74 @@ private:
 #endif
     }
 
+    enum WaitResultEnum {
+        eWaitResultWritten = 0,
+        eWaitResultMissing,
+        eWaitResultAborted,
+        eWaitResultTimedOut,
+    };
+
+    // wait until the slot for time is written by TimeBufferWrite.
+    // The buffer mutex must be locked by guard, and it is locked on return.
+    WaitResultEnum waitSlot(TimeBuffer* timeBuffer, OFX::MultiThread::AutoMutex& guard, double time, TimeBufferSlot** slot)
+    {
+        const double timeout = _timeOut->getValue(); // 0 means infinite
+        const double start = currentTimeMs();
+        for (;;) {
+            *slot = timeBuffer->findSlot(time);
+            if (*slot && (*slot)->state == eSlotStateWritten) {
+                return eWaitResultWritten;
+            }
+            if (!*slot && !timeBuffer->isExpected(time)) {
+                // the backing file may hold the image for time: it is read without the buffer lock
+                const std::string backingFile = timeBuffer->backingFile;
+                if (backingFile.empty()) {
+                    return eWaitResultMissing;
+                }
+                guard.unlock();
+                TimeBufferFileHeader header;
+                TimeBufferData* data = 0;
+                {
+                    OFX::MultiThread::AutoMutex fileGuard(timeBuffer->fileMutex);
+                    data = loadBackingFile(backingFile, time, &header);
+                }
+                guard.relock();
+                if (!data) {
+                    if (timeBuffer->findSlot(time)) {
+                        continue; // reserved meanwhile
+                    }
+                    return eWaitResultMissing;
+                }
+                timeBuffer->restore(time, data, header); // may fail if another render published the slot meanwhile: check again
+                continue;
+            }
+            if (timeout > 0. && currentTimeMs() - start >= timeout) {
+                return eWaitResultTimedOut;
+            }
+            const unsigned int generation = timeBuffer->changed.generation();
+            guard.unlock();
+            timeBuffer->changed.wait(generation, kWaitSlice);
+            guard.relock();
+            if (abort()) {
+                return eWaitResultAborted;
+            }
+        }
+    }
+
+    // wait for the slot to read at time, or for the latest slot if the user chose so and there is no slot for time.
+    // The buffer mutex must be locked by guard, and it is locked on return.
+    WaitResultEnum waitSlotOrLatest(TimeBuffer* timeBuffer, OFX::MultiThread::AutoMutex& guard, double time, TimeBufferSlot** slot)
+    {
+        WaitResultEnum result = waitSlot(timeBuffer, guard, time, slot);
+        if (result == eWaitResultMissing && (UnorderedRenderEnum)_unorderedRender->getValue() == eUnorderedRenderLast) {
+            TimeBufferSlot* latest = timeBuffer->latestSlot();
+            if (latest) {
+                result = waitSlot(timeBuffer, guard, latest->time, slot);
+            }
+        }
+        return result;
+    }
+
     TimeBuffer* getBuffer()
     {
         std::string key = _projectId + '.' + _groupId + '.' + _name;
@@ -419,6 +1139,8 @@ private:
     OFX::IntParam *_startFrame;
     OFX::ChoiceParam *_unorderedRender;
     OFX::DoubleParam *_timeOut;
+    OFX::IntParam *_slots;
+    OFX::StringParam *_backingFile;
     OFX::BooleanParam *_resetTrigger;
     OFX::StringParam *_sublabel;
 
@@ -470,66 +1192,66 @@ TimeBufferReadPlugin::render(const OFX::RenderArguments &args)
     int startFrame = _startFrame->getValue();
     // * if t <= startTime:
     //   - a black image is rendered
-    //   - if t == startTime, the buffer is locked and marked as dirty, with date t+1, then unlocked
+    //   - if t == startTime, the buffer is locked, all slots are freed and the slot for t+1 is reserved, then unlocked,
+    //     unless another tile of this frame already did it
     if (time <= startFrame) {
         clearPersistentMessage();
         fillBlack(*this, args.renderWindow, dst.get());
         if (time == startFrame) {
-            OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
-            timeBuffer->dirty = true;
-            timeBuffer->time = time + 1;
+            bool restarted = false;
+            unsigned int restartCount = 0;
+            std::string backingFile;
+            {
+                OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
+                TimeBufferSlot* latest = timeBuffer->latestSlot();
+                if (!latest || latest->time != time + 1 || latest->state != eSlotStatePending) {
+                    timeBuffer->reset(timeBuffer->slotCount);
+                    timeBuffer->reserve(time + 1);
+                    restarted = true;
+                    restartCount = ++timeBuffer->restartCount;
+                    backingFile = timeBuffer->backingFile;
+                }
+            }
+            // the backing file holds a frame of the previous run, which must neither be restored nor prevent
+            // saving the earlier frames of this run
+            if (restarted) {
+                OFX::MultiThread::AutoMutex fileGuard(timeBuffer->fileMutex);
+                timeBuffer->updateFileRestart(backingFile, restartCount);
+            }
         }
         clearPersistentMessage();
         return;
     }
     OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
     // * if t > startTime:
-    //   - the buffer is locked, and if it doesn't have date t, then either the render fails, a black image is rendered, or the buffer is used anyway, depending on the user-chosen strategy
-    if (timeBuffer->time != time) {
-        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
-        switch (e) {
-            case eUnorderedRenderError:
-                setPersistentMessage(OFX::Message::eMessageError, "", "Frames must be rendered in sequential order");
-                OFX::throwSuiteStatusException(kOfxStatFailed);
-                return;
-            case eUnorderedRenderBlack:
-                fillBlack(*this, args.renderWindow, dst.get());
-                timeBuffer->dirty = true;
-                timeBuffer->time = time + 1;
-                return;
-            case eUnorderedRenderLast:
-                // nothing special to do, continue.
-                break;
-        }
-    }
-    //   - if it is marked as dirty, it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-    int delay = 5; // initial delay, in milliseconds
-    double timeout = _timeOut->getValue();
-    while (timeBuffer->dirty) {
-        guard.unlock();
-        sleep(delay);
-        if (abort()) {
+    //   - the buffer is locked, and if there is no slot for t (and, with several slots, no earlier frame is in flight), then either the render fails, a black image is rendered, or the latest slot is used anyway, depending on the user-chosen strategy
+    //   - if the slot is not written, the buffer is unlocked, and we wait until TimeBufferWrite notifies that a slot changed, then it is locked and checked again. abort() and the time-out are checked regularly.
+    TimeBufferSlot* slot = 0;
+    const WaitResultEnum waitResult = waitSlotOrLatest(timeBuffer, guard, time, &slot);
+    switch (waitResult) {
+        case eWaitResultWritten:
+            break;
+        case eWaitResultAborted:
             return;
-        }
-        delay *= 2;
-        if (delay > timeout) {
+        case eWaitResultMissing:
+        case eWaitResultTimedOut: {
             UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
             switch (e) {
                 case eUnorderedRenderError:
                 case eUnorderedRenderLast:
-                    setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
+                    setPersistentMessage(OFX::Message::eMessageError, "", waitResult == eWaitResultTimedOut ? "Timed out" : "Frames must be rendered in sequential order");
                     OFX::throwSuiteStatusException(kOfxStatFailed);
                     return;
                 case eUnorderedRenderBlack:
                     fillBlack(*this, args.renderWindow, dst.get());
-                    timeBuffer->dirty = true;
-                    timeBuffer->time = time + 1;
+                    timeBuffer->reserve(time + 1);
                     return;
             }
+            break;
         }
-        guard.relock();
     }
-    if (args.renderScale.x != timeBuffer->renderScale.x || args.renderScale.y != timeBuffer->renderScale.y) {
+    assert(slot && slot->state == eSlotStateWritten);
+    if (args.renderScale.x != slot->renderScale.x || args.renderScale.y != slot->renderScale.y) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
             case eUnorderedRenderError:
@@ -539,23 +1261,32 @@ TimeBufferReadPlugin::render(const OFX::RenderArguments &args)
                 return;
             case eUnorderedRenderBlack:
                 fillBlack(*this, args.renderWindow, dst.get());
-                timeBuffer->dirty = true;
-                timeBuffer->time = time + 1;
+                timeBuffer->reserve(time + 1);
                 return;
         }
     }
-    //   - when the buffer is locked and clean, it is copied to output and unlocked
+    //   - when the buffer is locked and the slot is written, its image is retained, the slot for t+1 is reserved (if it is not yet), and the buffer is unlocked
+    TimeBufferData* data = slot->data;
+    assert(data);
+    data->retain();
+    const OfxRectI bounds = slot->bounds;
+    const OFX::PixelComponentEnum pixelComponents = slot->pixelComponents;
+    const int pixelComponentCount = slot->pixelComponentCount;
+    const OFX::BitDepthEnum bitDepth = slot->bitDepth;
+    const int rowBytes = slot->rowBytes;
+    timeBuffer->reserve(time + 1);
+    guard.unlock();
+    //   - the render window is copied from the slot image to output, then the image is released
     copyPixels(*this, args.renderWindow,
-               (void*)&timeBuffer->pixelData.front(),
-               timeBuffer->bounds,
-               timeBuffer->pixelComponents,
-               timeBuffer->pixelComponentCount,
-               timeBuffer->bitDepth,
-               timeBuffer->rowBytes,
+               data->data(),
+               bounds,
+               pixelComponents,
+               pixelComponentCount,
+               bitDepth,
+               rowBytes,
                dst.get());
-    //   - the buffer is re-locked for writing, and marked as dirty, with date t+1, then unlocked
-    timeBuffer->dirty = true;
-    timeBuffer->time = time + 1;
+    guard.relock();
+    data->release();
     clearPersistentMessage();
     //std::cout << "render! OK\n";
 }
@@ -594,46 +1325,32 @@ TimeBufferReadPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgumen
     }
     OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
     // * if t > startTime:
-    // - the buffer is locked, and if it doesn't have date t, then either getRoD fails, a black image with an empty RoD is rendered, or the RoD from buffer is used anyway, depending on the user-chosen strategy
-    if (timeBuffer->time != time) {
-        UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
-        switch (e) {
-            case eUnorderedRenderError:
-                setPersistentMessage(OFX::Message::eMessageError, "", "Frames must be rendered in sequential order");
-                OFX::throwSuiteStatusException(kOfxStatFailed);
-                return false;
-            case eUnorderedRenderBlack:
-                return false; // use default behavior
-            case eUnorderedRenderLast:
-                // nothing special to do, continue.
-                break;
-        }
-    }
-    // - if it is marked as dirty ,it is unlocked, then locked and read again after a delay (there are no condition variables in the multithread suite, polling is the only solution). The delay starts at 10ms, and is multiplied by two at each unsuccessful lock. abort() is checked at each iteration.
-    int delay = 5; // initial delay, in milliseconds
-    double timeout = _timeOut->getValue();
-    while (timeBuffer->dirty) {
-        guard.unlock();
-        sleep(delay);
-        if (abort()) {
+    // - the buffer is locked, and if there is no slot for t, then either getRoD fails, a black image with an empty RoD is rendered, or the RoD from the latest slot is used anyway, depending on the user-chosen strategy
+    // - if the slot is not written, the buffer is unlocked, and we wait until TimeBufferWrite notifies that a slot changed, then it is locked and checked again. abort() and the time-out are checked regularly.
+    TimeBufferSlot* slot = 0;
+    const WaitResultEnum waitResult = waitSlotOrLatest(timeBuffer, guard, time, &slot);
+    switch (waitResult) {
+        case eWaitResultWritten:
+            break;
+        case eWaitResultAborted:
             return false;
-        }
-        delay *= 2;
-        if (delay > timeout) {
+        case eWaitResultMissing:
+        case eWaitResultTimedOut: {
             UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
             switch (e) {
                 case eUnorderedRenderError:
                 case eUnorderedRenderLast:
-                    setPersistentMessage(OFX::Message::eMessageError, "", "Timed out");
+                    setPersistentMessage(OFX::Message::eMessageError, "", waitResult == eWaitResultTimedOut ? "Timed out" : "Frames must be rendered in sequential order");
                     OFX::throwSuiteStatusException(kOfxStatFailed);
                     return false;
                 case eUnorderedRenderBlack:
                     return false; // use default behavior
             }
+            break;
         }
-        guard.relock();
     }
-    if (args.renderScale.x != timeBuffer->renderScale.x || args.renderScale.y != timeBuffer->renderScale.y) {
+    assert(slot && slot->state == eSlotStateWritten);
+    if (args.renderScale.x != slot->renderScale.x || args.renderScale.y != slot->renderScale.y) {
         UnorderedRenderEnum e = (UnorderedRenderEnum)_unorderedRender->getValue();
         switch (e) {
             case eUnorderedRenderError:
@@ -646,10 +1363,10 @@ TimeBufferReadPlugin::getRegionOfDefinition(const OFX::RegionOfDefinitionArgumen
                 return false;
         }
     }
-    // - when the buffer is locked and clean, the buffer's RoD is returned and it is unlocked
-    OFX::Coords::toCanonical(timeBuffer->bounds,
-                             timeBuffer->renderScale,
-                             timeBuffer->par,
+    // - when the buffer is locked and the slot is written, the slot's RoD is returned and the buffer is unlocked
+    OFX::Coords::toCanonical(slot->bounds,
+                             slot->renderScale,
+                             slot->par,
                              &rod);
     clearPersistentMessage();
     return true;
@@ -664,7 +1381,7 @@ TimeBufferReadPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, con
         _sublabel->setValue(name);
         // check if a TimeBufferRead with the same name exists. If yes, issue an error, else clearPersistentMeassage()
         setName(name);
-    } else if (paramName == kParamReset) {
+    } else if (paramName == kParamReset || paramName == kParamSlots) {
         TimeBuffer* timeBuffer = 0;
         // * if the write instance does not exist, an error is displayed and render fails
         timeBuffer = getBuffer();
@@ -673,16 +1390,15 @@ TimeBufferReadPlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, con
         }
         // reset the buffer to a clean state
         OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset(_slots->getValue());
         _resetTrigger->setValue(!_resetTrigger->getValue()); // trigger a render
+    } else if (paramName == kParamBackingFile) {
+        TimeBuffer* timeBuffer = getBuffer();
+        if (!timeBuffer) {
+            throwSuiteStatusException(kOfxStatFailed);
+        }
+        OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
+        _backingFile->getValue(timeBuffer->backingFile);
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
         // TODO
@@ -806,6 +1522,30 @@ TimeBufferReadPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
             page->addChild(*param);
         }
     }
+    {
+        OFX::IntParamDescriptor* param = desc.defineIntParam(kParamSlots);
+        param->setLabel(kParamSlotsLabel);
+        param->setHint(kParamSlotsHint);
+        param->setRange(1, 16);
+        param->setDisplayRange(1, 8);
+        param->setDefault(kParamSlotsDefault);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+    {
+        OFX::StringParamDescriptor* param = desc.defineStringParam(kParamBackingFile);
+        param->setLabel(kParamBackingFileLabel);
+        param->setHint(kParamBackingFileHint);
+        param->setStringType(eStringTypeFilePath);
+        param->setFilePathExists(false);
+        param->setDefault("");
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
     {
         OFX::PushButtonParamDescriptor* param = desc.definePushButtonParam(kParamReset);
         param->setLabel(kParamResetLabel);
@@ -1114,25 +1854,89 @@ TimeBufferWritePlugin::render(const OFX::RenderArguments &args)
     if (!timeBuffer) {
         throwSuiteStatusException(kOfxStatFailed);
     }
-    // - the buffer is locked for writing, and if it doesn't have date t+1 or is not dirty, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
+    // - the buffer is locked for writing, and if there is no pending slot for t+1, then it is unlocked, render fails and a message is posted. It may be because the TimeBufferRead plugin is not upstream - in this case a solution is to connect TimeBufferRead output to TimeBufferWrite' sync input for syncing.
     {
         OFX::MultiThread::AutoMutex guard(timeBuffer->mutex);
-        if (timeBuffer->time != time+1 || !timeBuffer->dirty) {
+        TimeBufferSlot* slot = timeBuffer->findSlot(time + 1);
+        if (!slot || slot->state != eSlotStatePending ||
+            (slot->data && (slot->renderScale.x != args.renderScale.x || slot->renderScale.y != args.renderScale.y))) {
             setPersistentMessage(OFX::Message::eMessageError, "", "The TimeBuffer has wrong properties. Check that the corresponding TimeBufferRead effect is connected to the Sync input.");
             OFX::throwSuiteStatusException(kOfxStatFailed);
         }
-        // - src is copied to the buffer, and it is marked as not dirty, then unlocked
-        std::vector<unsigned char> pixelData;
-        timeBuffer->bounds = args.renderWindow;
-        timeBuffer->pixelComponents = src->getPixelComponents();
-        timeBuffer->pixelComponentCount = src->getPixelComponentCount();
-        timeBuffer->bitDepth = src->getPixelDepth();
-        timeBuffer->rowBytes = (args.renderWindow.x2 - args.renderWindow.x1) * timeBuffer->pixelComponentCount * sizeof(float);
-        timeBuffer->renderScale = args.renderScale;
-        timeBuffer->par = src->getPixelAspectRatio();
-        timeBuffer->pixelData.resize(timeBuffer->rowBytes * (args.renderWindow.y2 - args.renderWindow.y1));
-        copyPixels(*this, args.renderWindow, src.get(), &timeBuffer->pixelData.front(), timeBuffer->bounds, timeBuffer->pixelComponents, timeBuffer->pixelComponentCount, timeBuffer->bitDepth, timeBuffer->rowBytes);
-        timeBuffer->dirty = false;
+        // - if the slot has no image yet, an image covering the whole output RoD is allocated. The image is retained, then the buffer is unlocked
+        if (!slot->data) {
+            const double par = _dstClip->getPixelAspectRatio();
+            OfxRectI bounds;
+            OFX::Coords::toPixelEnclosing(_dstClip->getRegionOfDefinition(time), args.renderScale, par, &bounds);
+            OFX::Coords::rectBoundingBox(bounds, args.renderWindow, &bounds);
+            slot->bounds = bounds;
+            slot->pixelComponents = dstComponents;
+            slot->pixelComponentCount = dst->getPixelComponentCount();
+            slot->bitDepth = dstBitDepth;
+            slot->rowBytes = (bounds.x2 - bounds.x1) * slot->pixelComponentCount * sizeof(float);
+            slot->renderScale = args.renderScale;
+            slot->par = par;
+            slot->data = TimeBufferData::create(std::max((size_t)1, (size_t)slot->rowBytes * (bounds.y2 - bounds.y1)));
+            if (!slot->data) {
+                OFX::throwSuiteStatusException(kOfxStatErrMemory);
+            }
+        }
+        TimeBufferData* data = slot->data;
+        data->retain();
+        const OfxRectI bounds = slot->bounds;
+        const OFX::PixelComponentEnum pixelComponents = slot->pixelComponents;
+        const int pixelComponentCount = slot->pixelComponentCount;
+        const OFX::BitDepthEnum bitDepth = slot->bitDepth;
+        const int rowBytes = slot->rowBytes;
+        guard.unlock();
+        // - the render window of src is copied to the slot image
+        OfxRectI tile;
+        OFX::Coords::rectIntersection(args.renderWindow, bounds, &tile);
+        copyPixels(*this, tile, src.get(), data->data(), bounds, pixelComponents, pixelComponentCount, bitDepth, rowBytes);
+        // - the buffer is locked, the image is released, the slot is marked as written and TimeBufferRead is notified. The buffer is unlocked.
+        guard.relock();
+        // the slot may have been recycled or the buffer reset while copying
+        slot = timeBuffer->findSlot(time + 1);
+        std::string backingFile;
+        TimeBufferFileHeader header;
+        unsigned int restartCount = 0;
+        if (slot && slot->data == data && slot->state == eSlotStatePending) {
+            slot->state = eSlotStateWritten;
+            timeBuffer->changed.notify();
+            backingFile = timeBuffer->backingFile;
+            restartCount = timeBuffer->restartCount;
+            std::memset(&header, 0, sizeof(header));
+            std::strncpy(header.magic, kBackingFileMagic, sizeof(header.magic));
+            header.version = kBackingFileVersion;
+            header.time = slot->time;
+            header.bounds = slot->bounds;
+            header.pixelComponents = (int)slot->pixelComponents;
+            header.pixelComponentCount = slot->pixelComponentCount;
+            header.bitDepth = (int)slot->bitDepth;
+            header.rowBytes = slot->rowBytes;
+            header.renderScale = slot->renderScale;
+            header.par = slot->par;
+            header.dataSize = (unsigned long long)slot->rowBytes * (slot->bounds.y2 - slot->bounds.y1);
+        }
+        // - if the slot was written and there is a backing file, the image is saved to the backing file
+        bool saved = true;
+        if (!backingFile.empty()) {
+            guard.unlock();
+            {
+                OFX::MultiThread::AutoMutex fileGuard(timeBuffer->fileMutex);
+                // the sequence may have been restarted since the slot was written
+                if (timeBuffer->updateFileRestart(backingFile, restartCount) && header.time >= timeBuffer->fileTime) {
+                    saved = saveBackingFile(backingFile, header, data->data());
+                    timeBuffer->fileTime = saved ? header.time : -DBL_MAX;
+                }
+            }
+            guard.relock();
+        }
+        data->release();
+        if (!saved) {
+            setPersistentMessage(OFX::Message::eMessageError, "", std::string("Cannot write the TimeBuffer backing file \"") + backingFile + "\".");
+            OFX::throwSuiteStatusException(kOfxStatFailed);
+        }
     }
     // - src is also copied to output.
 
@@ -1164,15 +1968,7 @@ TimeBufferWritePlugin::changedParam(const OFX::InstanceChangedArgs &/*args*/, co
             sendMessage(OFX::Message::eMessageError, "", "A TimeBufferRead instance is connected to this buffer, please reset it instead.");
             return;
         }
-        timeBuffer->time = -DBL_MAX;
-        timeBuffer->dirty = true;
-        timeBuffer->pixelComponents = ePixelComponentNone;
-        timeBuffer->pixelComponentCount = 0;
-        timeBuffer->bitDepth = eBitDepthNone;
-        timeBuffer->rowBytes = 0;
-        timeBuffer->par = 1.;
-        timeBuffer->bounds.x1 = timeBuffer->bounds.y1 = timeBuffer->bounds.x2 = timeBuffer->bounds.y2 = 0;
-        timeBuffer->renderScale.x = timeBuffer->renderScale.y = 1;
+        timeBuffer->reset(timeBuffer->slotCount);
         _resetTrigger->setValue(!_resetTrigger->getValue()); // trigger a render
     } else if (paramName == kParamInfo) {
         // give information about allocated buffers
@@ -21,7 +21,11 @@
  */
 
 #include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <vector>
 #include <iostream>
+#include <memory>
 #ifdef _WINDOWS
 #include <windows.h>
 #endif
@@ -29,6 +33,9 @@
 #include "ofxsTransform3x3.h"
 #include "ofxsTransformInteract.h"
 #include "ofxsCoords.h"
+#include "ofxsMaskMix.h"
+
+#include "MipMap.h"
 
 using namespace OFX;
 
@@ -48,11 +55,268 @@ OFXS_NAMESPACE_ANONYMOUS_ENTER
 #define kPluginDirBlurDescription "Apply directional blur to an image.\n"\
 "This plugin concatenates transforms upstream."
 #define kPluginDirBlurIdentifier "net.sf.openfx.DirBlur"
+// History:
+// version 1.0: initial version
+// version 1.1: optional pyramid resampling for large minifications (Transform and TransformMasked)
+// version 1.2: optional running-sum directional blur for translations (DirBlur)
 #define kPluginVersionMajor 1 // Incrementing this number means that you have broken backwards compatibility of the plug-in.
-#define kPluginVersionMinor 0 // Increment this when you have fixed a bug or made it faster.
+#define kPluginVersionMinor 2 // Increment this when you have fixed a bug or made it faster.
 
 #define kParamSrcClipChanged "srcClipChanged"
 
+#define kParamDirBlurFast "fastTranslation"
+#define kParamDirBlurFastLabel "Fast Translation"
+#define kParamDirBlurFastHint "When the transform is a translation and fading is 0, compute the blur with running sums along the blur direction. " \
+"This is faster for long blurs when the host renders large tiles, but each tile still reads the source over the blur length, so there is little gain with scanline or small-tile rendering. " \
+"The result is slightly softer across the blur direction than with the adaptive sampler, which is used when this is unchecked, or when the transform is not a translation."
+
+#define kDirBlurTranslateMinLength 1. // under this blur length in pixels, the adaptive sampler is used
+
+// Directional blur by a translation, computed with running sums: each line of the render window costs its length
+// plus the blur length, so the cost per pixel only becomes independent of the blur length when the window is
+// much larger than the blur.
+// The blur is the average of the source over the segment {p + t * (1, slope), lo <= t <= hi}, expressed in
+// (u, r) coordinates, where u is along the major axis of the blur direction and r along the minor axis,
+// so that |slope| <= 1.
+// The source is sampled once per column u on each rasterized line r = c + u * slope (c integer), with linear
+// interpolation along r, and the window sums are computed from the running sums along each line.
+// A pixel lies between two consecutive lines, and its value is interpolated between the window sums of these lines.
+template <class PIX, int nComponents, int maxValue>
+class DirBlurTranslateProcessor : public OFX::MultiThread::Processor
+{
+public:
+    DirBlurTranslateProcessor(OFX::ImageEffect &effect,
+                              const OFX::Image *src,
+                              OFX::Image *dst,
+                              const OFX::Image *mask,
+                              bool maskInvert,
+                              double mix,
+                              bool blackOutside,
+                              const OfxRectI &renderWindow,
+                              double dx, // translation of the inverse transform for amount 1, in pixels
+                              double dy,
+                              double amountFrom,
+                              double amountTo)
+    : _effect(effect)
+    , _src(src)
+    , _dst(dst)
+    , _mask(mask)
+    , _maskInvert(maskInvert)
+    , _mix(mix)
+    , _blackOutside(blackOutside)
+    , _majorX(std::abs(dx) >= std::abs(dy))
+    , _slope(0.)
+    , _lo(0.)
+    , _hi(0.)
+    , _kmin(0)
+    , _kmax(0)
+    , _cMin(0)
+    , _cMax(-1)
+    {
+        const OfxRectI &srcBounds = src->getBounds();
+        _srcPixels = (const PIX*)src->getPixelAddress(srcBounds.x1, srcBounds.y1);
+        const std::ptrdiff_t rowStride = src->getRowBytes() / (int)sizeof(PIX);
+        const double du = _majorX ? dx : dy;
+        const double dr = _majorX ? dy : dx;
+        if (_majorX) {
+            _srcU1 = srcBounds.x1; _srcU2 = srcBounds.x2; _srcR1 = srcBounds.y1; _srcR2 = srcBounds.y2;
+            _winU1 = renderWindow.x1; _winU2 = renderWindow.x2; _winR1 = renderWindow.y1; _winR2 = renderWindow.y2;
+            _uStride = nComponents;
+            _rStride = rowStride;
+        } else {
+            _srcU1 = srcBounds.y1; _srcU2 = srcBounds.y2; _srcR1 = srcBounds.x1; _srcR2 = srcBounds.x2;
+            _winU1 = renderWindow.y1; _winU2 = renderWindow.y2; _winR1 = renderWindow.x1; _winR2 = renderWindow.x2;
+            _uStride = rowStride;
+            _rStride = nComponents;
+        }
+        if ( (du == 0.) || (amountFrom == amountTo) ) {
+            return;
+        }
+        _slope = dr / du;
+        // the extent of the segment along the major axis
+        _lo = std::min(amountFrom * du, amountTo * du);
+        _hi = std::max(amountFrom * du, amountTo * du);
+        // cells [k-0.5, k+0.5] covered by the segment
+        _kmin = (int)std::floor(_lo + 0.5);
+        _kmax = (int)std::floor(_hi + 0.5);
+        // the lines that contain the pixels of the render window (with a margin for rounding)
+        double cmin = DBL_MAX, cmax = -DBL_MAX;
+        for (int i = 0; i < 4; ++i) {
+            const double c = lineCoord( (i & 1) ? _winU2 - 1 : _winU1, (i & 2) ? _winR2 - 1 : _winR1 );
+            cmin = std::min(cmin, c);
+            cmax = std::max(cmax, c);
+        }
+        _cMin = (int)std::floor(cmin) - 1;
+        _cMax = (int)std::floor(cmax) + 1;
+    }
+
+    // number of lines, which is the maximum number of threads
+    int getNLines() const
+    {
+        return std::max(0, _cMax - _cMin + 1);
+    }
+
+private:
+    // the line coordinate of pixel (u, r): the pixel is between lines floor(c) and floor(c)+1.
+    // Every pixel belongs to exactly one line, since it is always computed by the same expression.
+    double lineCoord(int u, int r) const
+    {
+        return r - u * _slope;
+    }
+
+    // the range of columns u where the render window has pixels belonging to line c, with a margin
+    bool lineRange(int c, int *u1, int *u2) const
+    {
+        double ua, ub;
+        if (_slope == 0.) {
+            if (c < _winR1 - 1 || _winR2 <= c) {
+                return false;
+            }
+            ua = _winU1;
+            ub = _winU2 - 1;
+        } else {
+            // the pixel of line c in column u is near row c + u * slope
+            ua = (_winR1 - 1 - c) / _slope;
+            ub = (_winR2 + 1 - c) / _slope;
+            if (ua > ub) {
+                std::swap(ua, ub);
+            }
+        }
+        *u1 = (int)std::max( (double)_winU1, std::floor(ua) - 1 );
+        *u2 = (int)std::min( (double)_winU2 - 1, std::ceil(ub) + 1 );
+
+        return *u1 <= *u2;
+    }
+
+    // source pixel, or 0 if it is black
+    const PIX* srcPix(int u, int r) const
+    {
+        if (u < _srcU1 || _srcU2 <= u || r < _srcR1 || _srcR2 <= r) {
+            if (_blackOutside || _srcU1 >= _srcU2 || _srcR1 >= _srcR2) {
+                return 0;
+            }
+            u = std::max( _srcU1, std::min(u, _srcU2 - 1) );
+            r = std::max( _srcR1, std::min(r, _srcR2 - 1) );
+        }
+
+        return _srcPixels + (u - _srcU1) * _uStride + (r - _srcR1) * _rStride;
+    }
+
+    // compute the running sums of line c, for columns u1..u2-1
+    void lineSums(int c, int u1, int u2, std::vector<double> &sums) const
+    {
+        sums.resize( (size_t)(u2 - u1 + 1) * nComponents );
+        double *sum = &sums.front();
+        for (int j = 0; j < nComponents; ++j) {
+            sum[j] = 0.;
+        }
+        for (int u = u1; u < u2; ++u, sum += nComponents) {
+            const double y = c + u * _slope;
+            const int r = (int)std::floor(y);
+            const float a = (float)(y - r);
+            const PIX *p0 = srcPix(u, r);
+            const PIX *p1 = srcPix(u, r + 1);
+            for (int j = 0; j < nComponents; ++j) {
+                sum[nComponents + j] = sum[j] + (p0 ? (1.f - a) * p0[j] : 0.f) + (p1 ? a * p1[j] : 0.f);
+            }
+        }
+    }
+
+    // sum of the line samples over the segment starting at column u, weighted by their coverage
+    void windowSum(const std::vector<double> &sums, int u1, int u, double *w) const
+    {
+        const double *s = &sums[(size_t)(u + _kmin - u1) * nComponents];
+        const int n = _kmax - _kmin;
+        if (n == 0) {
+            for (int j = 0; j < nComponents; ++j) {
+                w[j] = (s[nComponents + j] - s[j]) * (_hi - _lo);
+            }
+        } else {
+            const double wLo = _kmin + 0.5 - _lo;
+            const double wHi = _hi - (_kmax - 0.5);
+            const double *e = s + n * nComponents;
+            for (int j = 0; j < nComponents; ++j) {
+                w[j] = wLo * (s[nComponents + j] - s[j]) + (e[j] - s[nComponents + j]) + wHi * (e[nComponents + j] - e[j]);
+            }
+        }
+    }
+
+    virtual void multiThreadFunction(unsigned int threadId, unsigned int nThreads) OVERRIDE FINAL
+    {
+        // each thread renders the pixels of a contiguous range of lines
+        const int n = getNLines();
+        const int c1 = _cMin + (int)(((long long)n * threadId) / nThreads);
+        const int c2 = _cMin + (int)(((long long)n * (threadId + 1)) / nThreads);
+        std::vector<double> sums[2];
+        int sumsU1[2] = { 0, 0 };
+        const double norm = 1. / (_hi - _lo);
+        // line c is used by the pixels of lines c-1 and c
+        for (int c = c1; c <= c2; ++c) {
+            if ( _effect.abort() ) {
+                return;
+            }
+            int ua, ub, ua1, ub1;
+            const bool prevValid = (c > c1) && lineRange(c - 1, &ua, &ub);
+            const bool curValid = (c < c2) && lineRange(c, &ua1, &ub1);
+            std::vector<double> &cur = sums[c & 1];
+            if (prevValid || curValid) {
+                const int u1 = std::min(prevValid ? ua : ua1, curValid ? ua1 : ua) + _kmin;
+                const int u2 = std::max(prevValid ? ub : ub1, curValid ? ub1 : ub) + _kmax + 1;
+                lineSums(c, u1, u2, cur);
+                sumsU1[c & 1] = u1;
+            }
+            if (!prevValid) {
+                continue;
+            }
+            // render the pixels of line c-1, which are between lines c-1 and c
+            const std::vector<double> &prev = sums[(c - 1) & 1];
+            for (int u = ua; u <= ub; ++u) {
+                int r = (int)std::ceil( (c - 1) + u * _slope );
+                while (std::floor( lineCoord(u, r) ) < c - 1) {
+                    ++r;
+                }
+                while (std::floor( lineCoord(u, r - 1) ) >= c - 1) {
+                    --r;
+                }
+                if (r < _winR1 || _winR2 <= r) {
+                    continue;
+                }
+                const double a = lineCoord(u, r) - (c - 1);
+                double w0[nComponents];
+                double w1[nComponents];
+                windowSum(prev, sumsU1[(c - 1) & 1], u, w0);
+                windowSum(cur, sumsU1[c & 1], u, w1);
+                float tmpPix[nComponents];
+                for (int j = 0; j < nComponents; ++j) {
+                    tmpPix[j] = (float)( ( (1. - a) * w0[j] + a * w1[j] ) * norm );
+                }
+                const int x = _majorX ? u : r;
+                const int y = _majorX ? r : u;
+                PIX *dstPix = (PIX *)_dst->getPixelAddress(x, y);
+                ofxsMaskMix<PIX, nComponents, maxValue, true>(tmpPix, x, y, _src, _mask != 0, _mask, (float)_mix, _maskInvert, dstPix);
+            }
+        }
+    }
+
+    OFX::ImageEffect &_effect;
+    const OFX::Image *_src;
+    OFX::Image *_dst;
+    const OFX::Image *_mask;
+    bool _maskInvert;
+    double _mix;
+    bool _blackOutside;
+    bool _majorX;
+    const PIX *_srcPixels;
+    std::ptrdiff_t _uStride;
+    std::ptrdiff_t _rStride;
+    int _srcU1, _srcU2, _srcR1, _srcR2;
+    int _winU1, _winU2, _winR1, _winR2;
+    double _slope;
+    double _lo, _hi;
+    int _kmin, _kmax;
+    int _cMin, _cMax;
+};
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /** @brief The plugin that does our work */
@@ -72,12 +336,18 @@ public:
     , _center(0)
     , _interactive(0)
     , _srcClipChanged(0)
+    , _mipmap(0)
+    , _mipmapPrefilter(0)
+    , _mipmapCache()
+    , _dirBlurFast(0)
     {
         // NON-GENERIC
         if (isDirBlur) {
             _amount = fetchDoubleParam(kParamTransform3x3Amount);
             _centered = fetchBooleanParam(kParamTransform3x3Centered);
             _fading = fetchDoubleParam(kParamTransform3x3Fading);
+            _dirBlurFast = fetchBooleanParam(kParamDirBlurFast);
+            assert(_dirBlurFast);
         }
         
         _translate = fetchDouble2DParam(kParamTransformTranslateOld);
@@ -92,6 +362,11 @@ public:
         assert(_translate && _rotate && _scale && _scaleUniform && _skewX && _skewY && _skewOrder && _center && _interactive);
         _srcClipChanged = fetchBooleanParam(kParamSrcClipChanged);
         assert(_srcClipChanged);
+        if (!isDirBlur) {
+            _mipmap = fetchBooleanParam(kParamMipMap);
+            _mipmapPrefilter = fetchChoiceParam(kParamMipMapPrefilter);
+            assert(_mipmap && _mipmapPrefilter);
+        }
         // On Natron, hide the uniform parameter if it is false and not animated,
         // since uniform scaling is easy through Natron's GUI.
         // The parameter is kept for backward compatibility.
@@ -104,6 +379,8 @@ public:
     }
 
 private:
+    virtual void getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args, OFX::RegionOfInterestSetter &rois) OVERRIDE FINAL;
+
     virtual bool isIdentity(double time) OVERRIDE FINAL;
 
     virtual bool getInverseTransformCanonical(double time, int view, double amount, bool invert, OFX::Matrix3x3* invtransform) const OVERRIDE FINAL;
@@ -115,6 +392,23 @@ private:
     /** @brief called when a clip has just been changed in some way (a rewire maybe) */
     virtual void changedClip(const InstanceChangedArgs &args, const std::string &clipName) OVERRIDE FINAL;
 
+    virtual void render(const OFX::RenderArguments &args) OVERRIDE FINAL;
+
+    virtual void purgeCaches() OVERRIDE FINAL;
+
+    /* pyramid render, which returns false if the pyramid cannot be used */
+    bool renderPyramid(const OFX::RenderArguments &args);
+
+    /* is the transform a translation, whatever the amount? */
+    bool isTranslation(double time) const;
+
+    /* directional blur render functions, which return false if the transform is not a translation */
+    template <class PIX, int nComponents, int maxValue>
+    bool renderDirBlurTranslateForBitDepth(const OFX::RenderArguments &args);
+
+    template <int nComponents>
+    bool renderDirBlurTranslate(const OFX::RenderArguments &args, OFX::BitDepthEnum dstBitDepth);
+
     // NON-GENERIC
     OFX::Double2DParam* _translate;
     OFX::DoubleParam* _rotate;
@@ -126,6 +420,11 @@ private:
     OFX::Double2DParam* _center;
     OFX::BooleanParam* _interactive;
     OFX::BooleanParam* _srcClipChanged; // set to true the first time the user connects src
+    OFX::BooleanParam* _mipmap; // not available in DirBlur
+    OFX::ChoiceParam* _mipmapPrefilter;
+
+    MipMapCache _mipmapCache;
+    OFX::BooleanParam* _dirBlurFast; // only available in DirBlur
 };
 
 // overridden is identity
@@ -167,6 +466,37 @@ TransformPlugin::isIdentity(double time)
     return false;
 }
 
+// the scale, rotation and skew are interpolated by getInverseTransformCanonical, so they must have no effect
+bool
+TransformPlugin::isTranslation(double time) const
+{
+    // NON-GENERIC
+    OfxPointD scaleParam = { 1., 1. };
+    if (_scale) {
+        _scale->getValueAtTime(time, scaleParam.x, scaleParam.y);
+    }
+    bool scaleUniform = false;
+    if (_scaleUniform) {
+        _scaleUniform->getValueAtTime(time, scaleUniform);
+    }
+    OfxPointD scale = { 1., 1. };
+    ofxsTransformGetScale(scaleParam, scaleUniform, &scale);
+    double rotate = 0.;
+    if (_rotate) {
+        _rotate->getValueAtTime(time, rotate);
+    }
+    double skewX = 0.;
+    if (_skewX) {
+        _skewX->getValueAtTime(time, skewX);
+    }
+    double skewY = 0.;
+    if (_skewY) {
+        _skewY->getValueAtTime(time, skewY);
+    }
+
+    return scale.x == 1. && scale.y == 1. && rotate == 0. && skewX == 0. && skewY == 0.;
+}
+
 bool
 TransformPlugin::getInverseTransformCanonical(double time, int /*view*/, double amount, bool invert, OFX::Matrix3x3* invtransform) const
 {
@@ -361,6 +691,245 @@ TransformPlugin::changedClip(const InstanceChangedArgs &args, const std::string
     }
 }
 
+// override the roi call
+void
+TransformPlugin::getRegionsOfInterest(const OFX::RegionsOfInterestArguments &args,
+                                      OFX::RegionOfInterestSetter &rois)
+{
+    Transform3x3Plugin::getRegionsOfInterest(args, rois);
+
+    const double time = args.time;
+    if (!_mipmap || !_srcClip || !_srcClip->isConnected() || !_mipmap->getValueAtTime(time)) {
+        return;
+    }
+    // The pyramid is computed from the whole source image, so that all the tiles of the frame can share it.
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+    OFX::Matrix3x3 invtransform;
+    if (!getInverseTransformCanonical(time, 0, 1., invert, &invtransform) ||
+        mipmapMaxLod(invtransform, args.regionOfInterest) < 1.) {
+        return;
+    }
+    OfxRectD srcRoD = _srcClip->getRegionOfDefinition(time);
+    if (srcRoD.x1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= srcRoD.x2 ||
+        srcRoD.y1 <= kOfxFlagInfiniteMin || kOfxFlagInfiniteMax <= srcRoD.y2 ||
+        OFX::Coords::rectIsEmpty(srcRoD)) {
+        return;
+    }
+    rois.setRegionOfInterest(*_srcClip, srcRoD);
+}
+
+bool
+TransformPlugin::renderPyramid(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    // the pyramid is not used with motion blur
+    double motionblur = 0.;
+    if (_motionblur) {
+        _motionblur->getValueAtTime(time, motionblur);
+    }
+    bool directionalBlur = false;
+    if (_directionalBlur) {
+        _directionalBlur->getValueAtTime(time, directionalBlur);
+    }
+    if (motionblur != 0. || directionalBlur || !_srcClip || !_srcClip->isConnected()) {
+        return false;
+    }
+
+    // the transform from destination pixels to source pixels
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    OFX::Matrix3x3 invtransform;
+    if (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, _srcClip->getPixelAspectRatio(), _dstClip->getPixelAspectRatio(), invert, 0., 1., &invtransform, 0, 1) != 1) {
+        return false;
+    }
+
+    FilterEnum filter = args.renderQualityDraft ? eFilterImpulse : eFilterCubic;
+    if (!args.renderQualityDraft && _filter) {
+        filter = (FilterEnum)_filter->getValueAtTime(time);
+    }
+    bool clamp = false;
+    if (_clamp) {
+        _clamp->getValueAtTime(time, clamp);
+    }
+    bool blackOutside = true;
+    if (_blackOutside) {
+        _blackOutside->getValueAtTime(time, blackOutside);
+    }
+    double mix = 1.;
+    if (_mix) {
+        _mix->getValueAtTime(time, mix);
+    }
+    MipMapPrefilterEnum prefilter = (MipMapPrefilterEnum)_mipmapPrefilter->getValueAtTime(time);
+
+    bool doMasking = ((!_maskApply || _maskApply->getValueAtTime(time)) && _maskClip && _maskClip->isConnected());
+    bool maskInvert = false;
+    if (doMasking && _maskInvert) {
+        _maskInvert->getValueAtTime(time, maskInvert);
+    }
+
+    return mipmapRender(*this, _mipmapCache, args, _srcClip, _dstClip, doMasking ? _maskClip : 0, maskInvert,
+                        invtransform, prefilter, filter, clamp, blackOutside, mix);
+}
+
+template <class PIX, int nComponents, int maxValue>
+bool
+TransformPlugin::renderDirBlurTranslateForBitDepth(const OFX::RenderArguments &args)
+{
+    const double time = args.time;
+    // the running sums give the same weight to all the transforms
+    double fading = 0.;
+    if (_fading) {
+        _fading->getValueAtTime(time, fading);
+    }
+    if (fading != 0.) {
+        return false;
+    }
+    double amount = 1.;
+    if (_amount) {
+        _amount->getValueAtTime(time, amount);
+    }
+    bool centered = false;
+    if (_centered) {
+        _centered->getValueAtTime(time, centered);
+    }
+    std::auto_ptr<const OFX::Image> src((_srcClip && _srcClip->isConnected()) ?
+                                        _srcClip->fetchImage(time) : 0);
+    if (!src.get() || OFX::Coords::rectIsEmpty(src->getBounds()) || OFX::Coords::rectIsEmpty(args.renderWindow)) {
+        return false;
+    }
+    // the upstream transform is not concatenated by this path
+    if (!src->getTransformIsIdentity()) {
+        return false;
+    }
+    std::auto_ptr<OFX::Image> dst(_dstClip->fetchImage(time));
+    if (!dst.get()) {
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (dst->getRenderScale().x != args.renderScale.x ||
+        dst->getRenderScale().y != args.renderScale.y ||
+        (dst->getField() != OFX::eFieldNone /* for DaVinci Resolve */ && dst->getField() != args.fieldToRender)) {
+        setPersistentMessage(OFX::Message::eMessageError, "", "OFX Host gave image with wrong scale or field properties");
+        OFX::throwSuiteStatusException(kOfxStatFailed);
+    }
+    if (src->getPixelDepth() != dst->getPixelDepth() ||
+        src->getPixelComponents() != dst->getPixelComponents()) {
+        return false;
+    }
+
+    // the transform must be a translation for all amounts, not only at amount 1 (e.g. a rotation by 360 degrees)
+    if ( !isTranslation(time) ) {
+        return false;
+    }
+
+    // the inverse transform for amount 1, in pixels, must be a translation (the pixel aspect ratios may differ)
+    bool invert = false;
+    if (_invert) {
+        _invert->getValueAtTime(time, invert);
+    }
+    const bool fielded = args.fieldToRender == OFX::eFieldLower || args.fieldToRender == OFX::eFieldUpper;
+    OFX::Matrix3x3 invtransform;
+    if (getInverseTransformsBlur(time, args.renderView, args.renderScale, fielded, src->getPixelAspectRatio(), dst->getPixelAspectRatio(), invert, 1., 1., &invtransform, 0, 1) != 1 ||
+        invtransform.i == 0.) {
+        return false;
+    }
+    const double eps = 1e-9;
+    if (std::abs(invtransform.a / invtransform.i - 1.) > eps || std::abs(invtransform.b / invtransform.i) > eps ||
+        std::abs(invtransform.d / invtransform.i) > eps || std::abs(invtransform.e / invtransform.i - 1.) > eps ||
+        invtransform.g != 0. || invtransform.h != 0.) {
+        return false;
+    }
+    const double dx = invtransform.c / invtransform.i;
+    const double dy = invtransform.f / invtransform.i;
+    const double amountFrom = centered ? -amount : 0.;
+    const double amountTo = amount;
+    if (std::abs(amountTo - amountFrom) * std::max(std::abs(dx), std::abs(dy)) < kDirBlurTranslateMinLength) {
+        return false;
+    }
+
+    bool blackOutside = true;
+    if (_blackOutside) {
+        _blackOutside->getValueAtTime(time, blackOutside);
+    }
+    double mix = 1.;
+    if (_mix) {
+        _mix->getValueAtTime(time, mix);
+    }
+
+    // auto ptr for the mask.
+    bool doMasking = ((!_maskApply || _maskApply->getValueAtTime(time)) && _maskClip && _maskClip->isConnected());
+    std::auto_ptr<const OFX::Image> mask(doMasking ? _maskClip->fetchImage(time) : 0);
+    bool maskInvert = false;
+    if (doMasking && _maskInvert) {
+        _maskInvert->getValueAtTime(time, maskInvert);
+    }
+
+    DirBlurTranslateProcessor<PIX, nComponents, maxValue> processor(*this, src.get(), dst.get(), mask.get(), maskInvert, mix, blackOutside,
+                                                                    args.renderWindow, dx, dy, amountFrom, amountTo);
+    const int nLines = processor.getNLines();
+    if (nLines > 0) {
+        processor.multiThread( std::max( 1u, std::min( (unsigned int)nLines, OFX::MultiThread::getNumCPUs() ) ) );
+    }
+
+    return true;
+}
+
+template <int nComponents>
+bool
+TransformPlugin::renderDirBlurTranslate(const OFX::RenderArguments &args,
+                                        OFX::BitDepthEnum dstBitDepth)
+{
+    switch (dstBitDepth) {
+        case OFX::eBitDepthUByte:
+            return renderDirBlurTranslateForBitDepth<unsigned char, nComponents, 255>(args);
+        case OFX::eBitDepthUShort:
+            return renderDirBlurTranslateForBitDepth<unsigned short, nComponents, 65535>(args);
+        case OFX::eBitDepthFloat:
+            return renderDirBlurTranslateForBitDepth<float, nComponents, 1>(args);
+        default:
+            return false;
+    }
+}
+
+// the overridden render function
+void
+TransformPlugin::render(const OFX::RenderArguments &args)
+{
+    OFX::BitDepthEnum dstBitDepth    = _dstClip->getPixelDepth();
+    OFX::PixelComponentEnum dstComponents  = _dstClip->getPixelComponents();
+
+    bool rendered = false;
+    if (_mipmap && _mipmap->getValueAtTime(args.time)) {
+        rendered = renderPyramid(args);
+    }
+    if (!rendered && _dirBlurFast && _dirBlurFast->getValueAtTime(args.time)) {
+        if (dstComponents == OFX::ePixelComponentRGBA) {
+            rendered = renderDirBlurTranslate<4>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentRGB) {
+            rendered = renderDirBlurTranslate<3>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentXY) {
+            rendered = renderDirBlurTranslate<2>(args, dstBitDepth);
+        } else if (dstComponents == OFX::ePixelComponentAlpha) {
+            rendered = renderDirBlurTranslate<1>(args, dstBitDepth);
+        }
+    }
+    if (!rendered) {
+        Transform3x3Plugin::render(args);
+    }
+}
+
+/** @brief free the pyramids that are not used by a render */
+void
+TransformPlugin::purgeCaches()
+{
+    _mipmapCache.purge();
+}
+
 
 mDeclarePluginFactory(TransformPluginFactory, {}, {});
 
@@ -393,6 +962,9 @@ void TransformPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc,
     TransformPluginDescribeInContext(desc, context, page);
 
     Transform3x3DescribeInContextEnd(desc, context, page, false, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
+
+    // pyramid
+    mipmapDescribeParams(desc, page);
     
     {
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSrcClipChanged);
@@ -437,6 +1009,9 @@ void TransformMaskedPluginFactory::describeInContext(OFX::ImageEffectDescriptor
 
     Transform3x3DescribeInContextEnd(desc, context, page, true, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeMotionBlur);
 
+    // pyramid
+    mipmapDescribeParams(desc, page);
+
     {
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSrcClipChanged);
         param->setDefault(false);
@@ -478,6 +1053,18 @@ void DirBlurPluginFactory::describeInContext(OFX::ImageEffectDescriptor &desc, O
 
     Transform3x3DescribeInContextEnd(desc, context, page, true, OFX::Transform3x3Plugin::eTransform3x3ParamsTypeDirBlur);
 
+    // fastTranslation
+    {
+        OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamDirBlurFast);
+        param->setLabel(kParamDirBlurFastLabel);
+        param->setHint(kParamDirBlurFastHint);
+        param->setDefault(false);
+        param->setAnimates(false);
+        if (page) {
+            page->addChild(*param);
+        }
+    }
+
     {
         OFX::BooleanParamDescriptor* param = desc.defineBooleanParam(kParamSrcClipChanged);
         param->setDefault(false);